@@ -65,4 +65,144 @@ static const uint32_t POLL_INTERVAL_NO_WORK_US = 1;
 // to complete. Due to overheads in the kernel, this number will
 // be a lower bound and the actual time spent sleeping may be higher.
 static const uint32_t POLL_INTERVAL_DURING_IO_US = 1;
+
+// Upper bound on the sleep time of the background threads while they are
+// idle under the NanoLog::WAKEUP_BACKOFF policy. The sleep time starts out at
+// POLL_INTERVAL_NO_WORK_US and doubles with every idle wakeup.
+static const uint32_t WAKEUP_BACKOFF_MAX_US = 1000;
+
+// Maximum time the background thread sleeps on the doorbell under the
+// NanoLog::WAKEUP_DOORBELL policy. This bounds how long the periodic chores
+// of the background thread (i.e. the governor) are put off while idle, as well
+// as the latency of a log message whose doorbell went unnoticed on kernels
+// without membarrier().
+static const uint32_t DOORBELL_TIMEOUT_US = 10000;
+
+// Fill level (in percent) beyond which a StagingBuffer is compressed ahead
+// of the others under the NanoLog::SCAN_FILL_PRIORITY policy, and the maximum
+// number of bytes compressed from a StagingBuffer per visit under that policy.
+static const uint32_t SCAN_URGENT_FILL_PERCENT = 50;
+static const uint32_t SCAN_QUOTA_BYTES = STAGING_BUFFER_SIZE / 8;
+
+// Maximum number of bytes compressed from a StagingBuffer per visit in
+// NanoLog::poll(), which checks its budget between visits. This bounds how
+// far a poll() overruns its budget.
+static const uint32_t POLL_QUOTA_BYTES = STAGING_BUFFER_SIZE / 64;
+
+// Number of StagingBuffers tracked by the bitmap of StagingBuffers that may
+// have log messages pending, which lets the compression threads skip the
+// StagingBuffers of idle threads. StagingBuffers beyond this number are
+// visited on every pass. This value must be a multiple of 4096.
+static const uint32_t MAX_ACTIVE_BUFFER_SLOTS = 1 << 16;
+static_assert(MAX_ACTIVE_BUFFER_SLOTS % 4096 == 0,
+              "MAX_ACTIVE_BUFFER_SLOTS must be a multiple of 4096");
+
+// How often the background compression thread removes the StagingBuffers
+// that were found empty since the last sweep from the bitmap above. Every
+// sweep that removes a StagingBuffer costs a membarrier() to synchronize
+// with the logging threads, which set their bit again with the next message.
+static const uint32_t IDLE_BUFFER_SWEEP_INTERVAL_US = 10000;
+
+// Maximum number of distinct runtime format strings (see NANO_LOG_RUNTIME)
+// that will be assigned dynamic log sites in the dictionary. Invocations
+// beyond this limit fall back to formatting the message on the logging thread.
+static const uint32_t MAX_DYNAMIC_LOG_SITES = 4096;
+
+// Number of entries in the per-thread direct-mapped cache that sits in front
+// of the dynamic log sites. This value must be a power of 2.
+static const uint32_t DYNAMIC_LOG_SITE_CACHE_SIZE = 64;
+static_assert((DYNAMIC_LOG_SITE_CACHE_SIZE &
+               (DYNAMIC_LOG_SITE_CACHE_SIZE - 1)) == 0,
+              "DYNAMIC_LOG_SITE_CACHE_SIZE must be a power of 2");
+
+// Maximum number of return addresses captured by a NANO_LOG_BT() invocation
+static const uint32_t MAX_BACKTRACE_FRAMES = 32;
+static_assert(MAX_BACKTRACE_FRAMES <= 255,
+              "The number of backtrace frames is encoded in a uint8_t");
+
+// Maximum number of non-string arguments of NANO_LOG_DELTA() invocations whose
+// previous values the background thread tracks within a BufferExtent. Once
+// they are exhausted, the BufferExtent ends early and the deltas restart
+// from 0 in the next one. This also bounds the number of non-string
+// arguments of a NANO_LOG_DELTA() invocation.
+static const uint32_t MAX_DELTA_BASES_PER_EXTENT = 64;
+
+// Once backtraces are being logged, how often the background compression
+// thread should check for newly loaded modules and persist a new snapshot
+// of the executable mappings for the decompressor to symbolize against.
+static const uint32_t MODULE_MAP_CHECK_INTERVAL_US = 1000;
+
+// Period at which the background compression thread starts a new metric
+// epoch and stages snapshots of the NANO_METRIC_*() aggregates the threads
+// collected over the previous one.
+static const uint32_t METRIC_EPOCH_INTERVAL_US = 1000000;
+
+// The back-pressure governor, once enabled via NanoLog::setDegradedLogLevel(),
+// lowers the log level to the degraded log level while the background thread
+// falls behind, so that less severe log messages are dropped instead of
+// blocking their producers. It engages when any single StagingBuffer or all
+// of them combined are filled beyond the high watermarks below (in percent)
+// and restores the log level once the fill levels drop below the low
+// watermark.
+static const uint32_t GOVERNOR_CHECK_INTERVAL_US = 100;
+static const uint32_t GOVERNOR_THREAD_HIGH_WATERMARK = 75;
+static const uint32_t GOVERNOR_GLOBAL_HIGH_WATERMARK = 50;
+static const uint32_t GOVERNOR_LOW_WATERMARK = 25;
+static_assert(GOVERNOR_LOW_WATERMARK < GOVERNOR_GLOBAL_HIGH_WATERMARK &&
+                  GOVERNOR_GLOBAL_HIGH_WATERMARK <=
+                      GOVERNOR_THREAD_HIGH_WATERMARK,
+              "The governor's watermarks must leave room for hysteresis");
+
+// Byte size of the per-thread priority lane, a small StagingBuffer that
+// log messages at or above the priority lane level (see NanoLog::
+// setPriorityLaneLevel()) are staged in. The background thread drains the
+// priority lanes before the regular StagingBuffers, so that severe messages
+// are not held up behind a backlog of less severe ones. Messages of half
+// this size or more are staged in the regular StagingBuffer instead.
+static const uint32_t PRIORITY_LANE_SIZE = 1 << 16;
+static_assert(PRIORITY_LANE_SIZE <= STAGING_BUFFER_SIZE,
+              "The priority lane shall not exceed the STAGING_BUFFER_SIZE");
+
+// Largest size (in bytes) of the uncompressed arguments of a log message that
+// the logging threads compress themselves once producer compression is
+// enabled (see NanoLog::setProducerCompression()). The arguments are first
+// recorded in a scratch buffer of this size on the logging thread's stack;
+// larger messages are left to the background thread.
+static const uint32_t PRODUCER_COMPRESSION_MAX_SIZE = 512;
+static_assert(2 * PRODUCER_COMPRESSION_MAX_SIZE < PRIORITY_LANE_SIZE / 2,
+              "Producer compressed messages must fit in the priority lanes");
+
+// Maximum number of characters logged for a single string argument. Longer
+// strings are truncated and marked with a trailing "...", which bounds the
+// time spent scanning and copying an unexpectedly large string and keeps it
+// from exceeding the maximum log message size. Format string precisions
+// (i.e. %.32s) can be used to impose tighter limits on individual arguments.
+static const uint32_t MAX_STRING_ARG_LENGTH = 1 << 14;
+static_assert(4 * MAX_STRING_ARG_LENGTH < STAGING_BUFFER_SIZE / 2,
+              "String arguments must fit in a log message (even if wide)");
+
+// Maximum number of log channels, including the primary channel that
+// NANO_LOG() logs to (see NanoLog::createChannel()). Each channel has its own
+// background thread, output buffers and per-thread StagingBuffers.
+static const uint32_t MAX_CHANNELS = 8;
+
+// Maximum time (in microseconds) the fatal signal handler installed by
+// NanoLog::installCrashHandler() waits for the background thread of a channel
+// to hand over the StagingBuffers; the channel is skipped otherwise.
+static const uint32_t CRASH_DRAIN_TIMEOUT_US = 200000;
+
+// Byte size of each of the two output buffers of the additional compression
+// threads (see NanoLog::setMaxCompressionThreads()). A compression thread
+// hands its output over to the background thread once a buffer fills up or
+// a pass through the StagingBuffers completes.
+static const uint32_t COMPRESSION_HELPER_BUFFER_SIZE = 4 * STAGING_BUFFER_SIZE;
+static_assert(COMPRESSION_HELPER_BUFFER_SIZE <= OUTPUT_BUFFER_SIZE,
+              "The compression threads' output must fit in the output buffer");
+
+// Fill level (in percent) of the fullest StagingBuffer at which the background
+// thread starts another compression thread, how often it checks the fill
+// level, and the minimum time between two such starts.
+static const uint32_t COMPRESSION_THREAD_SCALE_WATERMARK = 25;
+static const uint32_t COMPRESSION_THREAD_SCALE_CHECK_INTERVAL_US = 100;
+static const uint32_t COMPRESSION_THREAD_START_INTERVAL_US = 10000;
 }  // namespace NanoLogConfig
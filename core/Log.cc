@@ -82,7 +82,8 @@ Log::Encoder::Encoder(char* buffer, size_t bufferSize, bool skipCheckpoint,
       lastBufferIdEncoded(-1),
       currentExtentSize(nullptr),
       encodeMissDueToMetadata(0),
-      consecutiveEncodeMissesDueToMetadata(0) {
+      consecutiveEncodeMissesDueToMetadata(0),
+      deltaBases() {
   assert(buffer);
 
   // Start the buffer off with a checkpoint
@@ -102,8 +103,9 @@ Log::Encoder::Encoder(char* buffer, size_t bufferSize, bool skipCheckpoint,
 }
 
 /**
- * Given a vector of StaticLogInfo and a starting index, encode all the static
- * log information into a partial dictionary for the Decompressor to use.
+ * Given a view of the StaticLogInfo and a starting index, encode all the
+ * static log information into a partial dictionary for the Decompressor to
+ * use.
  *
  * \param[in/out] currentPosition
  *      Starting/Ending index
@@ -114,7 +116,7 @@ Log::Encoder::Encoder(char* buffer, size_t bufferSize, bool skipCheckpoint,
  *      Number of bytes encoded in the dictionary
  */
 uint32_t Log::Encoder::encodeNewDictionaryEntries(
-    uint32_t& currentPosition, std::vector<StaticLogInfo> allMetadata) {
+    uint32_t& currentPosition, SiteDictionary::View allMetadata) {
   char* bufferStart = writePos;
 
   if (sizeof(DictionaryFragment) >=
@@ -126,11 +128,11 @@ uint32_t Log::Encoder::encodeNewDictionaryEntries(
   df->entryType = EntryType::LOG_MSGS_OR_DIC;
 
   while (currentPosition < allMetadata.size()) {
-    StaticLogInfo& curr = allMetadata.at(currentPosition);
+    const StaticLogInfo& curr = allMetadata[currentPosition];
     size_t filenameLength = strlen(curr.filename) + 1;
     size_t formatLength = strlen(curr.formatString) + 1;
-    size_t nextDictSize =
-        sizeof(CompressedLogInfo) + filenameLength + formatLength;
+    size_t nextDictSize = sizeof(CompressedLogInfo) + filenameLength +
+                          formatLength + curr.extensionsLength;
 
     // Not enough space, break out!
     if (nextDictSize >= static_cast<uint32_t>(endOfBuffer - writePos)) break;
@@ -141,11 +143,18 @@ uint32_t Log::Encoder::encodeNewDictionaryEntries(
     cli->severity = curr.severity;
     cli->linenum = curr.lineNum;
     cli->filenameLength = static_cast<uint16_t>(filenameLength);
-    cli->formatStringLength = static_cast<uint16_t>(formatLength);
+    cli->formatStringLength =
+        static_cast<uint16_t>(formatLength + curr.extensionsLength);
 
     memcpy(writePos, curr.filename, filenameLength);
     memcpy(writePos + filenameLength, curr.formatString, formatLength);
     writePos += filenameLength + formatLength;
+
+    // Site extensions trail the format string's NULL terminator
+    if (curr.extensionsLength > 0) {
+      memcpy(writePos, curr.extensions, curr.extensionsLength);
+      writePos += curr.extensionsLength;
+    }
     ++currentPosition;
   }
 
@@ -185,10 +194,14 @@ uint32_t Log::Encoder::encodeNewDictionaryEntries(
  */
 long Log::Encoder::encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
                                  bool newPass,
-                                 std::vector<StaticLogInfo> dictionary,
+                                 SiteDictionary::View dictionary,
                                  uint64_t* numEventsCompressed) {
   if (!encodeBufferExtentStart(bufferId, newPass)) return 0;
 
+  // Like the timestamps, the deltas restart with every BufferExtent so that
+  // the extents can be decoded independently of each other
+  deltaBases.reset();
+
   uint64_t lastTimestamp = 0;
   long remaining = nbytes;
   long numEventsProcessed = 0;
@@ -196,9 +209,10 @@ long Log::Encoder::encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
 
   while (remaining > 0) {
     auto* entry = reinterpret_cast<UncompressedEntry*>(from);
+    uint32_t fmtId = entry->fmtId & ~PRECOMPRESSED_FLAG;
 
     // New log entry that we have not observed yet
-    if (dictionary.size() <= entry->fmtId) {
+    if (dictionary.size() <= fmtId) {
       ++encodeMissDueToMetadata;
       ++consecutiveEncodeMissesDueToMetadata;
 
@@ -209,7 +223,7 @@ long Log::Encoder::encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
                 "log message (id=%u) during compression. If "
                 "you are using Preprocessor NanoLog, there is "
                 "be a problem with your integration.\r\n",
-                entry->fmtId);
+                fmtId);
       }
 
       break;
@@ -219,14 +233,14 @@ long Log::Encoder::encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
 
 #ifdef ENABLE_DBG_PRINTING
     printf("Trying to encode fmtId=%u, size=%u, remaining=%ld\r\n",
-           entry->fmtId, entry->entrySize, remaining);
-    printf("\t%s\r\n", dictionary.at(entry->fmtId).formatString);
+           fmtId, entry->entrySize, remaining);
+    printf("\t%s\r\n", dictionary[fmtId].formatString);
 #endif
 
     if (entry->entrySize > remaining) {
       if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE / 2)) break;
 
-      StaticLogInfo& info = dictionary.at(entry->fmtId);
+      const StaticLogInfo& info = dictionary[fmtId];
       fprintf(stderr,
               "NanoLog ERR: Attempting to log a message that "
               "is %u bytes while the maximum allowable size is "
@@ -238,22 +252,43 @@ long Log::Encoder::encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
 
     // Check for free space using the worst case assumption that
     // none of the arguments compressed and there are as many Nibbles
-    // as there are data bytes.
+    // as there are data bytes, plus the bytes that packVByte() may
+    // overwrite beyond the arguments.
     uint32_t maxCompressedSize = downCast<uint32_t>(
-        2 * entry->entrySize + sizeof(Log::UncompressedEntry));
+        2 * entry->entrySize + sizeof(Log::UncompressedEntry) +
+        BufferUtils::VBYTE_SLACK);
     if (maxCompressedSize > (endOfBuffer - writePos)) break;
 
+    // End the BufferExtent early if the previous values of the arguments
+    // cannot be tracked; this never happens to the first log message.
+    const StaticLogInfo& info = dictionary[fmtId];
+    uint64_t* argumentDeltaBases = nullptr;
+    if (info.deltaCompressionFunction != nullptr) {
+      argumentDeltaBases = deltaBases.getBases(fmtId, info.numNibbles);
+      if (argumentDeltaBases == nullptr) break;
+    }
+
     compressLogHeader(entry, &writePos, lastTimestamp);
     lastTimestamp = entry->timestamp;
 
-    StaticLogInfo& info = dictionary.at(entry->fmtId);
 #ifdef ENABLE_DBG_PRINTING
     printf("\r\nCompressing \'%s\' with info.id=%d\r\n", info.formatString,
-           entry->fmtId);
+           fmtId);
 #endif
-    char* argData = entry->argData;
-    info.compressionFunction(info.numNibbles, info.paramTypes, &argData,
-                             &writePos);
+    if (entry->fmtId & PRECOMPRESSED_FLAG) {
+      // The logging thread already compressed the arguments
+      size_t argBytes = entry->entrySize - sizeof(UncompressedEntry);
+      std::memcpy(writePos, entry->argData, argBytes);
+      writePos += argBytes;
+    } else if (argumentDeltaBases != nullptr) {
+      char* argData = entry->argData;
+      info.deltaCompressionFunction(info.paramTypes, &argData, &writePos,
+                                    argumentDeltaBases);
+    } else {
+      char* argData = entry->argData;
+      info.compressionFunction(info.numNibbles, info.paramTypes, &argData,
+                               &writePos);
+    }
 
     remaining -= entry->entrySize;
     from += entry->entrySize;
@@ -272,6 +307,59 @@ long Log::Encoder::encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
   return nbytes - remaining;
 }
 
+/**
+ * DeltaBaseTable constructor
+ */
+Log::DeltaBaseTable::DeltaBaseTable()
+    : siteIds(), siteOffsets(), numSites(0), bases(), numBases(0) {}
+
+/**
+ * Forgets the previous values of all the log sites, i.e. at the start of a
+ * BufferExtent.
+ */
+void Log::DeltaBaseTable::reset() {
+  numSites = 0;
+  numBases = 0;
+}
+
+/**
+ * Returns the previous values of the arguments of a log site that encodes
+ * its arguments as deltas (see Log::DELTA_ARGUMENTS and Log::XOR_DOUBLES),
+ * which are allocated and zeroed upon the site's first log message in the
+ * current BufferExtent.
+ *
+ * \param fmtId
+ *      Log site to find the previous values of
+ * \param numNibbles
+ *      Number of non-string arguments of the log site
+ *
+ * \return
+ *      The previous value of each of the numNibbles arguments, or nullptr
+ *      if the BufferExtent has run out of room to track them
+ */
+uint64_t* Log::DeltaBaseTable::getBases(uint32_t fmtId, int numNibbles) {
+  // A BufferExtent typically holds the log messages of few such sites
+  for (uint32_t i = 0; i < numSites; ++i)
+    if (siteIds[i] == fmtId) return bases + siteOffsets[i];
+
+  // Nothing to track for log sites without non-string arguments
+  uint32_t numSiteBases = static_cast<uint32_t>(numNibbles);
+  if (numSiteBases == 0) return bases;
+
+  if (numNibbles < 0 ||
+      numSiteBases > NanoLogConfig::MAX_DELTA_BASES_PER_EXTENT - numBases)
+    return nullptr;
+
+  siteIds[numSites] = fmtId;
+  siteOffsets[numSites] = numBases;
+  ++numSites;
+
+  uint64_t* siteBases = bases + numBases;
+  std::fill_n(siteBases, numSiteBases, 0);
+  numBases += numSiteBases;
+  return siteBases;
+}
+
 /**
  * Internal function that encodes a marker indicating that all log messages
  * after this point (but after the next marker) belong to a particular buffer.
@@ -316,6 +404,32 @@ bool Log::Encoder::encodeBufferExtentStart(uint32_t bufferId, bool newPass) {
   return true;
 }
 
+/**
+ * Appends log messages compressed by another Encoder that was constructed
+ * without a checkpoint. The log messages must only refer to dictionary
+ * entries that precede them in the output.
+ *
+ * \param encoded
+ *      Compressed log messages to append
+ * \param nbytes
+ *      Number of bytes to append
+ *
+ * \return
+ *      True if the operation succeeded; false if there's insufficient space
+ *      in the internal buffer
+ */
+bool Log::Encoder::appendEncoded(const char* encoded, size_t nbytes) {
+  if (nbytes > static_cast<size_t>(endOfBuffer - writePos)) return false;
+
+  std::memcpy(writePos, encoded, nbytes);
+  writePos += nbytes;
+
+  // Subsequent log messages start a BufferExtent of their own
+  lastBufferIdEncoded = -1;
+  currentExtentSize = nullptr;
+  return true;
+}
+
 /**
  * Retrieve the number of bytes encoded in the internal buffer
  *
@@ -456,6 +570,12 @@ Log::Decoder::Decoder()
       freeBuffers(),
       fmtId2metadata(),
       fmtId2fmtString(),
+      fmtId2siteInfo(),
+      enumTables(),
+      symbolizer(),
+      threadContexts(),
+      threadSpans(),
+      spanStats(),
       rawMetadata(nullptr),
       endOfRawMetadata(nullptr),
       numBufferFragmentsRead(0),
@@ -510,6 +630,11 @@ bool Log::Decoder::readDictionary(FILE* fd, bool flushOldDictionary) {
     endOfRawMetadata = rawMetadata;
     fmtId2metadata.clear();
     fmtId2fmtString.clear();
+    fmtId2siteInfo.clear();
+    enumTables.clear();
+    symbolizer.clear();
+    threadContexts.clear();
+    threadSpans.clear();
   }
 
   // Build an index of format id to metadata
@@ -815,6 +940,475 @@ bool Log::Decoder::createMicroCode(char** microCode, const char* formatString,
   return true;
 }
 
+/**
+ * Interprets the SiteExtension records that followed the format string of a
+ * dictionary entry. Records of unknown types are skipped.
+ *
+ * \param fmtId
+ *      The fmtId of the dictionary entry carrying the extensions
+ * \param extensions
+ *      Start of the SiteExtension records
+ * \param endOfExtensions
+ *      First byte beyond the last SiteExtension record
+ */
+void Log::Decoder::readSiteExtensions(uint32_t fmtId, const char* extensions,
+                                      const char* endOfExtensions) {
+  while (extensions + sizeof(SiteExtension) <= endOfExtensions) {
+    SiteExtension header;
+    memcpy(&header, extensions, sizeof(SiteExtension));
+    const char* payload = extensions + sizeof(SiteExtension);
+    const char* endOfPayload = payload + header.length;
+    extensions = endOfPayload;
+
+    if (endOfPayload > endOfExtensions) {
+      fprintf(stderr,
+              "Warning: Truncated site extension for fmtId=%u; "
+              "ignoring it\r\n",
+              fmtId);
+      return;
+    }
+
+    if (header.type == ENUM_TABLE) {
+      auto& table = enumTables[fmtId];
+      while (payload + sizeof(int64_t) < endOfPayload) {
+        int64_t value;
+        memcpy(&value, payload, sizeof(int64_t));
+        payload += sizeof(int64_t);
+
+        size_t nameLength = strnlen(payload, endOfPayload - payload);
+        table[value] = std::string(payload, nameLength);
+        payload += nameLength + 1;
+      }
+    } else if (header.type == ENUM_BINDING) {
+      auto& bindings = fmtId2siteInfo.at(fmtId).enumBindings;
+      for (; payload + sizeof(EnumBinding) <= endOfPayload;
+           payload += sizeof(EnumBinding)) {
+        EnumBinding binding;
+        memcpy(&binding, payload, sizeof(EnumBinding));
+        if (bindings.size() <= binding.paramIndex)
+          bindings.resize(binding.paramIndex + 1, -1);
+        bindings[binding.paramIndex] = binding.tableId;
+      }
+    } else if (header.type == BACKTRACE) {
+      fmtId2siteInfo.at(fmtId).hasBacktrace = true;
+    } else if (header.type == DELTA_ARGUMENTS) {
+      fmtId2siteInfo.at(fmtId).hasDeltaArguments = true;
+    } else if (header.type == XOR_DOUBLES &&
+               header.length >= sizeof(uint64_t)) {
+      uint64_t xorDoubles;
+      memcpy(&xorDoubles, payload, sizeof(uint64_t));
+      fmtId2siteInfo.at(fmtId).xorDoubles = xorDoubles;
+    } else if (header.type == VBYTE_ARGUMENTS &&
+               header.length >= sizeof(uint8_t)) {
+      fmtId2siteInfo.at(fmtId).vbyteVersion = static_cast<uint8_t>(*payload);
+    } else if (header.type == CONTEXT) {
+      fmtId2siteInfo.at(fmtId).isContext = true;
+    } else if (header.type == SPAN_BEGIN) {
+      fmtId2siteInfo.at(fmtId).isSpanBegin = true;
+    } else if (header.type == SPAN_END && header.length >= sizeof(uint32_t)) {
+      uint32_t beginId;
+      memcpy(&beginId, payload, sizeof(uint32_t));
+      fmtId2siteInfo.at(fmtId).spanBeginId = beginId;
+    } else if (header.type == METRIC && header.length >= sizeof(uint8_t)) {
+      fmtId2siteInfo.at(fmtId).metricType = static_cast<uint8_t>(*payload);
+    } else if (header.type == MODULE_MAP) {
+      while (payload + sizeof(ModuleMapping) < endOfPayload) {
+        ModuleMapping mapping;
+        memcpy(&mapping, payload, sizeof(ModuleMapping));
+        payload += sizeof(ModuleMapping);
+
+        size_t pathLength = strnlen(payload, endOfPayload - payload);
+        std::string path(payload, pathLength);
+        symbolizer.addMapping(mapping.start, mapping.end, mapping.offset,
+                              path.c_str());
+        payload += pathLength + 1;
+      }
+    }
+  }
+}
+
+/**
+ * Returns true if the integer arguments of the log messages of a fmtId are
+ * encoded as deltas (see Log::DELTA_ARGUMENTS).
+ */
+bool Log::Decoder::hasDeltaArguments(uint32_t fmtId) const {
+  return fmtId < fmtId2siteInfo.size() &&
+         fmtId2siteInfo[fmtId].hasDeltaArguments;
+}
+
+/**
+ * Returns the bit mask of the non-string arguments of the log messages of a
+ * fmtId that are doubles encoded as XORs (see Log::XOR_DOUBLES).
+ */
+uint64_t Log::Decoder::getXorDoubles(uint32_t fmtId) const {
+  if (fmtId >= fmtId2siteInfo.size()) return 0;
+
+  return fmtId2siteInfo[fmtId].xorDoubles;
+}
+
+/**
+ * Returns the version of the BufferUtils::packVByte() encoding of the
+ * arguments of the log messages of a fmtId (see Log::VBYTE_ARGUMENTS), or 0
+ * if they are pack()-ed.
+ */
+uint8_t Log::Decoder::getVByteVersion(uint32_t fmtId) const {
+  if (fmtId >= fmtId2siteInfo.size()) return 0;
+
+  return fmtId2siteInfo[fmtId].vbyteVersion;
+}
+
+/**
+ * Returns true if the log messages of a fmtId are followed by a backtrace.
+ */
+bool Log::Decoder::hasBacktrace(uint32_t fmtId) const {
+  return fmtId < fmtId2siteInfo.size() && fmtId2siteInfo[fmtId].hasBacktrace;
+}
+
+/**
+ * Reads back the backtrace following a log message (as encoded by
+ * compressBacktrace()) and prints the symbolized frames.
+ *
+ * \param outputFd
+ *      Where to output the backtrace; nullptr only consumes it
+ * \param in
+ *      Start of the encoded backtrace
+ *
+ * \return
+ *      The first byte beyond the encoded backtrace
+ */
+const char* Log::Decoder::printBacktrace(FILE* outputFd, const char* in) {
+  uint8_t numFrames = static_cast<uint8_t>(*in++);
+  BufferUtils::Nibbler nb(in, numFrames);
+
+  if (outputFd) fprintf(outputFd, ",\"bt\":[");
+
+  uint64_t address = 0;
+  for (int i = 0; i < numFrames; ++i) {
+    address += nb.getNext<int64_t>();
+    if (outputFd) {
+      fprintf(outputFd, "%s\"%s\"", (i == 0) ? "" : ",",
+              symbolizer.symbolize(address).c_str());
+    }
+  }
+
+  if (outputFd) fprintf(outputFd, "]");
+  return nb.getEndOfPackedArguments();
+}
+
+/**
+ * Returns true if the log messages of a fmtId are internal records that
+ * update the decoder's state rather than being output (i.e. context records
+ * and span entries).
+ */
+bool Log::Decoder::isInternalRecord(uint32_t fmtId) const {
+  return fmtId < fmtId2siteInfo.size() &&
+         (fmtId2siteInfo[fmtId].isContext || fmtId2siteInfo[fmtId].isSpanBegin);
+}
+
+/**
+ * Returns true if the log messages of a fmtId are context records.
+ */
+bool Log::Decoder::isContextRecord(uint32_t fmtId) const {
+  return fmtId < fmtId2siteInfo.size() && fmtId2siteInfo[fmtId].isContext;
+}
+
+/**
+ * Reads back the key and value of a context record and applies them to the
+ * context of the thread that logged it. An empty value removes the key.
+ *
+ * \param runtimeId
+ *      The runtime StagingBuffer id of the thread that logged the record
+ * \param in
+ *      Start of the record's arguments
+ *
+ * \return
+ *      The first byte beyond the record's arguments
+ */
+const char* Log::Decoder::readContextRecord(uint32_t runtimeId,
+                                            const char* in) {
+  const char* key = in;
+  const char* value = key + strlen(key) + 1;
+
+  auto& context = threadContexts[runtimeId];
+  if (*value == '\0')
+    context.erase(key);
+  else
+    context[key] = value;
+
+  return value + strlen(value) + 1;
+}
+
+/**
+ * Prints the current context of a thread as a JSON object member, if the
+ * thread has any context.
+ *
+ * \param outputFd
+ *      Where to output the context
+ * \param runtimeId
+ *      The runtime StagingBuffer id of the thread
+ */
+void Log::Decoder::printContext(FILE* outputFd, uint32_t runtimeId) const {
+  auto context = threadContexts.find(runtimeId);
+  if (context == threadContexts.end() || context->second.empty()) return;
+
+  fprintf(outputFd, "\"ctx\":{");
+  bool first = true;
+  for (const auto& entry : context->second) {
+    fprintf(outputFd, "%s\"%s\":\"%s\"", first ? "" : ",",
+            entry.first.c_str(), entry.second.c_str());
+    first = false;
+  }
+  fprintf(outputFd, "},");
+}
+
+/**
+ * Records the entry into a span by a thread.
+ *
+ * \param runtimeId
+ *      The runtime StagingBuffer id of the thread
+ * \param fmtId
+ *      The fmtId of the span entry record
+ * \param timestamp
+ *      Runtime timestamp of the span entry record
+ */
+void Log::Decoder::beginSpan(uint32_t runtimeId, uint32_t fmtId,
+                             uint64_t timestamp) {
+  threadSpans[runtimeId].push_back({fmtId, timestamp});
+}
+
+/**
+ * Returns true if the log messages of a fmtId record exits from a span.
+ */
+bool Log::Decoder::isSpanEnd(uint32_t fmtId) const {
+  return fmtId < fmtId2siteInfo.size() &&
+         fmtId2siteInfo[fmtId].spanBeginId >= 0;
+}
+
+/**
+ * Records the exit from a span by a thread, prints the duration and nesting
+ * of the span and adds the duration to the span's statistics. Spans whose
+ * entry was not found (i.e. it was logged to a previous log file) are marked
+ * as unmatched.
+ *
+ * \param outputFd
+ *      Where to output the duration and nesting of the span
+ * \param runtimeId
+ *      The runtime StagingBuffer id of the thread
+ * \param fmtId
+ *      The fmtId of the span exit record
+ * \param timestamp
+ *      Runtime timestamp of the span exit record
+ */
+void Log::Decoder::endSpan(FILE* outputFd, uint32_t runtimeId, uint32_t fmtId,
+                           uint64_t timestamp) {
+  auto beginId = static_cast<uint32_t>(fmtId2siteInfo.at(fmtId).spanBeginId);
+  std::vector<OpenSpan>& spans = threadSpans[runtimeId];
+
+  auto span = std::find_if(spans.rbegin(), spans.rend(),
+                           [beginId](const OpenSpan& open) {
+                             return open.beginId == beginId;
+                           });
+  if (span == spans.rend()) {
+    if (outputFd) fprintf(outputFd, ",\"unmatched\":true");
+    return;
+  }
+
+  // Spans above the matching one were never exited; discard them
+  uint64_t beginTimestamp = span->timestamp;
+  spans.erase(std::next(span).base(), spans.end());
+
+  uint64_t ns = 0;
+  if (timestamp > beginTimestamp) {
+    ns = PerfUtils::Cycles::toNanoseconds(timestamp - beginTimestamp,
+                                          checkpoint.cyclesPerSecond);
+  }
+
+  if (outputFd) {
+    fprintf(outputFd, ",\"depth\":%lu", spans.size());
+    if (!spans.empty())
+      fprintf(outputFd, ",\"parent\":\"%s\"",
+              fmtId2fmtString.at(spans.back().beginId).c_str());
+    fprintf(outputFd, ",\"dur_ns\":%lu", ns);
+  }
+
+  auto* metadata =
+      reinterpret_cast<FormatMetadata*>(fmtId2metadata.at(fmtId));
+  std::string key = std::string(metadata->filename) + ":" +
+                    std::to_string(metadata->lineNumber) + " " +
+                    fmtId2fmtString.at(beginId);
+
+  SpanStats& stats = spanStats[key];
+  if (stats.count == 0 || ns < stats.minNs) stats.minNs = ns;
+  if (ns > stats.maxNs) stats.maxNs = ns;
+  ++stats.count;
+  stats.totalNs += ns;
+  ++stats.buckets[(ns == 0) ? 0 : 63 - __builtin_clzll(ns)];
+}
+
+/**
+ * Prints the statistics of the durations of the spans decompressed thus far,
+ * one line per NANO_SPAN() invocation site. The "hist" member maps the lower
+ * bound (in ns) of each power-of-two bucket to the number of spans whose
+ * duration fell into it.
+ *
+ * \param outputFd
+ *      Where to output the statistics
+ */
+void Log::Decoder::printSpanSummary(FILE* outputFd) const {
+  for (const auto& entry : spanStats) {
+    const SpanStats& stats = entry.second;
+    size_t separator = entry.first.find(' ');
+
+    fprintf(outputFd,
+            "{\"span\":\"%s\",\"line\":\"%s\",\"count\":%lu,\"min_ns\":%lu,"
+            "\"avg_ns\":%lu,\"max_ns\":%lu,\"hist\":{",
+            entry.first.c_str() + separator + 1,
+            entry.first.substr(0, separator).c_str(), stats.count, stats.minNs,
+            stats.totalNs / stats.count, stats.maxNs);
+
+    bool first = true;
+    for (int i = 0; i < 64; ++i) {
+      if (stats.buckets[i] == 0) continue;
+
+      fprintf(outputFd, "%s\"%lu\":%lu", first ? "" : ",",
+              (i == 0) ? 0 : (1UL << i), stats.buckets[i]);
+      first = false;
+    }
+
+    fprintf(outputFd, "}}\n");
+  }
+}
+
+/**
+ * Returns true if the log messages of a fmtId are metric snapshots.
+ */
+bool Log::Decoder::isMetric(uint32_t fmtId) const {
+  return fmtId < fmtId2siteInfo.size() && fmtId2siteInfo[fmtId].metricType != 0;
+}
+
+/**
+ * Returns the id of the thread a metric snapshot belongs to, which differs
+ * from the id of the BufferFragment for the snapshots staged by the
+ * background thread.
+ *
+ * \param fmtId
+ *      The fmtId of the log message
+ * \param in
+ *      Start of the encoded snapshot
+ */
+uint32_t Log::Decoder::getMetricThreadId(uint32_t fmtId,
+                                         const char* in) const {
+  if (fmtId2siteInfo.at(fmtId).metricType == HISTOGRAM) {
+    uint64_t bucketMask;
+    memcpy(&bucketMask, in, sizeof(uint64_t));
+    in += sizeof(uint64_t);
+    return BufferUtils::Nibbler(in, 6 + __builtin_popcountll(bucketMask))
+        .getNext<uint32_t>();
+  }
+
+  return BufferUtils::Nibbler(in, 3).getNext<uint32_t>();
+}
+
+/**
+ * Reads back a metric snapshot following a log message (as encoded by
+ * compressCounterSnapshot() or compressHistogramSnapshot()) and prints the
+ * time, epoch and aggregates of the snapshot.
+ *
+ * \param outputFd
+ *      Where to output the snapshot; nullptr only consumes it
+ * \param fmtId
+ *      The fmtId of the log message
+ * \param timestamp
+ *      Runtime timestamp of the log message
+ * \param in
+ *      Start of the encoded snapshot
+ *
+ * \return
+ *      The first byte beyond the encoded snapshot
+ */
+const char* Log::Decoder::printMetricSnapshot(FILE* outputFd, uint32_t fmtId,
+                                              uint64_t timestamp,
+                                              const char* in) {
+  uint64_t bucketMask = 0;
+  int numValues = 3;
+  if (fmtId2siteInfo.at(fmtId).metricType == HISTOGRAM) {
+    memcpy(&bucketMask, in, sizeof(uint64_t));
+    in += sizeof(uint64_t);
+    numValues = 6 + __builtin_popcountll(bucketMask);
+  }
+
+  // The thread id was output by getMetricThreadId()
+  BufferUtils::Nibbler nb(in, numValues);
+  nb.getNext<uint32_t>();
+  uint32_t epoch = nb.getNext<uint32_t>();
+
+  if (outputFd) {
+    double time = checkpoint.unixTime +
+                  PerfUtils::Cycles::toSeconds(
+                      static_cast<int64_t>(timestamp - checkpoint.rdtsc),
+                      checkpoint.cyclesPerSecond);
+    fprintf(outputFd, ",\"time\":%.6lf,\"epoch\":%u", time, epoch);
+  }
+
+  if (numValues == 3) {
+    int64_t sum = nb.getNext<int64_t>();
+    if (outputFd) fprintf(outputFd, ",\"sum\":%ld", sum);
+    return nb.getEndOfPackedArguments();
+  }
+
+  uint64_t count = nb.getNext<uint64_t>();
+  uint64_t sum = nb.getNext<uint64_t>();
+  uint64_t min = nb.getNext<uint64_t>();
+  uint64_t max = nb.getNext<uint64_t>();
+  if (outputFd) {
+    fprintf(outputFd,
+            ",\"count\":%lu,\"sum\":%lu,\"min\":%lu,\"max\":%lu,\"hist\":{",
+            count, sum, min, max);
+  }
+
+  bool first = true;
+  for (int i = 0; i < 64; ++i) {
+    if ((bucketMask & (1UL << i)) == 0) continue;
+
+    uint64_t bucketCount = nb.getNext<uint64_t>();
+    if (outputFd) {
+      fprintf(outputFd, "%s\"%lu\":%lu", first ? "" : ",",
+              (i == 0) ? 0 : (1UL << i), bucketCount);
+    }
+    first = false;
+  }
+
+  if (outputFd) fprintf(outputFd, "}");
+  return nb.getEndOfPackedArguments();
+}
+
+/**
+ * Returns the enum table bound to an argument of a log message.
+ *
+ * \param fmtId
+ *      The fmtId of the log message
+ * \param paramIndex
+ *      Index of the argument (including dynamic width/precision arguments)
+ *
+ * \return
+ *      The table mapping enum values to names, or nullptr if the argument
+ *      is not bound to a table.
+ */
+const std::unordered_map<int64_t, std::string>* Log::Decoder::getEnumTable(
+    uint32_t fmtId, int paramIndex) const {
+  if (fmtId >= fmtId2siteInfo.size()) return nullptr;
+
+  const auto& bindings = fmtId2siteInfo[fmtId].enumBindings;
+  if (paramIndex >= static_cast<int>(bindings.size()) ||
+      bindings[paramIndex] < 0)
+    return nullptr;
+
+  auto table = enumTables.find(static_cast<uint32_t>(bindings[paramIndex]));
+  if (table == enumTables.end()) return nullptr;
+
+  return &table->second;
+}
+
 /**
  * Reads a partial dictionary from the log file and adds it to the global
  * mapping of log identifiers to static log information.
@@ -891,6 +1485,14 @@ bool Log::Decoder::readDictionaryFragment(FILE* fd) {
       return false;
     }
 
+    // Site extensions follow the NULL-terminated format string
+    size_t formatLength = strnlen(format, cli.formatStringLength) + 1;
+    auto fmtId = static_cast<uint32_t>(fmtId2metadata.size());
+    fmtId2siteInfo.resize(fmtId + 1);
+    if (formatLength < cli.formatStringLength)
+      readSiteExtensions(fmtId, format + formatLength,
+                         format + cli.formatStringLength);
+
     fmtId2metadata.push_back(endOfRawMetadata);
     fmtId2fmtString.push_back(format);
     createMicroCode(&endOfRawMetadata, format, filename, cli.linenum,
@@ -945,6 +1547,13 @@ Log::Decoder::~Decoder() {
   for (BufferFragment* bf : freeBuffers) delete bf;
 
   freeBuffers.clear();
+
+  delete bufferFragment;
+  bufferFragment = nullptr;
+
+  free(rawMetadata);
+  rawMetadata = nullptr;
+  endOfRawMetadata = nullptr;
 }
 
 /**
@@ -983,7 +1592,9 @@ Log::Decoder::BufferFragment::BufferFragment()
       endOfBuffer(nullptr),
       hasMoreLogs(false),
       nextLogId(-1),
-      nextLogTimestamp(0) {}
+      nextLogTimestamp(0),
+      deltaBases(),
+      vbyteValues() {}
 
 /**
  * Resets the state of the BufferFragment so that the data cannot be reused
@@ -994,6 +1605,7 @@ void Log::Decoder::BufferFragment::reset() {
   readPos = nullptr;
   endOfBuffer = nullptr;
   hasMoreLogs = false;
+  deltaBases.reset();
 }
 /**
  * Read in the next buffer fragment from the compressed log. If an error occurs
@@ -1014,7 +1626,7 @@ bool Log::Decoder::BufferFragment::readBufferExtent(FILE* fd,
   BufferExtent* be = reinterpret_cast<BufferExtent*>(storage);
 
   if (be->entryType != EntryType::BUFFER_EXTENT ||
-      validBytes < sizeof(BufferExtent) || be->length > sizeof(storage)) {
+      validBytes < sizeof(BufferExtent) || be->length > MAX_EXTENT_SIZE) {
     reset();
     return false;
   }
@@ -1030,6 +1642,7 @@ bool Log::Decoder::BufferFragment::readBufferExtent(FILE* fd,
 
   readPos = storage + sizeof(BufferExtent);
   endOfBuffer = storage + validBytes;
+  deltaBases.reset();
 
   if (be->isShort)
     runtimeId = be->threadIdOrPackNibble;
@@ -1093,6 +1706,107 @@ static inline void printSingleArg(
 #pragma GCC diagnostic pop
 }
 
+/**
+ * Helper to decompressNextLogStatement to read back the next integer argument
+ * of a log message with its original width and signedness.
+ *
+ * \param nb
+ *      Nibbler to read the argument from
+ * \param argType
+ *      FormatType of the argument; must be an integer type
+ *
+ * \return
+ *      The argument widened to an int64_t
+ */
+static int64_t getNextInteger(BufferUtils::Nibbler& nb, uint8_t argType) {
+  using namespace NanoLogInternal::Log;
+  switch (argType) {
+    case unsigned_char_t: return nb.getNext<unsigned char>();
+    case unsigned_short_int_t: return nb.getNext<unsigned short int>();
+    case unsigned_int_t: return nb.getNext<unsigned int>();
+    case wint_t_t: return nb.getNext<wint_t>();
+    case signed_char_t: return nb.getNext<signed char>();
+    case short_int_t: return nb.getNext<short int>();
+    case int_t: return nb.getNext<int>();
+    default: return nb.getNext<int64_t>();
+  }
+}
+
+/**
+ * Helper to decompressNextLogStatement to print an integer argument that is
+ * bound to an enum table by name. The format specifier in the fragment is
+ * rewritten into a "%s" that keeps the original flags and width. Values not
+ * found in the table are printed as integers with the original fragment.
+ *
+ * \param outputFd
+ *      Where to output the statement
+ * \param formatString
+ *      Partial format string containing exactly 1 integer format specifier
+ * \param value
+ *      Argument to print
+ * \param table
+ *      Enum table bound to the argument
+ * \param width
+ *      Width parameter of a printf-specifier, a value of -1 specifies none
+ * \param precision
+ *      precision parameter of a printf-specifier, a value of -1 specifies none
+ */
+static void printEnumArg(FILE* outputFd,
+                         NanoLogInternal::Log::LogMessage& logArguments,
+                         const char* formatString, int64_t value,
+                         const std::unordered_map<int64_t, std::string>& table,
+                         int width, int precision) {
+  auto name = table.find(value);
+  if (name == table.end()) {
+    printSingleArg(outputFd, logArguments, formatString, value, width,
+                   precision);
+    return;
+  }
+
+  logArguments.push(value);
+  if (outputFd == nullptr) return;
+
+  std::string fragment;
+  bool hasDynamicWidth = false;
+  const char* c = formatString;
+  while (*c != '\0') {
+    if (c[0] == '%' && c[1] == '%') {
+      fragment.append("%%");
+      c += 2;
+      continue;
+    }
+
+    if (*c != '%') {
+      fragment.push_back(*c++);
+      continue;
+    }
+
+    // Keep the flags and width, but drop the precision and length modifier
+    fragment.push_back(*c++);
+    while (*c != '\0' && strchr("-+ #0*123456789", *c) != nullptr) {
+      if (*c == '*') hasDynamicWidth = true;
+      if (*c != '0' || isdigit(fragment.back())) fragment.push_back(*c);
+      ++c;
+    }
+    if (*c == '.') {
+      ++c;
+      while (*c == '*' || isdigit(*c)) ++c;
+    }
+    while (*c != '\0' && strchr("hljztL", *c) != nullptr) ++c;
+    if (*c != '\0') ++c;
+    fragment.push_back('s');
+  }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+  if (hasDynamicWidth)
+    fprintf(outputFd, fragment.c_str(), width, name->second.c_str());
+  else
+    fprintf(outputFd, fragment.c_str(), name->second.c_str());
+#pragma GCC diagnostic pop
+}
+
 /**
  * Attempt to read back the next log statement contained in the BufferFragment,
  * output the original log message to outputFd, and if applicable, run an
@@ -1120,21 +1834,30 @@ static inline void printSingleArg(
  *
  * \return
  *      true indicates the operation sucessfully; false indicates that either
- *      we reached the end of the file or the file is corrupt.
+ *      we reached the end of the file, the file is corrupt or only context
+ *      records were consumed (in which case hasNext() may still be true).
  */
 bool Log::Decoder::BufferFragment::decompressNextLogStatement(
     FILE* outputFd, uint64_t& logMsgsProcessed, LogMessage& logArgs,
-    const Checkpoint& checkpoint, std::vector<void*>& fmtId2metadata,
+    const Checkpoint& checkpoint, Decoder& decoder,
     long aggregationFilterId, void (*aggregationFn)(const char*, ...)) {
   if (readPos > endOfBuffer || !hasMoreLogs) {
     hasMoreLogs = false;
     return false;
   }
 
+  // Internal records are not output by themselves. Since consuming them
+  // advances the timestamp of the next log message, return to the caller
+  // so that it can reconsider the order of the BufferFragments.
+  if (decoder.isInternalRecord(nextLogId)) {
+    consumeInternalRecords(decoder);
+    return false;
+  }
+
   {
     using namespace BufferUtils;
-    auto* metadata =
-        reinterpret_cast<FormatMetadata*>(fmtId2metadata.at(nextLogId));
+    auto* metadata = reinterpret_cast<FormatMetadata*>(
+        decoder.fmtId2metadata.at(nextLogId));
 
     const char* filename = metadata->filename;
     const char* logLevel = logLevelNames[metadata->logLevel];
@@ -1143,8 +1866,13 @@ bool Log::Decoder::BufferFragment::decompressNextLogStatement(
 
     // Output the context
     if (outputFd) {
+      uint32_t threadId = runtimeId;
+      if (decoder.isMetric(nextLogId))
+        threadId = decoder.getMetricThreadId(nextLogId, readPos);
+
       fprintf(outputFd, "{\"lvl\":\"%s\",\"tid\":%u,\"line\":\"%s:%u\",",
-              logLevel, runtimeId, filename, metadata->lineNumber);
+              logLevel, threadId, filename, metadata->lineNumber);
+      decoder.printContext(outputFd, threadId);
     }
 
     // Print out the actual log message, piece by piece
@@ -1152,19 +1880,74 @@ bool Log::Decoder::BufferFragment::decompressNextLogStatement(
         reinterpret_cast<char*>(metadata) + sizeof(FormatMetadata) +
         metadata->filenameLength);
 
-    Nibbler nb(readPos, metadata->numNibbles);
+    // The Encoder ends a BufferExtent before running out of room
+    bool deltaIntegers = decoder.hasDeltaArguments(nextLogId);
+    uint64_t xorDoubles = decoder.getXorDoubles(nextLogId);
+    uint64_t* argumentDeltaBases = nullptr;
+    if (deltaIntegers || xorDoubles != 0) {
+      argumentDeltaBases =
+          deltaBases.getBases(nextLogId, metadata->numNibbles);
+      if (argumentDeltaBases == nullptr) {
+        fprintf(stderr,
+                "Log message %u has more delta-encoded arguments than fit in "
+                "a BufferExtent; the log may be corrupted.\r\n",
+                nextLogId);
+        hasMoreLogs = false;
+        return false;
+      }
+    }
+
+    uint8_t vbyteVersion = decoder.getVByteVersion(nextLogId);
+    uint64_t* unpackedValues = nullptr;
+    if (vbyteVersion > VBYTE_VERSION) {
+      fprintf(stderr,
+              "Log message %u uses version %u of the argument encoding, "
+              "which this decompressor does not support.\r\n",
+              nextLogId, vbyteVersion);
+      hasMoreLogs = false;
+      return false;
+    } else if (vbyteVersion != 0) {
+      unpackedValues = vbyteValues;
+    }
+
+    Nibbler nb(readPos, metadata->numNibbles, argumentDeltaBases,
+               deltaIntegers, xorDoubles, unpackedValues);
     const char* nextStringArg = nb.getEndOfPackedArguments();
 
     // TODO(syang0) We can probably skip processing the log message at
     // if we (a) aren't printing and (b) aren't aggregating
+    int paramIndex = 0;
     for (int i = 0; i < metadata->numPrintFragments; ++i) {
       const wchar_t* wstrArg;
 
       int width = -1;
-      if (pf->hasDynamicWidth) width = nb.getNext<int>();
+      if (pf->hasDynamicWidth) {
+        width = nb.getNext<int>();
+        ++paramIndex;
+      }
 
       int precision = -1;
-      if (pf->hasDynamicPrecision) precision = nb.getNext<int>();
+      if (pf->hasDynamicPrecision) {
+        precision = nb.getNext<int>();
+        ++paramIndex;
+      }
+
+      // Integers bound to an enum table are rendered by name
+      const std::unordered_map<int64_t, std::string>* enumTable = nullptr;
+      if (pf->argType >= unsigned_char_t && pf->argType <= ptrdiff_t_t)
+        enumTable = decoder.getEnumTable(nextLogId, paramIndex);
+
+      if (pf->argType != NONE) ++paramIndex;
+
+      if (enumTable != nullptr) {
+        printEnumArg(outputFd, logArgs, pf->formatFragment,
+                     getNextInteger(nb, pf->argType), *enumTable, width,
+                     precision);
+        pf = reinterpret_cast<PrintFragment*>(reinterpret_cast<char*>(pf) +
+                                              pf->fragmentLength +
+                                              sizeof(PrintFragment));
+        continue;
+      }
 
       switch (pf->argType) {
         case NONE:
@@ -1322,9 +2105,20 @@ bool Log::Decoder::BufferFragment::decompressNextLogStatement(
                                             sizeof(PrintFragment));
     }
 
-    if (outputFd) fprintf(outputFd, "}\n");
     // We're done, advance the pointer to the end of the last string
     readPos = nextStringArg;
+
+    if (decoder.hasBacktrace(nextLogId))
+      readPos = decoder.printBacktrace(outputFd, readPos);
+
+    if (decoder.isSpanEnd(nextLogId))
+      decoder.endSpan(outputFd, runtimeId, nextLogId, nextLogTimestamp);
+
+    if (decoder.isMetric(nextLogId))
+      readPos = decoder.printMetricSnapshot(outputFd, nextLogId,
+                                            nextLogTimestamp, readPos);
+
+    if (outputFd) fprintf(outputFd, "}\n");
   }
 
   logMsgsProcessed++;
@@ -1338,6 +2132,29 @@ bool Log::Decoder::BufferFragment::decompressNextLogStatement(
   return true;
 }
 
+/**
+ * Applies the consecutive internal records (context records and span
+ * entries) at the read position to the state of the BufferFragment's thread
+ * and advances past them.
+ *
+ * \param decoder
+ *      Decoder holding the dictionary and the thread states
+ */
+void Log::Decoder::BufferFragment::consumeInternalRecords(Decoder& decoder) {
+  while (hasMoreLogs && decoder.isInternalRecord(nextLogId)) {
+    if (decoder.isContextRecord(nextLogId))
+      readPos = decoder.readContextRecord(runtimeId, readPos);
+    else
+      decoder.beginSpan(runtimeId, nextLogId, nextLogTimestamp);
+
+    if (readPos >= endOfBuffer)
+      hasMoreLogs = false;
+    else
+      hasMoreLogs = decompressLogHeader(&readPos, nextLogTimestamp, nextLogId,
+                                        nextLogTimestamp);
+  }
+}
+
 /**
  * Whether one can invoke decompressNextLogStatement or not
  */
@@ -1396,7 +2213,7 @@ bool Log::Decoder::internalDecompressUnordered(
         ++numBufferFragmentsRead;
         while (bf->hasNext()) {
           bf->decompressNextLogStatement(outputFd, logMsgsPrinted, logArguments,
-                                         checkpoint, fmtId2metadata,
+                                         checkpoint, *this,
                                          aggregationTargetId, aggregationFn);
         }
         break;
@@ -1565,7 +2382,7 @@ int64_t Log::Decoder::decompressTo(FILE* outputFd) {
       // Step 3b: Output the log message
       BufferFragment* bf = minStage->front();
       bf->decompressNextLogStatement(outputFd, logMsgsPrinted, logArguments,
-                                     checkpoint, fmtId2metadata);
+                                     checkpoint, *this);
 
       // Moves the minimum element to the end of the array
       std::pop_heap(minStage->begin(), minStage->end(), compareBufferFragments);
@@ -1615,61 +2432,60 @@ int64_t Log::Decoder::decompressTo(FILE* outputFd) {
  *      False indicates there are no more logs or there's an error
  */
 bool Log::Decoder::getNextLogStatement(LogMessage& logMsg, FILE* outputFd) {
-  if (bufferFragment->hasNext()) {
-    bufferFragment->decompressNextLogStatement(outputFd, logMsgsPrinted, logMsg,
-                                               checkpoint, fmtId2metadata, -1,
-                                               nullptr);
-    return true;
-  }
+  while (true) {
+    while (bufferFragment->hasNext()) {
+      if (bufferFragment->decompressNextLogStatement(
+              outputFd, logMsgsPrinted, logMsg, checkpoint, *this, -1,
+              nullptr))
+        return true;
+    }
 
-  logMsg.reset();
+    logMsg.reset();
 
-  // Decoder was never 'opened' properly
-  if (filename.empty() || !inputFd) return false;
+    // Decoder was never 'opened' properly
+    if (filename.empty() || !inputFd) return false;
 
-  // We've read the end of the file or an error
-  if (feof(inputFd) || !good) return false;
+    // We've read the end of the file or an error
+    if (feof(inputFd) || !good) return false;
 
-  while (!bufferFragment->hasNext() && !feof(inputFd) && good) {
-    EntryType entry = peekEntryType(inputFd);
-    bool wrapAround;
+    while (!bufferFragment->hasNext() && !feof(inputFd) && good) {
+      EntryType entry = peekEntryType(inputFd);
+      bool wrapAround;
 
-    switch (entry) {
-      case EntryType::BUFFER_EXTENT:
-        if (bufferFragment->readBufferExtent(inputFd, &wrapAround)) {
-          ++numBufferFragmentsRead;
-          break;
-        }
+      switch (entry) {
+        case EntryType::BUFFER_EXTENT:
+          if (bufferFragment->readBufferExtent(inputFd, &wrapAround)) {
+            ++numBufferFragmentsRead;
+            break;
+          }
 
-        fprintf(stderr, "Internal Error: Corrupted BufferExtent\r\n");
-        good = false;
-        return false;
+          fprintf(stderr, "Internal Error: Corrupted BufferExtent\r\n");
+          good = false;
+          return false;
 
-      case EntryType::CHECKPOINT:
-        if (readDictionary(inputFd, true)) {
-          // if (outputFd) fprintf(outputFd, "\r\n# New execution started\r\n");
+        case EntryType::CHECKPOINT:
+          if (readDictionary(inputFd, true)) {
+            // if (outputFd)
+            //   fprintf(outputFd, "\r\n# New execution started\r\n");
 
-          break;
-        }
+            break;
+          }
 
-        good = false;
-        return false;
+          good = false;
+          return false;
 
-      case EntryType::LOG_MSGS_OR_DIC:
-        good = readDictionaryFragment(inputFd);
-        break;
+        case EntryType::LOG_MSGS_OR_DIC:
+          good = readDictionaryFragment(inputFd);
+          break;
 
-      case EntryType::INVALID:
-        // Consume padding
-        while (!feof(inputFd) && peekEntryType(inputFd) == INVALID)
-          fgetc(inputFd);
-        break;
+        case EntryType::INVALID:
+          // Consume padding
+          while (!feof(inputFd) && peekEntryType(inputFd) == INVALID)
+            fgetc(inputFd);
+          break;
+      }
     }
   }
-
-  return bufferFragment->decompressNextLogStatement(
-      outputFd, logMsgsPrinted, logMsg, checkpoint, fmtId2metadata, -1,
-      nullptr);
 }
 
 /**
@@ -15,8 +15,16 @@
 #pragma once
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <ctime>
+#include <limits>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "Common.h"
@@ -24,6 +32,7 @@
 #include "Cycles.h"
 #include "Packer.h"
 #include "Portability.h"
+#include "Symbolizer.h"
 #include "Util.h"
 
 /**
@@ -120,6 +129,13 @@ struct StaticLogInfo {
   // non-preprocessor version of NanoLog
   typedef void (*CompressionFn)(int, const ParamType*, char**, char**);
 
+  // Function signature of the compression function of log sites that encode
+  // their arguments as deltas (see Log::DELTA_ARGUMENTS and
+  // Log::XOR_DOUBLES); the last parameter holds the previous value of each
+  // non-string argument
+  typedef void (*DeltaCompressionFn)(const ParamType*, char**, char**,
+                                     uint64_t*);
+
   // Constructor
   constexpr StaticLogInfo(CompressionFn compress, const char* filename,
                           const uint32_t lineNum, const uint8_t severity,
@@ -132,7 +148,10 @@ struct StaticLogInfo {
         formatString(fmtString),
         numParams(numParams),
         numNibbles(numNibbles),
-        paramTypes(paramTypes) {}
+        paramTypes(paramTypes),
+        extensions(nullptr),
+        extensionsLength(0),
+        deltaCompressionFunction(nullptr) {}
 
   // Stores the compression function to be used on the log's dynamic arguments
   CompressionFn compressionFunction;
@@ -159,6 +178,127 @@ struct StaticLogInfo {
   // argument list starting at 0) to parameter type as inferred from the
   // printf log message invocation
   const ParamType* paramTypes;
+
+  // Optional site extension records (see Log::SiteExtension) to persist
+  // in the dictionary along with the format string, or nullptr if none.
+  const char* extensions;
+
+  // Number of bytes in extensions
+  uint16_t extensionsLength;
+
+  // Compression function to be used instead of compressionFunction if the
+  // log site encodes its arguments as deltas, or nullptr otherwise
+  DeltaCompressionFn deltaCompressionFunction;
+};
+
+/**
+ * Append-only table of the StaticLogInfo of the log sites registered at
+ * runtime, indexed by logId. The entries are stored in fixed-size segments
+ * that are never moved, so that the compression threads can look up entries
+ * in place and without locking while new log sites are being registered.
+ * Readers bound their lookups by a View, which covers the entries published
+ * at the time it was taken (or fewer). Appends must be serialized by the
+ * caller.
+ */
+class SiteDictionary {
+ public:
+  /**
+   * Read-only view of the first entries of a SiteDictionary. Views are
+   * cheap to copy and remain valid for the lifetime of the dictionary.
+   */
+  class View {
+   public:
+    View() : dictionary(nullptr), numEntries(0) {}
+
+    View(const SiteDictionary* dictionary, uint32_t numEntries)
+        : dictionary(dictionary), numEntries(numEntries) {}
+
+    inline uint32_t size() const { return numEntries; }
+
+    inline const StaticLogInfo& operator[](uint32_t logId) const {
+      assert(logId < numEntries);
+      return (*dictionary)[logId];
+    }
+
+   private:
+    // Dictionary viewed
+    const SiteDictionary* dictionary;
+
+    // Number of entries covered by the view
+    uint32_t numEntries;
+  };
+
+  SiteDictionary() : segments(), numEntries(0) {}
+
+  ~SiteDictionary() {
+    for (StaticLogInfo* segment : segments) ::operator delete(segment);
+  }
+
+  /**
+   * Returns the number of entries published to the readers.
+   */
+  inline uint32_t size() const {
+    return numEntries.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Returns a view of the entries published so far, or of the first
+   * numEntries of them.
+   */
+  inline View view() const { return View(this, size()); }
+  inline View view(uint32_t numEntries) const {
+    return View(this, std::min(numEntries, size()));
+  }
+
+  /**
+   * Returns a published entry.
+   */
+  inline const StaticLogInfo& operator[](uint32_t logId) const {
+    return segments[logId >> SEGMENT_BITS][logId & (SEGMENT_SIZE - 1)];
+  }
+
+  /**
+   * Appends an entry and publishes it to the readers.
+   *
+   * \param info
+   *      Static log information of the new entry
+   *
+   * \return
+   *      The logId assigned to the entry
+   *
+   * \throw std::length_error
+   *      if the dictionary is full
+   */
+  uint32_t append(const StaticLogInfo& info) {
+    uint32_t logId = numEntries.load(std::memory_order_relaxed);
+    uint32_t segment = logId >> SEGMENT_BITS;
+    if (segment == MAX_SEGMENTS)
+      throw std::length_error("NanoLog supports at most " +
+                              std::to_string(MAX_SEGMENTS * SEGMENT_SIZE) +
+                              " log sites");
+
+    if (segments[segment] == nullptr)
+      segments[segment] = static_cast<StaticLogInfo*>(
+          ::operator new(SEGMENT_SIZE * sizeof(StaticLogInfo)));
+
+    new (&segments[segment][logId & (SEGMENT_SIZE - 1)]) StaticLogInfo(info);
+    numEntries.store(logId + 1, std::memory_order_release);
+    return logId;
+  }
+
+ private:
+  // Number of entries per segment (as a power of 2) and of segments
+  static const uint32_t SEGMENT_BITS = 12;
+  static const uint32_t SEGMENT_SIZE = 1 << SEGMENT_BITS;
+  static const uint32_t MAX_SEGMENTS = 1 << 12;
+
+  // Storage of the entries; segments are allocated as needed
+  StaticLogInfo* segments[MAX_SEGMENTS];
+
+  // Number of entries published to the readers
+  std::atomic<uint32_t> numEntries;
+
+  DISALLOW_COPY_AND_ASSIGN(SiteDictionary);
 };
 
 namespace Log {
@@ -186,6 +326,11 @@ struct UncompressedEntry {
   char argData[0];
 };
 
+// Set in UncompressedEntry::fmtId when the logging thread has already
+// compressed the arguments after the header with the site's compression
+// function (see NanoLog::setProducerCompression()).
+static constexpr uint32_t PRECOMPRESSED_FLAG = 1u << 31;
+
 /**
  * 2-bit enum that differentiates entries in the compressed log. These
  * two bits **MUST** be at the beginning of each entry in the log
@@ -367,6 +512,154 @@ struct CompressedLogInfo {
 };
 NANOLOG_PACK_POP
 
+/**
+ * Identifies the type of a SiteExtension record.
+ */
+enum SiteExtensionType : uint8_t {
+  // A table mapping enum values to names. The table is identified by the
+  // logId of the dictionary entry carrying it and its payload is a series of
+  // int64_t values, each followed by a NULL-terminated name.
+  ENUM_TABLE = 1,
+
+  // Binds arguments of the log message to ENUM_TABLEs so that they can be
+  // rendered by name. The payload is a series of EnumBindings.
+  ENUM_BINDING = 2,
+
+  // Indicates that every log message of the site is followed by a
+  // backtrace (see NANO_LOG_BT()). The payload is empty.
+  BACKTRACE = 3,
+
+  // A snapshot of the runtime's executable mappings used to symbolize
+  // backtraces. The payload is a series of ModuleMappings, each followed by
+  // the NULL-terminated path of the mapped file.
+  MODULE_MAP = 4,
+
+  // Marks the internal log site that records changes to a thread's context
+  // (see NanoLog::setContext()). Its log messages carry a NULL-terminated
+  // key and value and are attached to the thread's subsequent log messages
+  // rather than output by themselves. The payload is empty.
+  CONTEXT = 5,
+
+  // Marks the log site recording the entry into a NANO_SPAN() scope. Its
+  // log messages carry no arguments and the span is named by the format
+  // string. The payload is empty.
+  SPAN_BEGIN = 6,
+
+  // Marks the log site recording the exit from a NANO_SPAN() scope. The
+  // payload is the uint32_t logId of the matching SPAN_BEGIN site.
+  SPAN_END = 7,
+
+  // Marks the log site recording the snapshots of a NANO_METRIC_*() metric.
+  // Its log messages carry the aggregates of a thread's metric updates over
+  // a metric epoch and the metric is named by the format string. The payload
+  // is the uint8_t MetricType of the metric.
+  METRIC = 8,
+
+  // Indicates that the integer arguments of the site's log messages are
+  // encoded as BufferUtils::zigzagDelta()s from the same argument of the
+  // site's previous log message in the BufferExtent, or from 0 for the first
+  // (see NANO_LOG_DELTA()). The payload is empty.
+  DELTA_ARGUMENTS = 9,
+
+  // Indicates that some double arguments of the site's log messages are
+  // encoded as the BufferUtils::packXor() of their bits with those of the
+  // same argument of the site's previous log message in the BufferExtent, or
+  // with 0 for the first (see NANO_LOG_XOR()). The payload is a uint64_t bit
+  // mask of these arguments, the n-th bit standing for the n-th non-string
+  // argument.
+  XOR_DOUBLES = 10,
+
+  // Indicates that the non-string arguments of the site's log messages are
+  // encoded with BufferUtils::packVByte() rather than pack(). The payload is
+  // the uint8_t version of the encoding (see BufferUtils::VBYTE_VERSION).
+  VBYTE_ARGUMENTS = 11,
+};
+
+/**
+ * Types of the metrics aggregated by NANO_METRIC_*().
+ */
+enum MetricType : uint8_t {
+  // Sum of deltas; a snapshot consists of the thread id, the epoch and the
+  // sum
+  COUNTER = 1,
+
+  // Distribution of values; a snapshot consists of the thread id, the
+  // epoch, the count, sum, minimum and maximum of the values and the counts
+  // of the power-of-two buckets of the values
+  HISTOGRAM = 2,
+};
+
+/**
+ * Site extensions attach additional static information to a log invocation
+ * site. They follow the NULL-terminated format string of a CompressedLogInfo
+ * and are counted in its formatStringLength, so decoders that do not know
+ * about them see a regular format string. Each record starts with this
+ * header and records of unknown types shall be skipped.
+ */
+NANOLOG_PACK_PUSH
+struct SiteExtension {
+  // SiteExtensionType of the record
+  uint8_t type;
+
+  // Number of bytes in the payload following this header
+  uint16_t length;
+};
+NANOLOG_PACK_POP
+
+/**
+ * Payload entry of an ENUM_BINDING SiteExtension.
+ */
+NANOLOG_PACK_PUSH
+struct EnumBinding {
+  // Index of the bound argument in the log message's argument list
+  // (including dynamic width and precision arguments)
+  uint16_t paramIndex;
+
+  // logId of the dictionary entry holding the ENUM_TABLE
+  uint32_t tableId;
+};
+NANOLOG_PACK_POP
+
+/**
+ * Payload entry of a MODULE_MAP SiteExtension, describing one executable
+ * mapping of the runtime's address space (i.e. a line of /proc/self/maps).
+ */
+NANOLOG_PACK_PUSH
+struct ModuleMapping {
+  // Start and end of the mapped address range
+  uint64_t start;
+  uint64_t end;
+
+  // Offset into the mapped file of the start address
+  uint64_t offset;
+};
+NANOLOG_PACK_POP
+
+// Maximum number of bytes in the payload of a single SiteExtension; this
+// leaves room for the record header and an empty format string within the
+// 16-bit CompressedLogInfo::formatStringLength.
+static constexpr uint32_t MAX_SITE_EXTENSION_PAYLOAD =
+    std::numeric_limits<uint16_t>::max() - sizeof(SiteExtension) - 1;
+
+/**
+ * Appends a SiteExtension record to a buffer of extensions.
+ *
+ * \param[in/out] extensions
+ *      Buffer to append the record to
+ * \param type
+ *      Type of the record
+ * \param payload
+ *      Payload of the record (at most MAX_SITE_EXTENSION_PAYLOAD bytes)
+ */
+inline void appendSiteExtension(std::string& extensions,
+                                SiteExtensionType type,
+                                const std::string& payload) {
+  assert(payload.size() <= MAX_SITE_EXTENSION_PAYLOAD);
+  SiteExtension header = {type, static_cast<uint16_t>(payload.size())};
+  extensions.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  extensions.append(payload);
+}
+
 /**
  * Describes a unique log message within the user sources. The order in
  * which this structure appears in the log file determines the associated
@@ -521,8 +814,9 @@ inline size_t compressLogHeader(const UncompressedEntry* re, char** out,
   mo->entryType = EntryType::LOG_MSGS_OR_DIC;
 
   // Bitmask is needed to prevent -Wconversion warnings
+  uint32_t fmtId = re->fmtId & ~PRECOMPRESSED_FLAG;
   mo->additionalFmtIdBytes =
-      0x03 & static_cast<uint8_t>(BufferUtils::pack(out, re->fmtId) - 1);
+      0x03 & static_cast<uint8_t>(BufferUtils::pack(out, fmtId) - 1);
   mo->additionalTimestampBytes =
       0x0F & static_cast<uint8_t>(BufferUtils::pack(
                  out, static_cast<int64_t>(re->timestamp - lastTimestamp)));
@@ -556,9 +850,9 @@ inline bool decompressLogHeader(const char** in, uint64_t lastTimestamp,
   memcpy(&cre, (*in), sizeof(CompressedEntry));
   (*in) += sizeof(CompressedEntry);
 
-  logId = BufferUtils::unpack<uint32_t>(
+  logId = BufferUtils::unpackWord<uint32_t>(
       in, static_cast<uint8_t>(cre.additionalFmtIdBytes + 1));
-  timestamp = BufferUtils::unpack<int64_t>(
+  timestamp = BufferUtils::unpackWord<int64_t>(
       in, static_cast<uint8_t>(cre.additionalTimestampBytes));
 
   timestamp += lastTimestamp;
@@ -606,6 +900,31 @@ static inline void recordPrimitive(char*& buffer, T val) {
   buffer += sizeof(T);
 }
 
+/**
+ * Previous values of the arguments of the log sites that encode their
+ * arguments as deltas (see DELTA_ARGUMENTS and XOR_DOUBLES). The Encoder
+ * and the Decoder each track them in a table of fixed size, which restarts
+ * with every BufferExtent so that the extents can be decoded independently
+ * of each other.
+ */
+class DeltaBaseTable {
+  PUBLIC : DeltaBaseTable();
+  void reset();
+  uint64_t* getBases(uint32_t fmtId, int numNibbles);
+
+  PRIVATE :
+      // The log sites that encode their arguments as deltas and have been
+      // seen in the current BufferExtent, along with the offset of their
+      // arguments' previous values in bases
+      uint32_t siteIds[NanoLogConfig::MAX_DELTA_BASES_PER_EXTENT];
+  uint32_t siteOffsets[NanoLogConfig::MAX_DELTA_BASES_PER_EXTENT];
+  uint32_t numSites;
+
+  // Previous values of the arguments of the log sites in siteIds
+  uint64_t bases[NanoLogConfig::MAX_DELTA_BASES_PER_EXTENT];
+  uint32_t numBases;
+};
+
 /**
  * Encapsulates the knowledge on how to transform UncompresedLogMessage's
  * created by the generated code into a compressed log for a Decoder
@@ -631,11 +950,12 @@ class Encoder {
                    bool forceDictionaryOutput = false);
 
   long encodeLogMsgs(char* from, uint64_t nbytes, uint32_t bufferId,
-                     bool wrapAround, std::vector<StaticLogInfo> dictionary,
+                     bool wrapAround, SiteDictionary::View dictionary,
                      uint64_t* numEventsCompressed);
   uint32_t encodeNewDictionaryEntries(uint32_t& currentPosition,
-                                      std::vector<StaticLogInfo> allMetadata);
+                                      SiteDictionary::View allMetadata);
 
+  bool appendEncoded(const char* encoded, size_t nbytes);
   size_t getEncodedBytes();
   void swapBuffer(char* inBuffer, size_t inSize, char** outBuffer = nullptr,
                   size_t* outLength = nullptr, size_t* outSize = nullptr);
@@ -668,6 +988,10 @@ class Encoder {
   // Metric: Number of consecutive encode failures due to missing metadata
   // Used to detect cases where the dictionary isn't persisted due to bugs
   uint32_t consecutiveEncodeMissesDueToMetadata;
+
+  // Previous values of the arguments of the log sites that encode their
+  // arguments as deltas, for the current BufferExtent
+  DeltaBaseTable deltaBases;
 };
 
 /**
@@ -829,6 +1153,8 @@ class Decoder {
 
   bool getNextLogStatement(LogMessage& logMsg, FILE* outputFd = nullptr);
 
+  void printSpanSummary(FILE* outputFd) const;
+
   PRIVATE :
       /**
        * Reads and stores a BufferExtent from the compressed log and
@@ -836,12 +1162,16 @@ class Decoder {
        * extent.
        */
       struct BufferFragment {
-    // Stores the bytes in a compressed log BufferExtent. The size is
-    // chosen to be a little bigger than the size of a runtime
-    // StagingBuffer to account for any other entries that may be
-    // inserted at runtime.
-    char storage[NanoLogConfig::STAGING_BUFFER_SIZE +
-                 BufferExtent::maxSizeOfHeader()];
+    // Largest BufferExtent that fits in storage. The size is chosen to
+    // be a little bigger than the size of a runtime StagingBuffer to
+    // account for any other entries that may be inserted at runtime.
+    static constexpr uint32_t MAX_EXTENT_SIZE =
+        NanoLogConfig::STAGING_BUFFER_SIZE + BufferExtent::maxSizeOfHeader();
+
+    // Stores the bytes in a compressed log BufferExtent, followed by
+    // padding that keeps the word loads of BufferUtils::unpackWord() and
+    // BufferUtils::unpackVByte() within bounds at the end of the extent.
+    char storage[MAX_EXTENT_SIZE + BufferUtils::VBYTE_SLACK];
 
     // Number of valid bytes in storage.
     uint64_t validBytes;
@@ -864,15 +1194,25 @@ class Decoder {
     uint32_t nextLogId;
     uint64_t nextLogTimestamp;
 
+    // Previous values of the arguments of the log sites that encode their
+    // arguments as deltas, which is reset with each BufferExtent.
+    DeltaBaseTable deltaBases;
+
+    // Values of the log message being decompressed if its arguments were
+    // encoded with BufferUtils::packVByte(); FormatMetadata::numNibbles
+    // bounds their number
+    uint64_t vbyteValues[UINT8_MAX + 1];
+
     BufferFragment();
     void reset();
     bool hasNext();
     bool readBufferExtent(FILE* fd, bool* wrapAround = nullptr);
     bool decompressNextLogStatement(
         FILE* outputFd, uint64_t& logMsgsProcessed, LogMessage& logArguments,
-        const Checkpoint& checkpoint, std::vector<void*>& fmtId2metadata,
+        const Checkpoint& checkpoint, Decoder& decoder,
         long aggregationFilterId = -1,
         void (*aggregationFn)(const char*, ...) = NULL);
+    void consumeInternalRecords(Decoder& decoder);
     uint64_t getNextLogTimestamp() const;
   };
 
@@ -881,6 +1221,27 @@ class Decoder {
 
   bool readDictionary(FILE* fd, bool flushOldDictionary);
   bool readDictionaryFragment(FILE* fd);
+  void readSiteExtensions(uint32_t fmtId, const char* extensions,
+                          const char* endOfExtensions);
+  const std::unordered_map<int64_t, std::string>* getEnumTable(
+      uint32_t fmtId, int paramIndex) const;
+  bool hasBacktrace(uint32_t fmtId) const;
+  bool hasDeltaArguments(uint32_t fmtId) const;
+  uint64_t getXorDoubles(uint32_t fmtId) const;
+  uint8_t getVByteVersion(uint32_t fmtId) const;
+  const char* printBacktrace(FILE* outputFd, const char* in);
+  bool isInternalRecord(uint32_t fmtId) const;
+  bool isContextRecord(uint32_t fmtId) const;
+  const char* readContextRecord(uint32_t runtimeId, const char* in);
+  void printContext(FILE* outputFd, uint32_t runtimeId) const;
+  void beginSpan(uint32_t runtimeId, uint32_t fmtId, uint64_t timestamp);
+  bool isSpanEnd(uint32_t fmtId) const;
+  void endSpan(FILE* outputFd, uint32_t runtimeId, uint32_t fmtId,
+               uint64_t timestamp);
+  bool isMetric(uint32_t fmtId) const;
+  uint32_t getMetricThreadId(uint32_t fmtId, const char* in) const;
+  const char* printMetricSnapshot(FILE* outputFd, uint32_t fmtId,
+                                  uint64_t timestamp, const char* in);
 
   BufferFragment* allocateBufferFragment();
   void freeBufferFragment(BufferFragment* bf);
@@ -926,6 +1287,104 @@ class Decoder {
   // built from FormatMetadata's.
   std::vector<std::string> fmtId2fmtString;
 
+  /**
+   * Static information about a log message conveyed via SiteExtensions.
+   */
+  struct SiteInfo {
+    SiteInfo()
+        : enumBindings(),
+          hasBacktrace(false),
+          isContext(false),
+          isSpanBegin(false),
+          spanBeginId(-1),
+          metricType(0),
+          hasDeltaArguments(false),
+          xorDoubles(0),
+          vbyteVersion(0) {}
+
+    // Enum table id bound to each of the log message's arguments (-1 for
+    // unbound arguments). Empty for log messages without bound arguments.
+    std::vector<int64_t> enumBindings;
+
+    // Indicates that every log message is followed by a backtrace
+    bool hasBacktrace;
+
+    // Indicates that the log messages are context records
+    bool isContext;
+
+    // Indicates that the log messages record entries into a span
+    bool isSpanBegin;
+
+    // For log messages recording exits from a span, the fmtId of the
+    // matching span entry records; -1 otherwise.
+    int64_t spanBeginId;
+
+    // For log messages recording metric snapshots, the MetricType of the
+    // metric; 0 otherwise.
+    uint8_t metricType;
+
+    // Indicates that the integer arguments are encoded as deltas (see
+    // Log::DELTA_ARGUMENTS)
+    bool hasDeltaArguments;
+
+    // Bit mask of the non-string arguments that are doubles encoded as XORs
+    // (see Log::XOR_DOUBLES); 0 if there are none
+    uint64_t xorDoubles;
+
+    // Version of the BufferUtils::packVByte() encoding of the arguments (see
+    // Log::VBYTE_ARGUMENTS); 0 if they are pack()-ed
+    uint8_t vbyteVersion;
+  };
+
+  /**
+   * A span that was entered but not exited yet.
+   */
+  struct OpenSpan {
+    // fmtId of the span entry record
+    uint32_t beginId;
+
+    // Runtime timestamp of the span entry
+    uint64_t timestamp;
+  };
+
+  /**
+   * Durations of all the spans of a NANO_SPAN() invocation site.
+   */
+  struct SpanStats {
+    SpanStats() : count(0), totalNs(0), minNs(0), maxNs(0), buckets() {}
+
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t minNs;
+    uint64_t maxNs;
+
+    // Number of spans with a duration in [2^i, 2^(i+1)) ns in the i-th bucket
+    uint64_t buckets[64];
+  };
+
+  // Mapping of fmtId to the SiteInfo of the log message
+  std::vector<SiteInfo> fmtId2siteInfo;
+
+  // Mapping of enum table id to the names of the enum values in the table
+  std::unordered_map<uint32_t, std::unordered_map<int64_t, std::string>>
+      enumTables;
+
+  // Resolves backtraces against the module maps found in the dictionary
+  Symbolizer symbolizer;
+
+  // Mapping of runtime StagingBuffer id to the current context (key/value
+  // pairs) of the thread, as established by the context records read thus far
+  std::unordered_map<uint32_t, std::map<std::string, std::string>>
+      threadContexts;
+
+  // Mapping of runtime StagingBuffer id to the stack of spans the thread
+  // is currently in, innermost last.
+  std::unordered_map<uint32_t, std::vector<OpenSpan>> threadSpans;
+
+  // Durations of the spans read thus far, indexed by the location and name
+  // of the span ("file:line name"). These persist across executions.
+  std::map<std::string, SpanStats> spanStats;
+
   // Contains the raw metadata to interpret log messages,
   // directly read from the log file
   char* rawMetadata;
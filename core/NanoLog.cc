@@ -10,6 +10,8 @@ using namespace NanoLogInternal;
 
 std::string getStats() { return RuntimeLogger::getStats(); }
 
+std::string getHistograms() { return RuntimeLogger::getHistograms(); }
+
 void printConfig() {
   printf("==== NanoLog Configuration ====\r\n");
 
@@ -23,6 +25,7 @@ void printConfig() {
          NanoLogConfig::POLL_INTERVAL_NO_WORK_US);
   printf("IO Poll Interval  : %u µs\r\n",
          NanoLogConfig::POLL_INTERVAL_DURING_IO_US);
+  printf("Dynamic Log Sites : %u\r\n", NanoLogConfig::MAX_DYNAMIC_LOG_SITES);
 }
 
 void preallocate() { RuntimeLogger::preallocate(); }
@@ -33,8 +36,56 @@ LogLevel getLogLevel() { return RuntimeLogger::getLogLevel(); }
 
 void setLogLevel(LogLevel logLevel) { RuntimeLogger::setLogLevel(logLevel); }
 
+void setDegradedLogLevel(LogLevel logLevel) {
+  RuntimeLogger::setDegradedLogLevel(logLevel);
+}
+
+void setPriorityLaneLevel(LogLevel logLevel) {
+  RuntimeLogger::setPriorityLaneLevel(logLevel);
+}
+
+void setProducerCompression(bool enable) {
+  RuntimeLogger::setProducerCompression(enable);
+}
+
 void sync() { RuntimeLogger::sync(); }
 
+std::future<void> flushAsync() { return RuntimeLogger::flushAsync(); }
+
+bool enablePerCpuStaging() { return RuntimeLogger::enablePerCpuStaging(); }
+
+void installCrashHandler() { RuntimeLogger::installCrashHandler(); }
+
+void setMaxCompressionThreads(uint32_t numThreads) {
+  RuntimeLogger::setMaxCompressionThreads(numThreads);
+}
+
+void setWakeupPolicy(WakeupPolicy policy) {
+  RuntimeLogger::setWakeupPolicy(policy);
+}
+
+void setScanPolicy(ScanPolicy policy) { RuntimeLogger::setScanPolicy(policy); }
+
+void enableEmbeddedMode() { RuntimeLogger::enableEmbeddedMode(); }
+
+bool poll(uint64_t budgetNs) { return RuntimeLogger::poll(budgetNs); }
+
+Channel createChannel(const char* name, const char* filename) {
+  return RuntimeLogger::createChannel(name, filename);
+}
+
+Channel getChannel(const char* name) { return RuntimeLogger::getChannel(name); }
+
+void setChannelLogLevel(Channel channel, LogLevel logLevel) {
+  RuntimeLogger::setChannelLogLevel(channel, logLevel);
+}
+
+LogLevel getChannelLogLevel(Channel channel) {
+  return RuntimeLogger::getChannelLogLevel(channel);
+}
+
+void syncChannel(Channel channel) { RuntimeLogger::syncChannel(channel); }
+
 int getCoreIdOfBackgroundThread() {
   return RuntimeLogger::getCoreIdOfBackgroundThread();
 }
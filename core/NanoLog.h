@@ -15,6 +15,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <future>
 #include <string>
 
 /**
@@ -60,6 +62,14 @@ enum LogLevel {
 };  // namespace LogLevels
 using namespace LogLevels;
 
+/**
+ * Identifies a log channel (see createChannel()).
+ */
+typedef uint32_t Channel;
+
+// The channel NANO_LOG() logs to, which the functions below configure
+static const Channel PRIMARY_CHANNEL = 0;
+
 // User API
 
 /**
@@ -92,7 +102,221 @@ void setLogFile(const char* filename);
 void setLogLevel(LogLevel logLevel);
 
 /**
- * Returns the current minimum log severity level enforced by NanoLog
+ * Enables the back-pressure governor, which temporarily lowers the log level
+ * to the given level when the StagingBuffers back up because the background
+ * thread or the disk cannot keep up. Less severe log messages are then
+ * dropped rather than blocking the logging threads until the backlog drains.
+ * The governor is disabled by default (NUM_LOG_LEVELS), in which case no log
+ * messages are ever dropped.
+ *
+ * \param logLevel
+ *      Minimum log severity level enforced under back-pressure (e.g. WRN),
+ *      or NUM_LOG_LEVELS to disable the governor
+ */
+void setDegradedLogLevel(LogLevel logLevel);
+
+/**
+ * Stages log messages of the given severity level and above in a small
+ * per-thread priority lane that the background thread drains ahead of the
+ * regular StagingBuffers, so that they reach the log file with bounded
+ * latency even while less severe messages are backed up. Priority lanes are
+ * disabled by default (SILENT_LOG_LEVEL).
+ *
+ * Within a thread, priority messages may be persisted ahead of less severe
+ * messages logged before them; the decompressor restores the order when
+ * sorting the log messages by time.
+ *
+ * \param logLevel
+ *      Least severe log level to stage in the priority lanes (e.g. WRN)
+ */
+void setPriorityLaneLevel(LogLevel logLevel);
+
+/**
+ * Makes the logging threads compress the arguments of their log messages
+ * before staging them, rather than leaving the compression to the background
+ * thread. This costs the logging threads some latency per message, but the
+ * StagingBuffers hold considerably more messages, which suits deployments
+ * whose StagingBuffers must be kept small. The background thread then merely
+ * copies the compressed arguments to the output.
+ *
+ * Only messages of up to NanoLogConfig::PRODUCER_COMPRESSION_MAX_SIZE bytes
+ * are compressed by the logging threads; NANO_LOG_BT(), metric snapshots and
+ * structured records are always compressed by the background thread.
+ *
+ * \param enable
+ *      True to compress on the logging threads (disabled by default)
+ */
+void setProducerCompression(bool enable);
+
+/**
+ * Makes the threads that have not logged yet stage their log messages in
+ * per-CPU StagingBuffers rather than one StagingBuffer per thread, which
+ * bounds the memory used and the number of buffers the background thread
+ * scans by the number of CPUs. This suits applications with many threads
+ * (i.e. fiber schedulers) that log infrequently.
+ *
+ * Per-CPU staging relies on the restartable sequences (rseq) area glibc
+ * registers with the kernel to look up the current CPU without a system
+ * call. Since log messages of different threads then share a buffer,
+ * setContext() and NANO_SPAN() are not supported with per-CPU staging; they
+ * assert in debug builds and do nothing otherwise.
+ *
+ * \return
+ *      True if per-CPU staging was enabled; false if rseq is unavailable, in
+ *      which case NanoLog keeps using per-thread StagingBuffers
+ */
+bool enablePerCpuStaging();
+
+/**
+ * Installs handlers for fatal signals (SIGSEGV, SIGBUS, SIGFPE, SIGILL and
+ * SIGABRT) that write out the log messages still pending in NanoLog's
+ * buffers before the process terminates, so that the messages leading up to
+ * a crash are not lost. Upon a fatal signal, the handler stops the logging
+ * threads from staging further log messages, parks the background threads,
+ * and then compresses the pending log messages of all channels and writes
+ * them to the log files synchronously. The signal is re-raised with the
+ * disposition it had before this call.
+ *
+ * The handler is best-effort: it only relies on async-signal-safe functions,
+ * so it skips a channel whose background thread does not park within
+ * NanoLogConfig::CRASH_DRAIN_TIMEOUT_US (i.e. because the crashing thread
+ * holds one of NanoLog's locks). Applications that want to capture stack
+ * overflows should set up an alternate signal stack (see sigaltstack()).
+ */
+void installCrashHandler();
+
+/**
+ * Sets the maximum number of threads compressing the log messages of the
+ * primary channel. While the background thread falls behind (see
+ * NanoLogConfig::COMPRESSION_THREAD_SCALE_WATERMARK), it starts additional
+ * compression threads up to this limit, which then stay around until the
+ * process exits. The StagingBuffers are sharded among the compression
+ * threads, and threads that run out of work in their own shard help out
+ * with the others. The additional threads hand their output over to the
+ * background thread, which writes it to the log file; the log messages of
+ * each thread remain in order.
+ *
+ * \param numThreads
+ *      Maximum number of compression threads, including the background
+ *      thread (1 by default, which disables the additional threads)
+ */
+void setMaxCompressionThreads(uint32_t numThreads);
+
+/**
+ * How the background threads wait for new log messages while they are idle
+ * (see setWakeupPolicy()).
+ */
+enum WakeupPolicy {
+  /**
+   * Wake up every NanoLogConfig::POLL_INTERVAL_NO_WORK_US (the default).
+   */
+  WAKEUP_POLL,
+  /**
+   * Never sleep. This yields the lowest latency at the cost of keeping a
+   * core busy at all times.
+   */
+  WAKEUP_BUSY_POLL,
+  /**
+   * Double the sleep time with every consecutive idle wakeup, up to
+   * NanoLogConfig::WAKEUP_BACKOFF_MAX_US.
+   */
+  WAKEUP_BACKOFF,
+  /**
+   * Sleep until the first log message that is staged after the background
+   * thread went to sleep rings a doorbell, or for at most
+   * NanoLogConfig::DOORBELL_TIMEOUT_US.
+   */
+  WAKEUP_DOORBELL
+};
+
+/**
+ * Selects how the background threads of all channels wait for new log
+ * messages while they are idle. Polling keeps the idle logger busy with
+ * tens of thousands of wakeups per second, whereas the doorbell lets it
+ * sleep until there is work at the cost of a system call on the logging
+ * thread that stages the first log message after the background thread went
+ * to sleep. The additional compression threads (see setMaxCompressionThreads())
+ * back off rather than wait for the doorbell.
+ *
+ * \param policy
+ *      Wakeup policy to use
+ */
+void setWakeupPolicy(WakeupPolicy policy);
+
+/**
+ * The order in which the background threads compress the StagingBuffers of
+ * the logging threads (see setScanPolicy()).
+ */
+enum ScanPolicy {
+  /**
+   * Visit the StagingBuffers round-robin and compress all the log messages
+   * pending in each (the default).
+   */
+  SCAN_ROUND_ROBIN,
+  /**
+   * Compress the StagingBuffers whose logging threads are blocked on a full
+   * buffer or that are filled beyond NanoLogConfig::SCAN_URGENT_FILL_PERCENT
+   * first, fullest first, and limit each visit to
+   * NanoLogConfig::SCAN_QUOTA_BYTES.
+   */
+  SCAN_FILL_PRIORITY
+};
+
+/**
+ * Selects the order in which the background threads of all channels
+ * compress the StagingBuffers. Round-robin scanning lets a nearly full
+ * StagingBuffer wait behind all the others, which may block its logging
+ * thread, whereas the fill priority gets to it first and keeps a single
+ * busy thread from holding up the others. getHistograms() reports how often
+ * the fill priority took effect.
+ *
+ * \param policy
+ *      Scan policy to use
+ */
+void setScanPolicy(ScanPolicy policy);
+
+/**
+ * Switches all channels, including those created later, to embedded mode:
+ * the background threads are stopped and the application compresses and
+ * outputs the log messages by invoking poll() from its own event loop, e.g.
+ * on a housekeeping core. Since the compression then runs synchronously,
+ * the output of a program no longer depends on the scheduling of a
+ * background thread, which also makes for deterministic tests.
+ *
+ * sync(), setLogFile() and the shutdown write out the pending log messages
+ * on the calling thread, whereas the futures returned by flushAsync() only
+ * become ready through poll(). No additional compression threads are
+ * started (see setMaxCompressionThreads()).
+ *
+ * Setting the environment variable NANOLOG_EMBEDDED_MODE enables embedded
+ * mode before the background thread starts in the first place. Like
+ * setLogFile(), this function is *not* thread safe.
+ */
+void enableEmbeddedMode();
+
+/**
+ * Performs one bounded step of the compression of every channel in embedded
+ * mode (see enableEmbeddedMode()): a pass through the StagingBuffers, which
+ * is cut short once the budget is used up, and the output of the compressed
+ * log messages without waiting for the I/O to complete. The budget is
+ * checked between StagingBuffers, so a step may overrun it by the time it
+ * takes to compress NanoLogConfig::POLL_QUOTA_BYTES.
+ *
+ * A channel that is being polled by another thread is skipped.
+ *
+ * \param budgetNs
+ *      Time budget of the call in nanoseconds
+ *
+ * \return
+ *      True if there was work, in which case poll() should be invoked again
+ *      soon; false if NanoLog is idle or not in embedded mode
+ */
+bool poll(uint64_t budgetNs);
+
+/**
+ * Returns the current minimum log severity level enforced by NanoLog; this
+ * may be lower than the level set via setLogLevel() while NanoLog is under
+ * back-pressure (see setDegradedLogLevel()).
  */
 LogLevel getLogLevel();
 
@@ -104,6 +328,67 @@ LogLevel getLogLevel();
  */
 void sync();
 
+/**
+ * Asynchronous version of sync(); returns a future that becomes ready once
+ * the pending log statements are persisted to disk. Concurrent requests are
+ * coalesced so that they are served by a single flush (group commit).
+ */
+std::future<void> flushAsync();
+
+/**
+ * Creates a log channel, which is an independent instance of the NanoLog
+ * runtime with its own log file, log level, background thread and
+ * StagingBuffers. Log messages are logged to a channel via
+ * NANO_LOG_CHANNEL(), so that a high-volume source does not hold up the log
+ * messages of other channels or share their retention.
+ *
+ * The priority lane level and producer compression set for the primary
+ * channel apply to all channels. NANO_LOG_DURABLE(), contexts, spans,
+ * metrics and per-CPU staging are only supported on the primary channel.
+ *
+ * Channels are not destroyed before the application exits.
+ *
+ * \param name
+ *      Name of the channel; if a channel of this name already exists, it is
+ *      returned and filename is ignored
+ * \param filename
+ *      Where to place the channel's log file
+ *
+ * \return
+ *      Channel to pass to NANO_LOG_CHANNEL()
+ *
+ * \throw std::ios_base::failure
+ *      if the log file cannot be opened/created
+ * \throw std::length_error
+ *      if NanoLogConfig::MAX_CHANNELS channels exist already
+ */
+Channel createChannel(const char* name, const char* filename);
+
+/**
+ * Looks up a log channel created via createChannel() by name.
+ *
+ * \throw std::invalid_argument
+ *      if there is no channel of the name
+ */
+Channel getChannel(const char* name);
+
+/**
+ * Sets the minimum logging severity level of a channel (see setLogLevel()).
+ */
+void setChannelLogLevel(Channel channel, LogLevel logLevel);
+
+/**
+ * Returns the current minimum log severity level of a channel (see
+ * getLogLevel()).
+ */
+LogLevel getChannelLogLevel(Channel channel);
+
+/**
+ * Waits until all pending log statements of a channel are persisted to disk
+ * (see sync()).
+ */
+void syncChannel(Channel channel);
+
 // Debugging API
 
 /**
@@ -114,6 +399,15 @@ void sync();
  */
 std::string getStats();
 
+/**
+ * Returns a string containing the distributions gathered by the NanoLog
+ * system, i.e. how full the StagingBuffers are when the background thread
+ * gets to them, how often the logging threads blocked, and the effect of the
+ * scan policy (see setScanPolicy()). Like getStats(), this is a performance
+ * debugging aid and is read without synchronization.
+ */
+std::string getHistograms();
+
 /**
  * Prints the configuration parameters being used by NanoLog to stdout. This is
  * primarily used to keep track of configurations for benchmarking.
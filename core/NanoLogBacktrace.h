@@ -0,0 +1,217 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "NanoLogCpp17.h"
+
+/***
+ * This file implements NANO_LOG_BT(), which logs a message along with the
+ * call stack of the invocation. Rather than symbolizing the stack with
+ * backtrace_symbols() on the logging thread, the frame pointer chain is walked
+ * and only the raw return addresses are stored. The compression thread
+ * encodes them as nibble-packed deltas after the log message's arguments.
+ *
+ * To resolve the addresses, the runtime persists snapshots of its executable
+ * mappings (/proc/self/maps) in the dictionary upon the first NANO_LOG_BT()
+ * and whenever new modules are loaded. The decompressor then symbolizes the
+ * addresses offline with the symbol tables of the mapped binaries, so the
+ * binaries must still be present when decompressing.
+ *
+ * Full backtraces require code compiled with -fno-omit-frame-pointer. Without
+ * frame pointers the trace may be cut short, but the walk never leaves the
+ * thread's stack.
+ */
+namespace NanoLogInternal {
+
+/**
+ * Captures the return addresses on the call stack of the function this is
+ * inlined into by walking the frame pointer chain.
+ *
+ * \param[out] frames
+ *      Array to store the number of frames captured in frames[0], followed by
+ *      the return addresses, innermost first. Must have maxFrames + 1 entries.
+ * \param maxFrames
+ *      Maximum number of return addresses to capture
+ */
+NANOLOG_ALWAYS_INLINE void captureBacktrace(uintptr_t* frames,
+                                            uint32_t maxFrames) {
+  static thread_local uintptr_t stackLow = 0, stackHigh = 0;
+  if (stackHigh == 0)
+    RuntimeLogger::getThreadStackBounds(&stackLow, &stackHigh);
+
+  auto fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  uint32_t numFrames = 0;
+
+  while (numFrames < maxFrames && fp >= stackLow &&
+         fp + 2 * sizeof(uintptr_t) <= stackHigh &&
+         (fp & (sizeof(uintptr_t) - 1)) == 0) {
+    // Every frame starts with the caller's frame pointer and return address
+    const auto* frame = reinterpret_cast<const uintptr_t*>(fp);
+    if (frame[1] == 0) break;
+
+    frames[++numFrames] = frame[1];
+
+    // Stacks grow down, so a well-formed chain only moves up
+    if (frame[0] <= fp) break;
+    fp = frame[0];
+  }
+
+  frames[0] = numFrames;
+}
+
+/**
+ * Compresses the backtrace stored after a log message's arguments by
+ * stageLogEntryWithTrailer(). The encoding consists of the number of frames
+ * in a byte, followed by the nibbles and pack()-ed deltas between successive
+ * return addresses.
+ *
+ * \param[in/out] input
+ *      Input buffer to read the backtrace from
+ * \param[in/out] output
+ *      Output buffer to write the compressed backtrace to
+ */
+inline void compressBacktrace(char** input, char** output) {
+  uintptr_t numFrames;
+  std::memcpy(&numFrames, *input, sizeof(uintptr_t));
+  *input += sizeof(uintptr_t);
+
+  char* out = *output;
+  *out++ = static_cast<char>(numFrames);
+
+  auto* nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(out);
+  out += (numFrames + 1) / 2;
+
+  uintptr_t previous = 0;
+  for (uintptr_t i = 0; i < numFrames; ++i) {
+    uintptr_t frame;
+    std::memcpy(&frame, *input, sizeof(uintptr_t));
+    *input += sizeof(uintptr_t);
+
+    int nibble =
+        BufferUtils::pack(&out, static_cast<int64_t>(frame - previous));
+    if (i & 0x1)
+      nibbles[i / 2].second = 0xf & nibble;
+    else
+      nibbles[i / 2].first = 0xf & nibble;
+
+    previous = frame;
+  }
+
+  *output = out;
+}
+
+/**
+ * Compression function for log messages with a backtrace; compresses the
+ * arguments with compress() followed by the backtrace.
+ */
+template <typename... Ts>
+inline void compressWithBacktrace(int numNibbles, const ParamType* paramTypes,
+                                  char** input, char** output) {
+  compress<Ts...>(numNibbles, paramTypes, input, output);
+  compressBacktrace(input, output);
+}
+
+/**
+ * Logs a log message along with a previously captured backtrace. This
+ * function is meant to work in conjunction with the #define-d NANO_LOG_BT()
+ * and otherwise behaves like log().
+ *
+ * \param logId[in/out]
+ *      LogId that should be permanently associated with the static information.
+ *      An input value of -1 indicates that NanoLog should persist the static
+ *      log information and assign a new, globally unique identifier.
+ * \param filename
+ *      Name of the file containing the log invocation
+ * \param linenum
+ *      Line number within filename of the log invocation.
+ * \param severity
+ *      LogLevel severity of the log invocation
+ * \param format
+ *      Static printf format string associated with the log invocation
+ * \param numNibbles
+ *      Number of nibbles needed to store all the arguments (derived from
+ *      the format string).
+ * \param paramTypes
+ *      An array indicating the type of the n-th format parameter associated
+ *      with the format string to be processed.
+ *      *** THIS VARIABLE MUST HAVE A STATIC LIFETIME AS PTRS WILL BE SAVED ***
+ * \param backtrace
+ *      Backtrace captured by captureBacktrace()
+ * \param args
+ *      Argument pack for all the arguments for the log invocation
+ */
+template <long unsigned int N, int M, typename... Ts>
+inline void logBacktrace(int& logId, const char* filename, const int linenum,
+                         const LogLevel severity, const char (&format)[M],
+                         const int numNibbles,
+                         const std::array<ParamType, N>& paramTypes,
+                         const uintptr_t* backtrace, Ts... args) {
+  if (logId == UNASSIGNED_LOGID) {
+    StaticLogInfo info(&compressWithBacktrace<Ts...>, filename, linenum,
+                       severity, format, sizeof...(Ts), numNibbles,
+                       paramTypes.data());
+
+    std::string extensions = getEnumBindings<Ts...>();
+    Log::appendSiteExtension(extensions, Log::BACKTRACE, std::string());
+
+    // The module map must precede the first backtrace in the dictionary
+    RuntimeLogger::enableModuleMaps();
+    RuntimeLogger::registerInvocationSite(info, logId, extensions);
+  }
+
+  stageLogEntryWithTrailer(logId, RuntimeLogger::isPriority(severity),
+                           paramTypes, backtrace,
+                           (backtrace[0] + 1) * sizeof(uintptr_t), args...);
+}
+
+/**
+ * NANO_LOG_BT macro used for logging a message along with the call stack of
+ * the invocation.
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_BT(severity, format, ...)                                     \
+  do {                                                                         \
+    constexpr int numNibbles = NanoLogInternal::getNumNibblesNeeded(format);   \
+    constexpr int nParams = NanoLogInternal::countFmtParams(format);           \
+                                                                               \
+    static constexpr std::array<NanoLogInternal::ParamType, nParams>           \
+        paramTypes = NanoLogInternal::analyzeFormatString<nParams>(format);    \
+    static int logId = NanoLogInternal::UNASSIGNED_LOGID;                      \
+                                                                               \
+    if (NanoLog::severity > NanoLog::getLogLevel()) break;                     \
+                                                                               \
+    if (false) {                                                               \
+      NanoLogInternal::checkFormat(format, ##__VA_ARGS__);                     \
+    } /*NOLINT(cppcoreguidelines-pro-type-vararg, hicpp-vararg)*/              \
+                                                                               \
+    uintptr_t backtrace[NanoLogConfig::MAX_BACKTRACE_FRAMES + 1];              \
+    NanoLogInternal::captureBacktrace(backtrace,                               \
+                                      NanoLogConfig::MAX_BACKTRACE_FRAMES);    \
+                                                                               \
+    NanoLogInternal::logBacktrace(logId, __FILENAME__, __LINE__,               \
+                                  NanoLog::severity, format, numNibbles,       \
+                                  paramTypes, backtrace, ##__VA_ARGS__);       \
+  } while (0)
+} /* Namespace NanoLogInternal */
@@ -0,0 +1,156 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "NanoLogCpp17.h"
+
+/***
+ * This file implements thread-local logging contexts (a.k.a. mapped
+ * diagnostic contexts), i.e. key/value pairs such as a request id that are
+ * attached to every log message of a thread.
+ *
+ * Rather than copying the context into every log message, NanoLog::
+ * setContext() writes a context record into the thread's StagingBuffer only
+ * when a value changes. The decompressor tracks the records of every thread
+ * and prints the thread's current context with each of its log messages.
+ *
+ * Example:
+ *      NanoLog::setContext("request", requestId);
+ *      NANO_LOG(NOTICE, "Processing");   // -> "ctx":{"request":"..."}
+ *      NanoLog::clearContext("request");
+ */
+namespace NanoLogInternal {
+
+/**
+ * The context of a thread as last persisted to the log.
+ */
+struct ThreadContext {
+  ThreadContext() : entries(), logFileGeneration(0) {}
+
+  // Key/value pairs of the context; contexts are expected to be small
+  std::vector<std::pair<std::string, std::string>> entries;
+
+  // RuntimeLogger::getLogFileGeneration() at the time the entries were
+  // persisted
+  uint32_t logFileGeneration;
+};
+
+/**
+ * Returns the context of the calling thread.
+ */
+inline ThreadContext& getThreadContext() {
+  static thread_local ThreadContext context;
+  return context;
+}
+
+/**
+ * Writes a context record into the calling thread's StagingBuffer.
+ *
+ * \param key
+ *      Key of the context entry
+ * \param value
+ *      New value of the context entry; an empty value removes the entry
+ */
+inline void logContextRecord(const char* key, const char* value) {
+  static constexpr std::array<ParamType, 2> paramTypes = {
+      {ParamType::STRING_WITH_NO_PRECISION,
+       ParamType::STRING_WITH_NO_PRECISION}};
+  static int logId = UNASSIGNED_LOGID;
+
+  if (logId == UNASSIGNED_LOGID) {
+    StaticLogInfo info(&compressSite<paramTypes, const char*, const char*>,
+                       __builtin_strrchr(__FILE__, '/') + 1, __LINE__,
+                       SILENT_LOG_LEVEL, "%s%s", 2, 0, paramTypes.data());
+
+    std::string extensions;
+    Log::appendSiteExtension(extensions, Log::CONTEXT, std::string());
+    RuntimeLogger::registerInvocationSite(info, logId, extensions);
+  }
+
+  stageLogEntry<&compressSite<paramTypes, const char*, const char*>>(
+      logId, false, paramTypes, key, value);
+}
+} /* Namespace NanoLogInternal */
+
+namespace NanoLog {
+/**
+ * Sets an entry of the calling thread's logging context, which is attached
+ * to all of the thread's subsequent log messages by the decompressor. The
+ * change is only written to the log if the value differs from the current
+ * one, so this may be invoked for every unit of work.
+ *
+ * If the log file is changed via setLogFile(), the whole context is written
+ * again upon the thread's next setContext(); messages logged to the new file
+ * before then are output without the context.
+ *
+ * Contexts are not supported with per-CPU staging (see
+ * enablePerCpuStaging()), where this does nothing.
+ *
+ * \param key
+ *      Key of the context entry
+ * \param value
+ *      Value of the context entry; nullptr or "" removes the entry
+ */
+inline void setContext(const char* key, const char* value) {
+  using namespace NanoLogInternal;
+
+  // The decompressor attributes context records to the StagingBuffer they
+  // were staged in, which is shared by all the threads on a CPU
+  assert(!RuntimeLogger::isPerCpuStaging() &&
+         "setContext() is not supported with per-CPU staging");
+  if (RuntimeLogger::isPerCpuStaging()) return;
+
+  if (value == nullptr) value = "";
+
+  ThreadContext& context = getThreadContext();
+  uint32_t generation = RuntimeLogger::getLogFileGeneration();
+  if (context.logFileGeneration != generation) {
+    context.logFileGeneration = generation;
+    for (const auto& entry : context.entries)
+      logContextRecord(entry.first.c_str(), entry.second.c_str());
+  }
+
+  auto entry = context.entries.begin();
+  while (entry != context.entries.end() && entry->first != key) ++entry;
+
+  if (entry == context.entries.end()) {
+    if (*value == '\0') return;
+    context.entries.emplace_back(key, value);
+  } else if (entry->second == value) {
+    return;
+  } else if (*value == '\0') {
+    context.entries.erase(entry);
+  } else {
+    entry->second = value;
+  }
+
+  logContextRecord(key, value);
+}
+
+/**
+ * Removes an entry from the calling thread's logging context.
+ *
+ * \param key
+ *      Key of the context entry to remove
+ */
+inline void clearContext(const char* key) { setContext(key, nullptr); }
+};  // namespace NanoLog
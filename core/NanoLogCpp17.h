@@ -18,12 +18,14 @@
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <cwchar>
 #include <iostream>
 #include <utility>
 
 #include "Common.h"
 #include "Cycles.h"
 #include "NanoLog.h"
+#include "NanoLogEnum.h"
 #include "Packer.h"
 #include "Portability.h"
 
@@ -98,22 +100,25 @@ constexpr inline bool isLength(char c) {
 constexpr inline bool isDigit(char c) { return (c >= '0' && c <= '9'); }
 
 /**
- * Analyzes a static printf style format string and extracts type information
+ * Analyzes a printf style format string and extracts type information
  * about the p-th parameter that would be used in a corresponding NANO_LOG()
- * invocation.
+ * invocation. This variant operates on a pointer and length so that it can
+ * be used both at compile-time and on format strings only known at runtime.
  *
- * \tparam N
- *      Length of the static format string (automatically deduced)
  * \param fmt
  *      Format string to parse
+ * \param N
+ *      Length of the format string, including the NULL terminator
  * \param paramNum
  *      p-th parameter to return type information for (starts from zero)
  * \return
  *      Returns an ParamType enum describing the type of the parameter
+ *
+ * \throw invalid_argument
+ *      if the format string contains an invalid or unsupported specifier
  */
-template <int N>
-constexpr inline ParamType getParamInfo(const char (&fmt)[N],
-                                        int paramNum = 0) {
+constexpr inline ParamType getParamInfo(const char* fmt, int N,
+                                        int paramNum) {
   int pos = 0;
   while (pos < N - 1) {
     // The code below searches for something that looks like a printf
@@ -207,6 +212,26 @@ constexpr inline ParamType getParamInfo(const char (&fmt)[N],
   return ParamType::INVALID;
 }
 
+/**
+ * Analyzes a static printf style format string and extracts type information
+ * about the p-th parameter that would be used in a corresponding NANO_LOG()
+ * invocation.
+ *
+ * \tparam N
+ *      Length of the static format string (automatically deduced)
+ * \param fmt
+ *      Format string to parse
+ * \param paramNum
+ *      p-th parameter to return type information for (starts from zero)
+ * \return
+ *      Returns an ParamType enum describing the type of the parameter
+ */
+template <int N>
+constexpr inline ParamType getParamInfo(const char (&fmt)[N],
+                                        int paramNum = 0) {
+  return getParamInfo(fmt, N, paramNum);
+}
+
 /**
  * Helper to analyzeFormatString. This level of indirection is needed to
  * unpack the index_sequence generated in analyzeFormatString and
@@ -304,6 +329,29 @@ constexpr int getNumNibblesNeeded(const char (&fmt)[N]) {
   return numNibbles;
 }
 
+/**
+ * Counts the number of nibbles needed to compress the arguments described by
+ * an array of ParamTypes; the counterpart of getNumNibblesNeeded() for the
+ * already analyzed format string.
+ *
+ * \param paramTypes
+ *      Types of the format parameters (see analyzeFormatString())
+ */
+template <long unsigned int N>
+constexpr int getNumNibblesNeeded(const std::array<ParamType, N>& paramTypes) {
+  int numNibbles = 0;
+  for (ParamType t : paramTypes) {
+    if (t == NON_STRING || t == DYNAMIC_PRECISION || t == DYNAMIC_WIDTH)
+      ++numNibbles;
+  }
+
+  return numNibbles;
+}
+
+// Appended to string arguments that were truncated to
+// NanoLogConfig::MAX_STRING_ARG_LENGTH characters
+static constexpr char TRUNCATED_STRING_MARKER[] = "...";
+
 /**
  * Stores a single printf argument into a buffer and bumps the buffer pointer.
  *
@@ -385,6 +433,23 @@ store_argument(char** storage, T arg, const ParamType paramType,
 #pragma GCC diagnostic pop
 #endif
 
+  // Strings longer than the limit were sized for the truncation marker by
+  // getArgSize()
+  using CharT = std::remove_cv_t<std::remove_pointer_t<T>>;
+  constexpr size_t maxBytes =
+      NanoLogConfig::MAX_STRING_ARG_LENGTH * sizeof(CharT);
+  if (stringSize > maxBytes) {
+    memcpy(*storage, arg, maxBytes);
+    *storage += maxBytes;
+
+    for (size_t i = 0; i < sizeof(TRUNCATED_STRING_MARKER) - 1; ++i) {
+      auto c = static_cast<CharT>(TRUNCATED_STRING_MARKER[i]);
+      memcpy(*storage, &c, sizeof(CharT));
+      *storage += sizeof(CharT);
+    }
+    return;
+  }
+
   memcpy(*storage, arg, stringSize);
   *storage += stringSize;
   return;
@@ -516,6 +581,58 @@ inline size_t getArgSize(const ParamType, uint64_t& previousPrecision,
   return sizeof(void*);
 }
 
+/**
+ * Computes the number of bytes needed to store a (wide) string argument
+ * without a NULL terminator. The string is scanned for at most as many
+ * characters as will be stored, so long strings are never read in full:
+ * Strings are truncated according to the precision specified in the format
+ * string and to NanoLogConfig::MAX_STRING_ARG_LENGTH, in which case the
+ * TRUNCATED_STRING_MARKER is appended by store_argument().
+ *
+ * \tparam CharT
+ *      Character type of the string (automatically deduced)
+ *
+ * \param fmtType
+ *      Type of the argument according to the original printf-like format
+ *      string (for precision info)
+ * \param previousPrecision
+ *      The last 'precision' format specifier type encountered
+ * \param[out] stringBytes
+ *      Byte length of the string to store
+ * \param str
+ *      String to compute the length for
+ */
+template <typename CharT>
+inline void getStringArgBytes(const ParamType fmtType,
+                              uint64_t previousPrecision, size_t& stringBytes,
+                              const CharT* str) {
+  // Scan one character past the limit to detect whether truncation is needed
+  size_t maxLength = NanoLogConfig::MAX_STRING_ARG_LENGTH + 1;
+
+  // Strings with static length specifiers (ex %.10s), have non-negative
+  // ParamTypes equal to the static length. Thus, we use that value to
+  // truncate the string as necessary.
+  if (fmtType >= ParamType::STRING)
+    maxLength = std::min<size_t>(maxLength, static_cast<uint32_t>(fmtType));
+
+  // If the string had a dynamic precision specified (i.e. %.*s), use
+  // the previous parameter as the precision and truncate as necessary.
+  else if (fmtType == ParamType::STRING_WITH_DYNAMIC_PRECISION)
+    maxLength = std::min<size_t>(maxLength, previousPrecision);
+
+  size_t length;
+  if constexpr (std::is_same_v<CharT, wchar_t>)
+    length = wcsnlen(str, maxLength);
+  else
+    length = strnlen(str, maxLength);
+
+  if (length > NanoLogConfig::MAX_STRING_ARG_LENGTH)
+    length = NanoLogConfig::MAX_STRING_ARG_LENGTH +
+             sizeof(TRUNCATED_STRING_MARKER) - 1;
+
+  stringBytes = length * sizeof(CharT);
+}
+
 /**
  * String specialization for getArgSize. Returns the number of bytes needed
  * to represent a string (with consideration for any 'precision' specifiers
@@ -540,21 +657,7 @@ inline size_t getArgSize(const ParamType fmtType, uint64_t& previousPrecision,
                          size_t& stringBytes, const char* str) {
   if (fmtType <= ParamType::NON_STRING) return sizeof(void*);
 
-  stringBytes = strlen(str);
-  uint32_t fmtLength = static_cast<uint32_t>(fmtType);
-
-  // Strings with static length specifiers (ex %.10s), have non-negative
-  // ParamTypes equal to the static length. Thus, we use that value to
-  // truncate the string as necessary.
-  if (fmtType >= ParamType::STRING && stringBytes > fmtLength)
-    stringBytes = fmtLength;
-
-  // If the string had a dynamic precision specified (i.e. %.*s), use
-  // the previous parameter as the precision and truncate as necessary.
-  else if (fmtType == ParamType::STRING_WITH_DYNAMIC_PRECISION &&
-           stringBytes > previousPrecision)
-    stringBytes = previousPrecision;
-
+  getStringArgBytes(fmtType, previousPrecision, stringBytes, str);
   return stringBytes + sizeof(uint32_t);
 }
 
@@ -565,22 +668,7 @@ inline size_t getArgSize(const ParamType fmtType, uint64_t& previousPrecision,
                          size_t& stringBytes, const wchar_t* wstr) {
   if (fmtType <= ParamType::NON_STRING) return sizeof(void*);
 
-  stringBytes = wcslen(wstr);
-  uint32_t fmtLength = static_cast<uint32_t>(fmtType);
-
-  // Strings with static length specifiers (ex %.10s), have non-negative
-  // ParamTypes equal to the static length. Thus, we use that value to
-  // truncate the string as necessary.
-  if (fmtType >= ParamType::STRING && stringBytes > fmtLength)
-    stringBytes = fmtLength;
-
-  // If the string had a dynamic precision specified (i.e. %.*s), use
-  // the previous parameter as the precision and truncate as necessary.
-  else if (fmtType == ParamType::STRING_WITH_DYNAMIC_PRECISION &&
-           stringBytes > previousPrecision)
-    stringBytes = previousPrecision;
-
-  stringBytes *= sizeof(wchar_t);
+  getStringArgBytes(fmtType, previousPrecision, stringBytes, wstr);
   return stringBytes + sizeof(uint32_t);
 }
 
@@ -642,6 +730,22 @@ inline size_t getArgSizes(const std::array<ParamType, N>&, uint64_t&,
   return 0;
 }
 
+/**
+ * Returns the width of the NULL terminator of a string argument of type T
+ * (i.e. sizeof(wchar_t) for wide strings).
+ */
+template <typename T>
+constexpr uint32_t getCharacterWidth() {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-arith"
+  if constexpr (std::is_same_v<std::decay_t<std::remove_pointer_t<T>>, void>) {
+    return sizeof(void*);
+  } else {
+    return sizeof(typename std::remove_pointer<T>::type);
+  }
+#pragma GCC diagnostic pop
+}
+
 /**
  * Takes a single argument and compresses into a format that's compatible with
  * the NanoLog Decompressor.
@@ -690,20 +794,8 @@ inline void compressSingle(BufferUtils::TwoNibbles* nibbles, int* nibbleCnt,
     // save space. The length was explicitly encoded previously in the
     // uncompressed format to allow the two-pass compression function
     // to quickly skip strings in the stringsOnly=false pass.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpointer-arith"
-    constexpr uint32_t characterWidth = []() {
-      if constexpr (std::is_same_v<std::decay_t<std::remove_pointer_t<T>>,
-                                   void>) {
-        return sizeof(void*);
-      } else {
-        return sizeof(typename std::remove_pointer<T>::type);
-      }
-    }();
-#pragma GCC diagnostic pop
-
-    bzero(*out, characterWidth);
-    *out += characterWidth;
+    bzero(*out, getCharacterWidth<T>());
+    *out += getCharacterWidth<T>();
     return;
   }
 
@@ -720,10 +812,18 @@ inline void compressSingle(BufferUtils::TwoNibbles* nibbles, int* nibbleCnt,
   printf("\tCBasic  [%p->%p]= ", *in, *out);
   std::cout << argument << "\r\n";
 #endif
+  // Enums are packed as their underlying integer type
+  int nibble;
+  if constexpr (std::is_enum_v<T>)
+    nibble = BufferUtils::pack(
+        out, static_cast<std::underlying_type_t<T>>(argument));
+  else
+    nibble = BufferUtils::pack(out, argument);
+
   if (*nibbleCnt & 0x1)
-    nibbles[*nibbleCnt / 2].second = 0xf & BufferUtils::pack(out, argument);
+    nibbles[*nibbleCnt / 2].second = 0xf & nibble;
   else
-    nibbles[*nibbleCnt / 2].first = 0xf & BufferUtils::pack(out, argument);
+    nibbles[*nibbleCnt / 2].first = 0xf & nibble;
 
   ++(*nibbleCnt);
   *in += sizeof(T);
@@ -864,6 +964,597 @@ inline void compress(int numNibbles, const ParamType* paramTypes, char** input,
   *output = out;
 }
 
+/**
+ * Counts the string parameters among the first end parameters described by
+ * an array of ParamTypes.
+ *
+ * \param paramTypes
+ *      Types of the format parameters (see analyzeFormatString())
+ * \param end
+ *      Number of parameters to consider
+ */
+template <long unsigned int N>
+constexpr int countStringParams(const std::array<ParamType, N>& paramTypes,
+                                size_t end) {
+  int numStrings = 0;
+  for (size_t i = 0; i < end && i < N; ++i)
+    if (paramTypes[i] > ParamType::NON_STRING) ++numStrings;
+
+  return numStrings;
+}
+
+/**
+ * Consumes a single argument of a log site whose parameter types are known
+ * at compile time (see compressSite()). Non-string arguments are packed into
+ * the output right away with their nibble at a fixed position, whereas
+ * strings are only located so that they can be copied after all the
+ * non-string arguments.
+ *
+ * \tparam paramTypes
+ *      Types of the format parameters of the log site
+ * \tparam argNum
+ *      Position of the argument in the argument list
+ * \tparam T
+ *      Type of the argument
+ * \tparam deltaIntegers
+ *      True if integer arguments are encoded as zigzagDelta()s relative to
+ *      their previous values rather than as is (see Log::DELTA_ARGUMENTS)
+ * \tparam xorDoubles
+ *      Bit mask of the non-string arguments that are encoded as packXor()s
+ *      with their previous values if they are doubles (see Log::XOR_DOUBLES)
+ *
+ * \param nibbles
+ *      Location of the nibbles in the output
+ * \param[in/out] in
+ *      Input buffer to read the argument from
+ * \param[in/out] out
+ *      Output buffer to pack non-string arguments to
+ * \param[out] strings
+ *      Locations of the string arguments in the input buffer
+ * \param[out] stringBytes
+ *      Lengths of the string arguments without a NULL terminator
+ * \param[in/out] deltaBases
+ *      Previous value of each non-string argument if any argument is encoded
+ *      relative to it
+ */
+template <const auto& paramTypes, size_t argNum, typename T,
+          bool deltaIntegers, uint64_t xorDoubles>
+NANOLOG_ALWAYS_INLINE void compressSiteArgument(
+    BufferUtils::TwoNibbles* nibbles, char** in, char** out,
+    const char** strings, uint32_t* stringBytes,
+    [[maybe_unused]] uint64_t* deltaBases) {
+  constexpr int numStringsBefore = countStringParams(paramTypes, argNum);
+
+  if constexpr (paramTypes[argNum] > ParamType::NON_STRING) {
+    std::memcpy(&stringBytes[numStringsBefore], *in, sizeof(uint32_t));
+    *in += sizeof(uint32_t);
+    strings[numStringsBefore] = *in;
+    *in += stringBytes[numStringsBefore];
+  } else {
+    constexpr int nibbleNum = static_cast<int>(argNum) - numStringsBefore;
+
+    T argument;
+    std::memcpy(&argument, *in, sizeof(T));
+    *in += sizeof(T);
+
+    int nibble;
+    if constexpr (deltaIntegers &&
+                  (std::is_integral_v<T> || std::is_enum_v<T>)) {
+      // Signed integers are sign-extended so that the decoder can recover
+      // them whatever the width of the format specifier
+      uint64_t value;
+      if constexpr (std::is_enum_v<T>)
+        value = static_cast<uint64_t>(
+            static_cast<std::underlying_type_t<T>>(argument));
+      else
+        value = static_cast<uint64_t>(argument);
+
+      nibble = BufferUtils::pack(
+          out, BufferUtils::zigzagDelta(value, deltaBases[nibbleNum]));
+      deltaBases[nibbleNum] = value;
+    } else if constexpr (((xorDoubles >> nibbleNum) & 0x1) &&
+                         (std::is_same_v<T, double> ||
+                          std::is_same_v<T, float>)) {
+      // Floats are promoted to double as when they are passed to printf
+      double promoted = argument;
+      uint64_t bits;
+      std::memcpy(&bits, &promoted, sizeof(double));
+
+      nibble = BufferUtils::packXor(out, bits ^ deltaBases[nibbleNum]);
+      deltaBases[nibbleNum] = bits;
+    } else if constexpr (std::is_enum_v<T>) {
+      nibble = BufferUtils::pack(
+          out, static_cast<std::underlying_type_t<T>>(argument));
+    } else {
+      nibble = BufferUtils::pack(out, argument);
+    }
+
+    if constexpr (nibbleNum & 0x1)
+      nibbles[nibbleNum / 2].second = 0xf & nibble;
+    else
+      nibbles[nibbleNum / 2].first = 0xf & nibble;
+  }
+}
+
+/**
+ * Copies a string argument located by compressSiteArgument() to the output
+ * with a NULL terminator; does nothing for non-string arguments.
+ *
+ * \tparam paramTypes
+ *      Types of the format parameters of the log site
+ * \tparam argNum
+ *      Position of the argument in the argument list
+ * \tparam T
+ *      Type of the argument
+ *
+ * \param[in/out] out
+ *      Output buffer to write the string to
+ * \param strings
+ *      Locations of the string arguments in the input buffer
+ * \param stringBytes
+ *      Lengths of the string arguments without a NULL terminator
+ */
+template <const auto& paramTypes, size_t argNum, typename T>
+NANOLOG_ALWAYS_INLINE void compressSiteString(char** out,
+                                              const char* const* strings,
+                                              const uint32_t* stringBytes) {
+  if constexpr (paramTypes[argNum] > ParamType::NON_STRING) {
+    constexpr int stringNum = countStringParams(paramTypes, argNum);
+    std::memcpy(*out, strings[stringNum], stringBytes[stringNum]);
+    *out += stringBytes[stringNum];
+
+    bzero(*out, getCharacterWidth<T>());
+    *out += getCharacterWidth<T>();
+  }
+}
+
+/**
+ * Helper to compressSite() and compressSiteDeltas() that unpacks the
+ * positions of the arguments.
+ */
+template <const auto& paramTypes, bool deltaIntegers, uint64_t xorDoubles,
+          typename... Ts, size_t... Indices>
+NANOLOG_ALWAYS_INLINE void compressSiteHelper(std::index_sequence<Indices...>,
+                                              char** input, char** output,
+                                              [[maybe_unused]]
+                                              uint64_t* deltaBases) {
+  constexpr int numNibbles = getNumNibblesNeeded(paramTypes);
+  constexpr int numStrings = countStringParams(paramTypes, sizeof...(Ts));
+
+  char* in = *input;
+  char* out = *output;
+
+  [[maybe_unused]] auto* nibbles =
+      reinterpret_cast<BufferUtils::TwoNibbles*>(out);
+  out += (numNibbles + 1) / 2;
+
+  // HACK: Zero length arrays are not allowed
+  [[maybe_unused]] const char* strings[numStrings + 1];
+  [[maybe_unused]] uint32_t stringBytes[numStrings + 1];
+
+  (compressSiteArgument<paramTypes, Indices, Ts, deltaIntegers, xorDoubles>(
+       nibbles, &in, &out, strings, stringBytes, deltaBases),
+   ...);
+  (compressSiteString<paramTypes, Indices, Ts>(&out, strings, stringBytes),
+   ...);
+
+  *input = in;
+  *output = out;
+}
+
+/**
+ * Specialization of compress() for a log site whose parameter types are
+ * known at compile time, which is used as the compression function of
+ * NANO_LOG() invocations. The output is identical, but the position of each
+ * argument's nibble and whether it is a string are resolved at compile time,
+ * so the arguments are compressed in a single pass of straight-line code
+ * rather than in two passes that branch on the ParamType of each argument.
+ *
+ * \tparam paramTypes
+ *      Types of the format parameters of the log site; must have a static
+ *      lifetime
+ * \tparam Ts
+ *      Types of the arguments encoded in the input buffer
+ *
+ * \param[in/out] input
+ *      Input buffer to read the arguments back from
+ * \param[in/out] output
+ *      Output buffer to write the compressed results to
+ */
+template <const auto& paramTypes, typename... Ts>
+inline void compressSite(int, const ParamType*, char** input, char** output) {
+  static_assert(paramTypes.size() == sizeof...(Ts),
+                "The arguments must match the format parameters");
+  compressSiteHelper<paramTypes, false, 0, Ts...>(
+      std::index_sequence_for<Ts...>(), input, output, nullptr);
+}
+
+/**
+ * Variant of compressSite() used as the delta compression function of
+ * NANO_LOG_DELTA() and NANO_LOG_XOR() invocations. The integer arguments are
+ * encoded as the zigzagDelta() and the chosen double arguments as the
+ * packXor() from the argument's value in the previous log message of the
+ * site, which the compression thread tracks per BufferExtent (see
+ * Log::DeltaBaseTable).
+ *
+ * \tparam paramTypes
+ *      Types of the format parameters of the log site; must have a static
+ *      lifetime
+ * \tparam deltaIntegers
+ *      True if the integer arguments are encoded as zigzagDelta()s
+ * \tparam xorDoubles
+ *      Bit mask of the non-string arguments encoded as packXor()s if they
+ *      are doubles
+ * \tparam Ts
+ *      Types of the arguments encoded in the input buffer
+ *
+ * \param[in/out] input
+ *      Input buffer to read the arguments back from
+ * \param[in/out] output
+ *      Output buffer to write the compressed results to
+ * \param[in/out] deltaBases
+ *      Previous value of each non-string argument, which is updated to the
+ *      arguments' values
+ */
+template <const auto& paramTypes, bool deltaIntegers, uint64_t xorDoubles,
+          typename... Ts>
+inline void compressSiteDeltas(const ParamType*, char** input, char** output,
+                               uint64_t* deltaBases) {
+  static_assert(paramTypes.size() == sizeof...(Ts),
+                "The arguments must match the format parameters");
+  compressSiteHelper<paramTypes, deltaIntegers, xorDoubles, Ts...>(
+      std::index_sequence_for<Ts...>(), input, output, deltaBases);
+}
+
+/**
+ * Compresses an argument of a log site for compressSiteVByte(). Non-string
+ * arguments are stored as by BufferUtils::packVByteValue() or, for sites
+ * with many of them, gathered for BufferUtils::packVByte(). Strings are
+ * located as in compressSiteArgument().
+ *
+ * \tparam paramTypes
+ *      Types of the format parameters of the log site
+ * \tparam argNum
+ *      Position of the argument in the argument list
+ * \tparam T
+ *      Type of the argument
+ * \tparam gather
+ *      True to gather the non-string arguments rather than store them
+ *
+ * \param nibbles
+ *      Location of the codes in the output
+ * \param[in/out] in
+ *      Input buffer to read the argument from
+ * \param[in/out] out
+ *      Output buffer to store non-string arguments to
+ * \param[out] values
+ *      Gathered values of the non-string arguments, negative integers being
+ *      replaced with their magnitude
+ * \param[out] minCodes
+ *      Lower bound of the BufferUtils::vbyteCode() of the gathered values,
+ *      which records whether they are negated
+ * \param[out] strings
+ *      Locations of the string arguments in the input buffer
+ * \param[out] stringBytes
+ *      Lengths of the string arguments without a NULL terminator
+ */
+template <const auto& paramTypes, size_t argNum, typename T, bool gather>
+NANOLOG_ALWAYS_INLINE void compressSiteVByteArgument(
+    BufferUtils::TwoNibbles* nibbles, char** in, char** out,
+    [[maybe_unused]] uint64_t* values, [[maybe_unused]] uint8_t* minCodes,
+    const char** strings, uint32_t* stringBytes) {
+  constexpr int numStringsBefore = countStringParams(paramTypes, argNum);
+
+  if constexpr (paramTypes[argNum] > ParamType::NON_STRING) {
+    std::memcpy(&stringBytes[numStringsBefore], *in, sizeof(uint32_t));
+    *in += sizeof(uint32_t);
+    strings[numStringsBefore] = *in;
+    *in += stringBytes[numStringsBefore];
+  } else {
+    constexpr int valueNum = static_cast<int>(argNum) - numStringsBefore;
+
+    T argument;
+    std::memcpy(&argument, *in, sizeof(T));
+    *in += sizeof(T);
+
+    // Floating point values are stored verbatim; the decoder tells floats
+    // from doubles by their size
+    uint64_t value;
+    uint8_t minCode;
+    if constexpr (std::is_floating_point_v<T>) {
+      value = 0;
+      std::memcpy(&value, &argument, sizeof(T));
+      minCode = BufferUtils::vbyteCode(sizeof(T));
+    } else if constexpr (std::is_pointer_v<T>) {
+      value = reinterpret_cast<uint64_t>(argument);
+      minCode = BufferUtils::vbyteCode(1);
+    } else {
+      using Integer = typename std::conditional_t<std::is_enum_v<T>,
+                                                  std::underlying_type<T>,
+                                                  std::common_type<T>>::type;
+      Integer integer = static_cast<Integer>(argument);
+      bool negated = false;
+      if constexpr (std::is_signed_v<Integer>) negated = integer < 0;
+
+      // The negation is modulo 2^64 so that the minimum value survives it
+      value = negated ? 0 - static_cast<uint64_t>(integer)
+                      : static_cast<uint64_t>(integer);
+      minCode = BufferUtils::vbyteCode(1, negated);
+    }
+
+    if constexpr (gather) {
+      values[valueNum] = value;
+      minCodes[valueNum] = minCode;
+    } else {
+      uint8_t code = BufferUtils::packVByteValue(out, value, minCode);
+      if constexpr (valueNum & 0x1)
+        nibbles[valueNum / 2].second = code;
+      else
+        nibbles[valueNum / 2].first = code;
+    }
+  }
+}
+
+/**
+ * Helper to compressSiteVByte() that unpacks the positions of the arguments.
+ */
+template <const auto& paramTypes, typename... Ts, size_t... Indices>
+NANOLOG_ALWAYS_INLINE void compressSiteVByteHelper(
+    std::index_sequence<Indices...>, char** input, char** output) {
+  constexpr int numValues = getNumNibblesNeeded(paramTypes);
+  constexpr int numStrings = countStringParams(paramTypes, sizeof...(Ts));
+
+  // Shuffling the values into place several at a time only pays off once
+  // there are enough of them to amortize gathering them
+  constexpr bool gather = numValues >= BufferUtils::VBYTE_MIN_GATHERED;
+
+  char* in = *input;
+  char* out = *output;
+
+  auto* nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(out);
+  if constexpr (!gather) {
+    // The unused half of the last byte of codes is left zero
+    if constexpr (numValues & 0x1) nibbles[numValues / 2].second = 0;
+    out += (numValues + 1) / 2;
+  }
+
+  // HACK: Zero length arrays are not allowed
+  [[maybe_unused]] uint64_t values[gather ? numValues : 1];
+  [[maybe_unused]] uint8_t minCodes[gather ? numValues : 1];
+  [[maybe_unused]] const char* strings[numStrings + 1];
+  [[maybe_unused]] uint32_t stringBytes[numStrings + 1];
+
+  (compressSiteVByteArgument<paramTypes, Indices, Ts, gather>(
+       nibbles, &in, &out, values, minCodes, strings, stringBytes),
+   ...);
+
+  if constexpr (gather)
+    out = BufferUtils::packVByte(values, minCodes, numValues, out);
+  (compressSiteString<paramTypes, Indices, Ts>(&out, strings, stringBytes),
+   ...);
+
+  *input = in;
+  *output = out;
+}
+
+/**
+ * Returns true if the arguments of a NANO_LOG() site are compressed with
+ * compressSiteVByte() rather than compressSite(). Long doubles do not fit
+ * in the 8 bytes a BufferUtils::packVByte() code can express, so sites with
+ * any keep the nibble format, as do sites without non-string arguments.
+ */
+template <const auto& paramTypes, typename... Ts>
+constexpr bool usesVByteArguments() {
+  return getNumNibblesNeeded(paramTypes) > 0 &&
+         !(std::is_same_v<Ts, long double> || ...);
+}
+
+/**
+ * Variant of compressSite() that stores the non-string arguments with
+ * BufferUtils::packVByte(), which is used as the compression function of
+ * NANO_LOG() invocations that usesVByteArguments() (see
+ * Log::VBYTE_ARGUMENTS). Sites with many such arguments gather them into
+ * an array first so that their codes can be computed and their bytes
+ * shuffled into place several at a time.
+ *
+ * \tparam paramTypes
+ *      Types of the format parameters of the log site; must have a static
+ *      lifetime
+ * \tparam Ts
+ *      Types of the arguments encoded in the input buffer
+ *
+ * \param[in/out] input
+ *      Input buffer to read the arguments back from
+ * \param[in/out] output
+ *      Output buffer to write the compressed results to, of which
+ *      BufferUtils::VBYTE_SLACK bytes beyond the result may be overwritten
+ */
+template <const auto& paramTypes, typename... Ts>
+inline void compressSiteVByte(int, const ParamType*, char** input,
+                              char** output) {
+  static_assert(paramTypes.size() == sizeof...(Ts),
+                "The arguments must match the format parameters");
+  static_assert(usesVByteArguments<paramTypes, Ts...>(),
+                "The arguments must fit in BufferUtils::packVByte()");
+  compressSiteVByteHelper<paramTypes, Ts...>(std::index_sequence_for<Ts...>(),
+                                             input, output);
+}
+
+/**
+ * Returns the compression function of a NANO_LOG() site, which is either
+ * compressSiteVByte() or compressSite() (see usesVByteArguments()).
+ */
+template <const auto& paramTypes, typename... Ts>
+constexpr StaticLogInfo::CompressionFn getSiteCompressionFn() {
+  if constexpr (usesVByteArguments<paramTypes, Ts...>())
+    return &compressSiteVByte<paramTypes, Ts...>;
+  else
+    return &compressSite<paramTypes, Ts...>;
+}
+
+/**
+ * Records the dynamic arguments of a log invocation into the thread-local
+ * StagingBuffer for later compression, followed by an optional trailer of
+ * opaque bytes that only the site's compression function knows how to
+ * interpret (i.e. a backtrace). The static information associated with the
+ * invocation must have already been registered under logId.
+ *
+ * \tparam N
+ *      length of the paramTypes array (automatically deduced)
+ * \tparam Ts
+ *      Types of the arguments passed in for the log (automatically deduced)
+ *
+ * \param logId
+ *      Unique identifier assigned to the log invocation's static information
+ * \param priority
+ *      Stage the entry in the thread's priority lane (see
+ *      RuntimeLogger::isPriority())
+ * \param paramTypes
+ *      An array indicating the type of the n-th format parameter associated
+ *      with the format string to be processed.
+ * \param trailer
+ *      Bytes to store after the arguments
+ * \param trailerSize
+ *      Number of bytes in trailer
+ * \param args
+ *      Argument pack for all the arguments for the log invocation
+ */
+template <long unsigned int N, typename... Ts>
+inline void stageLogEntryWithTrailer(const int logId, const bool priority,
+                                     const std::array<ParamType, N>& paramTypes,
+                                     const void* trailer,
+                                     const size_t trailerSize, Ts... args) {
+  using namespace NanoLogInternal::Log;
+  assert(N == static_cast<uint32_t>(sizeof...(Ts)));
+
+  uint64_t previousPrecision = -1;
+  uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+  size_t stringSizes[N + 1] = {};  // HACK: Zero length arrays are not allowed
+  size_t allocSize =
+      getArgSizes(paramTypes, previousPrecision, stringSizes, args...) +
+      sizeof(UncompressedEntry) + trailerSize;
+
+  char* writePos =
+      NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, priority);
+  auto originalWritePos = writePos;
+
+  UncompressedEntry* ue = new (writePos) UncompressedEntry();
+  writePos += sizeof(UncompressedEntry);
+
+  store_arguments(paramTypes, stringSizes, &writePos, args...);
+
+  if (trailerSize > 0) {
+    std::memcpy(writePos, trailer, trailerSize);
+    writePos += trailerSize;
+  }
+
+  ue->fmtId = logId;
+  ue->timestamp = timestamp;
+  ue->entrySize = downCast<uint32_t>(allocSize);
+
+#ifdef ENABLE_DBG_PRINTING
+  printf("\r\nRecording %d of size %u\r\n", logId, ue->entrySize);
+#endif
+
+  assert(allocSize == downCast<uint32_t>((writePos - originalWritePos)));
+  NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, priority);
+}
+
+/**
+ * Compresses the dynamic arguments of a log invocation with the site's
+ * compression function on the calling thread and records the result into the
+ * thread-local StagingBuffer, so that the compression thread only needs to
+ * copy them to the output (see NanoLog::setProducerCompression()).
+ *
+ * \tparam compressionFn
+ *      Compression function of the log site (i.e. compress<Ts...>)
+ * \tparam N
+ *      length of the paramTypes array (automatically deduced)
+ * \tparam Ts
+ *      Types of the arguments passed in for the log (automatically deduced)
+ *
+ * \param logId
+ *      Unique identifier assigned to the log invocation's static information,
+ *      which must have been registered with compressionFn
+ * \param priority
+ *      Stage the entry in the thread's priority lane (see
+ *      RuntimeLogger::isPriority())
+ * \param paramTypes
+ *      An array indicating the type of the n-th format parameter associated
+ *      with the format string to be processed.
+ * \param args
+ *      Argument pack for all the arguments for the log invocation
+ *
+ * \return
+ *      True if the entry was staged; false if the arguments exceed
+ *      NanoLogConfig::PRODUCER_COMPRESSION_MAX_SIZE and nothing was staged
+ */
+template <StaticLogInfo::CompressionFn compressionFn, long unsigned int N,
+          typename... Ts>
+inline bool stageCompressedLogEntry(const int logId, const bool priority,
+                                    const std::array<ParamType, N>& paramTypes,
+                                    Ts... args) {
+  using namespace NanoLogInternal::Log;
+  assert(N == static_cast<uint32_t>(sizeof...(Ts)));
+
+  uint64_t previousPrecision = -1;
+  uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+  size_t stringSizes[N + 1] = {};  // HACK: Zero length arrays are not allowed
+  size_t argSize =
+      getArgSizes(paramTypes, previousPrecision, stringSizes, args...);
+  if (argSize > NanoLogConfig::PRODUCER_COMPRESSION_MAX_SIZE) return false;
+
+  char scratch[NanoLogConfig::PRODUCER_COMPRESSION_MAX_SIZE];
+  char* readPos = scratch;
+  store_arguments(paramTypes, stringSizes, &readPos, args...);
+
+  // Reserve space for the worst case of none of the arguments compressing
+  // (see Log::Encoder::encodeLogMsgs()), plus the bytes that packVByte()
+  // may overwrite, and return the excess upon finishing
+  size_t maxSize =
+      sizeof(UncompressedEntry) + 2 * argSize + BufferUtils::VBYTE_SLACK;
+  char* writePos =
+      NanoLogInternal::RuntimeLogger::reserveAlloc(maxSize, priority);
+  auto originalWritePos = writePos;
+
+  UncompressedEntry* ue = new (writePos) UncompressedEntry();
+  writePos += sizeof(UncompressedEntry);
+
+  readPos = scratch;
+  compressionFn(getNumNibblesNeeded(paramTypes), paramTypes.data(), &readPos,
+                &writePos);
+
+  size_t allocSize = writePos - originalWritePos;
+  assert(allocSize <= maxSize);
+
+  ue->fmtId = logId | PRECOMPRESSED_FLAG;
+  ue->timestamp = timestamp;
+  ue->entrySize = downCast<uint32_t>(allocSize);
+
+  NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, priority);
+  return true;
+}
+
+/**
+ * Records the dynamic arguments of a log invocation into the thread-local
+ * StagingBuffer for later compression (see stageLogEntryWithTrailer()). The
+ * static information registered under logId must specify compressionFn as
+ * the compression function, which allows the calling thread to compress the
+ * arguments itself if NanoLog::setProducerCompression() is enabled.
+ */
+template <StaticLogInfo::CompressionFn compressionFn, long unsigned int N,
+          typename... Ts>
+inline void stageLogEntry(const int logId, const bool priority,
+                          const std::array<ParamType, N>& paramTypes,
+                          Ts... args) {
+  if (RuntimeLogger::isProducerCompression() &&
+      stageCompressedLogEntry<compressionFn>(logId, priority, paramTypes,
+                                             args...))
+    return;
+
+  stageLogEntryWithTrailer(logId, priority, paramTypes, nullptr, 0, args...);
+}
+
 /**
  * Logs a log message in the NanoLog system given all the static and dynamic
  * information associated with the log message. This function is meant to work
@@ -871,10 +1562,14 @@ inline void compress(int numNibbles, const ParamType* paramTypes, char** input,
  * maintain a permanent mapping of logId to static information once it's
  * assigned by this function.
  *
- * \tparam N
- *      length of the format string (automatically deduced)
+ * \tparam paramTypes
+ *      An array indicating the type of the n-th format parameter associated
+ *      with the format string to be processed, from which the compression
+ *      function of the log site is specialized (see compressSite() and
+ *      compressSiteVByte()).
+ *      *** THIS VARIABLE MUST HAVE A STATIC LIFETIME AS PTRS WILL BE SAVED ***
  * \tparam M
- *      length of the paramTypes array (automatically deduced)
+ *      length of the format string (automatically deduced)
  * \tparam Ts
  *      Types of the arguments passed in for the log (automatically deduced)
  *
@@ -893,55 +1588,224 @@ inline void compress(int numNibbles, const ParamType* paramTypes, char** input,
  * \param numNibbles
  *      Number of nibbles needed to store all the arguments (derived from
  *      the format string).
- * \param paramTypes
- *      An array indicating the type of the n-th format parameter associated
- *      with the format string to be processed.
- *      *** THIS VARIABLE MUST HAVE A STATIC LIFETIME AS PTRS WILL BE SAVED ***
  * \param args
  *      Argument pack for all the arguments for the log invocation
  */
-template <long unsigned int N, int M, typename... Ts>
+template <const auto& paramTypes, int M, typename... Ts>
 inline void log(int& logId, const char* filename, const int linenum,
                 const LogLevel severity, const char (&format)[M],
-                const int numNibbles,
-                const std::array<ParamType, N>& paramTypes, Ts... args) {
-  using namespace NanoLogInternal::Log;
-  assert(N == static_cast<uint32_t>(sizeof...(Ts)));
+                const int numNibbles, Ts... args) {
+  constexpr StaticLogInfo::CompressionFn compressionFn =
+      getSiteCompressionFn<paramTypes, Ts...>();
 
   if (logId == UNASSIGNED_LOGID) {
     const ParamType* array = paramTypes.data();
-    StaticLogInfo info(&compress<Ts...>, filename, linenum, severity, format,
+    StaticLogInfo info(compressionFn, filename, linenum, severity, format,
                        sizeof...(Ts), numNibbles, array);
 
-    RuntimeLogger::registerInvocationSite(info, logId);
+    std::string extensions = getEnumBindings<Ts...>();
+    if (usesVByteArguments<paramTypes, Ts...>())
+      Log::appendSiteExtension(
+          extensions, Log::VBYTE_ARGUMENTS,
+          std::string(1, static_cast<char>(BufferUtils::VBYTE_VERSION)));
+    RuntimeLogger::registerInvocationSite(info, logId, extensions);
   }
 
-  uint64_t previousPrecision = -1;
-  uint64_t timestamp = PerfUtils::Cycles::rdtsc();
-  size_t stringSizes[N + 1] = {};  // HACK: Zero length arrays are not allowed
-  size_t allocSize =
-      getArgSizes(paramTypes, previousPrecision, stringSizes, args...) +
-      sizeof(UncompressedEntry);
+  stageLogEntry<compressionFn>(logId, RuntimeLogger::isPriority(severity),
+                               paramTypes, args...);
+}
 
-  char* writePos = NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize);
-  auto originalWritePos = writePos;
+/**
+ * Converts a bit mask of the arguments of a log site into the bit mask of
+ * the non-string arguments among them that are doubles (see
+ * Log::XOR_DOUBLES).
+ *
+ * \param paramTypes
+ *      Types of the format parameters of the log site
+ * \param isDouble
+ *      Whether each argument is a double (or a float promoted to one)
+ * \param xorArguments
+ *      Bit mask of the arguments, the n-th bit standing for the n-th argument
+ */
+template <long unsigned int N>
+constexpr uint64_t getXorDoubles(const std::array<ParamType, N>& paramTypes,
+                                 const std::array<bool, N>& isDouble,
+                                 uint64_t xorArguments) {
+  uint64_t xorDoubles = 0;
+  int nibbleNum = 0;
+  for (size_t i = 0; i < N; ++i) {
+    if (paramTypes[i] > ParamType::NON_STRING) continue;
+
+    if (i < 64 && nibbleNum < 64 && ((xorArguments >> i) & 0x1) &&
+        isDouble[i])
+      xorDoubles |= 1ULL << nibbleNum;
+    ++nibbleNum;
+  }
 
-  UncompressedEntry* ue = new (writePos) UncompressedEntry();
-  writePos += sizeof(UncompressedEntry);
+  return xorDoubles;
+}
 
-  store_arguments(paramTypes, stringSizes, &writePos, args...);
+/**
+ * Variant of log() used by NANO_LOG_DELTA() and NANO_LOG_XOR() whose
+ * arguments are encoded by the compression thread relative to the arguments
+ * of the site's previous log message (see compressSiteDeltas()). Since the
+ * encoding depends on the order in which a thread's log messages are
+ * compressed, the arguments are never compressed by the calling thread.
+ *
+ * \tparam deltaIntegers
+ *      True to encode the integer arguments as deltas
+ * \tparam xorArguments
+ *      Bit mask of the double arguments to encode as XORs, the n-th bit
+ *      standing for the n-th argument
+ */
+template <const auto& paramTypes, bool deltaIntegers, uint64_t xorArguments,
+          int M, typename... Ts>
+inline void logDeltas(int& logId, const char* filename, const int linenum,
+                      const LogLevel severity, const char (&format)[M],
+                      const int numNibbles, Ts... args) {
+  static_assert(getNumNibblesNeeded(paramTypes) <=
+                    static_cast<int>(NanoLogConfig::MAX_DELTA_BASES_PER_EXTENT),
+                "Too many arguments to encode as deltas");
+
+  constexpr std::array<bool, sizeof...(Ts)> isDouble = {
+      {(std::is_same_v<Ts, double> || std::is_same_v<Ts, float>)...}};
+  constexpr uint64_t xorDoubles =
+      getXorDoubles(paramTypes, isDouble, xorArguments);
 
-  ue->fmtId = logId;
-  ue->timestamp = timestamp;
-  ue->entrySize = downCast<uint32_t>(allocSize);
+  if (logId == UNASSIGNED_LOGID) {
+    const ParamType* array = paramTypes.data();
+    StaticLogInfo info(&compressSite<paramTypes, Ts...>, filename, linenum,
+                       severity, format, sizeof...(Ts), numNibbles, array);
+    info.deltaCompressionFunction =
+        &compressSiteDeltas<paramTypes, deltaIntegers, xorDoubles, Ts...>;
+
+    std::string extensions = getEnumBindings<Ts...>();
+    if (deltaIntegers)
+      Log::appendSiteExtension(extensions, Log::DELTA_ARGUMENTS,
+                               std::string());
+    if (xorDoubles != 0)
+      Log::appendSiteExtension(
+          extensions, Log::XOR_DOUBLES,
+          std::string(reinterpret_cast<const char*>(&xorDoubles),
+                      sizeof(xorDoubles)));
+    RuntimeLogger::registerInvocationSite(info, logId, extensions);
+  }
 
-#ifdef ENABLE_DBG_PRINTING
-  printf("\r\nRecording %d:'%s' of size %u\r\n", logId, info.formatString,
-         ue->entrySize);
-#endif
+  stageLogEntryWithTrailer(logId, RuntimeLogger::isPriority(severity),
+                           paramTypes, nullptr, 0, args...);
+}
 
-  assert(allocSize == downCast<uint32_t>((writePos - originalWritePos)));
-  NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+/**
+ * Logs a message that has already been formatted into a string. This is the
+ * fallback used by logRuntime() when a runtime format string cannot be
+ * assigned a dynamic log site, and is attributed to the same invocation site
+ * (see RuntimeLogger::getPreformattedLogId()).
+ *
+ * \param filename
+ *      Name of the file containing the log invocation
+ * \param linenum
+ *      Line number within filename of the log invocation.
+ * \param severity
+ *      LogLevel severity of the log invocation
+ * \param message
+ *      Preformatted message to log
+ */
+inline void logPreformatted(const char* filename, const int linenum,
+                            const LogLevel severity, const char* message) {
+  static constexpr std::array<ParamType, 1> paramTypes = {
+      {ParamType::STRING_WITH_NO_PRECISION}};
+
+  int logId = RuntimeLogger::getPreformattedLogId(filename, linenum, severity,
+                                                  &compress<const char*>);
+  stageLogEntry<&compress<const char*>>(
+      logId, RuntimeLogger::isPriority(severity), paramTypes, message);
+}
+
+/**
+ * Returns the kind of an argument of type T, which determines the printf
+ * conversions that may be applied to it (see RuntimeLogger::ArgumentKind).
+ */
+template <typename T>
+constexpr RuntimeLogger::ArgumentKind getArgumentKind() {
+  using D = std::decay_t<T>;
+  if constexpr (std::is_same_v<D, const char*> || std::is_same_v<D, char*>)
+    return RuntimeLogger::STRING_ARGUMENT;
+  else if constexpr (std::is_same_v<D, const wchar_t*> ||
+                     std::is_same_v<D, wchar_t*>)
+    return RuntimeLogger::WIDE_STRING_ARGUMENT;
+  else if constexpr (std::is_pointer_v<D>)
+    return RuntimeLogger::POINTER_ARGUMENT;
+  else if constexpr (std::is_same_v<D, long double>)
+    return RuntimeLogger::LONG_DOUBLE_ARGUMENT;
+  else if constexpr (std::is_floating_point_v<D>)
+    return RuntimeLogger::DOUBLE_ARGUMENT;
+  else if constexpr (std::is_integral_v<D> || std::is_enum_v<D>)
+    return (sizeof(D) > sizeof(int)) ? RuntimeLogger::LONG_ARGUMENT
+                                     : RuntimeLogger::INT_ARGUMENT;
+  else
+    return RuntimeLogger::OTHER_ARGUMENT;
+}
+
+/**
+ * Logs a message whose printf format string is only known at runtime. The
+ * format string is parsed upon first use and assigned a dynamic log site that
+ * is registered in the dictionary just like a NANO_LOG() invocation, so that
+ * subsequent invocations with the same format string, argument types and
+ * invocation site take the regular binary logging path.
+ *
+ * If the format string is invalid or does not match the arguments passed in
+ * (i.e. their number or a conversion applied to an argument of another kind,
+ * such as a "%d" to a double), the format string itself is logged. If the
+ * number of dynamic log sites has reached
+ * NanoLogConfig::MAX_DYNAMIC_LOG_SITES, the message is formatted with
+ * snprintf() and logged as a string instead.
+ *
+ * \tparam Ts
+ *      Types of the arguments passed in for the log (automatically deduced)
+ *
+ * \param filename
+ *      Name of the file containing the log invocation
+ * \param linenum
+ *      Line number within filename of the log invocation.
+ * \param severity
+ *      LogLevel severity of the log invocation
+ * \param format
+ *      printf format string associated with the log invocation
+ * \param args
+ *      Argument pack for all the arguments for the log invocation
+ */
+template <typename... Ts>
+inline void logRuntime(const char* filename, const int linenum,
+                       const LogLevel severity, const char* format,
+                       Ts... args) {
+  static constexpr RuntimeLogger::ArgumentKind argumentKinds[] = {
+      getArgumentKind<Ts>()..., RuntimeLogger::OTHER_ARGUMENT};
+
+  const ParamType* runtimeParamTypes = nullptr;
+  int logId = RuntimeLogger::getDynamicLogId(
+      filename, linenum, severity, format, &compress<Ts...>,
+      sizeof...(Ts), argumentKinds, &runtimeParamTypes);
+
+  if (logId == RuntimeLogger::DYNAMIC_LOG_SITES_EXHAUSTED) {
+    char buffer[1024];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    snprintf(buffer, sizeof(buffer), format, args...);
+#pragma GCC diagnostic pop
+    logPreformatted(filename, linenum, severity, buffer);
+    return;
+  }
+
+  if (logId < 0) {
+    logPreformatted(filename, linenum, severity, format);
+    return;
+  }
+
+  std::array<ParamType, sizeof...(Ts)> paramTypes{};
+  std::copy_n(runtimeParamTypes, sizeof...(Ts), paramTypes.begin());
+  stageLogEntry<&compress<Ts...>>(logId, RuntimeLogger::isPriority(severity),
+                                  paramTypes, args...);
 }
 
 /**
@@ -953,7 +1817,7 @@ inline void log(int& logId, const char* filename, const int linenum,
  * \param ...
  *      format parameters
  */
-static void NANOLOG_PRINTF_FORMAT_ATTR(1, 2)
+static inline void NANOLOG_PRINTF_FORMAT_ATTR(1, 2)
     checkFormat(NANOLOG_PRINTF_FORMAT const char*, ...) {}
 
 #define __FILENAME__ (__builtin_strrchr(__FILE__, '/') + 1)
@@ -992,7 +1856,175 @@ static void NANOLOG_PRINTF_FORMAT_ATTR(1, 2)
       NanoLogInternal::checkFormat(format, ##__VA_ARGS__);                     \
     } /*NOLINT(cppcoreguidelines-pro-type-vararg, hicpp-vararg)*/              \
                                                                                \
-    NanoLogInternal::log(logId, __FILENAME__, __LINE__, NanoLog::severity,     \
-                         format, numNibbles, paramTypes, ##__VA_ARGS__);       \
+    NanoLogInternal::log<paramTypes>(logId, __FILENAME__, __LINE__,            \
+                                     NanoLog::severity, format, numNibbles,    \
+                                     ##__VA_ARGS__);                           \
+  } while (0)
+
+/**
+ * NANO_LOG_SERIES macro used for logging arguments that change little from
+ * one log message to the next (i.e. sequence numbers, order ids, counters,
+ * prices and latencies). It behaves like NANO_LOG(), but the chosen
+ * arguments are stored relative to their values in the previous log message
+ * of the same invocation site and thread: integers as the difference, which
+ * typically takes a single byte, and doubles as the XOR of their bits,
+ * without the leading or trailing zero bytes.
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param deltaIntegers
+ *      True to store all the integer arguments as differences (must be
+ *      constant)
+ * \param xorArguments
+ *      Bit mask of the double arguments to store as XORs, the n-th bit
+ *      standing for the n-th argument (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_SERIES(severity, deltaIntegers, xorArguments, format, ...)    \
+  do {                                                                         \
+    constexpr int numNibbles = NanoLogInternal::getNumNibblesNeeded(format);   \
+    constexpr int nParams = NanoLogInternal::countFmtParams(format);           \
+                                                                               \
+    static constexpr std::array<NanoLogInternal::ParamType, nParams>           \
+        paramTypes = NanoLogInternal::analyzeFormatString<nParams>(format);    \
+    static int logId = NanoLogInternal::UNASSIGNED_LOGID;                      \
+                                                                               \
+    if (NanoLog::severity > NanoLog::getLogLevel()) break;                     \
+                                                                               \
+    if (false) {                                                               \
+      NanoLogInternal::checkFormat(format, ##__VA_ARGS__);                     \
+    } /*NOLINT(cppcoreguidelines-pro-type-vararg, hicpp-vararg)*/              \
+                                                                               \
+    NanoLogInternal::logDeltas<paramTypes, (deltaIntegers), (xorArguments)>(   \
+        logId, __FILENAME__, __LINE__, NanoLog::severity, format, numNibbles,  \
+        ##__VA_ARGS__);                                                        \
+  } while (0)
+
+/**
+ * NANO_LOG_DELTA macro used for logging integer arguments that change little
+ * from one log message to the next (i.e. sequence numbers, order ids and
+ * counters). It behaves like NANO_LOG(), but the integer arguments are
+ * stored as the difference from their values in the previous log message of
+ * the same invocation site and thread (see NANO_LOG_SERIES()).
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_DELTA(severity, format, ...)                                  \
+  NANO_LOG_SERIES(severity, true, 0, format, ##__VA_ARGS__)
+
+/**
+ * NANO_LOG_XOR macro used for logging double arguments that change little
+ * from one log message to the next (i.e. prices). It behaves like
+ * NANO_LOG(), but the chosen double arguments are stored as the XOR of their
+ * bits with those of their values in the previous log message of the same
+ * invocation site and thread (see NANO_LOG_SERIES()).
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param xorArguments
+ *      Bit mask of the double arguments to store as XORs, the n-th bit
+ *      standing for the n-th argument (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_XOR(severity, xorArguments, format, ...)                      \
+  NANO_LOG_SERIES(severity, false, xorArguments, format, ##__VA_ARGS__)
+
+/**
+ * NANO_LOG_CHANNEL macro used for logging to a channel other than the primary
+ * channel (see NanoLog::createChannel()). It behaves like NANO_LOG(), but
+ * the log message is subject to the channel's log level and is persisted to
+ * the channel's log file.
+ *
+ * \param channel
+ *      The NanoLog::Channel to log to
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_CHANNEL(channel, severity, format, ...)                       \
+  do {                                                                         \
+    constexpr int numNibbles = NanoLogInternal::getNumNibblesNeeded(format);   \
+    constexpr int nParams = NanoLogInternal::countFmtParams(format);           \
+                                                                               \
+    static constexpr std::array<NanoLogInternal::ParamType, nParams>           \
+        paramTypes = NanoLogInternal::analyzeFormatString<nParams>(format);    \
+    static int logId = NanoLogInternal::UNASSIGNED_LOGID;                      \
+                                                                               \
+    const NanoLog::Channel nanoLogChannel = (channel);                         \
+    if (NanoLog::severity > NanoLog::getChannelLogLevel(nanoLogChannel))       \
+      break;                                                                   \
+                                                                               \
+    if (false) {                                                               \
+      NanoLogInternal::checkFormat(format, ##__VA_ARGS__);                     \
+    } /*NOLINT(cppcoreguidelines-pro-type-vararg, hicpp-vararg)*/              \
+                                                                               \
+    NanoLogInternal::RuntimeLogger::ChannelScope nanoLogChannelScope(          \
+        nanoLogChannel);                                                       \
+    NanoLogInternal::log<paramTypes>(logId, __FILENAME__, __LINE__,            \
+                                     NanoLog::severity, format, numNibbles,    \
+                                     ##__VA_ARGS__);                           \
+  } while (0)
+
+/**
+ * NANO_LOG_DURABLE macro used for logging messages that must be on disk
+ * before the caller proceeds (i.e. audit records). It behaves like NANO_LOG(),
+ * but blocks until the log message and the ones the thread logged before it
+ * are persisted. Other threads' log messages are not waited on.
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_DURABLE(severity, format, ...)                                \
+  do {                                                                         \
+    if (NanoLog::severity > NanoLog::getLogLevel()) break;                     \
+                                                                               \
+    NANO_LOG(severity, format, ##__VA_ARGS__);                                 \
+    NanoLogInternal::RuntimeLogger::waitUntilPersisted();                      \
+  } while (0)
+
+/**
+ * NANO_LOG_RUNTIME macro used for logging with a format string that is only
+ * known at runtime (i.e. from a plugin or scripting layer). Unlike NANO_LOG(),
+ * the format string is not checked at compile-time and is instead parsed
+ * once at runtime (see logRuntime()).
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (may be a runtime value)
+ * \param format
+ *      printf-like format string
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_RUNTIME(severity, format, ...)                                \
+  do {                                                                         \
+    const NanoLog::LogLevel runtimeSeverity = (severity);                      \
+    if (runtimeSeverity > NanoLog::getLogLevel()) break;                       \
+                                                                               \
+    NanoLogInternal::logRuntime(__FILENAME__, __LINE__, runtimeSeverity,       \
+                                format, ##__VA_ARGS__);                        \
   } while (0)
 } /* Namespace NanoLogInternal */
+
+#include "NanoLogBacktrace.h"
+#include "NanoLogContext.h"
+#include "NanoLogMetric.h"
+#include "NanoLogSpan.h"
+#include "NanoLogStruct.h"
@@ -0,0 +1,186 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <atomic>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Log.h"
+#include "NanoLog.h"
+
+/***
+ * This file allows enum values and errno codes to be logged as plain integers
+ * and rendered by name at decompression time, which keeps toString() and
+ * strerror() lookups off the logging thread.
+ *
+ * A table mapping the values of an enum type to names is registered once via
+ * NanoLog::registerEnumTable() and persisted to the dictionary. Every log
+ * site registered afterwards that takes an argument of that enum type binds
+ * the argument to the table, and the decompressor prints the name in place
+ * of the integer. A built-in table is provided for errno values, which are
+ * marked by passing them as a NanoLog::Errno.
+ *
+ * Since the GNU format checker rejects scoped enums (enum class) passed to
+ * integer specifiers, they should be passed through NanoLog::enumArg().
+ *
+ * Example:
+ *      enum class State { IDLE, BUSY };
+ *      NanoLog::registerEnumTable<State>("State", {{State::IDLE, "IDLE"},
+ *                                                  {State::BUSY, "BUSY"}});
+ *      ...
+ *      NANO_LOG(NOTICE, "state=%d", NanoLog::enumArg(state));
+ *      NANO_LOG(ERROR, "open() failed: %d", NanoLog::Errno(errno));
+ */
+namespace NanoLog {
+/**
+ * Type for errno values to be rendered by name and description.
+ */
+enum Errno : int {};
+};  // namespace NanoLog
+
+namespace NanoLogInternal {
+
+/**
+ * Stores the dictionary identifier of the enum table registered for an
+ * enum type.
+ *
+ * \tparam E
+ *      Enum type associated with the table
+ */
+template <typename E>
+struct EnumTable {
+  // Identifier of the table or -1 if no table was registered for E
+  static inline std::atomic<int> id{-1};
+
+  static inline int getId() { return id.load(std::memory_order_acquire); }
+};
+
+// The errno table is registered lazily upon first use
+template <>
+struct EnumTable<NanoLog::Errno> {
+  static inline int getId() { return RuntimeLogger::getErrnoTableId(); }
+};
+
+/**
+ * Wraps a (scoped) enum type with a distinct unscoped enum that can be passed
+ * to printf integer specifiers and is bound to the same enum table.
+ *
+ * \tparam E
+ *      Enum type to wrap
+ */
+template <typename E>
+struct EnumArg {
+  enum Value : std::underlying_type_t<E> {};
+};
+
+/**
+ * Returns the id of the enum table bound to arguments of type T, or -1 if
+ * there is none.
+ */
+template <typename T>
+inline int getEnumTableId() {
+  if constexpr (std::is_enum_v<T>)
+    return EnumTable<T>::getId();
+  else
+    return -1;
+}
+
+/**
+ * Builds the ENUM_BINDING site extension for a log invocation site whose
+ * arguments are of types Ts, binding every argument whose type has an enum
+ * table registered.
+ *
+ * \tparam Ts
+ *      Types of the arguments of the log invocation site
+ *
+ * \return
+ *      The encoded SiteExtension, or an empty string if no arguments are
+ *      bound
+ */
+template <typename... Ts>
+inline std::string getEnumBindings() {
+  std::string extension;
+
+  if constexpr ((std::is_enum_v<Ts> || ...)) {
+    const int tableIds[] = {getEnumTableId<Ts>()...};
+
+    std::string bindings;
+    for (uint16_t i = 0; i < sizeof...(Ts); ++i) {
+      if (tableIds[i] < 0) continue;
+
+      Log::EnumBinding binding = {i, static_cast<uint32_t>(tableIds[i])};
+      bindings.append(reinterpret_cast<const char*>(&binding),
+                      sizeof(binding));
+    }
+
+    if (!bindings.empty())
+      Log::appendSiteExtension(extension, Log::ENUM_BINDING, bindings);
+  }
+
+  return extension;
+}
+} /* Namespace NanoLogInternal */
+
+namespace NanoLog {
+/**
+ * Registers a table mapping the values of enum type E to names. Arguments of
+ * type E (or NanoLog::enumArg()-ed values of type E) in log invocation sites
+ * encountered after this call are logged as integers and rendered by name by
+ * the decompressor. Values not found in the table are printed as integers.
+ *
+ * \tparam E
+ *      Enum type described by the table
+ *
+ * \param name
+ *      Name of the table; must have a static lifetime
+ * \param entries
+ *      Enum values and their names
+ */
+template <typename E>
+inline void registerEnumTable(
+    const char* name,
+    std::initializer_list<std::pair<E, const char*>> entries) {
+  static_assert(std::is_enum_v<E>,
+                "registerEnumTable() requires an enum type");
+  using namespace NanoLogInternal;
+  using U = std::underlying_type_t<E>;
+
+  std::vector<std::pair<int64_t, std::string>> table;
+  for (const auto& entry : entries)
+    table.emplace_back(static_cast<int64_t>(static_cast<U>(entry.first)),
+                       entry.second);
+
+  int id = RuntimeLogger::registerEnumTable(name, table);
+  EnumTable<E>::id.store(id, std::memory_order_release);
+  EnumTable<typename EnumArg<E>::Value>::id.store(id,
+                                                  std::memory_order_release);
+}
+
+/**
+ * Converts a (scoped) enum value into a value that can be passed to a printf
+ * integer specifier, while keeping the binding to E's enum table.
+ *
+ * \param value
+ *      Enum value to log
+ */
+template <typename E>
+inline typename NanoLogInternal::EnumArg<E>::Value enumArg(E value) {
+  return static_cast<typename NanoLogInternal::EnumArg<E>::Value>(value);
+}
+};  // namespace NanoLog
@@ -0,0 +1,509 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "NanoLogCpp17.h"
+
+/***
+ * This file implements NANO_METRIC_COUNT() and NANO_METRIC_HIST(), which
+ * aggregate counters and value distributions in thread-local slots instead of
+ * logging every update.
+ *
+ * The background compression thread starts a new metric epoch every
+ * NanoLogConfig::METRIC_EPOCH_INTERVAL_US and stages one snapshot record per
+ * thread and metric updated during the epoch that ended, then resets the
+ * aggregates. The aggregates of the current epoch are staged by the threads
+ * themselves as they exit or invoke NanoLog::flushMetrics(). The
+ * decompressor outputs the snapshots as a time series, one line per thread,
+ * metric and epoch.
+ *
+ * Example:
+ *      NANO_METRIC_COUNT("rx_packets", 1);
+ *      NANO_METRIC_HIST("rx_latency_ns", latencyNs);
+ */
+namespace NanoLogInternal {
+
+/**
+ * Static information associated with a NANO_METRIC_*() invocation site.
+ * Metric sites are registered upon construction, so they should be
+ * function-local statics.
+ */
+struct MetricSite {
+  /**
+   * Returns the number of slots assigned to the metrics of a MetricType thus
+   * far and assigns a new slot if requested.
+   */
+  static inline int nextSlot(Log::MetricType type, bool assign) {
+    static std::atomic<int> numSlots[3];
+    return assign ? numSlots[type].fetch_add(1) : numSlots[type].load();
+  }
+
+  MetricSite(const char* filename, int linenum, const char* name,
+             Log::MetricType type, StaticLogInfo::CompressionFn compressionFn)
+      : logId(UNASSIGNED_LOGID), slot(nextSlot(type, true)) {
+    static constexpr std::array<ParamType, 0> noParams = {};
+    StaticLogInfo info(compressionFn, filename, linenum, INF, name, 0, 0,
+                       noParams.data());
+
+    std::string extensions;
+    Log::appendSiteExtension(extensions, Log::METRIC,
+                             std::string(1, static_cast<char>(type)));
+    RuntimeLogger::registerInvocationSite(info, logId, extensions);
+  }
+
+  // Log id of the metric's snapshot records
+  int logId;
+
+  // Index of the metric's slot among the thread-local slots of its type
+  int slot;
+
+  DISALLOW_COPY_AND_ASSIGN(MetricSite);
+};
+
+/**
+ * Snapshot of a thread's counter, as staged after the log message header.
+ */
+struct CounterSnapshot {
+  // Id the log records of the thread are attributed to
+  uint32_t threadId;
+  uint32_t epoch;
+  int64_t sum;
+};
+
+/**
+ * Snapshot of a thread's histogram, as staged after the log message header.
+ */
+struct HistogramSnapshot {
+  // Id the log records of the thread are attributed to
+  uint32_t threadId;
+  uint32_t epoch;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+
+  // Number of values in [2^i, 2^(i+1)) in the i-th bucket (0 and 1 share
+  // the 0-th bucket)
+  uint64_t buckets[64];
+};
+
+/**
+ * Aggregates of all the metrics updated by a thread. They are kept in two
+ * banks: the thread updates the bank of the current epoch's parity while the
+ * background thread collects the bank of the epoch that just ended (see
+ * RuntimeLogger::collectMetrics()).
+ */
+struct ThreadMetrics {
+  ThreadMetrics()
+      : threadId(RuntimeLogger::getThreadBufferId()),
+        updates(0),
+        exited(false),
+        mutex(),
+        counters(),
+        histograms() {}
+
+  /**
+   * Slot holding the aggregates of a counter over the last two epochs.
+   */
+  struct CounterSlot {
+    CounterSlot() : site(nullptr), sum(), dirty() {}
+
+    const MetricSite* site;
+    int64_t sum[2];
+    bool dirty[2];
+  };
+
+  /**
+   * Slot holding the aggregates of a histogram over the last two epochs.
+   */
+  struct HistogramSlot {
+    HistogramSlot() : site(nullptr), snapshot() {}
+
+    const MetricSite* site;
+
+    // A count of 0 indicates that the bank was not updated
+    HistogramSnapshot snapshot[2];
+  };
+
+  /**
+   * Returns the slot of a metric, growing the slots upon its first update
+   * by the thread.
+   */
+  template <typename Slot>
+  inline Slot& getSlot(std::vector<Slot>& slots, const MetricSite& site,
+                       Log::MetricType type) {
+    if (site.slot >= static_cast<int>(slots.size()) ||
+        slots[site.slot].site == nullptr) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (site.slot >= static_cast<int>(slots.size()))
+        slots.resize(MetricSite::nextSlot(type, false));
+      slots[site.slot].site = &site;
+    }
+
+    return slots[site.slot];
+  }
+
+  /**
+   * Invoked before updating the aggregates, so that the background thread
+   * waits on the update before collecting the bank of an epoch it ended.
+   *
+   * 
+eturn
+   *      Bank of the current epoch
+   */
+  inline int beginUpdate() {
+    updates.store(updates.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+
+    // Either the background thread finds the update in progress or the
+    // update finds the new epoch (see RuntimeLogger::collectMetrics())
+    if (RuntimeLogger::isMetricFenceNeeded())
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    else
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    return RuntimeLogger::getMetricEpoch();
+  }
+
+  /**
+   * Complement to beginUpdate().
+   */
+  inline void endUpdate() {
+    updates.store(updates.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+  }
+
+  // Id the snapshots of the thread are attributed to
+  const uint32_t threadId;
+
+  // Incremented before and after every update, so odd while one is in
+  // progress
+  std::atomic<uint32_t> updates;
+
+  // Set as the thread exits, after which the background thread deletes the
+  // aggregates upon collecting them
+  std::atomic<bool> exited;
+
+  // Protects the growth of the slots and the metric sites assigned to them
+  // against the background thread collecting them
+  std::mutex mutex;
+
+  // Slots indexed by MetricSite::slot, grown upon first use
+  std::vector<CounterSlot> counters;
+  std::vector<HistogramSlot> histograms;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadMetrics);
+};
+
+/**
+ * Registry of the aggregates of all the threads that updated metrics.
+ */
+struct MetricRegistry {
+  MetricRegistry() : mutex(), threads() {}
+
+  // Protects threads
+  std::mutex mutex;
+  std::vector<ThreadMetrics*> threads;
+};
+
+/**
+ * Returns the registry of the threads' aggregates. It is never destroyed,
+ * since the RuntimeLogger collects the aggregates as it is destroyed.
+ */
+inline MetricRegistry& getMetricRegistry() {
+  static MetricRegistry* registry = new MetricRegistry();
+  return *registry;
+}
+
+/**
+ * Stages snapshots of the metrics the calling thread updated in the current
+ * epoch into its own StagingBuffer and resets their aggregates.
+ *
+ * \param metrics
+ *      Aggregates of the calling thread
+ */
+inline void flushThreadMetrics(ThreadMetrics& metrics) {
+  static constexpr std::array<ParamType, 0> noParams = {};
+  std::vector<std::pair<int, CounterSnapshot>> counters;
+  std::vector<std::pair<int, HistogramSnapshot>> histograms;
+
+  // The snapshots are staged after the update, since the background thread
+  // may be waiting on it while the StagingBuffer is full
+  uint32_t epoch = metrics.beginUpdate();
+  int bank = epoch & 1;
+  for (auto& counter : metrics.counters) {
+    if (!counter.dirty[bank]) continue;
+
+    counters.push_back({counter.site->logId,
+                        {metrics.threadId, epoch, counter.sum[bank]}});
+    counter.sum[bank] = 0;
+    counter.dirty[bank] = false;
+  }
+
+  for (auto& histogram : metrics.histograms) {
+    HistogramSnapshot& snapshot = histogram.snapshot[bank];
+    if (snapshot.count == 0) continue;
+
+    snapshot.threadId = metrics.threadId;
+    snapshot.epoch = epoch;
+    histograms.push_back({histogram.site->logId, snapshot});
+    snapshot = HistogramSnapshot();
+  }
+  metrics.endUpdate();
+
+  for (auto& counter : counters)
+    stageLogEntryWithTrailer(counter.first, false, noParams, &counter.second,
+                             sizeof(CounterSnapshot));
+
+  for (auto& histogram : histograms)
+    stageLogEntryWithTrailer(histogram.first, false, noParams,
+                             &histogram.second, sizeof(HistogramSnapshot));
+}
+
+/**
+ * Stages snapshots of the metrics a thread updated in an epoch that ended
+ * and resets their aggregates. This is invoked by the background thread
+ * once the thread no longer updates the bank of the epoch.
+ *
+ * \param metrics
+ *      Aggregates of the thread
+ * \param epoch
+ *      Epoch that ended
+ * \param stage
+ *      Stages a snapshot record given the log id, the snapshot and its size;
+ *      returns false if it is out of space
+ *
+ * 
+eturn
+ *      True if all the snapshots were staged; otherwise the rest are staged
+ *      upon the next invocation
+ */
+template <typename StageFn>
+inline bool collectThreadMetrics(ThreadMetrics& metrics, uint32_t epoch,
+                                 StageFn&& stage) {
+  int bank = epoch & 1;
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  for (auto& counter : metrics.counters) {
+    if (!counter.dirty[bank]) continue;
+
+    CounterSnapshot snapshot = {metrics.threadId, epoch, counter.sum[bank]};
+    if (!stage(counter.site->logId, &snapshot, sizeof(snapshot)))
+      return false;
+
+    counter.sum[bank] = 0;
+    counter.dirty[bank] = false;
+  }
+
+  for (auto& histogram : metrics.histograms) {
+    HistogramSnapshot& snapshot = histogram.snapshot[bank];
+    if (snapshot.count == 0) continue;
+
+    snapshot.threadId = metrics.threadId;
+    snapshot.epoch = epoch;
+    if (!stage(histogram.site->logId, &snapshot, sizeof(HistogramSnapshot)))
+      return false;
+
+    snapshot = HistogramSnapshot();
+  }
+
+  return true;
+}
+
+/**
+ * Owns the aggregates of a thread, which are registered upon the thread's
+ * first metric update and flushed as it exits.
+ */
+struct ThreadMetricsHolder {
+  ThreadMetricsHolder() : metrics(new ThreadMetrics()) {
+    MetricRegistry& registry = getMetricRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.threads.push_back(metrics);
+  }
+
+  // Constructed after the StagingBufferDestroyer of the thread (see
+  // RuntimeLogger::getThreadBufferId()), so the flush precedes its
+  // destruction
+  ~ThreadMetricsHolder() {
+    flushThreadMetrics(*metrics);
+    metrics->exited.store(true, std::memory_order_release);
+  }
+
+  ThreadMetrics* metrics;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadMetricsHolder);
+};
+
+/**
+ * Returns the metric aggregates of the calling thread.
+ */
+inline ThreadMetrics& getThreadMetrics() {
+  static thread_local ThreadMetricsHolder holder;
+  return *holder.metrics;
+}
+
+/**
+ * Adds a delta to the calling thread's aggregate of a counter.
+ */
+inline void updateCounter(const MetricSite& site, int64_t delta) {
+  ThreadMetrics& metrics = getThreadMetrics();
+  ThreadMetrics::CounterSlot& counter =
+      metrics.getSlot(metrics.counters, site, Log::COUNTER);
+
+  int bank = metrics.beginUpdate() & 1;
+  counter.sum[bank] += delta;
+  counter.dirty[bank] = true;
+  metrics.endUpdate();
+}
+
+/**
+ * Adds a value to the calling thread's aggregate of a histogram.
+ */
+inline void updateHistogram(const MetricSite& site, uint64_t value) {
+  ThreadMetrics& metrics = getThreadMetrics();
+  ThreadMetrics::HistogramSlot& histogram =
+      metrics.getSlot(metrics.histograms, site, Log::HISTOGRAM);
+
+  int bank = metrics.beginUpdate() & 1;
+  HistogramSnapshot& snapshot = histogram.snapshot[bank];
+  if (snapshot.count == 0 || value < snapshot.min) snapshot.min = value;
+  if (value > snapshot.max) snapshot.max = value;
+  ++snapshot.count;
+  snapshot.sum += value;
+  ++snapshot.buckets[(value == 0) ? 0 : 63 - __builtin_clzll(value)];
+  metrics.endUpdate();
+}
+
+/**
+ * Compresses a CounterSnapshot into the nibbles and pack()-ed values of the
+ * thread id, the epoch and the sum.
+ */
+inline void compressCounterSnapshot(int numNibbles, const ParamType* paramTypes,
+                                    char** input, char** output) {
+  CounterSnapshot snapshot;
+  std::memcpy(&snapshot, *input, sizeof(CounterSnapshot));
+  *input += sizeof(CounterSnapshot);
+
+  auto* nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(*output);
+  char* out = *output + 2;
+  nibbles[0].first = 0xf & BufferUtils::pack(&out, snapshot.threadId);
+  nibbles[0].second = 0xf & BufferUtils::pack(&out, snapshot.epoch);
+  nibbles[1].first = 0xf & BufferUtils::pack(&out, snapshot.sum);
+  nibbles[1].second = 0;
+  *output = out;
+}
+
+/**
+ * Compresses a HistogramSnapshot into a bitmask of the non-empty buckets,
+ * followed by the nibbles and pack()-ed values of the thread id, epoch,
+ * count, sum, minimum, maximum and the counts of the non-empty buckets.
+ */
+inline void compressHistogramSnapshot(int numNibbles,
+                                      const ParamType* paramTypes,
+                                      char** input, char** output) {
+  HistogramSnapshot snapshot;
+  std::memcpy(&snapshot, *input, sizeof(HistogramSnapshot));
+  *input += sizeof(HistogramSnapshot);
+
+  uint64_t bucketMask = 0;
+  for (int i = 0; i < 64; ++i)
+    if (snapshot.buckets[i] != 0) bucketMask |= 1UL << i;
+
+  char* out = *output;
+  std::memcpy(out, &bucketMask, sizeof(uint64_t));
+  out += sizeof(uint64_t);
+
+  int numValues = 6 + __builtin_popcountll(bucketMask);
+  auto* nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(out);
+  out += (numValues + 1) / 2;
+
+  int n = 0;
+  auto packValue = [&](auto value) {
+    int nibble = BufferUtils::pack(&out, value);
+    if (n & 0x1)
+      nibbles[n / 2].second = 0xf & nibble;
+    else
+      nibbles[n / 2].first = 0xf & nibble;
+    ++n;
+  };
+
+  packValue(snapshot.threadId);
+  packValue(snapshot.epoch);
+  packValue(snapshot.count);
+  packValue(snapshot.sum);
+  packValue(snapshot.min);
+  packValue(snapshot.max);
+  for (int i = 0; i < 64; ++i)
+    if (snapshot.buckets[i] != 0) packValue(snapshot.buckets[i]);
+
+  *output = out;
+}
+
+/**
+ * NANO_METRIC_COUNT macro used for adding a delta to a counter.
+ *
+ * \param name
+ *      Name of the counter (must be a literal without format specifiers)
+ * \param delta
+ *      Value to add to the counter
+ */
+#define NANO_METRIC_COUNT(name, delta)                                         \
+  do {                                                                         \
+    static_assert(NanoLogInternal::countFmtParams(name) == 0,                  \
+                  "Metric names cannot contain format specifiers");            \
+    static const NanoLogInternal::MetricSite metricSite(                       \
+        __FILENAME__, __LINE__, name, NanoLogInternal::Log::COUNTER,           \
+        &NanoLogInternal::compressCounterSnapshot);                            \
+    NanoLogInternal::updateCounter(metricSite,                                 \
+                                   static_cast<int64_t>(delta));               \
+  } while (0)
+
+/**
+ * NANO_METRIC_HIST macro used for adding a value to a histogram.
+ *
+ * \param name
+ *      Name of the histogram (must be a literal without format specifiers)
+ * \param value
+ *      Non-negative value to add to the histogram
+ */
+#define NANO_METRIC_HIST(name, value)                                          \
+  do {                                                                         \
+    static_assert(NanoLogInternal::countFmtParams(name) == 0,                  \
+                  "Metric names cannot contain format specifiers");            \
+    static const NanoLogInternal::MetricSite metricSite(                       \
+        __FILENAME__, __LINE__, name, NanoLogInternal::Log::HISTOGRAM,         \
+        &NanoLogInternal::compressHistogramSnapshot);                          \
+    NanoLogInternal::updateHistogram(metricSite,                               \
+                                     static_cast<uint64_t>(value));            \
+  } while (0)
+} /* Namespace NanoLogInternal */
+
+namespace NanoLog {
+/**
+ * Stages snapshots of the calling thread's metric aggregates without waiting
+ * for the current metric epoch to end, e.g. before invoking sync().
+ */
+inline void flushMetrics() {
+  using namespace NanoLogInternal;
+  flushThreadMetrics(getThreadMetrics());
+}
+};  // namespace NanoLog
@@ -0,0 +1,146 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+
+#include "NanoLogCpp17.h"
+
+/***
+ * This file implements NANO_SPAN(), which times the enclosing scope. Entering
+ * and exiting the scope each stage a log entry without arguments, so the
+ * records consist of nothing but the log site id and the timestamp.
+ *
+ * The decompressor pairs the records of every thread and outputs the exit
+ * records with the duration and nesting depth of the span. A per-site summary
+ * with a latency histogram can be printed via Decoder::printSpanSummary().
+ *
+ * Spans are recorded at the TRC log level. They are not supported with
+ * per-CPU staging (see NanoLog::enablePerCpuStaging()), where they are not
+ * recorded.
+ *
+ * Example:
+ *      void handle() {
+ *        NANO_SPAN("handle");
+ *        ...
+ *      }
+ */
+namespace NanoLogInternal {
+
+/**
+ * Static information associated with a NANO_SPAN() invocation site.
+ */
+struct SpanSite {
+  constexpr SpanSite(const char* filename, int linenum, const char* name)
+      : filename(filename),
+        linenum(linenum),
+        name(name),
+        beginId(UNASSIGNED_LOGID),
+        endId(UNASSIGNED_LOGID) {}
+
+  const char* filename;
+  int linenum;
+  const char* name;
+
+  // Log ids of the span entry and exit records
+  int beginId;
+  int endId;
+};
+
+/**
+ * Registers the log sites of the span entry and exit records.
+ *
+ * \param site
+ *      Span to register
+ */
+inline void registerSpanSite(SpanSite& site) {
+  static constexpr std::array<ParamType, 0> noParams = {};
+
+  if (site.beginId == UNASSIGNED_LOGID) {
+    StaticLogInfo info(&compress<>, site.filename, site.linenum, TRC,
+                       site.name, 0, 0, noParams.data());
+
+    std::string extensions;
+    Log::appendSiteExtension(extensions, Log::SPAN_BEGIN, std::string());
+    RuntimeLogger::registerInvocationSite(info, site.beginId, extensions);
+  }
+
+  if (site.endId == UNASSIGNED_LOGID) {
+    StaticLogInfo info(&compress<>, site.filename, site.linenum, TRC,
+                       site.name, 0, 0, noParams.data());
+
+    auto beginId = static_cast<uint32_t>(site.beginId);
+    std::string extensions;
+    Log::appendSiteExtension(
+        extensions, Log::SPAN_END,
+        std::string(reinterpret_cast<const char*>(&beginId), sizeof(beginId)));
+    RuntimeLogger::registerInvocationSite(info, site.endId, extensions);
+  }
+}
+
+/**
+ * Records the entry into a span upon construction and the exit upon
+ * destruction. This class is meant to be instantiated by NANO_SPAN().
+ */
+class SpanScope {
+ public:
+  explicit SpanScope(SpanSite& site) : site(nullptr) {
+    if (TRC > RuntimeLogger::getLogLevel()) return;
+
+    // The decompressor pairs the records by the StagingBuffer they were
+    // staged in, which is shared by all the threads on a CPU
+    assert(!RuntimeLogger::isPerCpuStaging() &&
+           "NANO_SPAN() is not supported with per-CPU staging");
+    if (RuntimeLogger::isPerCpuStaging()) return;
+
+    if (site.endId == UNASSIGNED_LOGID) registerSpanSite(site);
+
+    this->site = &site;
+    stageLogEntry<&compress<>>(site.beginId, false, std::array<ParamType, 0>());
+  }
+
+  ~SpanScope() {
+    if (site != nullptr)
+      stageLogEntry<&compress<>>(site->endId, false,
+                                 std::array<ParamType, 0>());
+  }
+
+ private:
+  // Span being timed, or nullptr if the span is not recorded
+  SpanSite* site;
+
+  DISALLOW_COPY_AND_ASSIGN(SpanScope);
+};
+
+#define NANOLOG_SPAN_CONCAT_(a, b) a##b
+#define NANOLOG_SPAN_CONCAT(a, b) NANOLOG_SPAN_CONCAT_(a, b)
+
+/**
+ * NANO_SPAN macro used for timing the enclosing scope.
+ *
+ * \param name
+ *      Name of the span (must be a literal without format specifiers)
+ */
+#define NANO_SPAN(name)                                                        \
+  NanoLogInternal::SpanScope NANOLOG_SPAN_CONCAT(nanoLogSpan, __LINE__)(       \
+      []() -> NanoLogInternal::SpanSite& {                                     \
+        static_assert(NanoLogInternal::countFmtParams(name) == 0,              \
+                      "NANO_SPAN() names cannot contain format specifiers");   \
+        static NanoLogInternal::SpanSite site(__FILENAME__, __LINE__, name);   \
+        return site;                                                           \
+      }())
+} /* Namespace NanoLogInternal */
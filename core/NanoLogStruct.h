@@ -0,0 +1,482 @@
+/* Copyright (c) 2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <cstring>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#include "NanoLogCpp17.h"
+
+/***
+ * This file allows plain-old-data structs to be logged in their raw form via
+ * NANO_LOG_STRUCT(). Instead of formatting every field at the call site, the
+ * runtime thread copies the entire object into the StagingBuffer with a single
+ * memcpy and defers the field-by-field work to the compression thread.
+ *
+ * The struct's layout must first be described with NANO_LOG_REFLECT(), which
+ * records a member pointer and a name for every field to be logged. Upon the
+ * first invocation of a NANO_LOG_STRUCT() site, the schema is turned into a
+ * synthesized printf format string of the form "Type{field=%d, ...}" and
+ * persisted to the dictionary like any other log statement. This means the
+ * decompressor needs no special knowledge of structs to render named fields,
+ * and integer fields are nibble-packed by the compression thread exactly like
+ * regular NANO_LOG() arguments.
+ *
+ * Example:
+ *      struct Order { uint64_t id; double price; int32_t qty; char sym[8]; };
+ *      NANO_LOG_REFLECT(Order, id, price, qty, sym);
+ *      ...
+ *      NANO_LOG_STRUCT(INF, order);
+ */
+
+/**
+ * Applies macro m(t, x) to every argument x of the variable argument list,
+ * separated by commas. Supports up to 32 arguments.
+ */
+#define NANOLOG_FE_1(m, t, x) m(t, x)
+#define NANOLOG_FE_2(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_1(m, t, __VA_ARGS__)
+#define NANOLOG_FE_3(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_2(m, t, __VA_ARGS__)
+#define NANOLOG_FE_4(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_3(m, t, __VA_ARGS__)
+#define NANOLOG_FE_5(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_4(m, t, __VA_ARGS__)
+#define NANOLOG_FE_6(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_5(m, t, __VA_ARGS__)
+#define NANOLOG_FE_7(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_6(m, t, __VA_ARGS__)
+#define NANOLOG_FE_8(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_7(m, t, __VA_ARGS__)
+#define NANOLOG_FE_9(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_8(m, t, __VA_ARGS__)
+#define NANOLOG_FE_10(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_9(m, t, __VA_ARGS__)
+#define NANOLOG_FE_11(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_10(m, t, __VA_ARGS__)
+#define NANOLOG_FE_12(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_11(m, t, __VA_ARGS__)
+#define NANOLOG_FE_13(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_12(m, t, __VA_ARGS__)
+#define NANOLOG_FE_14(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_13(m, t, __VA_ARGS__)
+#define NANOLOG_FE_15(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_14(m, t, __VA_ARGS__)
+#define NANOLOG_FE_16(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_15(m, t, __VA_ARGS__)
+#define NANOLOG_FE_17(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_16(m, t, __VA_ARGS__)
+#define NANOLOG_FE_18(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_17(m, t, __VA_ARGS__)
+#define NANOLOG_FE_19(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_18(m, t, __VA_ARGS__)
+#define NANOLOG_FE_20(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_19(m, t, __VA_ARGS__)
+#define NANOLOG_FE_21(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_20(m, t, __VA_ARGS__)
+#define NANOLOG_FE_22(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_21(m, t, __VA_ARGS__)
+#define NANOLOG_FE_23(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_22(m, t, __VA_ARGS__)
+#define NANOLOG_FE_24(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_23(m, t, __VA_ARGS__)
+#define NANOLOG_FE_25(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_24(m, t, __VA_ARGS__)
+#define NANOLOG_FE_26(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_25(m, t, __VA_ARGS__)
+#define NANOLOG_FE_27(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_26(m, t, __VA_ARGS__)
+#define NANOLOG_FE_28(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_27(m, t, __VA_ARGS__)
+#define NANOLOG_FE_29(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_28(m, t, __VA_ARGS__)
+#define NANOLOG_FE_30(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_29(m, t, __VA_ARGS__)
+#define NANOLOG_FE_31(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_30(m, t, __VA_ARGS__)
+#define NANOLOG_FE_32(m, t, x, ...) \
+  m(t, x), NANOLOG_FE_31(m, t, __VA_ARGS__)
+#define NANOLOG_FE_SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+    _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, \
+    _27, _28, _29, _30, _31, _32, NAME, ...) \
+  NAME
+#define NANOLOG_FOR_EACH(m, t, ...) \
+  NANOLOG_FE_SELECT(__VA_ARGS__, NANOLOG_FE_32, NANOLOG_FE_31, NANOLOG_FE_30, \
+                    NANOLOG_FE_29, NANOLOG_FE_28, NANOLOG_FE_27, \
+                    NANOLOG_FE_26, NANOLOG_FE_25, NANOLOG_FE_24, \
+                    NANOLOG_FE_23, NANOLOG_FE_22, NANOLOG_FE_21, \
+                    NANOLOG_FE_20, NANOLOG_FE_19, NANOLOG_FE_18, \
+                    NANOLOG_FE_17, NANOLOG_FE_16, NANOLOG_FE_15, \
+                    NANOLOG_FE_14, NANOLOG_FE_13, NANOLOG_FE_12, \
+                    NANOLOG_FE_11, NANOLOG_FE_10, NANOLOG_FE_9, NANOLOG_FE_8, \
+                    NANOLOG_FE_7, NANOLOG_FE_6, NANOLOG_FE_5, NANOLOG_FE_4, \
+                    NANOLOG_FE_3, NANOLOG_FE_2, NANOLOG_FE_1) \
+  (m, t, __VA_ARGS__)
+
+#define NANOLOG_STRUCT_MEMBER_PTR(Type, field) &Type::field
+
+/**
+ * Describes the fields of a struct to be logged with NANO_LOG_STRUCT(). This
+ * macro must be invoked in the global namespace with the fully qualified name
+ * of the struct and, in order, the names of the (up to 32) fields to log.
+ *
+ * Supported field types are integers, enums, bools, floats/doubles, pointers
+ * and fixed-size char arrays (which are logged as strings up to the first
+ * NULL character or the size of the array, whichever comes first).
+ *
+ * \param Type
+ *      Fully qualified name of a trivially copyable struct
+ * \param ...
+ *      Names of the fields within Type to log
+ */
+#define NANO_LOG_REFLECT(Type, ...)                                          \
+  template <>                                                                \
+  struct NanoLogInternal::StructSchema<Type> {                               \
+    static constexpr bool reflected = true;                                  \
+    static constexpr const char* typeName = #Type;                           \
+    static constexpr const char* fieldNames = #__VA_ARGS__;                  \
+    static constexpr auto fields = std::make_tuple(                          \
+        NANOLOG_FOR_EACH(NANOLOG_STRUCT_MEMBER_PTR, Type, __VA_ARGS__));     \
+  }
+
+namespace NanoLogInternal {
+
+/**
+ * Schema of a struct loggable via NANO_LOG_STRUCT(). This template is
+ * specialized for each struct by NANO_LOG_REFLECT().
+ *
+ * \tparam T
+ *      Type of the struct described
+ */
+template <typename T>
+struct StructSchema {
+  static constexpr bool reflected = false;
+};
+
+/**
+ * Returns the printf specifier used to render a struct field of type F in the
+ * synthesized format string. The specifier selected must be consistent with
+ * the type returned by getStructFieldValue() for the same field type, since
+ * the decompressor will use the specifier to interpret the packed value.
+ *
+ * \tparam F
+ *      Type of the struct field
+ */
+template <typename F>
+constexpr const char* getStructFieldSpecifier() {
+  if constexpr (std::is_array_v<F>) {
+    static_assert(
+        std::is_same_v<std::remove_cv_t<std::remove_extent_t<F>>, char>,
+        "NANO_LOG_STRUCT only supports arrays of char");
+    return "%s";
+  } else if constexpr (std::is_enum_v<F>) {
+    return getStructFieldSpecifier<std::underlying_type_t<F>>();
+  } else if constexpr (std::is_same_v<F, bool>) {
+    return "%d";
+  } else if constexpr (std::is_same_v<F, char>) {
+    return "%c";
+  } else if constexpr (std::is_integral_v<F> && std::is_signed_v<F>) {
+    return (sizeof(F) <= sizeof(int32_t)) ? "%d" : "%lld";
+  } else if constexpr (std::is_integral_v<F>) {
+    return (sizeof(F) <= sizeof(uint32_t)) ? "%u" : "%llu";
+  } else if constexpr (std::is_same_v<F, float>) {
+    return "%.7g";
+  } else if constexpr (std::is_same_v<F, double>) {
+    return "%.15g";
+  } else if constexpr (std::is_pointer_v<F>) {
+    return "%p";
+  } else {
+    static_assert(!sizeof(F*), "Unsupported field type for NANO_LOG_STRUCT");
+    return "";
+  }
+}
+
+/**
+ * Converts a non-string struct field into the type that will be pack()-ed
+ * by the compression thread (see getStructFieldSpecifier()).
+ *
+ * \param field
+ *      Value of the field to convert
+ */
+template <typename F>
+inline auto getStructFieldValue(const F& field) {
+  if constexpr (std::is_enum_v<F>) {
+    return getStructFieldValue(static_cast<std::underlying_type_t<F>>(field));
+  } else if constexpr (std::is_integral_v<F> && std::is_signed_v<F>) {
+    if constexpr (sizeof(F) <= sizeof(int32_t))
+      return static_cast<int32_t>(field);
+    else
+      return static_cast<long long int>(field);
+  } else if constexpr (std::is_integral_v<F>) {
+    if constexpr (sizeof(F) <= sizeof(uint32_t))
+      return static_cast<uint32_t>(field);
+    else
+      return static_cast<unsigned long long int>(field);
+  } else if constexpr (std::is_pointer_v<F>) {
+    return static_cast<const void*>(field);
+  } else {
+    return field;
+  }
+}
+
+/**
+ * Builds the printf format string describing struct T, i.e.
+ * "T{field1=%d, field2=%s, ...}". The result is computed once and cached for
+ * the lifetime of the program, so the pointer returned may be persisted.
+ *
+ * \tparam T
+ *      Type of the struct described by NANO_LOG_REFLECT()
+ */
+template <typename T>
+inline const char* getStructFormatString() {
+  using Schema = StructSchema<T>;
+  static const std::string format = []() {
+    std::string fmt(Schema::typeName);
+    fmt.append("{");
+
+    const char* names = Schema::fieldNames;
+    int fieldNum = 0;
+    auto appendField = [&](auto memberPtr) {
+      using F = std::remove_cv_t<
+          std::remove_reference_t<decltype(std::declval<T>().*memberPtr)>>;
+
+      // Peel off the next name from the stringified macro arguments
+      while (*names == ',' || *names == ' ') ++names;
+      const char* end = names;
+      while (*end != '\0' && *end != ',' && *end != ' ') ++end;
+
+      if (fieldNum++ > 0) fmt.append(", ");
+      fmt.append(names, end - names);
+      fmt.append("=");
+      fmt.append(getStructFieldSpecifier<F>());
+      names = end;
+    };
+
+    std::apply([&](auto... memberPtrs) { (appendField(memberPtrs), ...); },
+               Schema::fields);
+    fmt.append("}");
+    return fmt;
+  }();
+
+  return format.c_str();
+}
+
+/**
+ * Returns true if the struct field pointed to by a member pointer of type M
+ * is rendered as a string.
+ */
+template <typename T, typename M>
+constexpr bool isStructStringField() {
+  using F = std::remove_cv_t<
+      std::remove_reference_t<decltype(std::declval<T>().*std::declval<M>())>>;
+  return std::is_array_v<F>;
+}
+
+/**
+ * Returns the ParamType array for struct T in the same form as would be
+ * produced by analyzeFormatString() on getStructFormatString<T>().
+ *
+ * \tparam T
+ *      Type of the struct described by NANO_LOG_REFLECT()
+ */
+template <typename T>
+inline const ParamType* getStructParamTypes() {
+  static constexpr auto paramTypes = std::apply(
+      [](auto... memberPtrs) {
+        return std::array<ParamType, sizeof...(memberPtrs)>{
+            (isStructStringField<T, decltype(memberPtrs)>()
+                 ? ParamType::STRING_WITH_NO_PRECISION
+                 : ParamType::NON_STRING)...};
+      },
+      StructSchema<T>::fields);
+  return paramTypes.data();
+}
+
+/**
+ * Returns the number of nibbles needed to compress the non-string fields of
+ * struct T.
+ */
+template <typename T>
+constexpr int getStructNumNibbles() {
+  return std::apply(
+      [](auto... memberPtrs) {
+        return (0 + ... +
+                (isStructStringField<T, decltype(memberPtrs)>() ? 0 : 1));
+      },
+      StructSchema<T>::fields);
+}
+
+/**
+ * Returns the ENUM_BINDING site extension binding the enum fields of struct
+ * T to their enum tables (see getEnumBindings()).
+ */
+template <typename T>
+inline std::string getStructEnumBindings() {
+  return std::apply(
+      [](auto... memberPtrs) {
+        return getEnumBindings<std::remove_cv_t<std::remove_reference_t<
+            decltype(std::declval<T>().*memberPtrs)>>...>();
+      },
+      StructSchema<T>::fields);
+}
+
+/**
+ * Compression function for structs logged by NANO_LOG_STRUCT(). Consumes
+ * the raw struct bytes copied into the input buffer and emits an encoding
+ * identical to what compress() would produce for the synthesized format
+ * string, i.e. the nibbles, followed by the pack()-ed non-string fields,
+ * followed by the NULL-terminated string fields.
+ *
+ * \tparam T
+ *      Type of the struct described by NANO_LOG_REFLECT()
+ * \param numNibbles
+ *      Number of nibbles needed to compress the non-string fields
+ * \param paramTypes
+ *      Unused; the field types are known at compile-time.
+ * \param[in/out] input
+ *      Input buffer to read the raw struct back from
+ * \param[in/out] output
+ *      Output buffer to write the compressed results to
+ */
+template <typename T>
+inline void compressStruct(int numNibbles, const ParamType*, char** input,
+                           char** output) {
+  // The struct may be arbitrarily aligned within the StagingBuffer, so copy
+  // its bytes out before locating the fields through the member pointers.
+  // T need not be default constructible, so the fields are copied out of
+  // the bytes rather than read from a T.
+  alignas(T) unsigned char storage[sizeof(T)];
+  std::memcpy(storage, *input, sizeof(T));
+  *input += sizeof(T);
+  const T* obj = std::launder(reinterpret_cast<const T*>(storage));
+
+  char* out = *output;
+  auto* nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(out);
+  out += (numNibbles + 1) / 2;
+
+  int nibbleCnt = 0;
+  auto packField = [&](auto memberPtr) {
+    if constexpr (!isStructStringField<T, decltype(memberPtr)>()) {
+      std::remove_cv_t<std::remove_reference_t<decltype(obj->*memberPtr)>>
+          field;
+      std::memcpy(static_cast<void*>(&field), &(obj->*memberPtr),
+                  sizeof(field));
+      uint8_t nibble =
+          0xf & BufferUtils::pack(&out, getStructFieldValue(field));
+      if (nibbleCnt & 0x1)
+        nibbles[nibbleCnt / 2].second = nibble;
+      else
+        nibbles[nibbleCnt / 2].first = nibble;
+      ++nibbleCnt;
+    }
+  };
+
+  auto copyString = [&](auto memberPtr) {
+    if constexpr (isStructStringField<T, decltype(memberPtr)>()) {
+      const char* str = &(obj->*memberPtr)[0];
+      size_t length = strnlen(str, sizeof(obj->*memberPtr));
+      std::memcpy(out, str, length);
+      out += length;
+      *out++ = '\0';
+    }
+  };
+
+  std::apply([&](auto... memberPtrs) { (packField(memberPtrs), ...); },
+             StructSchema<T>::fields);
+  std::apply([&](auto... memberPtrs) { (copyString(memberPtrs), ...); },
+             StructSchema<T>::fields);
+  *output = out;
+}
+
+/**
+ * Logs a raw struct in the NanoLog system. This function is meant to work in
+ * conjunction with the #define-d NANO_LOG_STRUCT() and, like log(), expects
+ * the caller to maintain a permanent mapping of logId to static information.
+ *
+ * \tparam T
+ *      Type of the struct described by NANO_LOG_REFLECT()
+ *
+ * \param logId[in/out]
+ *      LogId that should be permanently associated with the static information.
+ *      An input value of -1 indicates that NanoLog should persist the static
+ *      log information and assign a new, globally unique identifier.
+ * \param filename
+ *      Name of the file containing the log invocation
+ * \param linenum
+ *      Line number within filename of the log invocation.
+ * \param severity
+ *      LogLevel severity of the log invocation
+ * \param obj
+ *      Struct to log
+ */
+template <typename T>
+inline void logStruct(int& logId, const char* filename, const int linenum,
+                      const LogLevel severity, const T& obj) {
+  using namespace NanoLogInternal::Log;
+  static_assert(StructSchema<T>::reflected,
+                "Structs must be described with NANO_LOG_REFLECT() before "
+                "they can be logged with NANO_LOG_STRUCT()");
+  static_assert(std::is_trivially_copyable_v<T>,
+                "NANO_LOG_STRUCT requires a trivially copyable type");
+
+  if (logId == UNASSIGNED_LOGID) {
+    constexpr int numFields = std::tuple_size_v<
+        std::remove_const_t<decltype(StructSchema<T>::fields)>>;
+    StaticLogInfo info(&compressStruct<T>, filename, linenum, severity,
+                       getStructFormatString<T>(), numFields,
+                       getStructNumNibbles<T>(), getStructParamTypes<T>());
+
+    RuntimeLogger::registerInvocationSite(info, logId,
+                                          getStructEnumBindings<T>());
+  }
+
+  uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+  size_t allocSize = sizeof(UncompressedEntry) + sizeof(T);
+  bool priority = RuntimeLogger::isPriority(severity);
+  char* writePos =
+      NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize, priority);
+
+  UncompressedEntry* ue = new (writePos) UncompressedEntry();
+  std::memcpy(ue->argData, static_cast<const void*>(&obj), sizeof(T));
+
+  ue->fmtId = logId;
+  ue->timestamp = timestamp;
+  ue->entrySize = downCast<uint32_t>(allocSize);
+
+  NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, priority);
+}
+
+/**
+ * NANO_LOG_STRUCT macro used for logging a struct in its raw form. The
+ * struct's fields must have been previously described via NANO_LOG_REFLECT().
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param obj
+ *      Struct to log
+ */
+#define NANO_LOG_STRUCT(severity, obj)                                     \
+  do {                                                                     \
+    static int logId = NanoLogInternal::UNASSIGNED_LOGID;                  \
+                                                                           \
+    if (NanoLog::severity > NanoLog::getLogLevel()) break;                 \
+                                                                           \
+    NanoLogInternal::logStruct(logId, __FILENAME__, __LINE__,              \
+                               NanoLog::severity, obj);                    \
+  } while (0)
+} /* Namespace NanoLogInternal */
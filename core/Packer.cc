@@ -0,0 +1,260 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Packer.h"
+
+#if NANOLOG_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace BufferUtils {
+
+/**
+ * Shuffle masks and sizes indexed by the codes of two consecutive values
+ * stored by packVByte(), the first in the low bits.
+ */
+struct VByteTables {
+  // Moves the bytes of the two values from the 64-bit lanes of a 128-bit
+  // register to the front of it, indexed by their byte counts minus one
+  // (i.e. the codes without the negation bit) with the second's shifted
+  // left by 3
+  alignas(16) uint8_t packMasks[64][16];
+
+  // Moves the bytes of the two values at the front of a 128-bit register
+  // into its 64-bit lanes, zero-extending them, indexed by a byte of codes
+  alignas(16) uint8_t unpackMasks[256][16];
+
+  // All ones in the 64-bit lanes of the values that are negated, indexed by
+  // a byte of codes
+  alignas(16) uint64_t negateMasks[256][2];
+
+  // Number of bytes of the two values, indexed by a byte of codes
+  uint8_t pairBytes[256];
+
+  constexpr VByteTables()
+      : packMasks(), unpackMasks(), negateMasks(), pairBytes() {
+    for (int pair = 0; pair < 64; ++pair) {
+      int first = (pair & 0x7) + 1;
+      int second = (pair >> 3) + 1;
+      for (int i = 0; i < 16; ++i) packMasks[pair][i] = 0x80;
+      for (int i = 0; i < first; ++i)
+        packMasks[pair][i] = static_cast<uint8_t>(i);
+      for (int i = 0; i < second; ++i)
+        packMasks[pair][first + i] = static_cast<uint8_t>(8 + i);
+    }
+
+    for (int codes = 0; codes < 256; ++codes) {
+      uint8_t firstCode = codes & 0xf;
+      uint8_t secondCode = static_cast<uint8_t>(codes >> 4);
+      int first = vbyteBytes(firstCode);
+      int second = vbyteBytes(secondCode);
+      for (int i = 0; i < 16; ++i) unpackMasks[codes][i] = 0x80;
+      for (int i = 0; i < first; ++i)
+        unpackMasks[codes][i] = static_cast<uint8_t>(i);
+      for (int i = 0; i < second; ++i)
+        unpackMasks[codes][8 + i] = static_cast<uint8_t>(first + i);
+
+      negateMasks[codes][0] = vbyteNegated(firstCode) ? ~0ULL : 0;
+      negateMasks[codes][1] = vbyteNegated(secondCode) ? ~0ULL : 0;
+      pairBytes[codes] = static_cast<uint8_t>(first + second);
+    }
+  }
+};
+static constexpr VByteTables vbyteTables;
+
+/**
+ * Returns the code to store a value with given the lower bound passed to
+ * packVByte() and the number of its low bytes that are not all zero.
+ */
+static inline uint8_t vbyteCodeOf(uint8_t minCode, int significantBytes) {
+  int bytesCode = significantBytes - 1;
+  if (bytesCode < (minCode & 0x7)) bytesCode = minCode & 0x7;
+  return static_cast<uint8_t>(bytesCode | (minCode & 0x8));
+}
+
+/**
+ * Stores the code of the index-th value among the codes of packVByte().
+ * The codes must be stored in order.
+ */
+static inline void setVByteCode(uint8_t* codes, int index, uint8_t code) {
+  if (index & 0x1)
+    codes[index / 2] = static_cast<uint8_t>(codes[index / 2] | (code << 4));
+  else
+    codes[index / 2] = code;
+}
+
+/**
+ * Portable implementation of packVByte() for the values from index start on,
+ * given the position of their codes and of the first value.
+ */
+static char* packVByteScalar(const uint64_t* values, const uint8_t* minCodes,
+                             int start, int numValues, uint8_t* codes,
+                             char* out) {
+  for (int i = start; i < numValues; ++i) {
+    setVByteCode(codes, i, packVByteValue(&out, values[i], minCodes[i]));
+  }
+
+  return out;
+}
+
+/**
+ * Portable implementation of unpackVByte() for the values from index start
+ * on, given the position of their codes and of the first value.
+ */
+static const char* unpackVByteScalar(const char* in, const uint8_t* codes,
+                                     int start, int numValues,
+                                     uint64_t* values) {
+  for (int i = start; i < numValues; ++i) {
+    uint8_t code = (i & 0x1) ? codes[i / 2] >> 4 : codes[i / 2] & 0xf;
+    int bytes = vbyteBytes(code);
+
+    uint64_t value;
+    std::memcpy(&value, in, sizeof(uint64_t));
+    if (bytes < 8) value &= (1ULL << (8 * bytes)) - 1;
+    values[i] = vbyteNegated(code) ? 0 - value : value;
+    in += bytes;
+  }
+
+  return in;
+}
+
+#if NANOLOG_HAS_X86_SIMD
+/**
+ * AVX2 implementation of packVByte(). Four values are loaded at a time and
+ * the number of significant bytes of each is found from a mask of their
+ * zero bytes. A shuffle then moves the significant bytes of each pair of
+ * values to the front of its 128-bit lane, which is stored as is.
+ */
+__attribute__((target("avx2"))) static char* packVByteAvx2(
+    const uint64_t* values, const uint8_t* minCodes, int numValues,
+    char* out) {
+  uint8_t* codes = reinterpret_cast<uint8_t*>(out);
+  out += (numValues + 1) / 2;
+
+  int i = 0;
+  for (; i + 4 <= numValues; i += 4) {
+    __m256i quad =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+    uint32_t nonZeroBytes = ~static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(quad, _mm256_setzero_si256())));
+
+    uint8_t quadCodes[4];
+    int quadBytes[4];
+    for (int j = 0; j < 4; ++j) {
+      uint32_t nonZero = (nonZeroBytes >> (8 * j)) & 0xff;
+      quadCodes[j] =
+          vbyteCodeOf(minCodes[i + j], 32 - __builtin_clz(nonZero | 1));
+      quadBytes[j] = vbyteBytes(quadCodes[j]);
+    }
+    codes[i / 2] = static_cast<uint8_t>(quadCodes[0] | (quadCodes[1] << 4));
+    codes[i / 2 + 1] =
+        static_cast<uint8_t>(quadCodes[2] | (quadCodes[3] << 4));
+
+    int low = (quadCodes[0] & 0x7) | ((quadCodes[1] & 0x7) << 3);
+    int high = (quadCodes[2] & 0x7) | ((quadCodes[3] & 0x7) << 3);
+    __m256i masks = _mm256_set_m128i(
+        _mm_load_si128(
+            reinterpret_cast<const __m128i*>(vbyteTables.packMasks[high])),
+        _mm_load_si128(
+            reinterpret_cast<const __m128i*>(vbyteTables.packMasks[low])));
+    __m256i packed = _mm256_shuffle_epi8(quad, masks);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm256_castsi256_si128(packed));
+    out += quadBytes[0] + quadBytes[1];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm256_extracti128_si256(packed, 1));
+    out += quadBytes[2] + quadBytes[3];
+  }
+
+  return packVByteScalar(values, minCodes, i, numValues, codes, out);
+}
+
+/**
+ * SSSE3 implementation of unpackVByte(). Each byte of codes selects a
+ * shuffle that moves the bytes of its two values into the 64-bit lanes of
+ * a 128-bit register and a mask of the lanes to negate.
+ */
+__attribute__((target("ssse3"))) static const char* unpackVByteSsse3(
+    const char* in, int numValues, uint64_t* values) {
+  const uint8_t* codes = reinterpret_cast<const uint8_t*>(in);
+  in += (numValues + 1) / 2;
+
+  int i = 0;
+  for (; i + 2 <= numValues; i += 2) {
+    uint8_t pair = codes[i / 2];
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    __m128i unpacked = _mm_shuffle_epi8(
+        bytes, _mm_load_si128(reinterpret_cast<const __m128i*>(
+                   vbyteTables.unpackMasks[pair])));
+    __m128i negate = _mm_load_si128(
+        reinterpret_cast<const __m128i*>(vbyteTables.negateMasks[pair]));
+    unpacked = _mm_sub_epi64(_mm_xor_si128(unpacked, negate), negate);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), unpacked);
+    in += vbyteTables.pairBytes[pair];
+  }
+
+  return unpackVByteScalar(in, codes, i, numValues, values);
+}
+#endif  // NANOLOG_HAS_X86_SIMD
+
+/**
+ * Implementation of packVByte() for the processor, selected upon first use.
+ */
+static auto selectPackVByte() {
+  using PackFn = char* (*)(const uint64_t*, const uint8_t*, int, char*);
+#if NANOLOG_HAS_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return PackFn(&packVByteAvx2);
+#endif
+
+  return PackFn([](const uint64_t* values, const uint8_t* minCodes,
+                   int numValues, char* out) {
+    uint8_t* codes = reinterpret_cast<uint8_t*>(out);
+    return packVByteScalar(values, minCodes, 0, numValues, codes,
+                           out + (numValues + 1) / 2);
+  });
+}
+
+/**
+ * Implementation of unpackVByte() for the processor, selected upon first use.
+ */
+static auto selectUnpackVByte() {
+  using UnpackFn = const char* (*)(const char*, int, uint64_t*);
+#if NANOLOG_HAS_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) return UnpackFn(&unpackVByteSsse3);
+#endif
+
+  return UnpackFn([](const char* in, int numValues, uint64_t* values) {
+    const uint8_t* codes = reinterpret_cast<const uint8_t*>(in);
+    return unpackVByteScalar(in + (numValues + 1) / 2, codes, 0, numValues,
+                             values);
+  });
+}
+
+char* packVByte(const uint64_t* values, const uint8_t* minCodes,
+                int numValues, char* out) {
+  static const auto implementation = selectPackVByte();
+  return implementation(values, minCodes, numValues, out);
+}
+
+const char* unpackVByte(const char* in, int numValues, uint64_t* values) {
+  static const auto implementation = selectUnpackVByte();
+  return implementation(in, numValues, values);
+}
+
+}  // namespace BufferUtils
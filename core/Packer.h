@@ -55,13 +55,26 @@
  *      (c) S = [9, 8 + sizeof(T)) => integer was represented in S-8 bytes and
  *                                    a negation was performed on the integer
  *
+ * The special codes of a log message's arguments are stored together ahead of
+ * the packed values, which allows the decompressor to find the size of all the
+ * values with a table lookup per pair of codes (see getSizeOfPackedValues())
+ * and to read each value with a single word load (see unpackWord()).
+ *
  * TODO(syang0) Consider a packing scheme that can encode the special code
  * directly in the stream itself
  *
- * TODO(syang0) A common use case for logs is to log metrics, which tend to be
- * monotonically increasing (i.e. time alive, number of hits, etc), so would it
- * make more sense to start encoding number deltas instead of just the smallest
- * value.
+ * NANO_LOG() sites without long double arguments use the Stream-VByte-like
+ * variant produced by packVByte() instead (see Log::VBYTE_ARGUMENTS). It
+ * keeps the codes ahead of the values, but each code is simply the number of
+ * bytes minus one plus a negation bit, with no special case. A byte of codes
+ * thus indexes a table of shuffle masks that unpacks two values at once
+ * (see unpackVByte()).
+ *
+ * Log sites that opt into it with NANO_LOG_DELTA() encode their integers as
+ * the zigzagDelta() from the previous value of the same argument instead,
+ * since metrics tend to be monotonically increasing (i.e. time alive, number
+ * of hits, etc). Likewise, NANO_LOG_XOR() encodes the chosen double
+ * arguments as the packXor() of their bits with those of the previous value.
  */
 
 namespace BufferUtils {
@@ -94,29 +107,10 @@ template <typename T>
 inline typename std::enable_if<
     std::is_integral<T>::value && !std::is_signed<T>::value, int>::type
 pack(char** buffer, T val) {
-  // Binary search for the smallest container. It is also worth noting that
-  // with -O3, the compiler will strip out extraneous if-statements based on T
-  // For example, if T is uint16_t, it would only leave the t < 1U<<8 check
-
-  // TODO(syang0) Is this too costly vs. a simple for loop?
-  int numBytes;
-  if (val < (1UL << 8)) {
-    numBytes = 1;
-  } else if (val < (1UL << 16)) {
-    numBytes = 2;
-  } else if (val < (1UL << 24)) {
-    numBytes = 3;
-  } else if (val < (1UL << 32)) {
-    numBytes = 4;
-  } else if (val < (1UL << 40)) {
-    numBytes = 5;
-  } else if (val < (1UL << 48)) {
-    numBytes = 6;
-  } else if (val < (1UL << 56)) {
-    numBytes = 7;
-  } else {
-    numBytes = 8;
-  }
+  // The smallest container is derived from the number of leading zero bits,
+  // which avoids a chain of unpredictable branches on the magnitude of val.
+  // The low bit is set so that a value of 0 still occupies 1 byte.
+  int numBytes = (71 - __builtin_clzll(static_cast<uint64_t>(val) | 1)) >> 3;
 
   // Although we store the entire value here, we take advantage of the fact
   // that x86-64 is little-endian (storing the least significant bits first)
@@ -279,6 +273,176 @@ unpack(const char** in, uint8_t packNibble) {
   return result;
 }
 
+/**
+ * Variant of unpack() for integers and pointers that loads a whole word and
+ * masks off the bytes beyond the value rather than copying exactly as many
+ * bytes as were pack()-ed, which avoids a variable length memcpy() per value.
+ * Unlike unpack(), at least sizeof(uint64_t) bytes must be readable at *in.
+ *
+ * \param in
+ *      data array pointer to read the data back from and increment.
+ * \param packResult
+ *      special 4-bit code returned from pack()
+ *
+ * \return
+ *      original full-width value before compression
+ */
+template <typename T>
+inline typename std::enable_if<!std::is_floating_point<T>::value, T>::type
+unpackWord(const char** in, uint8_t packResult) {
+  // Number of bytes pack()-ed for each special code; the 16-byte code is
+  // never produced for integers and consumes nothing, as with unpack()
+  static constexpr uint8_t packedBytes[16] = {0, 1, 2, 3, 4, 5, 6, 7,
+                                              8, 1, 2, 3, 4, 5, 6, 7};
+  static constexpr uint64_t masks[9] = {0,
+                                        0xffULL,
+                                        0xffffULL,
+                                        0xffffffULL,
+                                        0xffffffffULL,
+                                        0xffffffffffULL,
+                                        0xffffffffffffULL,
+                                        0xffffffffffffffULL,
+                                        ~0ULL};
+
+  uint8_t bytes = packedBytes[packResult & 0xf];
+  uint64_t packed;
+  std::memcpy(&packed, *in, sizeof(uint64_t));
+  packed &= masks[bytes];
+  (*in) += bytes;
+
+  if (packResult > 8) packed = -packed;
+
+  if constexpr (std::is_pointer<T>::value)
+    return reinterpret_cast<T>(packed);
+  else
+    return static_cast<T>(packed);
+}
+
+/**
+ * Maps the difference between two integers onto an unsigned integer such
+ * that differences of a small magnitude, whether positive or negative, map
+ * to small values (i.e. 0, -1, 1, -2 map to 0, 1, 2, 3), which pack() then
+ * stores in few bytes. The difference is computed modulo 2^64.
+ *
+ * \param value
+ *      Integer to encode
+ * \param base
+ *      Integer to encode the value relative to
+ *
+ * \return
+ *      The zig-zag encoded difference
+ */
+inline uint64_t zigzagDelta(uint64_t value, uint64_t base) {
+  uint64_t delta = value - base;
+  uint64_t sign = static_cast<uint64_t>(static_cast<int64_t>(delta) >> 63);
+  return (delta << 1) ^ sign;
+}
+
+/**
+ * Inverse of zigzagDelta(); returns the integer encoded relative to base.
+ */
+inline uint64_t unzigzagDelta(uint64_t encoded, uint64_t base) {
+  return base + ((encoded >> 1) ^ (0 - (encoded & 0x1)));
+}
+
+/**
+ * Packs the XOR of the bits of two consecutive floating point values of a
+ * series, in the spirit of Gorilla. Close values share their sign, exponent
+ * and high mantissa bits, and values with few significant digits end in zero
+ * bits, so the XOR is stored without its leading or trailing zero bytes,
+ * whichever is fewer bytes. The special codes are compatible with the sizes
+ * of those of pack() (see getSizeOfPackedValues()):
+ *      (a) S = [1, 8]  => the low S bytes of the XOR were stored
+ *      (b) S = [9, 15] => the high S-8 bytes of the XOR were stored
+ * As with pack(), sizeof(uint64_t) bytes must be writable at *buffer.
+ *
+ * \param[in/out] buffer
+ *      char array pointer used to store the compressed value and bump
+ * \param xorBits
+ *      XOR of the bits of the value with those of the previous value
+ *
+ * \return
+ *      Special 4-bit value indicating how the XOR was packed
+ */
+inline int packXor(char** buffer, uint64_t xorBits) {
+  // A value identical to the previous one still occupies 1 byte
+  int lowBytes = (71 - __builtin_clzll(xorBits | 1)) >> 3;
+  int highBytes = 8 - (__builtin_ctzll(xorBits | (1ULL << 63)) >> 3);
+
+  // Which form is shorter is as good as random for a noisy series, so both
+  // are computed and one is selected without a branch
+  bool useHigh = highBytes < lowBytes;
+  uint64_t packed = useHigh ? xorBits >> (8 * (8 - highBytes)) : xorBits;
+  int numBytes = useHigh ? highBytes : lowBytes;
+
+  std::memcpy(*buffer, &packed, sizeof(uint64_t));
+  *buffer += numBytes;
+
+  return useHigh ? 8 + numBytes : numBytes;
+}
+
+/**
+ * Inverse of packXor(); returns the XOR of the bits of the value with those
+ * of the previous value. As with unpackWord(), at least sizeof(uint64_t)
+ * bytes must be readable at *in.
+ *
+ * \param in
+ *      data array pointer to read the data back from and increment.
+ * \param packResult
+ *      special 4-bit code returned from packXor()
+ */
+inline uint64_t unpackXor(const char** in, uint8_t packResult) {
+  // Mask of the bytes stored for each special code and the shift that
+  // restores the position of the high bytes
+  static constexpr uint64_t masks[16] = {0,
+                                         0xffULL,
+                                         0xffffULL,
+                                         0xffffffULL,
+                                         0xffffffffULL,
+                                         0xffffffffffULL,
+                                         0xffffffffffffULL,
+                                         0xffffffffffffffULL,
+                                         ~0ULL,
+                                         0xffULL,
+                                         0xffffULL,
+                                         0xffffffULL,
+                                         0xffffffffULL,
+                                         0xffffffffffULL,
+                                         0xffffffffffffULL,
+                                         0xffffffffffffffULL};
+  static constexpr uint8_t packedBytes[16] = {0, 1, 2, 3, 4, 5, 6, 7,
+                                              8, 1, 2, 3, 4, 5, 6, 7};
+  static constexpr uint8_t shifts[16] = {0,  0,  0,  0,  0,  0,  0,  0,
+                                         0, 56, 48, 40, 32, 24, 16, 8};
+
+  uint64_t packed;
+  std::memcpy(&packed, *in, sizeof(uint64_t));
+  (*in) += packedBytes[packResult & 0xf];
+
+  return (packed & masks[packResult & 0xf]) << shifts[packResult & 0xf];
+}
+
+/**
+ * Number of bytes used to represent the values encoded with a TwoNibbles,
+ * indexed by its byte representation (see getSizeOfPackedValues()).
+ */
+struct PackedSizes {
+  uint8_t ofPair[256];
+  uint8_t ofFirst[16];
+
+  static constexpr uint8_t ofNibble(int nibble) {
+    if (nibble == 0) return 16;
+    return static_cast<uint8_t>(nibble > 8 ? nibble - 8 : nibble);
+  }
+
+  constexpr PackedSizes() : ofPair(), ofFirst() {
+    for (int i = 0; i < 256; ++i)
+      ofPair[i] = static_cast<uint8_t>(ofNibble(i & 0xf) + ofNibble(i >> 4));
+    for (int i = 0; i < 16; ++i) ofFirst[i] = ofNibble(i);
+  }
+};
+inline constexpr PackedSizes packedSizes;
+
 /**
  * Given a stream of nibbles, return the total number of bytes used to represent
  * the values encoded with the nibbles.
@@ -293,27 +457,130 @@ unpack(const char** in, uint8_t packNibble) {
  */
 inline static uint32_t getSizeOfPackedValues(const TwoNibbles* nibbles,
                                              uint32_t numNibbles) {
+  // The first nibble occupies the low bits of each byte
+  const auto* pairs = reinterpret_cast<const uint8_t*>(nibbles);
+
   uint32_t size = 0;
-  for (uint32_t i = 0; i < numNibbles / 2; ++i) {
-    size += nibbles[i].first + nibbles[i].second;
-    if (nibbles[i].first == 0) size += 16;
-    if (nibbles[i].first > 0x8) size -= 8;
-    if (nibbles[i].second == 0) size += 16;
-    if (nibbles[i].second > 0x8) size -= 8;
-  }
+  for (uint32_t i = 0; i < numNibbles / 2; ++i)
+    size += packedSizes.ofPair[pairs[i]];
 
-  if (numNibbles & 0x1) {
-    size += nibbles[numNibbles / 2].first;
-    if (nibbles[numNibbles / 2].first == 0) size += 16;
-    if (nibbles[numNibbles / 2].first > 0x8) size -= 8;
-  }
+  if (numNibbles & 0x1)
+    size += packedSizes.ofFirst[pairs[numNibbles / 2] & 0xf];
 
   return size;
 }
 
+/**
+ * Version of the encoding of packVByte() recorded in the payload of the
+ * Log::VBYTE_ARGUMENTS extension of the log sites using it. Decoders reject
+ * log sites with a version they do not know.
+ */
+static constexpr uint8_t VBYTE_VERSION = 1;
+
+/**
+ * Number of bytes beyond the last value that packVByte() may write to and
+ * that unpackVByte() may read from, since they move 16 bytes at a time.
+ */
+static constexpr size_t VBYTE_SLACK = 16;
+
+/**
+ * Returns the code of a value stored by packVByte() in numBytes bytes,
+ * negated if indicated. These codes are the lower bounds passed to
+ * packVByte() as well as the codes it stores.
+ */
+constexpr uint8_t vbyteCode(int numBytes, bool negated = false) {
+  return static_cast<uint8_t>((numBytes - 1) | (negated ? 0x8 : 0));
+}
+
+/**
+ * Returns the number of bytes of a value stored by packVByte() with a code.
+ */
+constexpr int vbyteBytes(uint8_t code) { return (code & 0x7) + 1; }
+
+/**
+ * Returns true if a value stored by packVByte() with a code is negated.
+ */
+constexpr bool vbyteNegated(uint8_t code) { return (code & 0x8) != 0; }
+
+/**
+ * Least number of values for which packVByte() is faster than storing them
+ * one by one with packVByteValue() at positions known at compile time.
+ */
+static constexpr int VBYTE_MIN_GATHERED = 32;
+
+/**
+ * Stores a single value as packVByte() does and bumps the buffer pointer.
+ * As with pack(), sizeof(uint64_t) bytes must be writable at *buffer.
+ *
+ * \param[in/out] buffer
+ *      char array pointer used to store the value and bump
+ * \param value
+ *      Value to store; negative integers are passed as their magnitude
+ * \param minCode
+ *      Code giving the least number of bytes to store the value in and
+ *      whether it is negated (see packVByte())
+ *
+ * \return
+ *      The vbyteCode() of the value
+ */
+inline uint8_t packVByteValue(char** buffer, uint64_t value, uint8_t minCode) {
+  int bytesCode = ((71 - __builtin_clzll(value | 1)) >> 3) - 1;
+  if (bytesCode < (minCode & 0x7)) bytesCode = minCode & 0x7;
+
+  std::memcpy(*buffer, &value, sizeof(uint64_t));
+  *buffer += bytesCode + 1;
+
+  return static_cast<uint8_t>(bytesCode | (minCode & 0x8));
+}
+
+/**
+ * Stores a series of values in the fewest bytes each, along with one 4-bit
+ * code per value (see vbyteCode()). All the codes come first, two per byte
+ * with the first in the low bits, and are followed by the values. The codes
+ * and values are computed and shuffled into place four at a time with AVX2
+ * if the processor supports it.
+ *
+ * \param values
+ *      Values to store; negative integers are passed as their magnitude
+ * \param minCodes
+ *      Code of each value giving the least number of bytes to store it in
+ *      (i.e. 4 for floats, 8 for doubles) and whether it is negated
+ * \param numValues
+ *      Number of values to store
+ * \param out
+ *      Buffer to store the codes and values to, VBYTE_SLACK bytes of which
+ *      beyond the last value may be overwritten
+ *
+ * \return
+ *      Pointer to the first byte beyond the last value in out
+ */
+char* packVByte(const uint64_t* values, const uint8_t* minCodes,
+                int numValues, char* out);
+
+/**
+ * Inverse of packVByte(). The values are unshuffled two at a time with SSSE3
+ * if the processor supports it, so VBYTE_SLACK bytes beyond the last value
+ * must be readable.
+ *
+ * \param in
+ *      The codes and values stored by packVByte()
+ * \param numValues
+ *      Number of values stored
+ * \param[out] values
+ *      Storage for numValues values, the negated ones being negated back
+ *      (modulo 2^64)
+ *
+ * \return
+ *      Pointer to the first byte beyond the last value in the input
+ */
+const char* unpackVByte(const char* in, int numValues, uint64_t* values);
+
 /**
  * This class takes in a data stream of pack() Nibbles followed by pack()'ed
- * values as produced by the compressor and unpack()'s them one by one.
+ * values as produced by the compressor and unpack()'s them one by one. The
+ * integers are read with unpackWord(), so sizeof(uint64_t) bytes beyond the
+ * last pack()-ed value must be readable. Streams produced by packVByte() are
+ * unpacked upfront instead, which requires VBYTE_SLACK readable bytes.
  */
 class Nibbler {
   PRIVATE :
@@ -329,6 +596,21 @@ class Nibbler {
   // End of the last valid packed value
   const char* endOfValues;
 
+  // Previous value (or bits) of the next value in the stream if any of the
+  // values are encoded relative to it, or nullptr if all are pack()-ed as is
+  uint64_t* deltaBase;
+
+  // Indicates whether the integers are encoded as zigzagDelta()s
+  bool deltaIntegers;
+
+  // Bit mask of the remaining values, starting from the next one, that are
+  // doubles encoded as packXor()s
+  uint64_t xorDoubles;
+
+  // Next value unpacked by unpackVByte() if the stream was produced by
+  // packVByte(), or nullptr if the values are pack()-ed
+  const uint64_t* vbyteValue;
+
  public:
   /**
    * Nibbler Constructor
@@ -337,14 +619,37 @@ class Nibbler {
    *      Data stream consisting of the Nibbles followed by pack()ed values.
    * \param numNibbles
    *      Number of nibbles in the data stream
+   * \param deltaBases
+   *      If any of the values in the stream are encoded relative to the
+   *      previous value, the previous value (or bits) of each of the
+   *      numNibbles values, which is updated as the values are read; nullptr
+   *      otherwise.
+   * \param deltaIntegers
+   *      True if the integers in the stream are encoded as zigzagDelta()s
+   * \param xorDoubles
+   *      Bit mask of the values in the stream that are doubles encoded as
+   *      packXor()s, the n-th bit standing for the n-th value
+   * \param vbyteValues
+   *      If the stream was produced by packVByte() (see
+   *      Log::VBYTE_ARGUMENTS), storage for numNibbles values into which
+   *      they are unpacked; nullptr if the values are pack()-ed.
    */
-  Nibbler(const char* nibbleStart, int numNibbles)
+  Nibbler(const char* nibbleStart, int numNibbles,
+          uint64_t* deltaBases = nullptr, bool deltaIntegers = false,
+          uint64_t xorDoubles = 0, uint64_t* vbyteValues = nullptr)
       : nibblePosition(reinterpret_cast<const TwoNibbles*>(nibbleStart)),
         onFirstNibble(true),
         currPackedValue(nibbleStart + (numNibbles + 1) / 2),
-        endOfValues(nullptr) {
-    endOfValues = nibbleStart + (numNibbles + 1) / 2 +
-                  getSizeOfPackedValues(nibblePosition, numNibbles);
+        endOfValues(nullptr),
+        deltaBase(deltaBases),
+        deltaIntegers(deltaIntegers && deltaBases != nullptr),
+        xorDoubles(deltaBases != nullptr ? xorDoubles : 0),
+        vbyteValue(vbyteValues) {
+    if (vbyteValues != nullptr)
+      endOfValues = unpackVByte(nibbleStart, numNibbles, vbyteValues);
+    else
+      endOfValues = nibbleStart + (numNibbles + 1) / 2 +
+                    getSizeOfPackedValues(nibblePosition, numNibbles);
   }
 
   /**
@@ -362,8 +667,48 @@ class Nibbler {
     uint8_t nibble =
         (onFirstNibble) ? nibblePosition->first : nibblePosition->second;
 
-    T ret = unpack<T>(&currPackedValue, nibble);
-
+    T ret;
+    if (vbyteValue != nullptr) {
+      uint64_t value = *vbyteValue++;
+      if constexpr (std::is_floating_point<T>::value) {
+        // Floats are the only values stored in 4 bytes by compressSiteVByte()
+        if (vbyteBytes(nibble) == sizeof(float)) {
+          float single;
+          std::memcpy(&single, &value, sizeof(float));
+          ret = single;
+        } else {
+          double promoted;
+          std::memcpy(&promoted, &value, sizeof(double));
+          ret = promoted;
+        }
+      } else if constexpr (std::is_pointer<T>::value) {
+        ret = reinterpret_cast<T>(value);
+      } else {
+        ret = static_cast<T>(value);
+      }
+    } else if constexpr (std::is_same<T, double>::value) {
+      if (xorDoubles & 0x1) {
+        *deltaBase ^= unpackXor(&currPackedValue, nibble);
+        std::memcpy(&ret, deltaBase, sizeof(double));
+      } else {
+        ret = unpack<T>(&currPackedValue, nibble);
+      }
+    } else if constexpr (std::is_floating_point<T>::value) {
+      ret = unpack<T>(&currPackedValue, nibble);
+    } else if constexpr (std::is_integral<T>::value) {
+      if (deltaIntegers) {
+        *deltaBase = unzigzagDelta(
+            unpackWord<uint64_t>(&currPackedValue, nibble), *deltaBase);
+        ret = static_cast<T>(*deltaBase);
+      } else {
+        ret = unpackWord<T>(&currPackedValue, nibble);
+      }
+    } else {
+      ret = unpackWord<T>(&currPackedValue, nibble);
+    }
+
+    if (deltaBase != nullptr) ++deltaBase;
+    xorDoubles >>= 1;
     if (!onFirstNibble) ++nibblePosition;
 
     onFirstNibble = !onFirstNibble;
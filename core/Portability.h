@@ -27,6 +27,22 @@
 #define NANOLOG_PACK_POP
 #endif
 
+// glibc 2.35+ registers a restartable sequences (rseq) area for every thread,
+// which the kernel keeps updated with the CPU the thread runs on
+#if defined(__GNUC__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#define NANOLOG_HAS_RSEQ 1
+#else
+#define NANOLOG_HAS_RSEQ 0
+#endif
+
+// SSSE3 and AVX2 code paths are compiled with per-function target attributes
+// and selected at runtime, so the build may still target baseline x86-64
+#if defined(__GNUC__) && defined(__x86_64__)
+#define NANOLOG_HAS_X86_SIMD 1
+#else
+#define NANOLOG_HAS_X86_SIMD 0
+#endif
+
 #if _MSC_VER
 
 #ifdef _USE_ATTRIBUTES_FOR_SAL
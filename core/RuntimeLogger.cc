@@ -16,9 +16,16 @@
 #include "RuntimeLogger.h"
 
 #include <fcntl.h>
+#include <link.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <iosfwd>
 #include <iostream>
 #include <locale>
@@ -27,39 +34,178 @@
 
 #include "Config.h"
 #include "Cycles.h" /* Cycles::rdtsc() */
+#include "NanoLogCpp17.h"
 #include "Util.h"
 
 namespace NanoLogInternal {
 
 // Define the static members of RuntimeLogger here
 __thread RuntimeLogger::StagingBuffer* RuntimeLogger::stagingBuffer = nullptr;
+__thread RuntimeLogger::PriorityLane* RuntimeLogger::priorityLane = nullptr;
+__thread RuntimeLogger::CpuBuffer* RuntimeLogger::heldCpuBuffer = nullptr;
+__thread RuntimeLogger::StagingBuffer* RuntimeLogger::lastCpuBuffer = nullptr;
+__thread uint64_t RuntimeLogger::lastCpuSequence = 0;
+__thread RuntimeLogger::StagingBuffer*
+    RuntimeLogger::channelBuffers[NanoLogConfig::MAX_CHANNELS] = {};
+__thread RuntimeLogger::PriorityLane*
+    RuntimeLogger::channelLanes[NanoLogConfig::MAX_CHANNELS] = {};
+__thread RuntimeLogger* RuntimeLogger::activeChannel = nullptr;
+__thread RuntimeLogger* RuntimeLogger::channelBeingPolled = nullptr;
 thread_local RuntimeLogger::StagingBufferDestroyer RuntimeLogger::sbc;
+__thread RuntimeLogger::DynamicLogSite* RuntimeLogger::dynamicLogSiteCache
+    [NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE] = {};
+__thread RuntimeLogger::DynamicLogSite* RuntimeLogger::overflowLogSiteCache
+    [NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE] = {};
 RuntimeLogger RuntimeLogger::nanoLogSingleton;
+std::atomic<RuntimeLogger*> RuntimeLogger::channels
+    [NanoLogConfig::MAX_CHANNELS] = {&RuntimeLogger::nanoLogSingleton};
+std::mutex RuntimeLogger::channelMutex;
 size_t LoggerThreadId =
     std::getenv("LOGGER_THREAD_ID") ? atoi(std::getenv("LOGGER_THREAD_ID")) : 0;
 
+// Indicates that a completed write to the log file is already on disk;
+// otherwise persisting log records requires an additional fdatasync()
+static constexpr bool writesAreDurable =
+    (NanoLogConfig::FILE_PARAMS & (O_DSYNC | O_SYNC)) != 0;
+
+// Fatal signals handled once installCrashHandler() is invoked and their prior
+// dispositions, which are restored before the signals are re-raised
+static const int crashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+static struct sigaction previousCrashActions[Util::arraySize(crashSignals)];
+static bool crashHandlerInstalled = false;
+
+// Set once a thread receives a fatal signal and once it has written out the
+// pending log messages; threads that crash concurrently wait for the latter
+static std::atomic<bool> crashDrainStarted(false);
+static std::atomic<bool> crashDrainCompleted(false);
+
+// How the background threads of all channels wait for work while idle (see
+// NanoLog::setWakeupPolicy())
+static std::atomic<WakeupPolicy> wakeupPolicy(WAKEUP_POLL);
+
+// Indicates that the process is registered for expedited membarrier()s,
+// which the doorbell and the activeBuffers rely on to spare the logging
+// threads a fence
+static std::atomic<bool> membarrierRegistered(false);
+
+/**
+ * Registers the process for expedited membarrier()s upon the first
+ * invocation.
+ *
+ * \return
+ *      True if the process is registered
+ */
+static bool registerMembarrier() {
+  static const bool registered =
+      syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0,
+              0) == 0;
+  membarrierRegistered = registered;
+  return registered;
+}
+
+// Order in which the background threads of all channels compress the
+// StagingBuffers (see NanoLog::setScanPolicy())
+static std::atomic<ScanPolicy> scanPolicy(SCAN_ROUND_ROBIN);
+
+// Indicates that channels are created without a background thread (see
+// NanoLog::enableEmbeddedMode())
+static std::atomic<bool> embeddedMode(false);
+
 // RuntimeLogger constructor
 RuntimeLogger::RuntimeLogger()
+    : RuntimeLogger(PRIMARY_CHANNEL, "", NanoLogConfig::DEFAULT_LOG_FILE) {}
+
+/**
+ * Constructs the RuntimeLogger of a channel.
+ *
+ * \param channel
+ *      Channel of the RuntimeLogger
+ * \param name
+ *      Name of the channel
+ * \param filename
+ *      Log file of the channel
+ *
+ * \throw std::ios_base::failure
+ *      if the log file of a channel other than the primary channel cannot be
+ *      opened or created
+ */
+RuntimeLogger::RuntimeLogger(Channel channel, const char* name,
+                             const char* filename)
     : threadBuffers(),
+      priorityLanes(),
+      numPriorityLanes(0),
+      cpuBuffers(nullptr),
+      numCpuBuffers(0),
       nextBufferId(),
       bufferMutex(),
+      bufferRegistry(new BufferRegistry(std::vector<StagingBuffer*>())),
+      activeBuffers(),
+      freeBufferSlots(),
+      registryEpoch(1),
+      scanEpoch(0),
+      retiredRegistries(),
+      reclaimedEpoch(1),
+      idleSlots(),
+      numIdleBufferClears(0),
+      channel(channel),
+      channelName(name),
       compressionThread(),
+      compressionState(nullptr),
+      embedded(false),
+      pollMutex(),
+      pollInProgress(false),
       hasOutstandingOperation(false),
       compressionThreadShouldExit(false),
       syncStatus(SYNC_COMPLETED),
+      syncRequestsIssued(0),
+      syncRoundTarget(0),
+      syncRequestsCompleted(0),
+      syncPromises(),
+      numSyncRounds(0),
       condMutex(),
       workAdded(),
       hintSyncCompleted(),
+      numPersistenceWaiters(0),
+      doorbell(0),
       outputFd(-1),
       aioCb(),
       compressingBuffer(nullptr),
       outputDoubleBuffer(nullptr),
       currentLogLevel(INF),
+      logLevelMutex(),
+      configuredLogLevel(INF),
+      degradedLogLevel(NUM_LOG_LEVELS),
+      governorEngaged(false),
+      numGovernorEngagements(0),
+      priorityLaneLevel(SILENT_LOG_LEVEL),
+      priorityBytesRead(0),
+      producerCompression(false),
+      compressionHelpers(),
+      numCompressionThreads(1),
+      maxCompressionThreads(1),
+      nextCompressionThreadStart(0),
+      helperClaims(0),
+      handoffQueue(),
+      numHandoffs(0),
+      handoffMutex(),
+      helpersShouldExit(false),
+      persistedDictionaryEntries(0),
+      crashDrainState(CRASH_DRAIN_IDLE),
+      logFileGeneration(0),
+      metricEpoch(0),
+      metricMembarrier(false),
+      metricMutex(),
+      metricsPending(false),
+      metricBuffer(nullptr),
       cycleAtThreadStart(0),
       cyclesAtLastAIOStart(0),
       cyclesActive(0),
       cyclesCompressing(0),
       stagingBufferPeekDist(),
+      numUrgentServices(0),
+      numBlockedServices(0),
+      numQuotaCutoffs(0),
+      urgentBuffers(),
       cyclesScanningAndCompressing(0),
       cyclesDiskIO_upperBound(0),
       totalBytesRead(0),
@@ -70,12 +216,31 @@ RuntimeLogger::RuntimeLogger()
       coreId(-1),
       registrationMutex(),
       invocationSites(),
-      nextInvocationIndexToBePersisted(0) {
+      nextInvocationIndexToBePersisted(0),
+      siteExtensions(),
+      moduleMapMutex(),
+      moduleMapsEnabled(false),
+      moduleMapLoadCount(0),
+      dynamicLogSiteMutex(),
+      dynamicLogSites(),
+      preformattedLogSites(),
+      dynamicLogSiteIndex(),
+      dynamicLogSiteCacheMisses(0),
+      dynamicLogSiteOverflows(0) {
   for (size_t i = 0; i < Util::arraySize(stagingBufferPeekDist); ++i)
     stagingBufferPeekDist[i] = 0;
 
-  const char* filename = NanoLogConfig::DEFAULT_LOG_FILE;
   outputFd = open(filename, NanoLogConfig::FILE_PARAMS, 0666);
+  if (outputFd < 0 && channel != PRIMARY_CHANNEL) {
+    std::string err = "Unable to open log file of channel '";
+    err.append(name);
+    err.append("' (");
+    err.append(filename);
+    err.append("): ");
+    err.append(strerror(errno));
+    throw std::ios_base::failure(err);
+  }
+
   if (outputFd < 0) {
     fprintf(stderr,
             "NanoLog could not open the default file location "
@@ -106,33 +271,84 @@ RuntimeLogger::RuntimeLogger()
     std::exit(-1);
   }
 
-  compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
-
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  CPU_SET(LoggerThreadId, &cpuset);
-  if (int rc = pthread_setaffinity_np(compressionThread.native_handle(),
-                                      sizeof(cpu_set_t), &cpuset);
-      rc != 0) {
-    throw std::ios_base::failure("Error calling pthread_setaffinity_np: " +
-                                 std::to_string(rc));
+  // Setting NANOLOG_EMBEDDED_MODE keeps the background thread from starting
+  // in the first place (see NanoLog::enableEmbeddedMode())
+  if (channel == PRIMARY_CHANNEL && std::getenv("NANOLOG_EMBEDDED_MODE"))
+    embeddedMode = true;
+
+  if (embeddedMode) {
+    embedded = true;
+    cycleAtThreadStart = PerfUtils::Cycles::rdtsc();
+  } else {
+    compressionThread =
+        std::thread(&RuntimeLogger::compressionThreadMain, this);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(LoggerThreadId, &cpuset);
+    if (int rc = pthread_setaffinity_np(compressionThread.native_handle(),
+                                        sizeof(cpu_set_t), &cpuset);
+        rc != 0) {
+      throw std::ios_base::failure("Error calling pthread_setaffinity_np: " +
+                                   std::to_string(rc));
+    }
   }
-  pthread_setname_np(pthread_self(), "logger");
+  if (channel == PRIMARY_CHANNEL) pthread_setname_np(pthread_self(), "logger");
 }
 
 // RuntimeLogger destructor
 RuntimeLogger::~RuntimeLogger() {
-  sync();
+  // The other channels are shut down along with the primary channel
+  if (this == &nanoLogSingleton) {
+    for (uint32_t i = 1; i < NanoLogConfig::MAX_CHANNELS; ++i)
+      delete channels[i].exchange(nullptr);
+  }
+
+  // Stage the metric aggregates of the threads still running, waiting for
+  // the metricBuffer to drain as necessary
+  if (this == &nanoLogSingleton) {
+    while (!collectMetrics(false)) sync_internal();
+    bool collected = collectMetrics(true);
+    while (!collected) {
+      sync_internal();
+      collected = collectMetrics(false);
+    }
+  }
+
+  sync_internal();
 
-  // Stop the compression thread
+  // Stop the additional compression threads, whose output is collected by
+  // the background thread before it exits
+  helpersShouldExit = true;
+  for (CompressionHelper* helper : compressionHelpers) {
+    if (helper->thread.joinable()) helper->thread.join();
+  }
+  numCompressionThreads = 1;
+
+  stopCompressionThread();
+
+  // In embedded mode, the remaining output is written out by this thread
   {
-    std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
-    nanoLogSingleton.compressionThreadShouldExit = true;
-    nanoLogSingleton.workAdded.notify_all();
+    std::lock_guard<std::mutex> lock(pollMutex);
+    while (compressionState != nullptr &&
+           (compressionState->encoder.getEncodedBytes() > 0 ||
+            hasOutstandingOperation))
+      compressionStep(*compressionState, NO_DEADLINE, true);
+
+    delete compressionState;
+    compressionState = nullptr;
   }
 
-  if (nanoLogSingleton.compressionThread.joinable())
-    nanoLogSingleton.compressionThread.join();
+  for (CompressionHelper* helper : compressionHelpers) delete helper;
+  compressionHelpers.clear();
+
+  // The compression threads no longer refer to the retired BufferRegistries
+  for (RetiredRegistry& retired : retiredRegistries) {
+    delete retired.registry;
+    delete retired.removed;
+  }
+  retiredRegistries.clear();
+  delete bufferRegistry.exchange(nullptr);
 
   // Free all the data structures
   if (compressingBuffer) {
@@ -199,6 +415,14 @@ std::string RuntimeLogger::getStats() {
            100.0 * secondsAwake / secondsThreadHasBeenAlive);
   out << buffer;
 
+  uint32_t numCompressionThreads = nanoLogSingleton.numCompressionThreads;
+  if (numCompressionThreads > 1) {
+    snprintf(buffer, 1024,
+             "%u additional compression threads were started to keep up\r\n",
+             numCompressionThreads - 1);
+    out << buffer;
+  }
+
   snprintf(buffer, 1024,
            "On average, that's\r\n\t%0.2lf MB/s or "
            "%0.2lf ns/byte w/ processing\r\n",
@@ -237,6 +461,37 @@ std::string RuntimeLogger::getStats() {
            nanoLogSingleton.padBytesWritten);
   out << buffer;
 
+  size_t numDynamicLogSites;
+  {
+    std::lock_guard<std::mutex> lock(nanoLogSingleton.dynamicLogSiteMutex);
+    numDynamicLogSites = nanoLogSingleton.dynamicLogSites.size();
+  }
+
+  snprintf(buffer, 1024,
+           "Runtime format strings used %lu of %u dynamic log sites "
+           "(%lu cache misses, %lu formatted on the logging thread)\r\n",
+           numDynamicLogSites, NanoLogConfig::MAX_DYNAMIC_LOG_SITES,
+           nanoLogSingleton.dynamicLogSiteCacheMisses.load(),
+           nanoLogSingleton.dynamicLogSiteOverflows.load());
+  out << buffer;
+
+  snprintf(buffer, 1024,
+           "The back-pressure governor engaged %u times and is %s\r\n",
+           nanoLogSingleton.numGovernorEngagements,
+           nanoLogSingleton.governorEngaged ? "engaged" : "not engaged");
+  out << buffer;
+
+  snprintf(buffer, 1024,
+           "%lu bytes were consumed from the priority lanes ahead of the "
+           "StagingBuffers\r\n",
+           nanoLogSingleton.priorityBytesRead);
+  out << buffer;
+
+  snprintf(buffer, 1024, "%lu sync requests were served in %lu sync rounds\r\n",
+           nanoLogSingleton.syncRequestsCompleted,
+           nanoLogSingleton.numSyncRounds);
+  out << buffer;
+
   return out.str();
 }
 
@@ -263,6 +518,20 @@ std::string RuntimeLogger::getHistograms() {
     out << buffer;
   }
 
+  bool fillPriority = scanPolicy.load() == SCAN_FILL_PRIORITY;
+  snprintf(buffer, 1024,
+           "Scan policy: %s\r\n"
+           "\tServiced ahead of the pass : %lu "
+           "(%lu with a blocked producer)\r\n"
+           "\tCut short by the quota     : %lu\r\n"
+           "\tIdle buffers skipped       : %lu\r\n",
+           (fillPriority) ? "fill priority" : "round-robin",
+           nanoLogSingleton.numUrgentServices,
+           nanoLogSingleton.numBlockedServices,
+           nanoLogSingleton.numQuotaCutoffs,
+           nanoLogSingleton.numIdleBufferClears);
+  out << buffer;
+
   {
     std::unique_lock<std::mutex> lock(nanoLogSingleton.bufferMutex);
     for (size_t i = 0; i < nanoLogSingleton.threadBuffers.size(); ++i) {
@@ -311,6 +580,352 @@ void RuntimeLogger::preallocate() {
   // the user is already willing to invoke this up front cost.
 }
 
+/**
+ * Checks whether a printf conversion may be applied to an argument.
+ *
+ * \param kind
+ *      ArgumentKind of the argument
+ * \param length
+ *      Length modifier of the conversion (i.e. "l" or "ll"), if any
+ * \param conversion
+ *      Conversion character of the format specifier (i.e. 'd' or 's')
+ *
+ * \return
+ *      true if the conversion matches the argument
+ */
+static bool conversionMatches(RuntimeLogger::ArgumentKind kind,
+                              const char* length, char conversion) {
+  bool isLong = *length == 'l' || *length == 'j' || *length == 'z' ||
+                *length == 't' || *length == 'L';
+
+  switch (conversion) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      return kind == (isLong ? RuntimeLogger::LONG_ARGUMENT
+                             : RuntimeLogger::INT_ARGUMENT);
+    case 'c':
+      return kind == RuntimeLogger::INT_ARGUMENT;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+    case 'A':
+      return kind == (*length == 'L' ? RuntimeLogger::LONG_DOUBLE_ARGUMENT
+                                     : RuntimeLogger::DOUBLE_ARGUMENT);
+    case 'p':
+      return kind == RuntimeLogger::POINTER_ARGUMENT ||
+             kind == RuntimeLogger::STRING_ARGUMENT ||
+             kind == RuntimeLogger::WIDE_STRING_ARGUMENT;
+    case 's':
+      return kind == (*length == 'l' ? RuntimeLogger::WIDE_STRING_ARGUMENT
+                                     : RuntimeLogger::STRING_ARGUMENT);
+    default:
+      return false;
+  }
+}
+
+/**
+ * Parses a format string only known at runtime and checks it against the
+ * arguments passed in with it.
+ *
+ * \param format
+ *      printf format string to parse
+ * \param numArgs
+ *      Number of arguments passed in with the format string
+ * \param argumentKinds
+ *      ArgumentKind of the n-th argument
+ * \param[out] paramTypes
+ *      Populated with the ParamType of the n-th format parameter
+ *
+ * \return
+ *      true if the format string is valid and matches the arguments
+ */
+static bool parseRuntimeFormat(
+    const char* format, int numArgs,
+    const RuntimeLogger::ArgumentKind* argumentKinds,
+    std::vector<ParamType>& paramTypes) {
+  int length = downCast<int>(strlen(format) + 1);
+
+  try {
+    for (int i = 0;; ++i) {
+      ParamType type = getParamInfo(format, length, i);
+      if (type == ParamType::INVALID) break;
+      paramTypes.push_back(type);
+    }
+  } catch (const std::invalid_argument&) {
+    return false;
+  }
+
+  if (paramTypes.size() != static_cast<size_t>(numArgs)) return false;
+
+  // Formatting an argument with the conversion of another kind is undefined
+  // behavior (i.e. a double passed to "%d" or an int to "%s"). The
+  // specifiers were validated above, so they are only skimmed here.
+  int argNum = 0;
+  for (const char* c = format; *c != '\0'; ++c) {
+    if (*c != '%') continue;
+    if (*++c == '%') continue;
+
+    while (isFlag(*c)) ++c;
+    if (*c == '*') {
+      if (argumentKinds[argNum++] != RuntimeLogger::INT_ARGUMENT) return false;
+      ++c;
+    }
+    while (isDigit(*c)) ++c;
+
+    if (*c == '.') {
+      ++c;
+      if (*c == '*') {
+        if (argumentKinds[argNum++] != RuntimeLogger::INT_ARGUMENT)
+          return false;
+        ++c;
+      }
+      while (isDigit(*c)) ++c;
+    }
+
+    const char* length = c;
+    while (isLength(*c)) ++c;
+    if (!conversionMatches(argumentKinds[argNum++], length, *c)) return false;
+  }
+
+  return true;
+}
+
+/**
+ * Slow path of getDynamicLogId() that finds or creates the dynamic log site
+ * under the global lock and installs it in the thread-local cache. Once all
+ * MAX_DYNAMIC_LOG_SITES are assigned, new format strings are given a site
+ * private to the calling thread instead, so that subsequent invocations are
+ * still served out of the thread-local cache.
+ *
+ * \param preformatted
+ *      True if the site is for getPreformattedLogId(), in which case it is
+ *      created regardless of the MAX_DYNAMIC_LOG_SITES
+ *
+ * \return
+ *      The dynamic log site, whose logId is DYNAMIC_LOG_SITES_EXHAUSTED if
+ *      all MAX_DYNAMIC_LOG_SITES have been assigned and the format string
+ *      would be valid for a new site.
+ */
+RuntimeLogger::DynamicLogSite* RuntimeLogger::lookupDynamicLogSite(
+    uint64_t hash, const char* filename, uint32_t linenum, LogLevel severity,
+    const char* format, StaticLogInfo::CompressionFn compressionFn,
+    int numArgs, const ArgumentKind* argumentKinds, bool preformatted) {
+  uint64_t cacheIndex = hash & (NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE - 1);
+  DynamicLogSite*& cacheEntry = dynamicLogSiteCache[cacheIndex];
+  dynamicLogSiteCacheMisses.fetch_add(1, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(dynamicLogSiteMutex);
+  auto range = dynamicLogSiteIndex.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->matches(hash, filename, linenum, severity, format,
+                            compressionFn)) {
+      cacheEntry = it->second;
+      return cacheEntry;
+    }
+  }
+
+  std::vector<ParamType> paramTypes;
+  bool valid = parseRuntimeFormat(format, numArgs, argumentKinds, paramTypes);
+
+  if (!preformatted &&
+      dynamicLogSites.size() >= NanoLogConfig::MAX_DYNAMIC_LOG_SITES) {
+    // Invalid format strings must never be passed to snprintf(), so they
+    // keep their DYNAMIC_LOG_SITE_INVALID
+    DynamicLogSite*& overflowEntry = overflowLogSiteCache[cacheIndex];
+    delete overflowEntry;
+    overflowEntry = new DynamicLogSite(hash, filename, linenum, severity,
+                                       format, compressionFn);
+    overflowEntry->paramTypes = std::move(paramTypes);
+    overflowEntry->logId =
+        (valid) ? DYNAMIC_LOG_SITES_EXHAUSTED : DYNAMIC_LOG_SITE_INVALID;
+
+    cacheEntry = overflowEntry;
+    return cacheEntry;
+  }
+
+  std::deque<DynamicLogSite>& sites =
+      (preformatted) ? preformattedLogSites : dynamicLogSites;
+  sites.emplace_back(hash, filename, linenum, severity, format, compressionFn);
+  DynamicLogSite* site = &sites.back();
+  site->paramTypes = std::move(paramTypes);
+  site->logId = DYNAMIC_LOG_SITE_INVALID;
+
+  if (valid) {
+    int numNibbles = 0;
+    for (ParamType type : site->paramTypes) {
+      if (type == ParamType::NON_STRING ||
+          type == ParamType::DYNAMIC_WIDTH ||
+          type == ParamType::DYNAMIC_PRECISION)
+        ++numNibbles;
+    }
+
+    StaticLogInfo info(compressionFn, filename, linenum, severity,
+                       site->format.c_str(), numArgs, numNibbles,
+                       site->paramTypes.data());
+    site->logId = UNASSIGNED_LOGID;
+    registerInvocationSite_internal(site->logId, info);
+  }
+
+  dynamicLogSiteIndex.emplace(hash, site);
+  cacheEntry = site;
+  return site;
+}
+
+/**
+ * Persists a table mapping enum values to names in the dictionary. Arguments
+ * bound to the table are logged as integers and rendered by name by the
+ * decompressor. Entries that do not fit into a single SiteExtension are
+ * dropped.
+ *
+ * \param name
+ *      Name of the table; must have a static lifetime
+ * \param entries
+ *      Enum values and their names
+ *
+ * \return
+ *      Identifier of the table, to be used in Log::EnumBindings
+ */
+int RuntimeLogger::registerEnumTable(
+    const char* name,
+    const std::vector<std::pair<int64_t, std::string>>& entries) {
+  std::string table;
+  for (const auto& entry : entries) {
+    if (table.size() + sizeof(int64_t) + entry.second.size() + 1 >
+        Log::MAX_SITE_EXTENSION_PAYLOAD)
+      break;
+
+    table.append(reinterpret_cast<const char*>(&entry.first), sizeof(int64_t));
+    table.append(entry.second.c_str(), entry.second.size() + 1);
+  }
+
+  std::string extensions;
+  Log::appendSiteExtension(extensions, Log::ENUM_TABLE, table);
+
+  // The table is stored as a log site that is never logged
+  int tableId = UNASSIGNED_LOGID;
+  StaticLogInfo info(nullptr, name, 0, LogLevels::SILENT_LOG_LEVEL, "", 0, 0,
+                     nullptr);
+  nanoLogSingleton.registerInvocationSite_internal(tableId, info, extensions);
+  return tableId;
+}
+
+/**
+ * Returns the identifier of the built-in table mapping errno values to
+ * their names and descriptions, registering it upon first use.
+ */
+int RuntimeLogger::getErrnoTableId() {
+  static const int errnoTableId = []() {
+    std::vector<std::pair<int64_t, std::string>> entries;
+    for (int err = 1; err < 256; ++err) {
+      const char* name = strerrorname_np(err);
+      if (name == nullptr) continue;
+
+      entries.emplace_back(err, std::string(name) + " (" +
+                                    strerrordesc_np(err) + ")");
+    }
+
+    return registerEnumTable("errno", entries);
+  }();
+
+  return errnoTableId;
+}
+
+/**
+ * Persists a snapshot of the executable mappings of the process in the
+ * dictionary so that backtraces can be symbolized by the decompressor, and
+ * has the compression thread persist new snapshots as modules are loaded.
+ * This is invoked upon registering the first NANO_LOG_BT() site.
+ */
+void RuntimeLogger::enableModuleMaps() {
+  if (nanoLogSingleton.moduleMapsEnabled.load(std::memory_order_acquire))
+    return;
+
+  nanoLogSingleton.snapshotModuleMaps();
+}
+
+/**
+ * dl_iterate_phdr() callback returning the number of modules ever loaded
+ */
+static int getModuleLoadCount(struct dl_phdr_info* info, size_t,
+                              void* loadCount) {
+  *static_cast<unsigned long long*>(loadCount) = info->dlpi_adds;
+  return 1;
+}
+
+/**
+ * Registers the executable, file-backed mappings listed in /proc/self/maps
+ * as MODULE_MAP dictionary entries, unless no modules were loaded since the
+ * last snapshot.
+ */
+void RuntimeLogger::snapshotModuleMaps() {
+  std::lock_guard<std::mutex> lock(moduleMapMutex);
+
+  unsigned long long loadCount = 0;
+  dl_iterate_phdr(getModuleLoadCount, &loadCount);
+  if (moduleMapsEnabled && loadCount == moduleMapLoadCount) return;
+
+  moduleMapLoadCount = loadCount;
+  moduleMapsEnabled.store(true, std::memory_order_release);
+
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (maps == nullptr) {
+    perror("NanoLog could not read /proc/self/maps to symbolize backtraces");
+    return;
+  }
+
+  std::vector<std::string> payloads(1);
+  char line[4096];
+  while (fgets(line, sizeof(line), maps) != nullptr) {
+    Log::ModuleMapping mapping;
+    char perms[5];
+    int pathStart = 0;
+    if (sscanf(line, "%lx-%lx %4s %lx %*s %*s %n", &mapping.start,
+               &mapping.end, perms, &mapping.offset, &pathStart) < 4 ||
+        perms[2] != 'x' || line[pathStart] != '/')
+      continue;
+
+    std::string path(line + pathStart, strcspn(line + pathStart, "\n"));
+    if (payloads.back().size() + sizeof(mapping) + path.size() + 1 >
+        Log::MAX_SITE_EXTENSION_PAYLOAD)
+      payloads.emplace_back();
+
+    payloads.back().append(reinterpret_cast<const char*>(&mapping),
+                           sizeof(mapping));
+    payloads.back().append(path.c_str(), path.size() + 1);
+  }
+  fclose(maps);
+
+  // Like enum tables, module maps are stored as log sites never logged
+  for (const std::string& payload : payloads) {
+    std::string extensions;
+    Log::appendSiteExtension(extensions, Log::MODULE_MAP, payload);
+
+    int logId = UNASSIGNED_LOGID;
+    StaticLogInfo info(nullptr, "/proc/self/maps", 0,
+                       LogLevels::SILENT_LOG_LEVEL, "", 0, 0, nullptr);
+    registerInvocationSite_internal(logId, info, extensions);
+  }
+}
+
+/**
+ * Returns the bounds of the calling thread's stack.
+ *
+ * \param[out] low
+ *      Lowest address of the stack
+ * \param[out] high
+ *      First address beyond the stack
+ */
+void RuntimeLogger::getThreadStackBounds(uintptr_t* low, uintptr_t* high) {
+  pthread_attr_t attr;
+  void* stackAddr = nullptr;
+  size_t stackSize = 0;
+
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+    pthread_attr_destroy(&attr);
+  }
+
+  *low = reinterpret_cast<uintptr_t>(stackAddr);
+  *high = *low + stackSize;
+}
+
 /**
  * Internal helper function to wait for AIO completion.
  */
@@ -335,11 +950,10 @@ void RuntimeLogger::waitForAIO() {
     }
     ++numAioWritesCompleted;
     hasOutstandingOperation = false;
+    markRecordsPersisted();
 
-    if (syncStatus == WAITING_ON_AIO) {
-      syncStatus = SYNC_COMPLETED;
-      hintSyncCompleted.notify_one();
-    }
+    std::lock_guard<std::mutex> lock(condMutex);
+    if (syncStatus == WAITING_ON_AIO) completeSyncRound();
   }
 }
 
@@ -363,22 +977,32 @@ void RuntimeLogger::setLogFile_internal(const char* filename) {
   }
 
   // Everything seems okay, stop the background thread and change files
-  sync();
+  sync_internal();
 
   // Stop the compression thread completely
-  {
-    std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
-    compressionThreadShouldExit = true;
-    workAdded.notify_all();
-  }
+  stopCompressionThread();
 
-  if (compressionThread.joinable()) compressionThread.join();
+  std::lock_guard<std::mutex> pollLock(pollMutex);
+
+  // In embedded mode, the log messages compressed since the sync() still go
+  // to the old file
+  while (compressionState != nullptr &&
+         (compressionState->encoder.getEncodedBytes() > 0 ||
+          hasOutstandingOperation))
+    compressionStep(*compressionState, NO_DEADLINE, true);
 
   if (outputFd > 0) close(outputFd);
   outputFd = newFd;
 
-  // Relaunch thread
+  // The new file starts over with a checkpoint
+  delete compressionState;
+  compressionState = nullptr;
+
   nextInvocationIndexToBePersisted = 0;  // Reset the dictionary
+  logFileGeneration.fetch_add(1, std::memory_order_release);
+  if (embedded) return;
+
+  // Relaunch thread
   compressionThreadShouldExit = false;
   compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
 
@@ -421,203 +1045,2200 @@ void RuntimeLogger::setLogFile(const char* filename) {
  *      LogLevel enum that specifies the minimum log level.
  */
 void RuntimeLogger::setLogLevel(LogLevel logLevel) {
+  nanoLogSingleton.setLogLevel_internal(logLevel);
+}
+
+// See setLogLevel()
+void RuntimeLogger::setLogLevel_internal(LogLevel logLevel) {
   if (logLevel < 0)
     logLevel = static_cast<LogLevel>(0);
   else if (logLevel >= NUM_LOG_LEVELS)
     logLevel = static_cast<LogLevel>(NUM_LOG_LEVELS - 1);
-  nanoLogSingleton.currentLogLevel = logLevel;
+
+  std::lock_guard<std::mutex> lock(logLevelMutex);
+  configuredLogLevel = logLevel;
+  setEffectiveLogLevel();
 }
 
 /**
- * Blocks until the NanoLog system is able to persist to disk the
- * pending log messages that occurred before this invocation. Note that this
- * operation has similar behavior to a "non-quiescent checkpoint" in a
- * database which means log messages occurring after this point this
- * invocation may also be persisted in a multi-threaded system.
+ * Sets the log level that the back-pressure governor lowers the log level to
+ * while the background thread falls behind. The governor is disabled by
+ * default (NUM_LOG_LEVELS). Log levels set via setLogLevel() that are already
+ * lower are left as is.
+ *
+ * \param logLevel
+ *      LogLevel enum that specifies the minimum log level under back-pressure
+ *      or NUM_LOG_LEVELS to disable the governor
  */
-void RuntimeLogger::sync() {
-  std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
-  nanoLogSingleton.syncStatus = SYNC_REQUESTED;
-  nanoLogSingleton.workAdded.notify_all();
-  nanoLogSingleton.hintSyncCompleted.wait(lock);
+void RuntimeLogger::setDegradedLogLevel(LogLevel logLevel) {
+  if (logLevel < 0)
+    logLevel = static_cast<LogLevel>(0);
+  else if (logLevel > NUM_LOG_LEVELS)
+    logLevel = NUM_LOG_LEVELS;
+
+  std::lock_guard<std::mutex> lock(nanoLogSingleton.logLevelMutex);
+  nanoLogSingleton.degradedLogLevel = logLevel;
+  nanoLogSingleton.setEffectiveLogLevel();
 }
 
 /**
- * Attempt to reserve contiguous space for the producer without making it
- * visible to the consumer (See reserveProducerSpace).
+ * Sets the least severe log level that is staged in the per-thread priority
+ * lanes rather than the StagingBuffers. SILENT_LOG_LEVEL (the default)
+ * disables the priority lanes.
  *
- * This is the slow path of reserveProducerSpace that checks for free space
- * within storage[] that involves touching variable shared with the compression
- * thread and thus causing potential cache-coherency delays.
+ * \param logLevel
+ *      LogLevel enum that specifies the least severe priority log level
+ */
+void RuntimeLogger::setPriorityLaneLevel(LogLevel logLevel) {
+  if (logLevel < 0)
+    logLevel = static_cast<LogLevel>(0);
+  else if (logLevel >= NUM_LOG_LEVELS)
+    logLevel = static_cast<LogLevel>(NUM_LOG_LEVELS - 1);
+
+  nanoLogSingleton.priorityLaneLevel = logLevel;
+}
+
+/**
+ * Enables or disables the compression of log message arguments on the
+ * logging threads (see NanoLog::setProducerCompression()).
  *
- * \param nbytes
- *      Number of contiguous bytes to reserve.
+ * \param enable
+ *      True to compress on the logging threads, false to leave the
+ *      compression to the background thread
+ */
+void RuntimeLogger::setProducerCompression(bool enable) {
+  nanoLogSingleton.producerCompression = enable;
+}
+
+/**
+ * Sets the maximum number of threads compressing the log messages of the
+ * primary channel (see NanoLog::setMaxCompressionThreads()).
  *
- * \param blocking
- *      Test parameter that indicates that the function should
- *      return with a nullptr rather than block when there's
- *      not enough space.
+ * \param numThreads
+ *      Maximum number of compression threads, including the background
+ *      thread; values below 1 are treated as 1
+ */
+void RuntimeLogger::setMaxCompressionThreads(uint32_t numThreads) {
+  nanoLogSingleton.maxCompressionThreads = std::max(numThreads, 1u);
+}
+
+/**
+ * Selects how the background threads of all channels wait for work while
+ * idle (see NanoLog::setWakeupPolicy()).
  *
- * \return
- *      A pointer into storage[] that can be written to by the producer for
- *      at least nbytes.
+ * \param policy
+ *      Wakeup policy to use
  */
-char* RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes,
-                                                         bool blocking) {
-#ifdef RECORD_PRODUCER_STATS
-  uint64_t start = PerfUtils::Cycles::rdtsc();
-#endif
+void RuntimeLogger::setWakeupPolicy(WakeupPolicy policy) {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  if (policy == WAKEUP_DOORBELL) registerMembarrier();
 
-  // There's a subtle point here, all the checks for remaining
-  // space are strictly < or >, not <= or => because if we allow
-  // the record and print positions to overlap, we can't tell
-  // if the buffer either completely full or completely empty.
-  // Doing this check here ensures that == means completely empty.
-  while (minFreeSpace <= nbytes) {
-    // Since consumerPos can be updated in a different thread, we
-    // save a consistent copy of it here to do calculations on
-    uint64_t cachedConsumerPos = consumerPos;
+  wakeupPolicy = policy;
 
-    if (cachedConsumerPos <= producerPos) {
-      minFreeSpace = NanoLogConfig::STAGING_BUFFER_SIZE - producerPos;
+  // Threads sleeping on the doorbell would not notice the change otherwise
+  for (std::atomic<RuntimeLogger*>& channel : channels) {
+    RuntimeLogger* logger = channel.load(std::memory_order_acquire);
+    if (logger != nullptr) logger->ringDoorbell();
+  }
+}
 
-      if (minFreeSpace > nbytes) break;
+/**
+ * Selects the order in which the background threads of all channels compress
+ * the StagingBuffers (see NanoLog::setScanPolicy()).
+ *
+ * \param policy
+ *      Scan policy to use
+ */
+void RuntimeLogger::setScanPolicy(ScanPolicy policy) { scanPolicy = policy; }
 
-      // Not enough space at the end of the buffer; wrap around
-      endOfRecordedSpace = producerPos;
+/**
+ * Stops the background threads of all channels, including those created
+ * later, and leaves the compression to poll() (see
+ * NanoLog::enableEmbeddedMode()).
+ */
+void RuntimeLogger::enableEmbeddedMode() {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  embeddedMode = true;
 
-      // Prevent the roll over if it overlaps the two positions because
-      // that would imply the buffer is completely empty when it's not.
-      if (cachedConsumerPos != 0) {
-        // prevents producerPos from updating before endOfRecordedSpace
-        Fence::sfence();
-        producerPos = 0;
-        minFreeSpace = cachedConsumerPos - producerPos;
-      }
-    } else {
-      minFreeSpace = cachedConsumerPos - producerPos;
-    }
+  for (std::atomic<RuntimeLogger*>& channel : channels) {
+    RuntimeLogger* logger = channel.load(std::memory_order_acquire);
+    if (logger != nullptr) logger->enableEmbeddedMode_internal();
+  }
+}
 
-    // Needed to prevent infinite loops in tests
-    if (!blocking && minFreeSpace <= nbytes) return nullptr;
+// See enableEmbeddedMode()
+void RuntimeLogger::enableEmbeddedMode_internal() {
+  if (embedded) return;
+
+  // Stop the additional compression threads, whose output is collected by
+  // the background thread before it exits
+  helpersShouldExit = true;
+  for (CompressionHelper* helper : compressionHelpers) {
+    if (helper->thread.joinable()) helper->thread.join();
   }
+  numCompressionThreads = 1;
 
-#ifdef RECORD_PRODUCER_STATS
-  uint64_t cyclesBlocked = PerfUtils::Cycles::rdtsc() - start;
-  cyclesProducerBlocked += cyclesBlocked;
+  // The compressionState is kept, so that poll() continues the output where
+  // the background thread left off
+  stopCompressionThread();
 
-  size_t maxIndex = Util::arraySize(cyclesProducerBlockedDist) - 1;
-  size_t index = std::min(cyclesBlocked / cyclesIn10Ns, maxIndex);
+  cycleAtThreadStart = PerfUtils::Cycles::rdtsc();
+  embedded = true;
+}
+
+/**
+ * Compresses and outputs the pending log messages of all channels on the
+ * calling thread in embedded mode (see NanoLog::poll()).
+ *
+ * \param budgetNs
+ *      Time budget of the call in nanoseconds
+ *
+ * \return
+ *      True if any channel had work
+ */
+bool RuntimeLogger::poll(uint64_t budgetNs) {
+  uint64_t deadline = PerfUtils::Cycles::rdtsc() +
+                      PerfUtils::Cycles::fromNanoseconds(budgetNs);
+
+  bool foundWork = false;
+  for (std::atomic<RuntimeLogger*>& channel : channels) {
+    RuntimeLogger* logger = channel.load(std::memory_order_acquire);
+    if (logger != nullptr && logger->embedded)
+      foundWork |= logger->driveCompression(deadline, false);
+  }
+
+  return foundWork;
+}
+
+/**
+ * Performs a step of the compression (see compressionStep()) on the calling
+ * thread in embedded mode.
+ *
+ * \param deadline
+ *      Time (in rdtsc cycles) at which to cut the step short
+ * \param blocking
+ *      Indicates whether to wait for another thread driving the compression
+ *      and for work; otherwise the step returns right away
+ *
+ * \return
+ *      True if the step had work
+ */
+bool RuntimeLogger::driveCompression(uint64_t deadline, bool blocking) {
+  std::unique_lock<std::mutex> lock(pollMutex, std::defer_lock);
+  if (blocking)
+    lock.lock();
+  else if (!lock.try_lock())
+    return false;
+
+  // The fatal signal handler takes over once the steps in progress finish
+  pollInProgress.store(true);
+  if (crashDrainState.load() != CRASH_DRAIN_IDLE) {
+    pollInProgress.store(false);
+    return false;
+  }
+
+  if (compressionState == nullptr)
+    compressionState = new CompressionState(compressingBuffer);
+
+  channelBeingPolled = this;
+  compressionState->cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+  bool foundWork = compressionStep(*compressionState, deadline, blocking);
+  cyclesActive +=
+      PerfUtils::Cycles::rdtsc() - compressionState->cyclesAwakeStart;
+  channelBeingPolled = nullptr;
+
+  pollInProgress.store(false);
+  return foundWork;
+}
+
+/**
+ * Stops the background thread once it has written out its output, if it is
+ * running.
+ */
+void RuntimeLogger::stopCompressionThread() {
+  {
+    std::lock_guard<std::mutex> lock(condMutex);
+    compressionThreadShouldExit = true;
+    workAdded.notify_all();
+  }
+  ringDoorbell();
+
+  if (compressionThread.joinable()) compressionThread.join();
+}
+
+/**
+ * Returns how long an idle compression thread sleeps under the
+ * WAKEUP_BACKOFF policy.
+ *
+ * \param idleWaits
+ *      Number of consecutive waits without any work in between
+ */
+static uint32_t getBackoffIntervalUs(uint32_t idleWaits) {
+  uint64_t intervalUs =
+      uint64_t(std::max(NanoLogConfig::POLL_INTERVAL_NO_WORK_US, 1u))
+      << std::min(idleWaits, 31u);
+  return downCast<uint32_t>(std::min(
+      intervalUs, uint64_t(NanoLogConfig::WAKEUP_BACKOFF_MAX_US)));
+}
+
+// CompressionHelper constructor
+RuntimeLogger::CompressionHelper::CompressionHelper(uint32_t consumerId)
+    : consumerId(consumerId),
+      thread(),
+      handoffBuffer(nullptr),
+      handoffBytes(0),
+      encodingBuffer(nullptr),
+      claims(),
+      encodedRecords(),
+      handoffRecords(),
+      encodedLaneRecords(),
+      handoffLaneRecords(),
+      passesCompleted(0),
+      passesAtLastWrapAround(0),
+      registryEpoch(0) {
+  int err = posix_memalign(reinterpret_cast<void**>(&handoffBuffer), 512,
+                           NanoLogConfig::COMPRESSION_HELPER_BUFFER_SIZE);
+  if (err == 0)
+    err = posix_memalign(reinterpret_cast<void**>(&encodingBuffer), 512,
+                         NanoLogConfig::COMPRESSION_HELPER_BUFFER_SIZE);
+
+  if (err) {
+    perror(
+        "The NanoLog system was not able to allocate enough memory "
+        "to support its operations. Quitting...\r\n");
+    std::exit(-1);
+  }
+}
+
+// CompressionHelper destructor
+RuntimeLogger::CompressionHelper::~CompressionHelper() {
+  free(handoffBuffer);
+  free(encodingBuffer);
+}
+
+/**
+ * Starts another compression thread. This is invoked by the background
+ * thread as the StagingBuffers back up.
+ */
+void RuntimeLogger::startCompressionHelper() {
+  auto* helper = new CompressionHelper(
+      downCast<uint32_t>(compressionHelpers.size() + 1));
+  compressionHelpers.push_back(helper);
+
+  // The StagingBuffers are resharded; the claims keep the log messages of
+  // each StagingBuffer in order while they change hands
+  numCompressionThreads.store(downCast<uint32_t>(compressionHelpers.size() + 1),
+                              std::memory_order_release);
+  helper->thread =
+      std::thread(&RuntimeLogger::compressionHelperMain, this, helper);
+}
+
+/**
+ * Main function of the additional compression threads. Every pass through
+ * the StagingBuffers compresses the log messages of the thread's shard (and
+ * of the other shards if the last pass found no work in its own) and hands
+ * the output over to the background thread. The priority lane of a claimed
+ * StagingBuffer is compressed ahead of it (see drainPriorityLanes()). A pass
+ * cut short by a full output buffer is resumed at the StagingBuffer it
+ * stopped at.
+ *
+ * \param helper
+ *      State of the compression thread
+ */
+void RuntimeLogger::compressionHelperMain(CompressionHelper* helper) {
+  Log::Encoder encoder(helper->encodingBuffer,
+                       NanoLogConfig::COMPRESSION_HELPER_BUFFER_SIZE, true);
+
+  // Indicates that the last pass found no work in the thread's own shard
+  bool stealing = false;
+
+  // Number of consecutive passes without any work
+  uint32_t idleWaits = 0;
+
+  // Slot at which a pass cut short by a full output buffer resumes
+  uint32_t resumeSlot = 0;
+
+  while (!helpersShouldExit &&
+         crashDrainState.load(std::memory_order_acquire) == CRASH_DRAIN_IDLE) {
+    // The output of this thread may only refer to the dictionary entries
+    // handed to the AIO
+    SiteDictionary::View dictionary = nanoLogSingleton.invocationSites.view(
+        persistedDictionaryEntries.load(std::memory_order_acquire));
+
+    uint32_t numThreads =
+        numCompressionThreads.load(std::memory_order_acquire);
+    uint64_t bytesConsumedThisPass = 0;
+    bool foundWorkInShard = false;
+    bool outputBufferFull = false;
+
+    const std::vector<StagingBuffer*>& slots =
+        enterBufferRegistry(helper->registryEpoch)->slots;
+    uint32_t numSlots = downCast<uint32_t>(slots.size());
+    for (uint32_t slot = activeBuffers.findNext(resumeSlot, numSlots);
+         slot < numSlots && !outputBufferFull;
+         slot = activeBuffers.findNext(slot + 1, numSlots)) {
+      if (crashDrainState.load(std::memory_order_relaxed) != CRASH_DRAIN_IDLE)
+        break;
+
+      StagingBuffer* sb = slots[slot];
+      if (sb == nullptr) continue;
+
+      bool inShard = isInShard(sb, helper->consumerId, numThreads);
+      if ((!inShard && !stealing) || sb->getBytesPending() == 0) continue;
+      sb->activeSinceSweep.store(true, std::memory_order_relaxed);
+
+      // The claim is counted before it is taken, so that the background
+      // thread never finds a claimed StagingBuffer while helpersIdle()
+      size_t index = 0;
+      while (index < helper->claims.size() && helper->claims[index] != sb)
+        ++index;
+
+      if (index == helper->claims.size()) {
+        helperClaims.fetch_add(1);
+        if (!sb->tryClaim()) {
+          helperClaims.fetch_sub(1);
+          continue;
+        }
+
+        helper->claims.push_back(sb);
+        helper->encodedRecords.emplace_back(sb, 0);
+      }
+
+      PriorityLane* lane = sb->lane.load(std::memory_order_acquire);
+      for (int segment = 0; lane != nullptr && segment < 2; ++segment) {
+        uint64_t laneBytes = 0;
+        char* lanePosition = lane->peek(&laneBytes);
+        if (laneBytes == 0) break;
+
+        uint64_t laneRecords = 0;
+        long bytesRead =
+            encoder.encodeLogMsgs(lanePosition, laneBytes, lane->getId(),
+                                  false, dictionary, &laneRecords);
+        helper->encodedLaneRecords.emplace_back(lane, laneRecords);
+        if (bytesRead == 0) {
+          outputBufferFull = true;
+          break;
+        }
+
+        lane->consume(bytesRead);
+        bytesConsumedThisPass += bytesRead;
+      }
+
+      if (outputBufferFull) {
+        resumeSlot = slot;
+        break;
+      }
+
+      uint64_t peekBytes = 0;
+      char* peekPosition = sb->peek(&peekBytes);
+      uint32_t remaining = downCast<uint32_t>(peekBytes);
+      while (remaining > 0) {
+        long bytesToEncode =
+            std::min(NanoLogConfig::RELEASE_THRESHOLD, remaining);
+        long bytesRead = encoder.encodeLogMsgs(
+            peekPosition + (peekBytes - remaining), bytesToEncode,
+            sb->getId(), false, dictionary,
+            &helper->encodedRecords[index].second);
+
+        // Either the output is full or the log message refers to a
+        // dictionary entry that is not persisted yet
+        if (bytesRead == 0) {
+          outputBufferFull = true;
+          resumeSlot = slot;
+          break;
+        }
+
+        remaining -= downCast<uint32_t>(bytesRead);
+        sb->consume(bytesRead);
+        bytesConsumedThisPass += bytesRead;
+      }
+
+      if (inShard && peekBytes > 0) foundWorkInShard = true;
+    }
+
+    handOff(helper, encoder);
+    exitBufferRegistry(helper->registryEpoch);
+
+    // The background thread relies on every completed pass having drained
+    // the thread's shard (see helpersCompletedPass()), so a pass cut short
+    // is only completed once the remaining StagingBuffers are visited
+    if (!outputBufferFull) {
+      helper->passesCompleted.fetch_add(1, std::memory_order_release);
+      resumeSlot = 0;
+    }
+
+    stealing = !foundWorkInShard;
+    if (bytesConsumedThisPass > 0) {
+      idleWaits = 0;
+      continue;
+    }
+
+    // The doorbell only wakes up the background thread
+    switch (wakeupPolicy.load(std::memory_order_relaxed)) {
+      case WAKEUP_BUSY_POLL:
+        break;
+      case WAKEUP_BACKOFF:
+      case WAKEUP_DOORBELL:
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(getBackoffIntervalUs(idleWaits++)));
+        break;
+      default:
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(NanoLogConfig::POLL_INTERVAL_NO_WORK_US));
+    }
+  }
+}
+
+/**
+ * Hands the output of an additional compression thread over to the
+ * background thread and releases the thread's claims on the StagingBuffers.
+ * Blocks while the background thread has not collected the previous output.
+ *
+ * \param helper
+ *      State of the compression thread
+ * \param encoder
+ *      Encoder of the compression thread
+ */
+void RuntimeLogger::handOff(CompressionHelper* helper, Log::Encoder& encoder) {
+  size_t encodedBytes = encoder.getEncodedBytes();
+  if (encodedBytes > 0) {
+    while (helper->handoffBytes.load(std::memory_order_acquire) != 0) {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(NanoLogConfig::POLL_INTERVAL_NO_WORK_US));
+    }
+
+    std::swap(helper->handoffBuffer, helper->encodingBuffer);
+    encoder.swapBuffer(helper->encodingBuffer,
+                       NanoLogConfig::COMPRESSION_HELPER_BUFFER_SIZE);
+    helper->handoffRecords.swap(helper->encodedRecords);
+    helper->handoffLaneRecords.swap(helper->encodedLaneRecords);
+    helper->handoffBytes.store(encodedBytes, std::memory_order_release);
+
+    std::lock_guard<std::mutex> lock(handoffMutex);
+    handoffQueue.push_back(helper);
+    numHandoffs.fetch_add(1);
+  }
+  if (encodedBytes > 0) ringDoorbell();
+  helper->encodedRecords.clear();
+  helper->encodedLaneRecords.clear();
+
+  // Other threads may consume the StagingBuffers once the output is queued
+  for (StagingBuffer* sb : helper->claims) sb->releaseClaim();
+  helperClaims.fetch_sub(downCast<uint32_t>(helper->claims.size()));
+  helper->claims.clear();
+}
+
+/**
+ * Appends the output handed over by the additional compression threads to
+ * the output of the background thread. This must be invoked before the
+ * background thread consumes a StagingBuffer, as the handed over output may
+ * hold earlier log messages of the StagingBuffer.
+ *
+ * \param encoder
+ *      Encoder of the background thread
+ *
+ * \return
+ *      False if the encoder ran out of space before all output was collected
+ */
+bool RuntimeLogger::collectHandoffs(Log::Encoder& encoder) {
+  if (numHandoffs.load(std::memory_order_acquire) == 0) return true;
+
+  std::lock_guard<std::mutex> lock(handoffMutex);
+  while (!handoffQueue.empty()) {
+    CompressionHelper* helper = handoffQueue.front();
+    if (!encoder.appendEncoded(helper->handoffBuffer,
+                               helper->handoffBytes.load()))
+      return false;
+
+    for (auto& records : helper->handoffRecords) {
+      records.first->recordsEncoded += records.second;
+      logsProcessed += records.second;
+    }
+    helper->handoffRecords.clear();
+
+    for (auto& records : helper->handoffLaneRecords) {
+      records.first->recordsEncoded += records.second;
+      logsProcessed += records.second;
+    }
+    helper->handoffLaneRecords.clear();
+
+    handoffQueue.pop_front();
+    numHandoffs.fetch_sub(1);
+    helper->handoffBytes.store(0, std::memory_order_release);
+  }
+
+  return true;
+}
+
+/**
+ * Returns true if the additional compression threads hold neither claims on
+ * StagingBuffers nor output waiting to be collected.
+ */
+bool RuntimeLogger::helpersIdle() {
+  return helperClaims.load() == 0 && numHandoffs.load() == 0;
+}
+
+/**
+ * Returns true if every additional compression thread completed a pass
+ * through the StagingBuffers since the last time this returned true and the
+ * output of the pass was collected. The background thread only starts a new
+ * pass in the output (see Log::BufferExtent) then, since the decompressor
+ * sorts the log messages by time within a window of passes. Output collected
+ * after the new pass started would hold log messages older than the ones the
+ * priority lanes contributed to the previous pass.
+ */
+bool RuntimeLogger::helpersCompletedPass() {
+  for (CompressionHelper* helper : compressionHelpers) {
+    if (helper->passesCompleted.load(std::memory_order_acquire) ==
+            helper->passesAtLastWrapAround ||
+        helper->handoffBytes.load(std::memory_order_acquire) != 0)
+      return false;
+  }
+
+  for (CompressionHelper* helper : compressionHelpers)
+    helper->passesAtLastWrapAround = helper->passesCompleted.load();
+
+  return true;
+}
+
+/**
+ * Recomputes the log level enforced on the logging threads from the
+ * configured log level and the state of the governor. The logLevelMutex must
+ * be held.
+ */
+void RuntimeLogger::setEffectiveLogLevel() {
+  // The logging threads were stopped by the fatal signal handler
+  if (crashDrainStarted.load(std::memory_order_relaxed)) return;
+
+  currentLogLevel = configuredLogLevel;
+  if (governorEngaged && degradedLogLevel < configuredLogLevel)
+    currentLogLevel = degradedLogLevel;
+}
+
+/**
+ * Measures how full the StagingBuffers are, in percent of their capacity.
+ *
+ * \param[out] threadFill
+ *      Fill level of the fullest StagingBuffer
+ * \param[out] globalFill
+ *      Fill level of all the StagingBuffers combined
+ *
+ * \return
+ *      False if there are no StagingBuffers
+ */
+bool RuntimeLogger::measureStagingFill(uint32_t* threadFill,
+                                       uint32_t* globalFill) {
+  uint64_t maxBytesPending = 0;
+  uint64_t totalBytesPending = 0;
+  uint64_t numBuffers;
+  {
+    // The StagingBuffers outside the activeBuffers are empty
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    const std::vector<StagingBuffer*>& slots =
+        bufferRegistry.load(std::memory_order_relaxed)->slots;
+    uint32_t numSlots = downCast<uint32_t>(slots.size());
+    numBuffers = threadBuffers.size();
+    for (uint32_t slot = activeBuffers.findNext(0, numSlots); slot < numSlots;
+         slot = activeBuffers.findNext(slot + 1, numSlots)) {
+      if (slots[slot] == nullptr) continue;
+
+      uint64_t bytesPending = slots[slot]->getBytesPending();
+      maxBytesPending = std::max(maxBytesPending, bytesPending);
+      totalBytesPending += bytesPending;
+    }
+  }
+
+  if (numBuffers == 0) return false;
+
+  *threadFill = downCast<uint32_t>(
+      100 * maxBytesPending / NanoLogConfig::STAGING_BUFFER_SIZE);
+  *globalFill = downCast<uint32_t>(
+      100 * totalBytesPending /
+      (numBuffers * NanoLogConfig::STAGING_BUFFER_SIZE));
+  return true;
+}
+
+/**
+ * Starts another compression thread while the fullest StagingBuffer is
+ * filled beyond NanoLogConfig::COMPRESSION_THREAD_SCALE_WATERMARK, up to the
+ * maximum set by setMaxCompressionThreads().
+ */
+void RuntimeLogger::scaleCompressionThreads() {
+  uint64_t now = PerfUtils::Cycles::rdtsc();
+  if (compressionHelpers.size() + 1 >= maxCompressionThreads ||
+      now < nextCompressionThreadStart || helpersShouldExit || embedded)
+    return;
+
+  uint32_t threadFill, globalFill;
+  if (!measureStagingFill(&threadFill, &globalFill) ||
+      threadFill < NanoLogConfig::COMPRESSION_THREAD_SCALE_WATERMARK)
+    return;
+
+  startCompressionHelper();
+  nextCompressionThreadStart =
+      now + PerfUtils::Cycles::fromNanoseconds(
+                NanoLogConfig::COMPRESSION_THREAD_START_INTERVAL_US * 1000);
+}
+
+/**
+ * Engages or releases the back-pressure governor based on how full the
+ * StagingBuffers are (see NanoLogConfig::GOVERNOR_*), unless it is disabled
+ * (see setDegradedLogLevel()). Every transition is logged as a WRN message
+ * regardless of the log level.
+ */
+void RuntimeLogger::updateGovernor() {
+  {
+    std::lock_guard<std::mutex> lock(logLevelMutex);
+    if (degradedLogLevel == NUM_LOG_LEVELS && !governorEngaged) return;
+  }
+
+  uint32_t threadFill, globalFill;
+  if (!measureStagingFill(&threadFill, &globalFill)) return;
+
+  LogLevel logLevel;
+  {
+    std::lock_guard<std::mutex> lock(logLevelMutex);
+    if (!governorEngaged) {
+      if (degradedLogLevel == NUM_LOG_LEVELS ||
+          (threadFill < NanoLogConfig::GOVERNOR_THREAD_HIGH_WATERMARK &&
+           globalFill < NanoLogConfig::GOVERNOR_GLOBAL_HIGH_WATERMARK))
+        return;
+
+      governorEngaged = true;
+      ++numGovernorEngagements;
+    } else {
+      if (threadFill >= NanoLogConfig::GOVERNOR_LOW_WATERMARK ||
+          globalFill >= NanoLogConfig::GOVERNOR_LOW_WATERMARK)
+        return;
+
+      governorEngaged = false;
+    }
+
+    setEffectiveLogLevel();
+    logLevel = currentLogLevel;
+  }
+
+  // The transitions are logged through this thread's own StagingBuffer,
+  // which is drained by this thread and thus never blocks. A per-CPU buffer
+  // could be held by a producer waiting on this thread for space.
+  ensureStagingBufferAllocated();
+  static constexpr char engagedFormat[] =
+      "NanoLog is falling behind (staging buffers %u%% full, %u%% overall); "
+      "dropping log messages less severe than level %d";
+  static constexpr char releasedFormat[] =
+      "NanoLog caught up (staging buffers %u%% full, %u%% overall); "
+      "restored log level %d";
+  static constexpr std::array<ParamType, 3> paramTypes =
+      analyzeFormatString<3>(engagedFormat);
+  static_assert(countFmtParams(engagedFormat) == 3 &&
+                    analyzeFormatString<3>(releasedFormat) == paramTypes,
+                "The governor's log messages must take the same arguments");
+  static int engagedLogId = UNASSIGNED_LOGID;
+  static int releasedLogId = UNASSIGNED_LOGID;
+
+  if (governorEngaged) {
+    log<paramTypes>(engagedLogId, __FILENAME__, __LINE__, WRN, engagedFormat,
+                    getNumNibblesNeeded(engagedFormat), threadFill,
+                    globalFill, static_cast<int>(logLevel));
+  } else {
+    log<paramTypes>(releasedLogId, __FILENAME__, __LINE__, WRN,
+                    releasedFormat, getNumNibblesNeeded(releasedFormat),
+                    threadFill, globalFill, static_cast<int>(logLevel));
+  }
+}
+
+/**
+ * Stages the NANO_METRIC_*() aggregates the threads collected over the epoch
+ * before the current one (see NanoLogMetric.h), optionally after starting a
+ * new epoch. The aggregates of exited threads are deleted once collected.
+ *
+ * Upon a new epoch, the threads updating the bank of the epoch that ended
+ * are waited on. The threads mark their updates without a fence before
+ * reading the epoch. The membarrier() forces one onto them, so that either
+ * this thread finds their update in progress or they find the new epoch.
+ *
+ * \param advanceEpoch
+ *      Start a new epoch once the aggregates of the current one's
+ *      predecessor are staged
+ *
+ * \return
+ *      True if all the aggregates of the epoch before the current one were
+ *      staged; otherwise the rest is staged upon the next invocation
+ */
+bool RuntimeLogger::collectMetrics(bool advanceEpoch) {
+  std::lock_guard<std::mutex> lock(metricMutex);
+  MetricRegistry& registry = getMetricRegistry();
+  std::lock_guard<std::mutex> registryLock(registry.mutex);
+  std::vector<ThreadMetrics*>& threads = registry.threads;
+
+  auto stageAggregates = [this, &threads]() {
+    uint32_t epoch = metricEpoch.load(std::memory_order_relaxed) - 1;
+    auto stage = [this](int logId, const void* snapshot, size_t size) {
+      return stageMetricSnapshot(logId, snapshot, size);
+    };
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+      ThreadMetrics* metrics = threads[i];
+      if (!collectThreadMetrics(*metrics, epoch, stage)) return false;
+
+      if (metrics->exited.load(std::memory_order_acquire)) {
+        delete metrics;
+        threads.erase(threads.begin() + i);
+        --i;
+      }
+    }
+
+    metricsPending.store(false, std::memory_order_relaxed);
+    return true;
+  };
+
+  // The threads update the bank of the previous epoch again in the next one
+  if (metricsPending.load(std::memory_order_relaxed) && !stageAggregates())
+    return false;
+
+  if (!advanceEpoch) return true;
+
+  if (!metricMembarrier && registerMembarrier())
+    metricMembarrier.store(true, std::memory_order_relaxed);
+
+  metricEpoch.fetch_add(1, std::memory_order_release);
+  if (!metricMembarrier ||
+      syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  for (ThreadMetrics* metrics : threads) {
+    uint32_t updates = metrics->updates.load(std::memory_order_acquire);
+    while ((updates & 1) &&
+           metrics->updates.load(std::memory_order_acquire) == updates)
+      std::this_thread::yield();
+  }
+
+  metricsPending.store(true, std::memory_order_relaxed);
+  return stageAggregates();
+}
+
+/**
+ * Stages a snapshot record of the metric aggregates of a thread into the
+ * metricBuffer without blocking. The metricMutex must be held.
+ *
+ * \param logId
+ *      Log id of the metric's snapshot records
+ * \param snapshot
+ *      Snapshot to stage after the log message header
+ * \param size
+ *      Size of the snapshot
+ *
+ * \return
+ *      False if the metricBuffer is out of space
+ */
+bool RuntimeLogger::stageMetricSnapshot(int logId, const void* snapshot,
+                                        size_t size) {
+  if (metricBuffer == nullptr) {
+    std::unique_lock<std::mutex> guard(bufferMutex);
+    uint32_t bufferId = nextBufferId++;
+
+    // Unlocked for the expensive StagingBuffer allocation
+    guard.unlock();
+    metricBuffer = new StagingBuffer(bufferId);
+    guard.lock();
+
+    registerStagingBuffer(metricBuffer);
+  }
+
+  size_t allocSize = sizeof(Log::UncompressedEntry) + size;
+  char* writePos = metricBuffer->reserveProducerSpace(allocSize, false);
+  if (writePos == nullptr) return false;
+
+  auto* ue = new (writePos) Log::UncompressedEntry();
+  ue->fmtId = logId;
+  ue->timestamp = PerfUtils::Cycles::rdtsc();
+  ue->entrySize = downCast<uint32_t>(allocSize);
+  std::memcpy(ue->argData, snapshot, size);
+
+  metricBuffer->finishReservation(allocSize);
+  metricBuffer->markActive();
+  return true;
+}
+
+/**
+ * Switches the threads that have not logged yet to per-CPU staging (see
+ * NanoLog::enablePerCpuStaging()).
+ *
+ * \return
+ *      False if the CPU of a thread cannot be determined cheaply, in which
+ *      case the threads keep using per-thread StagingBuffers
+ */
+bool RuntimeLogger::enablePerCpuStaging() {
+#if NANOLOG_HAS_RSEQ
+  if (__rseq_size == 0) return false;
+
+  std::lock_guard<std::mutex> lock(nanoLogSingleton.bufferMutex);
+  if (nanoLogSingleton.cpuBuffers.load() == nullptr) {
+    long numCpus = sysconf(_SC_NPROCESSORS_CONF);
+    nanoLogSingleton.numCpuBuffers =
+        (numCpus > 0) ? static_cast<uint32_t>(numCpus) : 1;
+    nanoLogSingleton.cpuBuffers.store(
+        new CpuBuffer[nanoLogSingleton.numCpuBuffers],
+        std::memory_order_release);
+  }
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Blocks until the NanoLog system is able to persist to disk the
+ * pending log messages that occurred before this invocation. Note that this
+ * operation has similar behavior to a "non-quiescent checkpoint" in a
+ * database which means log messages occurring after this point this
+ * invocation may also be persisted in a multi-threaded system.
+ */
+void RuntimeLogger::sync() { nanoLogSingleton.sync_internal(); }
+
+// See sync()
+void RuntimeLogger::sync_internal() {
+  std::future<void> future = flushAsync_internal();
+
+  // In embedded mode, the calling thread completes the sync itself
+  while (embedded && future.wait_for(std::chrono::seconds(0)) !=
+                         std::future_status::ready)
+    driveCompression(NO_DEADLINE, true);
+
+  future.wait();
+}
+
+/**
+ * Asynchronous version of sync(). Concurrent requests are coalesced into a
+ * single sync round (group commit).
+ *
+ * \return
+ *      A future that becomes ready once the log messages that occurred
+ *      before this invocation are persisted to disk
+ */
+std::future<void> RuntimeLogger::flushAsync() {
+  return nanoLogSingleton.flushAsync_internal();
+}
+
+// See flushAsync()
+std::future<void> RuntimeLogger::flushAsync_internal() {
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+
+  std::lock_guard<std::mutex> lock(condMutex);
+  uint64_t request = ++syncRequestsIssued;
+  syncPromises.emplace_back(request, std::move(promise));
+
+  // A round in progress may have already passed over log messages that
+  // occurred before this request, so it is left to the next round
+  if (syncStatus == SYNC_COMPLETED) {
+    syncRoundTarget = request;
+    syncStatus = SYNC_REQUESTED;
+  }
+
+  workAdded.notify_all();
+  ringDoorbell();
+  return future;
+}
+
+/**
+ * Blocks until the log records the calling thread staged thus far are
+ * persisted to disk. Unlike sync(), this does not wait on the other threads'
+ * log records and returns as soon as the write containing the calling
+ * thread's last log record completes. Threads staging to per-CPU buffers
+ * only wait on their last log record.
+ */
+void RuntimeLogger::waitUntilPersisted() {
+  StagingBuffer* sb = (stagingBuffer) ? stagingBuffer : lastCpuBuffer;
+  PriorityLane* lane = priorityLane;
+
+  // A thread staging to per-CPU buffers may have only staged to its
+  // priority lane, in which case it has no buffer to wait on
+  if (sb == nullptr && lane == nullptr) return;
+
+  // Sequence numbers of the last log records staged by this thread
+  uint64_t sequence = 0;
+  if (sb != nullptr)
+    sequence = (sb == stagingBuffer) ? sb->numAllocations : lastCpuSequence;
+  uint64_t laneSequence = (lane) ? lane->numAllocations : 0;
+
+  std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
+  ++nanoLogSingleton.numPersistenceWaiters;
+  nanoLogSingleton.workAdded.notify_all();
+  nanoLogSingleton.ringDoorbell();
+
+  auto persisted = [&]() {
+    return (sb == nullptr || sb->recordsPersisted.load(
+                                 std::memory_order_acquire) >= sequence) &&
+           (lane == nullptr || lane->recordsPersisted.load(
+                                   std::memory_order_acquire) >= laneSequence);
+  };
+
+  // In embedded mode, the calling thread writes out the log records itself
+  if (nanoLogSingleton.embedded) {
+    while (!persisted()) {
+      lock.unlock();
+      nanoLogSingleton.driveCompression(NO_DEADLINE, true);
+      lock.lock();
+    }
+  } else {
+    nanoLogSingleton.hintSyncCompleted.wait(lock, persisted);
+  }
+  --nanoLogSingleton.numPersistenceWaiters;
+}
+
+/**
+ * Creates a log channel (see NanoLog::createChannel()).
+ *
+ * \param name
+ *      Name of the channel
+ * \param filename
+ *      Log file of the channel
+ *
+ * \return
+ *      The new channel or the existing channel of the same name
+ */
+Channel RuntimeLogger::createChannel(const char* name, const char* filename) {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  Channel channel = PRIMARY_CHANNEL + 1;
+  for (; channel < NanoLogConfig::MAX_CHANNELS; ++channel) {
+    RuntimeLogger* logger = channels[channel].load();
+    if (logger == nullptr) break;
+    if (logger->channelName == name) return channel;
+  }
+
+  if (channel == NanoLogConfig::MAX_CHANNELS)
+    throw std::length_error("NanoLog supports at most " +
+                            std::to_string(NanoLogConfig::MAX_CHANNELS) +
+                            " channels (see NanoLogConfig::MAX_CHANNELS)");
+
+  channels[channel].store(new RuntimeLogger(channel, name, filename),
+                          std::memory_order_release);
+  return channel;
+}
+
+/**
+ * Looks up a log channel by name (see NanoLog::getChannel()).
+ */
+Channel RuntimeLogger::getChannel(const char* name) {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  for (Channel channel = PRIMARY_CHANNEL + 1;
+       channel < NanoLogConfig::MAX_CHANNELS; ++channel) {
+    RuntimeLogger* logger = channels[channel].load();
+    if (logger == nullptr) break;
+    if (logger->channelName == name) return channel;
+  }
+
+  throw std::invalid_argument(std::string("NanoLog channel '") + name +
+                              "' does not exist");
+}
+
+/**
+ * Sets the minimum log level of a channel (see setLogLevel()).
+ */
+void RuntimeLogger::setChannelLogLevel(Channel channel, LogLevel logLevel) {
+  getChannelLogger(channel)->setLogLevel_internal(logLevel);
+}
+
+/**
+ * Waits until the pending log messages of a channel are persisted (see
+ * sync()).
+ */
+void RuntimeLogger::syncChannel(Channel channel) {
+  getChannelLogger(channel)->sync_internal();
+}
+
+/**
+ * Completes the sync round in progress and starts the next round if more
+ * sync requests were issued in the meantime. The condMutex must be held.
+ */
+void RuntimeLogger::completeSyncRound() {
+  if (!writesAreDurable) fdatasync(outputFd);
+
+  ++numSyncRounds;
+  syncRequestsCompleted = syncRoundTarget;
+  while (!syncPromises.empty() &&
+         syncPromises.front().first <= syncRequestsCompleted) {
+    syncPromises.front().second.set_value();
+    syncPromises.pop_front();
+  }
+
+  if (syncRequestsIssued > syncRequestsCompleted) {
+    syncRoundTarget = syncRequestsIssued;
+    syncStatus = SYNC_REQUESTED;
+  } else {
+    syncStatus = SYNC_COMPLETED;
+  }
+}
+
+/**
+ * Records that the log records encoded thus far are contained in the output
+ * handed to the AIO. Invoked by the compression thread upon starting a write.
+ */
+void RuntimeLogger::markRecordsInFlight() {
+  // The StagingBuffers outside the activeBuffers are up to date
+  std::lock_guard<std::mutex> lock(bufferMutex);
+  const std::vector<StagingBuffer*>& slots =
+      bufferRegistry.load(std::memory_order_relaxed)->slots;
+  uint32_t numSlots = downCast<uint32_t>(slots.size());
+  for (uint32_t slot = activeBuffers.findNext(0, numSlots); slot < numSlots;
+       slot = activeBuffers.findNext(slot + 1, numSlots)) {
+    if (slots[slot] != nullptr)
+      slots[slot]->recordsInFlight = slots[slot]->recordsEncoded;
+  }
+  for (PriorityLane* lane : priorityLanes)
+    lane->recordsInFlight = lane->recordsEncoded;
+}
+
+/**
+ * Publishes the log records contained in a completed write as persisted and
+ * wakes up the threads in waitUntilPersisted(). Invoked by the compression
+ * thread upon completing a write.
+ */
+void RuntimeLogger::markRecordsPersisted() {
+  std::unique_lock<std::mutex> lock(condMutex);
+  if (numPersistenceWaiters == 0 && !writesAreDurable) return;
+  lock.unlock();
+
+  if (!writesAreDurable) fdatasync(outputFd);
+
+  {
+    std::lock_guard<std::mutex> bufferLock(bufferMutex);
+    for (StagingBuffer* sb : threadBuffers)
+      sb->recordsPersisted.store(sb->recordsInFlight,
+                                 std::memory_order_release);
+    for (PriorityLane* lane : priorityLanes)
+      lane->recordsPersisted.store(lane->recordsInFlight,
+                                   std::memory_order_release);
+  }
+
+  lock.lock();
+  if (numPersistenceWaiters > 0) hintSyncCompleted.notify_all();
+}
+
+/**
+ * Attempt to reserve contiguous space for the producer without making it
+ * visible to the consumer (See reserveProducerSpace).
+ *
+ * This is the slow path of reserveProducerSpace that checks for free space
+ * within storage[] that involves touching variable shared with the compression
+ * thread and thus causing potential cache-coherency delays.
+ *
+ * \param nbytes
+ *      Number of contiguous bytes to reserve.
+ *
+ * \param blocking
+ *      Test parameter that indicates that the function should
+ *      return with a nullptr rather than block when there's
+ *      not enough space.
+ *
+ * \return
+ *      A pointer into storage[] that can be written to by the producer for
+ *      at least nbytes.
+ */
+template <uint32_t capacity>
+char* RuntimeLogger::BasicStagingBuffer<capacity>::reserveSpaceInternal(
+    size_t nbytes, bool blocking) {
+#ifdef RECORD_PRODUCER_STATS
+  uint64_t start = PerfUtils::Cycles::rdtsc();
+#endif
+
+  // There's a subtle point here, all the checks for remaining
+  // space are strictly < or >, not <= or => because if we allow
+  // the record and print positions to overlap, we can't tell
+  // if the buffer either completely full or completely empty.
+  // Doing this check here ensures that == means completely empty.
+  bool blocked = false;
+  while (minFreeSpace <= nbytes) {
+    // Since consumerPos can be updated in a different thread, we
+    // save a consistent copy of it here to do calculations on
+    uint64_t cachedConsumerPos = consumerPos;
+
+    if (cachedConsumerPos <= producerPos) {
+      minFreeSpace = capacity - producerPos;
+
+      if (minFreeSpace > nbytes) break;
+
+      // Not enough space at the end of the buffer; wrap around
+      endOfRecordedSpace = producerPos;
+
+      // Prevent the roll over if it overlaps the two positions because
+      // that would imply the buffer is completely empty when it's not.
+      if (cachedConsumerPos != 0) {
+        // prevents producerPos from updating before endOfRecordedSpace
+        Fence::sfence();
+        producerPos = 0;
+        minFreeSpace = cachedConsumerPos - producerPos;
+      }
+    } else {
+      minFreeSpace = cachedConsumerPos - producerPos;
+    }
+
+    // Needed to prevent infinite loops in tests
+    if (!blocking && minFreeSpace <= nbytes) return nullptr;
+
+    // Lets the compression thread know to get to this buffer first
+    if (minFreeSpace <= nbytes && !blocked) {
+      blocked = true;
+      producerBlocked.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  if (blocked) producerBlocked.store(false, std::memory_order_relaxed);
+
+#ifdef RECORD_PRODUCER_STATS
+  uint64_t cyclesBlocked = PerfUtils::Cycles::rdtsc() - start;
+  cyclesProducerBlocked += cyclesBlocked;
+
+  size_t maxIndex = Util::arraySize(cyclesProducerBlockedDist) - 1;
+  size_t index = std::min(cyclesBlocked / cyclesIn10Ns, maxIndex);
   ++(cyclesProducerBlockedDist[index]);
 #endif
 
-  ++numTimesProducerBlocked;
-  return &storage[producerPos];
+  ++numTimesProducerBlocked;
+  return &storage[producerPos];
+}
+
+/**
+ * Peek at the data available for consumption within the stagingBuffer.
+ * The consumer should also invoke consume() to release space back
+ * to the producer. This can and should be done piece-wise where a
+ * large peek can be consume()-ed in smaller pieces to prevent blocking
+ * the producer.
+ *
+ * \param[out] bytesAvailable
+ *      Number of bytes consumable
+ * \return
+ *      Pointer to the consumable space
+ */
+template <uint32_t capacity>
+char* RuntimeLogger::BasicStagingBuffer<capacity>::peek(
+    uint64_t* bytesAvailable) {
+  // Save a consistent copy of producerPos
+  uint64_t cachedProducerPos = producerPos;
+
+  if (cachedProducerPos < consumerPos) {
+    Fence::lfence();  // Prevent reading new producerPos but old endOf...
+    *bytesAvailable = endOfRecordedSpace - consumerPos;
+
+    if (*bytesAvailable > 0) return &storage[consumerPos];
+
+    // Roll over
+    consumerPos = 0;
+  }
+
+  *bytesAvailable = cachedProducerPos - consumerPos;
+  return &storage[consumerPos];
+}
+
+template class RuntimeLogger::BasicStagingBuffer<
+    NanoLogConfig::STAGING_BUFFER_SIZE>;
+template class RuntimeLogger::BasicStagingBuffer<
+    NanoLogConfig::PRIORITY_LANE_SIZE>;
+
+/**
+ * Allocates the StagingBuffer of a CpuBuffer, which must be held by the
+ * calling thread.
+ *
+ * \param cpuBuffer
+ *      CpuBuffer to allocate the StagingBuffer for
+ */
+void RuntimeLogger::allocateCpuBuffer(CpuBuffer* cpuBuffer) {
+  std::unique_lock<std::mutex> guard(bufferMutex);
+  uint32_t bufferId = nextBufferId++;
+
+  // Unlocked for the expensive StagingBuffer allocation
+  guard.unlock();
+  cpuBuffer->buffer = new StagingBuffer(bufferId);
+  guard.lock();
+
+  registerStagingBuffer(cpuBuffer->buffer);
+}
+
+/**
+ * Adds a new StagingBuffer to the threadBuffers and assigns it a slot in the
+ * bufferRegistry. The bufferMutex must be held.
+ *
+ * \param sb
+ *      StagingBuffer to add
+ */
+void RuntimeLogger::registerStagingBuffer(StagingBuffer* sb) {
+  threadBuffers.push_back(sb);
+
+  std::vector<StagingBuffer*> slots =
+      bufferRegistry.load(std::memory_order_relaxed)->slots;
+  if (freeBufferSlots.empty()) {
+    sb->slot = downCast<uint32_t>(slots.size());
+    slots.push_back(sb);
+  } else {
+    sb->slot = freeBufferSlots.back();
+    freeBufferSlots.pop_back();
+    slots[sb->slot] = sb;
+  }
+
+  sb->activeBuffers = &activeBuffers;
+  publishBufferRegistry(std::move(slots), nullptr);
+}
+
+/**
+ * Removes a StagingBuffer that is to be deleted from the threadBuffers and
+ * frees its slot in the bufferRegistry. The StagingBuffer is deleted once
+ * the compression threads can no longer refer to it. The bufferMutex must be
+ * held.
+ *
+ * \param slot
+ *      Slot of the StagingBuffer to remove
+ */
+void RuntimeLogger::unregisterStagingBuffer(uint32_t slot) {
+  std::vector<StagingBuffer*> slots =
+      bufferRegistry.load(std::memory_order_relaxed)->slots;
+  StagingBuffer* sb = slots[slot];
+  threadBuffers.erase(
+      std::find(threadBuffers.begin(), threadBuffers.end(), sb));
+
+  slots[slot] = nullptr;
+  activeBuffers.clear(slot);
+  freeBufferSlots.push_back(slot);
+  publishBufferRegistry(std::move(slots), sb);
+}
+
+/**
+ * Replaces the bufferRegistry and retires the previous one. The bufferMutex
+ * must be held.
+ *
+ * \param slots
+ *      StagingBuffers of the new BufferRegistry by slot
+ * \param removed
+ *      StagingBuffer that was removed from the previous BufferRegistry, if
+ *      any, which is deleted along with it
+ */
+void RuntimeLogger::publishBufferRegistry(std::vector<StagingBuffer*> slots,
+                                          StagingBuffer* removed) {
+  BufferRegistry* previous =
+      bufferRegistry.exchange(new BufferRegistry(std::move(slots)));
+  uint64_t epoch = registryEpoch.fetch_add(1) + 1;
+  retiredRegistries.push_back({epoch, previous, removed});
+}
+
+/**
+ * Returns the current bufferRegistry to a compression thread, which may scan
+ * it and its StagingBuffers without the bufferMutex until it invokes
+ * exitBufferRegistry().
+ *
+ * \param readerEpoch
+ *      Records the epoch of the calling compression thread
+ */
+RuntimeLogger::BufferRegistry* RuntimeLogger::enterBufferRegistry(
+    std::atomic<uint64_t>& readerEpoch) {
+  // A registry retired after the epoch is read cannot have been loaded
+  readerEpoch.store(registryEpoch.load());
+  return bufferRegistry.load();
+}
+
+/**
+ * Frees the BufferRegistries (and the StagingBuffers removed from them)
+ * retired before the epochs of the compression threads scanning the
+ * registries. Invoked by the background thread in between passes.
+ */
+void RuntimeLogger::reclaimBufferRegistries() {
+  // Nothing was retired since the last reclamation
+  if (registryEpoch.load(std::memory_order_relaxed) == reclaimedEpoch) return;
+
+  std::lock_guard<std::mutex> lock(bufferMutex);
+
+  uint64_t oldestEpoch = scanEpoch.load();
+  for (CompressionHelper* helper : compressionHelpers) {
+    uint64_t epoch = helper->registryEpoch.load();
+    if (epoch != 0 && (oldestEpoch == 0 || epoch < oldestEpoch))
+      oldestEpoch = epoch;
+  }
+
+  auto it = retiredRegistries.begin();
+  while (it != retiredRegistries.end() &&
+         (oldestEpoch == 0 || it->epoch <= oldestEpoch)) {
+    reclaimedEpoch = it->epoch;
+    delete it->registry;
+    delete it->removed;
+    ++it;
+  }
+
+  retiredRegistries.erase(retiredRegistries.begin(), it);
 }
 
 /**
- * Peek at the data available for consumption within the stagingBuffer.
- * The consumer should also invoke consume() to release space back
- * to the producer. This can and should be done piece-wise where a
- * large peek can be consume()-ed in smaller pieces to prevent blocking
- * the producer.
+ * Clears the bits of the StagingBuffers in which the compression threads
+ * found no log messages since the last sweep from the activeBuffers, so that
+ * the passes skip them until their producers log again. Invoked by the
+ * background thread.
+ *
+ * \param registry
+ *      BufferRegistry scanned by the background thread
+ */
+void RuntimeLogger::sweepIdleBuffers(const BufferRegistry* registry) {
+  // The producers cannot be relied upon to notice their bit being cleared
+  // without membarrier(), in which case every StagingBuffer is visited
+  if (!registerMembarrier()) return;
+
+  const std::vector<StagingBuffer*>& slots = registry->slots;
+  uint32_t numSlots =
+      std::min(downCast<uint32_t>(slots.size()), ActiveBufferSet::CAPACITY);
+
+  idleSlots.clear();
+  for (uint32_t slot = activeBuffers.findNext(0, numSlots); slot < numSlots;
+       slot = activeBuffers.findNext(slot + 1, numSlots)) {
+    StagingBuffer* sb = slots[slot];
+    if (sb == nullptr) continue;
+
+    // The log records of the StagingBuffers outside the activeBuffers must
+    // all be accounted for as in flight (see markRecordsInFlight()), and
+    // their doorbells armed (see waitForDoorbell())
+    if (!sb->activeSinceSweep.exchange(false, std::memory_order_relaxed) &&
+        !sb->shouldDeallocate && sb->recordsInFlight == sb->recordsEncoded) {
+      sb->doorbellArmed.store(true, std::memory_order_relaxed);
+      activeBuffers.clear(slot);
+      idleSlots.push_back(slot);
+    }
+  }
+
+  if (idleSlots.empty()) return;
+
+  // The logging threads check their bit after bumping their producerPos
+  // without a fence. The membarrier() forces one onto them, so that either
+  // they find their bit cleared or this thread finds their log messages.
+  bool fenced =
+      syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0;
+
+  for (uint32_t slot : idleSlots) {
+    StagingBuffer* sb = slots[slot];
+    if (!fenced || sb->getBytesPending() > 0 || sb->shouldDeallocate)
+      activeBuffers.set(slot);
+    else
+      ++numIdleBufferClears;
+  }
+}
+
+// Documentation in NanoLog.h
+void RuntimeLogger::installCrashHandler() {
+  std::lock_guard<std::mutex> lock(channelMutex);
+  if (crashHandlerInstalled) return;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = crashSignalHandler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+
+  for (size_t i = 0; i < Util::arraySize(crashSignals); ++i)
+    sigaction(crashSignals[i], &action, &previousCrashActions[i]);
+
+  crashHandlerInstalled = true;
+}
+
+/**
+ * Handler for the fatal signals that writes out the log messages pending in
+ * the buffers of all channels and then re-raises the signal. Only
+ * async-signal-safe functions are used; in particular, no locks are taken
+ * and the output is written synchronously rather than via POSIX AIO.
+ *
+ * \param signal
+ *      Signal received
+ */
+void RuntimeLogger::crashSignalHandler(int signal, siginfo_t*, void*) {
+  if (!crashDrainStarted.exchange(true)) {
+    RuntimeLogger* loggers[NanoLogConfig::MAX_CHANNELS];
+    for (uint32_t i = 0; i < NanoLogConfig::MAX_CHANNELS; ++i) {
+      loggers[i] = channels[i].load(std::memory_order_acquire);
+
+      // Stop the logging threads from staging further log messages
+      if (loggers[i] != nullptr) loggers[i]->currentLogLevel = SILENT_LOG_LEVEL;
+    }
+
+    // The background thread of the primary channel parks while holding the
+    // registrationMutex, which the other channels' threads acquire, so it is
+    // parked last.
+    bool parked[NanoLogConfig::MAX_CHANNELS] = {};
+    for (uint32_t i = NanoLogConfig::MAX_CHANNELS; i-- > 0;) {
+      if (loggers[i] != nullptr) parked[i] = loggers[i]->requestCrashDrain();
+    }
+
+    for (uint32_t i = 0; i < NanoLogConfig::MAX_CHANNELS; ++i) {
+      if (parked[i]) loggers[i]->drainAfterCrash();
+    }
+
+    crashDrainCompleted.store(true, std::memory_order_release);
+  } else {
+    // Another thread is writing out the log messages
+    struct timespec interval = {0, 1000000};
+    while (!crashDrainCompleted.load(std::memory_order_acquire))
+      nanosleep(&interval, nullptr);
+  }
+
+  for (size_t i = 0; i < Util::arraySize(crashSignals); ++i) {
+    if (crashSignals[i] == signal)
+      sigaction(signal, &previousCrashActions[i], nullptr);
+  }
+
+  raise(signal);
+}
+
+/**
+ * Invoked by the fatal signal handler to request the background thread to
+ * park (see parkForCrashDrain()), after which the StagingBuffers can be
+ * drained by the handler.
  *
- * \param[out] bytesAvailable
- *      Number of bytes consumable
  * \return
- *      Pointer to the consumable space
+ *      True if the StagingBuffers can be drained; false if the background
+ *      thread did not park within NanoLogConfig::CRASH_DRAIN_TIMEOUT_US
  */
-char* RuntimeLogger::StagingBuffer::peek(uint64_t* bytesAvailable) {
-  // Save a consistent copy of producerPos
-  uint64_t cachedProducerPos = producerPos;
+bool RuntimeLogger::requestCrashDrain() {
+  // Nothing to wait for if the background thread itself crashed, or the
+  // thread driving the compression in embedded mode
+  if (channelBeingPolled == this) return true;
+  if (!embedded &&
+      (!compressionThread.joinable() ||
+       pthread_equal(pthread_self(), compressionThread.native_handle())))
+    return true;
+
+  crashDrainState.store(CRASH_DRAIN_REQUESTED);
+  ringDoorbell();
+
+  const uint32_t intervalUs = 100;
+  struct timespec interval = {0, intervalUs * 1000};
+  for (uint32_t waited = 0; waited < NanoLogConfig::CRASH_DRAIN_TIMEOUT_US;
+       waited += intervalUs) {
+    if (crashDrainState.load(std::memory_order_acquire) == CRASH_DRAIN_PARKED)
+      return true;
+
+    // In embedded mode, no thread parks; polls stop once they observe the
+    // request instead (see driveCompression())
+    if (embedded && !pollInProgress.load()) return true;
+
+    nanosleep(&interval, nullptr);
+  }
 
-  if (cachedProducerPos < consumerPos) {
-    Fence::lfence();  // Prevent reading new producerPos but old endOf...
-    *bytesAvailable = endOfRecordedSpace - consumerPos;
+  return false;
+}
 
-    if (*bytesAvailable > 0) return &storage[consumerPos];
+/**
+ * Invoked by the background thread upon a crash drain request to write out
+ * its pending output and then park for good while holding the locks that
+ * keep the buffer and log site registries stable for the signal handler.
+ *
+ * \param encoder
+ *      Encoder of the background thread
+ */
+void RuntimeLogger::parkForCrashDrain(Log::Encoder& encoder) {
+  waitForAIO();
+
+  // Collect the output of the additional compression threads, which stop
+  // once they observe the request
+  uint64_t deadline =
+      PerfUtils::Cycles::rdtsc() +
+      PerfUtils::Cycles::fromNanoseconds(
+          NanoLogConfig::CRASH_DRAIN_TIMEOUT_US * 1000 / 2);
+  while (true) {
+    bool collected = collectHandoffs(encoder);
+    if (!collected || encoder.getEncodedBytes() > 0) {
+      writeSynchronously(compressingBuffer, encoder.getEncodedBytes());
+      encoder.swapBuffer(compressingBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
+    }
 
-    // Roll over
-    consumerPos = 0;
+    if (collected && (helpersIdle() || PerfUtils::Cycles::rdtsc() > deadline))
+      break;
+
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
   }
 
-  *bytesAvailable = cachedProducerPos - consumerPos;
-  return &storage[consumerPos];
+  std::unique_lock<std::mutex> bufferLock(bufferMutex);
+  std::unique_lock<std::mutex> registrationLock(registrationMutex,
+                                                std::defer_lock);
+  if (this == &nanoLogSingleton) registrationLock.lock();
+
+  crashDrainState.store(CRASH_DRAIN_PARKED, std::memory_order_release);
+
+  // The process terminates once the signal handler re-raises the signal
+  while (true) std::this_thread::sleep_for(std::chrono::seconds(1));
 }
 
 /**
- * Main compression thread that handles scanning through the StagingBuffers,
- * compressing log entries, and outputting a compressed log file.
+ * Compresses the log messages pending in the StagingBuffers and writes them
+ * to the log file synchronously. This is invoked by the fatal signal handler
+ * once the background thread is parked or if it crashed itself, and must
+ * only invoke async-signal-safe functions.
  */
-void RuntimeLogger::compressionThreadMain() {
-  // Index of the last StagingBuffer checked for uncompressed log messages
-  size_t lastStagingBufferChecked = 0;
+void RuntimeLogger::drainAfterCrash() {
+  // The background thread crashed while a write was outstanding
+  if (hasOutstandingOperation) {
+    const struct aiocb* const aiocb_list[] = {&aioCb};
+    while (aio_error(&aioCb) == EINPROGRESS) aio_suspend(aiocb_list, 1, NULL);
+    hasOutstandingOperation = false;
+  }
 
-  // Marks when the thread wakes up. This value should be used to calculate
-  // the number of cyclesActive right before blocking/sleeping and then updated
-  // to the latest rdtsc() when the thread re-awakens.
-  uint64_t cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-  cycleAtThreadStart = cyclesAwakeStart;
+  // The output of the last step in embedded mode is still pending, unless
+  // the step was interrupted by the crash
+  if (embedded && compressionState != nullptr && channelBeingPolled != this)
+    writeSynchronously(compressingBuffer,
+                       compressionState->encoder.getEncodedBytes());
 
-  // Manages the state associated with compressing log messages
+  // The output starts over with a checkpoint and the full dictionary, since
+  // the compressingBuffer of a crashed background thread is in an unknown
+  // state and its dictionary entries may not have been written.
   Log::Encoder encoder(compressingBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
+  SiteDictionary::View sites = nanoLogSingleton.invocationSites.view();
+
+  auto flush = [&]() {
+    writeSynchronously(compressingBuffer, encoder.getEncodedBytes());
+    encoder.swapBuffer(compressingBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
+  };
+
+  uint32_t nextSite = 0;
+  while (nextSite < sites.size()) {
+    encoder.encodeNewDictionaryEntries(nextSite, sites);
+    if (nextSite < sites.size()) flush();
+  }
 
-  // Indicates whether a compression operation failed or not due
-  // to insufficient space in the outputBuffer
-  bool outputBufferFull = false;
+  bool wrapAround = true;
+  auto drain = [&](auto* buffer) {
+    bool flushed = false;
+    while (true) {
+      uint64_t peekBytes = 0;
+      char* peekPosition = buffer->peek(&peekBytes);
+      if (peekBytes == 0) return;
+
+      long bytesRead = encoder.encodeLogMsgs(peekPosition, peekBytes,
+                                             buffer->getId(), wrapAround,
+                                             sites, nullptr);
+
+      // Give up on the buffer if its next log message cannot be encoded
+      // into an empty output buffer
+      if (bytesRead == 0) {
+        if (flushed) return;
+        flush();
+        flushed = true;
+        continue;
+      }
 
-  // Indicates that in scanning the StagingBuffers, we have passed the
-  // zero-th index, but have not yet encoded that in he compressed output
-  bool wrapAround = false;
+      flushed = false;
+      wrapAround = false;
+      buffer->consume(bytesRead);
+    }
+  };
 
-  // Keeps a shadow mapping of the log identifiers to static information
-  // to allow the logging threads to register in parallel with compression
-  // lookup
-  std::vector<StaticLogInfo> shadowStaticInfo;
+  for (PriorityLane* lane : priorityLanes) drain(lane);
+  for (StagingBuffer* sb : threadBuffers) drain(sb);
 
-  // Each iteration of this loop scans for uncompressed log messages in the
-  // thread buffers, compresses as much as possible, and outputs it to a file.
-  // The loop will run so long as it's not shutdown or there's outstanding I/O
-  while (!compressionThreadShouldExit || encoder.getEncodedBytes() > 0 ||
-         hasOutstandingOperation) {
-    coreId = sched_getcpu();
+  flush();
+  fdatasync(outputFd);
+}
+
+/**
+ * Writes a buffer to the log file synchronously, padding it for O_DIRECT if
+ * necessary. This is used instead of POSIX AIO when the process crashes.
+ *
+ * \param buffer
+ *      Buffer to write, which must have room for the padding
+ * \param nbytes
+ *      Number of bytes to write
+ */
+void RuntimeLogger::writeSynchronously(char* buffer, size_t nbytes) {
+  if (NanoLogConfig::FILE_PARAMS & O_DIRECT) {
+    size_t bytesOver = nbytes % 512;
+
+    if (bytesOver != 0) {
+      memset(buffer + nbytes, 0, 512 - bytesOver);
+      nbytes += 512 - bytesOver;
+    }
+  }
+
+  while (nbytes > 0) {
+    ssize_t written = write(outputFd, buffer, nbytes);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+
+    buffer += written;
+    nbytes -= written;
+  }
+}
+
+/**
+ * Returns true if any of the priority lanes has log messages pending. The
+ * bufferMutex must be held.
+ */
+bool RuntimeLogger::hasPriorityWork() {
+  for (PriorityLane* lane : priorityLanes) {
+    if (lane->getBytesPending() > 0) return true;
+  }
+
+  return false;
+}
+
+/**
+ * Compresses all the log messages pending in the priority lanes and deletes
+ * the lanes of threads that have exited. The lanes are small, so they are
+ * encoded while holding the bufferMutex, which must be held by the caller.
+ *
+ * The log messages of a backed up StagingBuffer may reach the output several
+ * passes after the ones of its thread's priority lane, since a pass consumes
+ * a contiguous part of the StagingBuffer at a time and an additional
+ * compression thread may hold the StagingBuffer. This is beyond the window
+ * the decompressor sorts within, so a lane is drained together with its
+ * thread's StagingBuffer, and left to the compression thread holding the
+ * claim on the StagingBuffer if there is one (see compressionHelperMain()).
+ *
+ * \param encoder
+ *      Encoder to compress the log messages with
+ * \param[in/out] wrapAround
+ *      Indicates that the next buffer extent starts a new pass through the
+ *      buffers; reset once an extent is encoded
+ * \param dictionary
+ *      Static information of the log messages encoded so far
+ *
+ * \return
+ *      False if the encoder ran out of space before the lanes were drained
+ */
+bool RuntimeLogger::drainPriorityLanes(
+    Log::Encoder& encoder, bool& wrapAround,
+    SiteDictionary::View dictionary) {
+  const std::vector<StagingBuffer*>& slots =
+      bufferRegistry.load(std::memory_order_relaxed)->slots;
+  for (size_t i = 0; i < priorityLanes.size(); ++i) {
+    PriorityLane* lane = priorityLanes[i];
+
+    // Threads staging to per-CPU buffers have no StagingBuffer of their own
+    StagingBuffer* sb = nullptr;
+    if (lane->slot < slots.size() && slots[lane->slot] != nullptr &&
+        slots[lane->slot]->getId() == lane->getId())
+      sb = slots[lane->slot];
+
+    // The claim keeps the other compression threads off the lane
+    if (sb != nullptr) {
+      if (lane->getBytesPending() == 0 && !lane->checkCanDelete()) continue;
+      if (!sb->tryClaim()) continue;
+
+      // The other compression threads' output may hold earlier log messages
+      // of the StagingBuffer
+      if (!collectHandoffs(encoder)) {
+        sb->releaseClaim();
+        return false;
+      }
+    }
+
+    // A lane may hold two segments when its producer has rolled over
+    bool outputBufferFull = false;
+    for (int segment = 0; segment < 2; ++segment) {
+      uint64_t peekBytes = 0;
+      char* peekPosition = lane->peek(&peekBytes);
+      if (peekBytes == 0) break;
+
+      uint64_t logsProcessedBefore = logsProcessed;
+      long bytesRead =
+          encoder.encodeLogMsgs(peekPosition, peekBytes, lane->getId(),
+                                wrapAround, dictionary, &logsProcessed);
+      lane->recordsEncoded += logsProcessed - logsProcessedBefore;
+      if (bytesRead == 0) {
+        outputBufferFull = true;
+        break;
+      }
+
+      wrapAround = false;
+      lane->consume(bytesRead);
+      totalBytesRead += bytesRead;
+      priorityBytesRead += bytesRead;
+    }
+
+    // The StagingBuffer is drained after the lane, so that it holds no log
+    // messages staged before the ones drained from the lane
+    for (int segment = 0; sb != nullptr && segment < 2 && !outputBufferFull;
+         ++segment) {
+      uint64_t peekBytes = 0;
+      char* peekPosition = sb->peek(&peekBytes);
+      if (peekBytes == 0) break;
+
+      encodeStagingBuffer(encoder, sb, peekPosition, peekBytes, peekBytes,
+                          wrapAround, dictionary, &outputBufferFull);
+    }
+
+    bool deleteLane = !outputBufferFull && lane->checkCanDelete();
+    if (sb != nullptr) {
+      if (deleteLane) sb->lane.store(nullptr, std::memory_order_relaxed);
+      sb->releaseClaim();
+    }
+
+    if (outputBufferFull) return false;
+
+    if (deleteLane) {
+      delete lane;
+      priorityLanes.erase(priorityLanes.begin() + i);
+      numPriorityLanes.store(downCast<uint32_t>(priorityLanes.size()),
+                             std::memory_order_relaxed);
+      --i;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Compresses the log messages of a StagingBuffer claimed by the background
+ * thread and consumes them from the StagingBuffer.
+ *
+ * \param encoder
+ *      Encoder to compress the log messages with
+ * \param sb
+ *      StagingBuffer to compress
+ * \param peekPosition
+ *      Log messages returned by the StagingBuffer's peek()
+ * \param peekBytes
+ *      Number of bytes returned by peek()
+ * \param quota
+ *      Number of bytes after which to stop; the quota is rounded up to the
+ *      end of the log message it falls into
+ * \param[in/out] wrapAround
+ *      Indicates that the next buffer extent starts a new pass through the
+ *      buffers; reset once an extent is encoded
+ * \param dictionary
+ *      Static information of the log messages encoded so far
+ * \param[out] outputBufferFull
+ *      Set if the encoder ran out of space
+ *
+ * \return
+ *      Number of bytes consumed from the StagingBuffer
+ */
+uint64_t RuntimeLogger::encodeStagingBuffer(
+    Log::Encoder& encoder, StagingBuffer* sb, char* peekPosition,
+    uint64_t peekBytes, uint64_t quota, bool& wrapAround,
+    SiteDictionary::View dictionary, bool* outputBufferFull) {
+  uint64_t chunkSize =
+      std::min(uint64_t(NanoLogConfig::RELEASE_THRESHOLD), quota);
+  uint64_t bytesConsumed = 0;
+
+  // Encode the data in chunks to release space to the producer early
+  while (bytesConsumed < peekBytes && bytesConsumed < quota) {
+    char* chunk = peekPosition + bytesConsumed;
+    uint64_t remaining = peekBytes - bytesConsumed;
+
+    // Log messages are never split, so a chunk holds at least the next one
+    auto* entry = reinterpret_cast<Log::UncompressedEntry*>(chunk);
+    uint64_t bytesToEncode = std::min(
+        remaining, std::max(chunkSize, uint64_t(entry->entrySize)));
+
+    uint64_t logsProcessedBefore = logsProcessed;
+    long bytesRead =
+        encoder.encodeLogMsgs(chunk, bytesToEncode, sb->getId(), wrapAround,
+                              dictionary, &logsProcessed);
+    sb->recordsEncoded += logsProcessed - logsProcessedBefore;
+
+    if (bytesRead == 0) {
+      *outputBufferFull = true;
+      break;
+    }
+
+    wrapAround = false;
+    sb->consume(bytesRead);
+    bytesConsumed += bytesRead;
+  }
+
+  totalBytesRead += bytesConsumed;
+  if (bytesConsumed < peekBytes && !*outputBufferFull) ++numQuotaCutoffs;
+  return bytesConsumed;
+}
+
+/**
+ * Compresses the StagingBuffers whose producers are blocked or that are
+ * filled beyond NanoLogConfig::SCAN_URGENT_FILL_PERCENT ahead of the pass,
+ * blocked ones first and then the fullest first (see NanoLog::setScanPolicy()).
+ * Each StagingBuffer is compressed up to NanoLogConfig::SCAN_QUOTA_BYTES.
+ *
+ * \param registry
+ *      BufferRegistry scanned by the background thread
+ * \param encoder
+ *      Encoder to compress the log messages with
+ * \param[in/out] wrapAround
+ *      Indicates that the next buffer extent starts a new pass through the
+ *      buffers; reset once an extent is encoded
+ * \param dictionary
+ *      Static information of the log messages encoded so far
+ *
+ * \return
+ *      False if the encoder ran out of space
+ */
+bool RuntimeLogger::serviceUrgentBuffers(
+    const BufferRegistry* registry, Log::Encoder& encoder, bool& wrapAround,
+    SiteDictionary::View dictionary) {
+  const uint64_t blockedPriority = std::numeric_limits<uint64_t>::max();
+  const uint64_t urgentBytes = uint64_t(NanoLogConfig::STAGING_BUFFER_SIZE) *
+                               NanoLogConfig::SCAN_URGENT_FILL_PERCENT / 100;
+  const std::vector<StagingBuffer*>& slots = registry->slots;
+  uint32_t numSlots = downCast<uint32_t>(slots.size());
+
+  urgentBuffers.clear();
+  for (uint32_t slot = activeBuffers.findNext(0, numSlots); slot < numSlots;
+       slot = activeBuffers.findNext(slot + 1, numSlots)) {
+    StagingBuffer* sb = slots[slot];
+    if (sb == nullptr) continue;
+
+    uint64_t bytesPending = sb->getBytesPending();
+    if (sb->producerBlocked.load(std::memory_order_relaxed))
+      urgentBuffers.emplace_back(blockedPriority, sb);
+    else if (bytesPending >= urgentBytes)
+      urgentBuffers.emplace_back(bytesPending, sb);
+  }
+
+  if (urgentBuffers.empty()) return true;
+
+  std::sort(urgentBuffers.begin(), urgentBuffers.end(),
+            [](const std::pair<uint64_t, StagingBuffer*>& a,
+               const std::pair<uint64_t, StagingBuffer*>& b) {
+              return a.first > b.first;
+            });
+
+  for (const auto& urgent : urgentBuffers) {
+    StagingBuffer* sb = urgent.second;
+    if (!sb->tryClaim()) continue;
+
+    // The additional compression threads may hold earlier log messages
+    if (!collectHandoffs(encoder)) {
+      sb->releaseClaim();
+      return false;
+    }
+
+    uint64_t peekBytes = 0;
+    char* peekPosition = sb->peek(&peekBytes);
+    if (peekBytes == 0) {
+      sb->releaseClaim();
+      continue;
+    }
 
-    // Indicates how many bytes we have consumed from the StagingBuffers
-    // in a single iteration of the while above. A value of 0 means we
-    // were unable to consume anymore data any of the stagingBuffers
-    // (either due to empty stagingBuffers or a full output encoder)
-    uint64_t bytesConsumedThisIteration = 0;
+    ++numUrgentServices;
+    if (urgent.first == blockedPriority) ++numBlockedServices;
 
     uint64_t start = PerfUtils::Cycles::rdtsc();
-    // Step 1: Find buffers with entries and compress them
-    {
-      std::unique_lock<std::mutex> lock(bufferMutex);
-      size_t i = lastStagingBufferChecked;
-
-      // Output new dictionary entries, if necessary
-      if (nextInvocationIndexToBePersisted < invocationSites.size()) {
-        std::unique_lock<std::mutex> lock(registrationMutex);
-        encoder.encodeNewDictionaryEntries(nextInvocationIndexToBePersisted,
-                                           invocationSites);
-
-        // update our shadow copy
-        for (uint64_t i = shadowStaticInfo.size();
-             i < nextInvocationIndexToBePersisted; ++i) {
-          shadowStaticInfo.push_back(invocationSites.at(i));
-        }
+
+    bool outputBufferFull = false;
+    encodeStagingBuffer(encoder, sb, peekPosition, peekBytes,
+                        NanoLogConfig::SCAN_QUOTA_BYTES, wrapAround,
+                        dictionary, &outputBufferFull);
+    sb->releaseClaim();
+
+    cyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
+
+    if (outputBufferFull) return false;
+  }
+
+  return true;
+}
+
+/**
+ * Wakes up the background thread if it sleeps on the doorbell (see
+ * NanoLog::setWakeupPolicy()). This function is async-signal-safe.
+ */
+void RuntimeLogger::ringDoorbell() {
+  doorbell.fetch_add(1, std::memory_order_release);
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&doorbell), FUTEX_WAKE_PRIVATE,
+          1, nullptr, nullptr, 0);
+}
+
+/**
+ * Blocks the background thread while it is idle according to the wakeup
+ * policy (see NanoLog::setWakeupPolicy()). Sync requests and shutdowns cut
+ * the wait short under all policies.
+ *
+ * \param lock
+ *      Lock on the condMutex, which is released while waiting
+ * \param doorbellRing
+ *      Value of the doorbell before the thread last checked for work
+ * \param idleWaits
+ *      Number of consecutive waits without any work in between
+ */
+void RuntimeLogger::waitForWork(std::unique_lock<std::mutex>& lock,
+                                uint32_t doorbellRing, uint32_t idleWaits) {
+  switch (wakeupPolicy.load(std::memory_order_relaxed)) {
+    case WAKEUP_BUSY_POLL:
+      return;
+    case WAKEUP_BACKOFF:
+      workAdded.wait_for(
+          lock, std::chrono::microseconds(getBackoffIntervalUs(idleWaits)));
+      return;
+    case WAKEUP_DOORBELL:
+      // Completing the I/O and sync rounds is left to polling, since
+      // neither rings the doorbell
+      if (!hasOutstandingOperation && syncStatus == SYNC_COMPLETED) {
+        lock.unlock();
+        waitForDoorbell(doorbellRing);
+        return;
       }
+      break;
+    default:
+      break;
+  }
+
+  workAdded.wait_for(lock, std::chrono::microseconds(
+                               NanoLogConfig::POLL_INTERVAL_NO_WORK_US));
+}
+
+/**
+ * Arms the doorbells of the StagingBuffers and priority lanes and sleeps
+ * until a logging thread rings the doorbell (see finishAlloc()) or
+ * NanoLogConfig::DOORBELL_TIMEOUT_US passes.
+ *
+ * \param doorbellRing
+ *      Value of the doorbell before the thread last checked for work; the
+ *      thread does not sleep if the doorbell was rung since
+ */
+void RuntimeLogger::waitForDoorbell(uint32_t doorbellRing) {
+  {
+    // The doorbells of the StagingBuffers outside the activeBuffers are
+    // armed (see sweepIdleBuffers())
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    const std::vector<StagingBuffer*>& slots =
+        bufferRegistry.load(std::memory_order_relaxed)->slots;
+    uint32_t numSlots = downCast<uint32_t>(slots.size());
+    for (uint32_t slot = activeBuffers.findNext(0, numSlots); slot < numSlots;
+         slot = activeBuffers.findNext(slot + 1, numSlots)) {
+      if (slots[slot] != nullptr)
+        slots[slot]->doorbellArmed.store(true, std::memory_order_relaxed);
+    }
+    for (PriorityLane* lane : priorityLanes)
+      lane->doorbellArmed.store(true, std::memory_order_relaxed);
+
+    // The logging threads check the doorbell after bumping their producerPos
+    // without a fence. The membarrier() forces one onto them, so that either
+    // they find the doorbell armed or this thread finds their log messages.
+    if (!membarrierRegistered ||
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0)
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for (uint32_t slot = activeBuffers.findNext(0, numSlots); slot < numSlots;
+         slot = activeBuffers.findNext(slot + 1, numSlots)) {
+      if (slots[slot] != nullptr && slots[slot]->getBytesPending() > 0)
+        return;
+    }
+    for (PriorityLane* lane : priorityLanes)
+      if (lane->getBytesPending() > 0) return;
+  }
+
+  struct timespec timeout = {
+      NanoLogConfig::DOORBELL_TIMEOUT_US / 1000000,
+      (NanoLogConfig::DOORBELL_TIMEOUT_US % 1000000) * 1000};
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&doorbell), FUTEX_WAIT_PRIVATE,
+          doorbellRing, &timeout, nullptr, 0);
+}
+
+// CompressionState constructor
+RuntimeLogger::CompressionState::CompressionState(char* outputBuffer)
+    : lastStagingBufferChecked(0),
+      cyclesAwakeStart(PerfUtils::Cycles::rdtsc()),
+      encoder(outputBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE),
+      outputBufferFull(false),
+      wrapAround(false),
+      nextModuleMapCheck(0),
+      nextGovernorCheck(0),
+      nextScaleCheck(0),
+      stealing(false),
+      foundWorkInShard(false),
+      passCutShort(false),
+      nextMetricEpoch(PerfUtils::Cycles::rdtsc() +
+                      PerfUtils::Cycles::fromNanoseconds(
+                          NanoLogConfig::METRIC_EPOCH_INTERVAL_US * 1000)),
+      nextIdleBufferSweep(0),
+      idleWaits(0) {}
+
+/**
+ * Main compression thread that handles scanning through the StagingBuffers,
+ * compressing log messages, and outputting a compressed log file.
+ */
+void RuntimeLogger::compressionThreadMain() {
+  if (compressionState == nullptr)
+    compressionState = new CompressionState(compressingBuffer);
+
+  CompressionState& state = *compressionState;
+  state.cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+  cycleAtThreadStart = state.cyclesAwakeStart;
+
+  // The loop will run so long as it's not shutdown or there's outstanding I/O
+  while (!compressionThreadShouldExit || state.encoder.getEncodedBytes() > 0 ||
+         hasOutstandingOperation || numHandoffs.load() > 0)
+    compressionStep(state, NO_DEADLINE, true);
+
+  cycleAtThreadStart = 0;
+  cyclesActive += PerfUtils::Cycles::rdtsc() - state.cyclesAwakeStart;
+}
+
+/**
+ * Scans for uncompressed log messages in the StagingBuffers, compresses as
+ * much as possible, and outputs it to the log file. This is invoked in a loop
+ * by the background thread or, in embedded mode, by the application via
+ * poll().
+ *
+ * \param state
+ *      State of the compression
+ * \param deadline
+ *      Time (in rdtsc cycles) at which to cut the pass through the
+ *      StagingBuffers short; the next step resumes where it left off
+ * \param blocking
+ *      Indicates whether the step may sleep while there is no work and wait
+ *      for the output buffer to become available; otherwise it returns
+ *
+ * \return
+ *      True if the step had work, i.e. log messages to compress or a sync()
+ *      or write in progress
+ */
+bool RuntimeLogger::compressionStep(CompressionState& state, uint64_t deadline,
+                                    bool blocking) {
+  uint32_t& lastStagingBufferChecked = state.lastStagingBufferChecked;
+  uint64_t& cyclesAwakeStart = state.cyclesAwakeStart;
+  Log::Encoder& encoder = state.encoder;
+  bool& outputBufferFull = state.outputBufferFull;
+  bool& wrapAround = state.wrapAround;
+  uint64_t& nextModuleMapCheck = state.nextModuleMapCheck;
+  uint64_t& nextGovernorCheck = state.nextGovernorCheck;
+  uint64_t& nextScaleCheck = state.nextScaleCheck;
+  bool& stealing = state.stealing;
+  bool& foundWorkInShard = state.foundWorkInShard;
+  bool& passCutShort = state.passCutShort;
+  uint64_t& nextMetricEpoch = state.nextMetricEpoch;
+  uint64_t& nextIdleBufferSweep = state.nextIdleBufferSweep;
+  uint32_t& idleWaits = state.idleWaits;
+
+  coreId = sched_getcpu();
+
+  // Any ring of the doorbell after this point cuts the next sleep short
+  uint32_t doorbellRing = doorbell.load(std::memory_order_acquire);
+
+  // Hand the StagingBuffers over to the fatal signal handler, which takes
+  // over from the application's thread in embedded mode
+  if (crashDrainState.load(std::memory_order_acquire) ==
+          CRASH_DRAIN_REQUESTED &&
+      !embedded)
+    parkForCrashDrain(encoder);
+
+  // Indicates how many bytes we have consumed from the StagingBuffers
+  // in this step. A value of 0 means we
+  // were unable to consume anymore data any of the stagingBuffers
+  // (either due to empty stagingBuffers or a full output encoder)
+  uint64_t bytesConsumedThisIteration = 0;
 
-      // Scan through the threadBuffers looking for log messages to
-      // compress while the output buffer is not full.
-      while (!outputBufferFull && !threadBuffers.empty()) {
+  uint64_t start = PerfUtils::Cycles::rdtsc();
+
+  // Keep the module maps up to date for symbolizing backtraces
+  if (moduleMapsEnabled && start >= nextModuleMapCheck) {
+    snapshotModuleMaps();
+    nextModuleMapCheck =
+        start + PerfUtils::Cycles::fromNanoseconds(
+                    NanoLogConfig::MODULE_MAP_CHECK_INTERVAL_US * 1000);
+  }
+
+  // Drop less severe log messages while the StagingBuffers are backed up
+  if (start >= nextGovernorCheck) {
+    updateGovernor();
+    nextGovernorCheck =
+        start + PerfUtils::Cycles::fromNanoseconds(
+                    NanoLogConfig::GOVERNOR_CHECK_INTERVAL_US * 1000);
+  }
+
+  // Start another compression thread while the StagingBuffers back up
+  if (start >= nextScaleCheck) {
+    scaleCompressionThreads();
+    nextScaleCheck =
+        start + PerfUtils::Cycles::fromNanoseconds(
+                    NanoLogConfig::COMPRESSION_THREAD_SCALE_CHECK_INTERVAL_US *
+                    1000);
+  }
+
+  // Start a new metric epoch and stage the threads' aggregates of the last
+  // one. The metrics are only collected by the primary channel.
+  if (this == &nanoLogSingleton) {
+    bool advanceEpoch = start >= nextMetricEpoch;
+    if (advanceEpoch)
+      nextMetricEpoch =
+          start + PerfUtils::Cycles::fromNanoseconds(
+                      NanoLogConfig::METRIC_EPOCH_INTERVAL_US * 1000);
+    if (advanceEpoch || metricsPending.load(std::memory_order_relaxed))
+      collectMetrics(advanceEpoch);
+  }
+
+  // Step 1: Find buffers with entries and compress them
+  {
+    // Output new dictionary entries, if necessary. The log sites are
+    // registered with the primary channel and shared by all channels.
+    // The entries are read in place while new log sites are registered.
+    const SiteDictionary& sites = nanoLogSingleton.invocationSites;
+    if (nextInvocationIndexToBePersisted < sites.size())
+      encoder.encodeNewDictionaryEntries(nextInvocationIndexToBePersisted,
+                                         sites.view());
+
+    // The log messages may only refer to the dictionary entries output so far
+    SiteDictionary::View dictionary =
+        sites.view(nextInvocationIndexToBePersisted);
+
+    // Severe log messages skip ahead of the backlog in the threadBuffers
+    if (numPriorityLanes.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(bufferMutex);
+      uint64_t bytesReadBefore = totalBytesRead;
+      if (!drainPriorityLanes(encoder, wrapAround, dictionary))
+        outputBufferFull = true;
+      bytesConsumedThisIteration += totalBytesRead - bytesReadBefore;
+    }
+
+    // Output handed over by the additional compression threads
+    if (!outputBufferFull && !collectHandoffs(encoder))
+      outputBufferFull = true;
+
+    // The StagingBuffers are scanned without the bufferMutex
+    const BufferRegistry* registry = enterBufferRegistry(scanEpoch);
+    const std::vector<StagingBuffer*>& slots = registry->slots;
+    uint32_t numSlots = downCast<uint32_t>(slots.size());
+
+    // Nearly full StagingBuffers skip ahead of the pass
+    bool fillPriority =
+        scanPolicy.load(std::memory_order_relaxed) == SCAN_FILL_PRIORITY;
+    if (fillPriority && !outputBufferFull) {
+      uint64_t bytesReadBefore = totalBytesRead;
+      if (!serviceUrgentBuffers(registry, encoder, wrapAround, dictionary))
+        outputBufferFull = true;
+      bytesConsumedThisIteration += totalBytesRead - bytesReadBefore;
+    }
+
+    // Scan through the slots of the StagingBuffers that may have log
+    // messages to compress while the output buffer is not full. The slots
+    // outside the activeBuffers are skipped, but count towards the pass.
+    uint32_t numThreads =
+        numCompressionThreads.load(std::memory_order_acquire);
+    uint32_t i = std::min(lastStagingBufferChecked, numSlots);
+    uint32_t slotsPassed = 0;
+    while (!outputBufferFull && numSlots > 0) {
+      StagingBuffer* sb = (i < numSlots) ? slots[i] : nullptr;
+      if (sb != nullptr && activeBuffers.test(i)) {
         uint64_t peekBytes = 0;
-        StagingBuffer* sb = threadBuffers[i];
-        char* peekPosition = sb->peek(&peekBytes);
+        char* peekPosition = nullptr;
+        bool inShard = isInShard(sb, 0, numThreads);
+
+        // The StagingBuffers of the other compression threads' shards are
+        // only consumed while this thread runs out of work of its own, a
+        // sync() is in progress, or they are to be deleted
+        bool claimed = (inShard || stealing || syncStatus != SYNC_COMPLETED ||
+                        sb->shouldDeallocate) &&
+                       sb->tryClaim();
+        if (claimed) {
+          if (!collectHandoffs(encoder)) {
+            sb->releaseClaim();
+            lastStagingBufferChecked = i;
+            outputBufferFull = true;
+            break;
+          }
 
-        // If there's work, unlock to perform it
+          peekPosition = sb->peek(&peekBytes);
+        } else if (sb->getBytesPending() > 0) {
+          sb->activeSinceSweep.store(true, std::memory_order_relaxed);
+        }
+
+        // If there's work, perform it
         if (peekBytes > 0) {
           uint64_t start = PerfUtils::Cycles::rdtsc();
-          lock.unlock();
+          sb->activeSinceSweep.store(true, std::memory_order_relaxed);
 
           // Record metrics on the peek size
           size_t sizeOfDist = Util::arraySize(stagingBufferPeekDist);
@@ -625,180 +3246,219 @@ void RuntimeLogger::compressionThreadMain() {
               (sizeOfDist * peekBytes) / NanoLogConfig::STAGING_BUFFER_SIZE;
           ++(stagingBufferPeekDist[distIndex]);
 
-          // Encode the data in RELEASE_THRESHOLD chunks
-          uint32_t remaining = downCast<uint32_t>(peekBytes);
-          while (remaining > 0) {
-            long bytesToEncode =
-                std::min(NanoLogConfig::RELEASE_THRESHOLD, remaining);
-            long bytesRead = encoder.encodeLogMsgs(
-                peekPosition + (peekBytes - remaining), bytesToEncode,
-                sb->getId(), wrapAround, shadowStaticInfo, &logsProcessed);
-
-            if (bytesRead == 0) {
-              lastStagingBufferChecked = i;
-              outputBufferFull = true;
-              break;
-            }
-
-            wrapAround = false;
-            remaining -= downCast<uint32_t>(bytesRead);
-            sb->consume(bytesRead);
-            totalBytesRead += bytesRead;
-            bytesConsumedThisIteration += bytesRead;
-          }
+          uint64_t quota =
+              (fillPriority) ? NanoLogConfig::SCAN_QUOTA_BYTES : peekBytes;
+          if (deadline != NO_DEADLINE)
+            quota = std::min(quota, uint64_t(NanoLogConfig::POLL_QUOTA_BYTES));
+          uint64_t bytesRead = encodeStagingBuffer(
+              encoder, sb, peekPosition, peekBytes, quota, wrapAround,
+              dictionary, &outputBufferFull);
+          bytesConsumedThisIteration += bytesRead;
+
+          if (outputBufferFull)
+            lastStagingBufferChecked = i;
+          else if (bytesRead < peekBytes)
+            passCutShort = true;
+
+          if (inShard) foundWorkInShard = true;
+          sb->releaseClaim();
           cyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
-          lock.lock();
-        } else {
+        } else if (claimed) {
           // If there's no work, check if we're supposed to delete
           // the stagingBuffer
           if (sb->checkCanDelete()) {
-            delete sb;
-
-            threadBuffers.erase(threadBuffers.begin() + i);
-            if (threadBuffers.empty()) {
-              lastStagingBufferChecked = i = 0;
-              wrapAround = true;
-              break;
-            }
-
-            // Back up the indexes so that we ensure we wont skip
-            // a buffer in our pass (and it's okay to redo one)
-            if (lastStagingBufferChecked >= i && lastStagingBufferChecked > 0) {
-              --lastStagingBufferChecked;
-            }
-            --i;
+            std::lock_guard<std::mutex> lock(bufferMutex);
+            unregisterStagingBuffer(i);
+          } else {
+            sb->releaseClaim();
           }
         }
+      }
 
-        i = (i + 1) % threadBuffers.size();
+      // Move on to the next slot that may have work, wrapping around to the
+      // first one at the end
+      uint32_t next = activeBuffers.findNext(i + 1, numSlots);
+      bool wrapped = (next == numSlots);
+      if (wrapped) {
+        next = activeBuffers.findNext(0, numSlots);
+        if (next == numSlots) next = i;
+        slotsPassed += numSlots - i + next;
+      } else {
+        slotsPassed += next - i;
+      }
+      i = next;
+
+      // The decompressor relies on every pass draining all StagingBuffers
+      // to order the log messages, so a pass that left log messages behind
+      // due to the quota is merged into the next one
+      if (wrapped && collectHandoffs(encoder) && helpersCompletedPass()) {
+        if (!passCutShort) wrapAround = true;
+        passCutShort = false;
+      }
 
-        if (i == 0) wrapAround = true;
+      // Completed a full pass through the buffers
+      if (slotsPassed >= numSlots) {
+        stealing = !foundWorkInShard;
+        foundWorkInShard = false;
+        break;
+      }
 
-        // Completed a full pass through the buffers
-        if (i == lastStagingBufferChecked) break;
+      // Cut the pass short to drain the priority lanes first; the next
+      // pass resumes with the next buffer. Passes that have not encoded
+      // anything yet are completed, since sync() relies on them.
+      if (numPriorityLanes.load(std::memory_order_relaxed) > 0 &&
+          encoder.getEncodedBytes() > 0) {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        if (hasPriorityWork()) {
+          lastStagingBufferChecked = i;
+          break;
+        }
       }
 
-      cyclesScanningAndCompressing += PerfUtils::Cycles::rdtsc() - start;
+      // Likewise once the budget of a poll() is used up
+      if (deadline != NO_DEADLINE && encoder.getEncodedBytes() > 0 &&
+          PerfUtils::Cycles::rdtsc() >= deadline) {
+        lastStagingBufferChecked = i;
+        break;
+      }
     }
 
-    // If there's no data to output, go to sleep.
-    if (encoder.getEncodedBytes() == 0) {
-      std::unique_lock<std::mutex> lock(condMutex);
+    // Stop visiting the StagingBuffers of the threads gone idle
+    if (start >= nextIdleBufferSweep) {
+      sweepIdleBuffers(registry);
+      nextIdleBufferSweep =
+          start + PerfUtils::Cycles::fromNanoseconds(
+                      NanoLogConfig::IDLE_BUFFER_SWEEP_INTERVAL_US * 1000);
+    }
 
-      // If a sync was requested, we should make at least 1 more
-      // pass to make sure we got everything up to the sync point.
-      if (syncStatus == SYNC_REQUESTED) {
-        syncStatus = PERFORMING_SECOND_PASS;
-        continue;
-      }
+    exitBufferRegistry(scanEpoch);
+    reclaimBufferRegistries();
 
-      if (syncStatus == PERFORMING_SECOND_PASS) {
-        syncStatus =
-            (hasOutstandingOperation) ? WAITING_ON_AIO : SYNC_COMPLETED;
-      }
+    cyclesScanningAndCompressing += PerfUtils::Cycles::rdtsc() - start;
+  }
 
-      if (syncStatus == SYNC_COMPLETED) {
-        hintSyncCompleted.notify_one();
-      }
+  // If there's no data to output, go to sleep.
+  if (encoder.getEncodedBytes() == 0) {
+    std::unique_lock<std::mutex> lock(condMutex);
 
-      cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
-      workAdded.wait_for(lock, std::chrono::microseconds(
-                                   NanoLogConfig::POLL_INTERVAL_NO_WORK_US));
+    // If a sync was requested, we should make at least 1 more
+    // pass to make sure we got everything up to the sync point.
+    if (syncStatus == SYNC_REQUESTED) {
+      syncStatus = PERFORMING_SECOND_PASS;
+      return true;
+    }
+
+    // The additional compression threads may still hold log messages
+    // from before the sync point
+    if (syncStatus == PERFORMING_SECOND_PASS && helpersIdle()) {
+      if (hasOutstandingOperation)
+        syncStatus = WAITING_ON_AIO;
+      else
+        completeSyncRound();
+    }
 
+    // A poll() returns to the application instead
+    if (blocking) {
+      cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+      waitForWork(lock, doorbellRing, idleWaits++);
       cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
     }
+  } else {
+    idleWaits = 0;
+  }
 
-    if (hasOutstandingOperation) {
-      if (aio_error(&aioCb) == EINPROGRESS) {
-        const struct aiocb* const aiocb_list[] = {&aioCb};
-        if (outputBufferFull) {
-          // If the output buffer is full and we're not done,
-          // wait for completion
+  if (hasOutstandingOperation) {
+    if (aio_error(&aioCb) == EINPROGRESS) {
+      const struct aiocb* const aiocb_list[] = {&aioCb};
+      if (outputBufferFull && blocking) {
+        // If the output buffer is full and we're not done,
+        // wait for completion
+        cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+        int err = aio_suspend(aiocb_list, 1, NULL);
+        cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+        if (err != 0)
+          perror(
+              "LogCompressor's Posix AIO "
+              "suspend operation failed");
+      } else {
+        // If there's no new data, go to sleep.
+        if (blocking && bytesConsumedThisIteration == 0 &&
+            NanoLogConfig::POLL_INTERVAL_DURING_IO_US > 0 &&
+            wakeupPolicy.load(std::memory_order_relaxed) !=
+                WAKEUP_BUSY_POLL) {
+          std::unique_lock<std::mutex> lock(condMutex);
           cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
-          int err = aio_suspend(aiocb_list, 1, NULL);
+          workAdded.wait_for(lock,
+                             std::chrono::microseconds(
+                                 NanoLogConfig::POLL_INTERVAL_DURING_IO_US));
           cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-          if (err != 0)
-            perror(
-                "LogCompressor's Posix AIO "
-                "suspend operation failed");
-        } else {
-          // If there's no new data, go to sleep.
-          if (bytesConsumedThisIteration == 0 &&
-              NanoLogConfig::POLL_INTERVAL_DURING_IO_US > 0) {
-            std::unique_lock<std::mutex> lock(condMutex);
-            cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
-            workAdded.wait_for(lock,
-                               std::chrono::microseconds(
-                                   NanoLogConfig::POLL_INTERVAL_DURING_IO_US));
-            cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-          }
-
-          if (aio_error(&aioCb) == EINPROGRESS) continue;
         }
-      }
 
-      // Finishing up the IO
-      int err = aio_error(&aioCb);
-      ssize_t ret = aio_return(&aioCb);
-
-      if (err != 0) {
-        fprintf(stderr,
-                "LogCompressor's POSIX AIO failed"
-                " with %d: %s\r\n",
-                err, strerror(err));
-      } else if (ret < 0) {
-        perror("LogCompressor's Posix AIO Write failed");
-      }
-      ++numAioWritesCompleted;
-      hasOutstandingOperation = false;
-      cyclesDiskIO_upperBound += (start - cyclesAtLastAIOStart);
-
-      // We've completed an AIO, check if we need to notify
-      if (syncStatus == WAITING_ON_AIO) {
-        std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
-        if (syncStatus == WAITING_ON_AIO) {
-          syncStatus = SYNC_COMPLETED;
-          hintSyncCompleted.notify_one();
-        }
+        if (aio_error(&aioCb) == EINPROGRESS) return true;
       }
     }
 
-    // If we reach this point in the code, it means that all AIO operations
-    // have completed and the double buffer is now free. We'll check if
-    // we need to start a new AIO.
-    ssize_t bytesToWrite = encoder.getEncodedBytes();
-    if (bytesToWrite == 0) continue;
-
-    // Pad the output if necessary
-    if (NanoLogConfig::FILE_PARAMS & O_DIRECT) {
-      ssize_t bytesOver = bytesToWrite % 512;
+    // Finishing up the IO
+    int err = aio_error(&aioCb);
+    ssize_t ret = aio_return(&aioCb);
 
-      if (bytesOver != 0) {
-        memset(compressingBuffer, 0, 512 - bytesOver);
-        bytesToWrite = bytesToWrite + 512 - bytesOver;
-        padBytesWritten += (512 - bytesOver);
-      }
+    if (err != 0) {
+      fprintf(stderr,
+              "LogCompressor's POSIX AIO failed"
+              " with %d: %s\r\n",
+              err, strerror(err));
+    } else if (ret < 0) {
+      perror("LogCompressor's Posix AIO Write failed");
     }
+    ++numAioWritesCompleted;
+    hasOutstandingOperation = false;
+    cyclesDiskIO_upperBound += (start - cyclesAtLastAIOStart);
+    markRecordsPersisted();
 
-    aioCb.aio_fildes = outputFd;
-    aioCb.aio_buf = compressingBuffer;
-    aioCb.aio_nbytes = bytesToWrite;
-    totalBytesWritten += bytesToWrite;
+    // We've completed an AIO, check if we need to notify
+    if (syncStatus == WAITING_ON_AIO) {
+      std::unique_lock<std::mutex> lock(condMutex);
+      if (syncStatus == WAITING_ON_AIO) completeSyncRound();
+    }
+  }
 
-    cyclesAtLastAIOStart = PerfUtils::Cycles::rdtsc();
-    if (aio_write(&aioCb) == -1)
-      fprintf(stderr, "Error at aio_write(): %s\n", strerror(errno));
+  // If we reach this point in the code, it means that all AIO operations
+  // have completed and the double buffer is now free. We'll check if
+  // we need to start a new AIO.
+  ssize_t bytesToWrite = encoder.getEncodedBytes();
+  if (bytesToWrite == 0) return syncStatus != SYNC_COMPLETED;
 
-    hasOutstandingOperation = true;
+  // Pad the output if necessary
+  if (NanoLogConfig::FILE_PARAMS & O_DIRECT) {
+    ssize_t bytesOver = bytesToWrite % 512;
 
-    // Swap buffers
-    encoder.swapBuffer(outputDoubleBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
-    std::swap(outputDoubleBuffer, compressingBuffer);
-    outputBufferFull = false;
+    if (bytesOver != 0) {
+      memset(compressingBuffer, 0, 512 - bytesOver);
+      bytesToWrite = bytesToWrite + 512 - bytesOver;
+      padBytesWritten += (512 - bytesOver);
+    }
   }
 
-  cycleAtThreadStart = 0;
-  cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+  aioCb.aio_fildes = outputFd;
+  aioCb.aio_buf = compressingBuffer;
+  aioCb.aio_nbytes = bytesToWrite;
+  totalBytesWritten += bytesToWrite;
+
+  cyclesAtLastAIOStart = PerfUtils::Cycles::rdtsc();
+  if (aio_write(&aioCb) == -1)
+    fprintf(stderr, "Error at aio_write(): %s\n", strerror(errno));
+
+  hasOutstandingOperation = true;
+  markRecordsInFlight();
+  persistedDictionaryEntries.store(nextInvocationIndexToBePersisted,
+                                   std::memory_order_release);
+
+  // Swap buffers
+  encoder.swapBuffer(outputDoubleBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
+  std::swap(outputDoubleBuffer, compressingBuffer);
+  outputBufferFull = false;
+
+  return true;
 }
 
 }  // namespace NanoLogInternal
@@ -16,13 +16,21 @@
 #pragma once
 
 #include <aio.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <atomic>
 #include <cassert>
 #include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
 #include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "Common.h"
@@ -30,8 +38,13 @@
 #include "Fence.h"
 #include "Log.h"
 #include "NanoLog.h"
+#include "Portability.h"
 #include "Util.h"
 
+#if NANOLOG_HAS_RSEQ
+#include <sys/rseq.h>
+#endif
+
 namespace NanoLogInternal {
 using namespace NanoLog;
 
@@ -47,14 +60,24 @@ class RuntimeLogger {
   /**
    * See function below.
    */
-  inline void registerInvocationSite_internal(int& logId, StaticLogInfo info) {
+  inline void registerInvocationSite_internal(
+      int& logId, StaticLogInfo info,
+      const std::string& extensions = std::string()) {
     // TODO(syang0) Make this into a spin lock
     std::lock_guard<std::mutex> lock(nanoLogSingleton.registrationMutex);
 
     if (logId != UNASSIGNED_LOGID) return;
 
-    logId = static_cast<int32_t>(invocationSites.size());
-    invocationSites.push_back(info);
+    // Extensions that would overflow the dictionary entry are dropped
+    if (!extensions.empty() &&
+        strlen(info.formatString) + 1 + extensions.size() <=
+            std::numeric_limits<uint16_t>::max()) {
+      siteExtensions.push_back(extensions);
+      info.extensions = siteExtensions.back().data();
+      info.extensionsLength = static_cast<uint16_t>(extensions.size());
+    }
+
+    logId = static_cast<int32_t>(invocationSites.append(info));
 
 #ifdef ENABLE_DBG_PRINTING
     printf("Registered '%s' as id=%d\r\n", info.formatString, logId);
@@ -75,11 +98,24 @@ class RuntimeLogger {
    *       Unique log identifier to be assigned. A value other than -1
    *       indicates that the id has already been assigned and this
    *       function becomes a no-op.
+   *
+   * \param extensions
+   *      Optional Log::SiteExtension records to persist with the static log
+   *      info (i.e. bindings of the arguments to enum tables)
    */
-  static inline void registerInvocationSite(StaticLogInfo info, int& logId) {
-    nanoLogSingleton.registerInvocationSite_internal(logId, info);
+  static inline void registerInvocationSite(
+      StaticLogInfo info, int& logId,
+      const std::string& extensions = std::string()) {
+    nanoLogSingleton.registerInvocationSite_internal(logId, info, extensions);
   }
 
+  static int registerEnumTable(
+      const char* name,
+      const std::vector<std::pair<int64_t, std::string>>& entries);
+  static int getErrnoTableId();
+  static void enableModuleMaps();
+  static void getThreadStackBounds(uintptr_t* low, uintptr_t* high);
+
   /**
    * Allocate thread-local space for the generated C++ code to store an
    * uncompressed log message, but do not make it available for compression
@@ -91,12 +127,24 @@ class RuntimeLogger {
    *
    * \param nbytes
    *      number of bytes to allocate in the
+   * \param priority
+   *      Allocate the space in the thread's priority lane rather than the
+   *      StagingBuffer (see isPriority()); ignored for large allocations
    *
    * \return
    *      pointer to the allocated space
    */
-  static inline char* reserveAlloc(size_t nbytes) {
-    if (stagingBuffer == nullptr)
+  static inline char* reserveAlloc(size_t nbytes, bool priority = false) {
+    if (priority && fitsPriorityLane(nbytes)) {
+      if (priorityLane == nullptr)
+        ((activeChannel) ? *activeChannel : nanoLogSingleton)
+            .ensurePriorityLaneAllocated();
+
+      // NOLINTNEXTLINE(clang-analyzer-core.CallAndMessage)
+      return priorityLane->reserveProducerSpace(nbytes);
+    }
+
+    if (stagingBuffer == nullptr && !nanoLogSingleton.acquireCpuBuffer())
       nanoLogSingleton.ensureStagingBufferAllocated();
 
     // NOLINTNEXTLINE(clang-analyzer-core.CallAndMessage)
@@ -109,9 +157,160 @@ class RuntimeLogger {
    *
    * \param nbytes
    *      Number of bytes to make visible
+   * \param priority
+   *      Must match the value passed to reserveAlloc()
    */
-  static inline void finishAlloc(size_t nbytes) {
-    stagingBuffer->finishReservation(nbytes);
+  static inline void finishAlloc(size_t nbytes, bool priority = false) {
+    if (priority && fitsPriorityLane(nbytes)) {
+      priorityLane->finishReservation(nbytes);
+      if (priorityLane->disarmDoorbell())
+        ((activeChannel) ? *activeChannel : nanoLogSingleton).ringDoorbell();
+    } else {
+      stagingBuffer->finishReservation(nbytes);
+      stagingBuffer->markActive();
+      if (stagingBuffer->disarmDoorbell())
+        ((activeChannel) ? *activeChannel : nanoLogSingleton).ringDoorbell();
+      if (heldCpuBuffer != nullptr) releaseCpuBuffer();
+    }
+  }
+
+  /**
+   * Returns true if log messages of a severity should be staged in the
+   * thread's priority lane (see NanoLog::setPriorityLaneLevel()).
+   */
+  static inline bool isPriority(LogLevel severity) {
+    return severity <= nanoLogSingleton.priorityLaneLevel;
+  }
+
+  /**
+   * Returns true if the logging threads should compress the arguments of
+   * their log messages themselves (see NanoLog::setProducerCompression()).
+   */
+  static inline bool isProducerCompression() {
+    return nanoLogSingleton.producerCompression;
+  }
+
+  /**
+   * Returns true if the log messages of the calling thread are staged in
+   * per-CPU StagingBuffers shared with other threads (see
+   * enablePerCpuStaging()), in which case the decompressor cannot tell them
+   * apart by thread.
+   */
+  static inline bool isPerCpuStaging() {
+    return stagingBuffer == nullptr &&
+           nanoLogSingleton.cpuBuffers.load(std::memory_order_acquire) !=
+               nullptr;
+  }
+
+  // Special return values for getDynamicLogId() indicating that the format
+  // string could not be parsed or that no more dynamic log sites are left.
+  static constexpr int DYNAMIC_LOG_SITE_INVALID = -2;
+  static constexpr int DYNAMIC_LOG_SITES_EXHAUSTED = -3;
+
+  // Kind of an argument passed in with a runtime format string, which must
+  // match the conversion of its format parameter (i.e. a "%lf" for a
+  // DOUBLE_ARGUMENT) for the format string to be usable.
+  enum ArgumentKind : uint8_t {
+    INT_ARGUMENT,           // Integers promoted to an int (i.e. %d, %c, %*)
+    LONG_ARGUMENT,          // Integers wider than an int (i.e. %ld, %zu)
+    DOUBLE_ARGUMENT,        // float and double (i.e. %f, %lf, %g)
+    LONG_DOUBLE_ARGUMENT,   // long double (i.e. %Lf)
+    POINTER_ARGUMENT,       // Pointers other than strings (i.e. %p)
+    STRING_ARGUMENT,        // char strings (i.e. %s, %p)
+    WIDE_STRING_ARGUMENT,   // wchar_t strings (i.e. %ls, %p)
+    OTHER_ARGUMENT          // Types no conversion may be applied to
+  };
+
+  /**
+   * Maps a format string that is only known at runtime to a dynamic log
+   * site, parsing and registering the format string in the dictionary the
+   * first time it is encountered. Lookups are served out of a thread-local
+   * cache when possible, which avoids the global lock and the parse.
+   *
+   * \param filename
+   *      Name of the file containing the log invocation
+   * \param linenum
+   *      Line number within filename of the log invocation
+   * \param severity
+   *      LogLevel severity of the log invocation
+   * \param format
+   *      Runtime printf format string to look up
+   * \param compressionFn
+   *      Compression function matching the types of the log arguments
+   * \param numArgs
+   *      Number of arguments passed in with the format string
+   * \param argumentKinds
+   *      ArgumentKind of the n-th argument
+   * \param[out] paramTypes
+   *      Set to the ParamTypes of the format string for valid sites
+   *
+   * \return
+   *      The logId of the dynamic log site, DYNAMIC_LOG_SITE_INVALID if the
+   *      format string was malformed or did not match the arguments, or
+   *      DYNAMIC_LOG_SITES_EXHAUSTED if there was no room for a new site.
+   */
+  static inline int getDynamicLogId(const char* filename, uint32_t linenum,
+                                    LogLevel severity, const char* format,
+                                    StaticLogInfo::CompressionFn compressionFn,
+                                    int numArgs,
+                                    const ArgumentKind* argumentKinds,
+                                    const ParamType** paramTypes) {
+    uint64_t hash = hashDynamicLogSite(filename, linenum, severity, format,
+                                       compressionFn);
+    DynamicLogSite* site = dynamicLogSiteCache[
+        hash & (NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE - 1)];
+
+    if (site == nullptr || !site->matches(hash, filename, linenum, severity,
+                                          format, compressionFn)) {
+      site = nanoLogSingleton.lookupDynamicLogSite(
+          hash, filename, linenum, severity, format, compressionFn, numArgs,
+          argumentKinds);
+    }
+
+    if (site->logId == DYNAMIC_LOG_SITES_EXHAUSTED)
+      nanoLogSingleton.dynamicLogSiteOverflows.fetch_add(
+          1, std::memory_order_relaxed);
+
+    *paramTypes = site->paramTypes.data();
+    return site->logId;
+  }
+
+  /**
+   * Returns the logId of the "%s" log site that the message of a runtime
+   * format string is logged with when getDynamicLogId() could not assign it
+   * a site of its own. There is one such site per invocation site, which is
+   * not counted against NanoLogConfig::MAX_DYNAMIC_LOG_SITES.
+   *
+   * \param filename
+   *      Name of the file containing the log invocation
+   * \param linenum
+   *      Line number within filename of the log invocation
+   * \param severity
+   *      LogLevel severity of the log invocation
+   * \param compressionFn
+   *      Compression function for a single string argument
+   */
+  static inline int getPreformattedLogId(
+      const char* filename, uint32_t linenum, LogLevel severity,
+      StaticLogInfo::CompressionFn compressionFn) {
+    static constexpr ArgumentKind argumentKinds[] = {STRING_ARGUMENT};
+
+    uint64_t hash =
+        hashDynamicLogSite(filename, linenum, severity, "%s", compressionFn);
+    DynamicLogSite* site = dynamicLogSiteCache[
+        hash & (NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE - 1)];
+
+    // The cache may hold a thread's private site for the same "%s" format
+    // string passed to getDynamicLogId(), which has no logId
+    if (site == nullptr || site->logId < 0 ||
+        !site->matches(hash, filename, linenum, severity, "%s",
+                       compressionFn)) {
+      site = nanoLogSingleton.lookupDynamicLogSite(
+          hash, filename, linenum, severity, "%s", compressionFn, 1,
+          argumentKinds, true);
+    }
+
+    return site->logId;
   }
 
   static std::string getStats();
@@ -119,23 +318,391 @@ class RuntimeLogger {
   static void preallocate();
   static void setLogFile(const char* filename);
   static void setLogLevel(LogLevel logLevel);
+  static void setDegradedLogLevel(LogLevel logLevel);
+  static void setPriorityLaneLevel(LogLevel logLevel);
+  static void setProducerCompression(bool enable);
+  static bool enablePerCpuStaging();
+  static void installCrashHandler();
+  static void setMaxCompressionThreads(uint32_t numThreads);
+  static void setWakeupPolicy(WakeupPolicy policy);
+  static void setScanPolicy(ScanPolicy policy);
+  static void enableEmbeddedMode();
+  static bool poll(uint64_t budgetNs);
   static void sync();
+  static std::future<void> flushAsync();
+  static void waitUntilPersisted();
+
+  static Channel createChannel(const char* name, const char* filename);
+  static Channel getChannel(const char* name);
+  static void setChannelLogLevel(Channel channel, LogLevel logLevel);
+  static void syncChannel(Channel channel);
 
   static inline LogLevel getLogLevel() {
     return nanoLogSingleton.currentLogLevel;
   }
 
+  static inline LogLevel getChannelLogLevel(Channel channel) {
+    return getChannelLogger(channel)->currentLogLevel;
+  }
+
+  class ChannelScope;
+
+  /**
+   * Returns the number of times the output file was changed via
+   * setLogFile(), which lets threads detect that the state they persisted
+   * to the previous file (i.e. their context) must be persisted again.
+   */
+  static inline uint32_t getLogFileGeneration() {
+    return nanoLogSingleton.logFileGeneration.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Returns the current metric epoch, which the background thread advances
+   * every NanoLogConfig::METRIC_EPOCH_INTERVAL_US.
+   */
+  static inline uint32_t getMetricEpoch() {
+    return nanoLogSingleton.metricEpoch.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Returns true if the threads updating NANO_METRIC_*() metrics need a
+   * fence to hand their aggregates over to the background thread, i.e. as
+   * long as it cannot force one onto them with membarrier() (see
+   * collectMetrics()).
+   */
+  static inline bool isMetricFenceNeeded() {
+    return !nanoLogSingleton.metricMembarrier.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns the id the log records of the calling thread are attributed to,
+   * i.e. the id of its StagingBuffer, which is allocated if necessary.
+   * Threads staging to per-CPU buffers get an id of their own. Thread-local
+   * objects constructed afterwards may still log as they are destroyed.
+   */
+  static inline uint32_t getThreadBufferId() {
+    sbc.stagingBufferCreated();
+    if (stagingBuffer == nullptr &&
+        nanoLogSingleton.cpuBuffers.load(std::memory_order_acquire) !=
+            nullptr) {
+      std::lock_guard<std::mutex> guard(nanoLogSingleton.bufferMutex);
+      return nanoLogSingleton.nextBufferId++;
+    }
+
+    nanoLogSingleton.ensureStagingBufferAllocated();
+    return stagingBuffer->getId();
+  }
+
   static inline int getCoreIdOfBackgroundThread() {
     return nanoLogSingleton.coreId;
   }
 
   // Forward Declarations
-  PRIVATE : class StagingBuffer;
+  PRIVATE : template <uint32_t capacity>
+  class BasicStagingBuffer;
   class StagingBufferDestroyer;
 
+  using StagingBuffer = BasicStagingBuffer<NanoLogConfig::STAGING_BUFFER_SIZE>;
+  using PriorityLane = BasicStagingBuffer<NanoLogConfig::PRIORITY_LANE_SIZE>;
+
+  struct DynamicLogSite;
+
+  /**
+   * State of an additional compression thread (see NanoLog::
+   * setMaxCompressionThreads()). It compresses the StagingBuffers of its
+   * shard, and those of other shards while it runs out of work, into an
+   * output buffer of its own, which it hands over to the background thread
+   * for output. The StagingBuffers it compresses stay claimed until then, so
+   * that the log messages of every StagingBuffer are output in order.
+   */
+  struct CompressionHelper {
+    explicit CompressionHelper(uint32_t consumerId);
+    ~CompressionHelper();
+
+    // Index among the compression threads; the background thread is 0
+    uint32_t consumerId;
+
+    // Thread running compressionHelperMain()
+    std::thread thread;
+
+    // Buffer handed over to the background thread and the number of bytes
+    // of output in it; the count is reset once the output is collected
+    char* handoffBuffer;
+    std::atomic<size_t> handoffBytes;
+
+    // Buffer the thread compresses into; swapped with the handoffBuffer
+    char* encodingBuffer;
+
+    // StagingBuffers claimed by the thread since the last handover
+    std::vector<StagingBuffer*> claims;
+
+    // Log records compressed per StagingBuffer into the encodingBuffer and
+    // into the handoffBuffer; credited to the StagingBuffers on collection
+    std::vector<std::pair<StagingBuffer*, uint64_t>> encodedRecords;
+    std::vector<std::pair<StagingBuffer*, uint64_t>> handoffRecords;
+
+    // Same as above for the priority lanes of the claimed StagingBuffers
+    std::vector<std::pair<PriorityLane*, uint64_t>> encodedLaneRecords;
+    std::vector<std::pair<PriorityLane*, uint64_t>> handoffLaneRecords;
+
+    // Number of passes through the StagingBuffers completed
+    std::atomic<uint64_t> passesCompleted;
+
+    // Value of passesCompleted when the background thread last started a
+    // new pass in the output (see helpersCompletedPass())
+    uint64_t passesAtLastWrapAround;
+
+    // Epoch of the BufferRegistry the thread is scanning, or 0 in between
+    // passes (see enterBufferRegistry())
+    std::atomic<uint64_t> registryEpoch;
+
+    DISALLOW_COPY_AND_ASSIGN(CompressionHelper);
+  };
+
+  /**
+   * Two-level bitmap of the slots of the StagingBuffers that may have log
+   * messages pending (see BufferRegistry), which lets the passes through the
+   * StagingBuffers skip the ones of idle threads. The producers set the bit
+   * of their StagingBuffer whenever they find it clear after staging a log
+   * message (see markActive()), and the background thread clears the bits
+   * of the StagingBuffers found empty for a while (see sweepIdleBuffers()).
+   * Each bit of the summary indicates that a word of leaves has bits set.
+   */
+  class ActiveBufferSet {
+   public:
+    // Number of slots tracked; the slots beyond are always considered set
+    static constexpr uint32_t CAPACITY = NanoLogConfig::MAX_ACTIVE_BUFFER_SLOTS;
+
+    ActiveBufferSet() : leaves(), summary() {}
+
+    /**
+     * Returns true if the bit of a slot is set.
+     */
+    inline bool test(uint32_t slot) const {
+      return slot >= CAPACITY ||
+             (leaves[slot / 64].load(std::memory_order_relaxed) & bit(slot));
+    }
+
+    /**
+     * Sets the bit of a slot.
+     */
+    void set(uint32_t slot) {
+      if (slot >= CAPACITY) return;
+
+      leaves[slot / 64].fetch_or(bit(slot));
+      summary[slot / 4096].fetch_or(bit(slot / 64));
+    }
+
+    /**
+     * Clears the bit of a slot. This is only invoked by the background
+     * thread.
+     */
+    void clear(uint32_t slot) {
+      if (slot >= CAPACITY) return;
+
+      std::atomic<uint64_t>& leaf = leaves[slot / 64];
+      if ((leaf.fetch_and(~bit(slot)) & ~bit(slot)) != 0) return;
+
+      // A producer may have set another bit of the leaf in the meantime
+      summary[slot / 4096].fetch_and(~bit(slot / 64));
+      if (leaf.load() != 0) summary[slot / 4096].fetch_or(bit(slot / 64));
+    }
+
+    /**
+     * Finds the first slot with its bit set within a range of slots.
+     *
+     * \param from
+     *      First slot of the range
+     * \param end
+     *      Slot following the last slot of the range
+     *
+     * \return
+     *      The first slot with its bit set, or end if there is none
+     */
+    uint32_t findNext(uint32_t from, uint32_t end) const {
+      uint32_t limit = std::min(end, CAPACITY);
+      while (from < limit) {
+        uint32_t leaf = from / 64;
+        uint64_t bits = leaves[leaf].load(std::memory_order_relaxed) &
+                        (~uint64_t(0) << (from % 64));
+        if (bits != 0) {
+          uint32_t slot = leaf * 64 + __builtin_ctzll(bits);
+          return (slot < limit) ? slot : end;
+        }
+
+        // Skip the leaves without bits set
+        ++leaf;
+        while (leaf < CAPACITY / 64) {
+          uint64_t words = summary[leaf / 64].load(std::memory_order_relaxed) &
+                           (~uint64_t(0) << (leaf % 64));
+          if (words != 0) {
+            leaf = (leaf / 64) * 64 + __builtin_ctzll(words);
+            break;
+          }
+
+          leaf = (leaf / 64 + 1) * 64;
+        }
+
+        from = leaf * 64;
+      }
+
+      from = std::max(from, CAPACITY);
+      return (from < end) ? from : end;
+    }
+
+   private:
+    static inline uint64_t bit(uint32_t index) {
+      return uint64_t(1) << (index % 64);
+    }
+
+    // One bit per slot
+    std::atomic<uint64_t> leaves[CAPACITY / 64];
+
+    // One bit per word of leaves
+    std::atomic<uint64_t> summary[CAPACITY / 4096];
+
+    DISALLOW_COPY_AND_ASSIGN(ActiveBufferSet);
+  };
+
+  /**
+   * Immutable list of the StagingBuffers of a RuntimeLogger indexed by their
+   * slots in the activeBuffers. A new BufferRegistry is published whenever a
+   * StagingBuffer is added or removed, which lets the compression threads
+   * scan the StagingBuffers without holding the bufferMutex (see
+   * enterBufferRegistry()).
+   */
+  struct BufferRegistry {
+    explicit BufferRegistry(std::vector<StagingBuffer*> slots)
+        : slots(std::move(slots)) {}
+
+    // StagingBuffer assigned to each slot, or nullptr if the slot is free.
+    // Slots are reused but never removed.
+    const std::vector<StagingBuffer*> slots;
+
+    DISALLOW_COPY_AND_ASSIGN(BufferRegistry);
+  };
+
+  /**
+   * A BufferRegistry replaced by a newer one, along with the StagingBuffer
+   * removed from it, if any. Both are freed once the compression threads
+   * have left the epoch in which they were retired.
+   */
+  struct RetiredRegistry {
+    uint64_t epoch;
+    BufferRegistry* registry;
+    StagingBuffer* removed;
+  };
+
+  /**
+   * State carried from one step of the compression to the next (see
+   * compressionStep()). It outlives the background thread, so that the
+   * application can take over in embedded mode (see enableEmbeddedMode())
+   * without starting the log file over.
+   */
+  struct CompressionState {
+    explicit CompressionState(char* outputBuffer);
+
+    // Slot of the last StagingBuffer checked for uncompressed log messages
+    uint32_t lastStagingBufferChecked;
+
+    // Marks when the thread wakes up. This value should be used to calculate
+    // the number of cyclesActive right before blocking/sleeping and then
+    // updated to the latest rdtsc() when the thread re-awakens.
+    uint64_t cyclesAwakeStart;
+
+    // Manages the state associated with compressing log messages
+    Log::Encoder encoder;
+
+    // Indicates whether a compression operation failed or not due
+    // to insufficient space in the outputBuffer
+    bool outputBufferFull;
+
+    // Indicates that in scanning the StagingBuffers, we have passed the
+    // zero-th index, but have not yet encoded that in he compressed output
+    bool wrapAround;
+
+    // Next time (in rdtsc cycles) to check for newly loaded modules once
+    // backtraces are being logged
+    uint64_t nextModuleMapCheck;
+
+    // Next time (in rdtsc cycles) to check on the back-pressure governor
+    uint64_t nextGovernorCheck;
+
+    // Next time (in rdtsc cycles) to check whether to start another
+    // compression thread
+    uint64_t nextScaleCheck;
+
+    // Indicates that the last pass through the StagingBuffers found no work
+    // in this thread's shard (see CompressionHelper), in which case it helps
+    // out with the other shards, and whether the current pass found any
+    bool stealing;
+    bool foundWorkInShard;
+
+    // Indicates that the current pass left log messages behind in a
+    // StagingBuffer due to the SCAN_QUOTA_BYTES
+    bool passCutShort;
+
+    // Time (in rdtsc cycles) at which to start the next metric epoch
+    uint64_t nextMetricEpoch;
+
+    // Next time (in rdtsc cycles) to clear the bits of the idle
+    // StagingBuffers in the activeBuffers
+    uint64_t nextIdleBufferSweep;
+
+    // Number of consecutive sleeps without any output in between
+    uint32_t idleWaits;
+
+    DISALLOW_COPY_AND_ASSIGN(CompressionState);
+  };
+
   // Storage for staging uncompressed log statements for compression
   static __thread StagingBuffer* stagingBuffer;
 
+  // Storage for staging the thread's log statements at or above the
+  // priorityLaneLevel; allocated upon the first such log statement
+  static __thread PriorityLane* priorityLane;
+
+  /**
+   * A StagingBuffer shared by the threads running on a CPU (see
+   * enablePerCpuStaging()). Producers hold the lock from reserveAlloc()
+   * until finishAlloc(), which keeps the StagingBuffer single-producer.
+   */
+  struct alignas(64) CpuBuffer {
+    CpuBuffer() : locked(false), buffer(nullptr) {}
+
+    std::atomic<bool> locked;
+    StagingBuffer* buffer;
+
+    DISALLOW_COPY_AND_ASSIGN(CpuBuffer);
+  };
+
+  // CpuBuffer the thread holds between reserveAlloc() and finishAlloc(),
+  // in which case stagingBuffer points to the CpuBuffer's StagingBuffer
+  static __thread CpuBuffer* heldCpuBuffer;
+
+  // StagingBuffer of the CpuBuffer the thread last logged to and the
+  // sequence number of the log record (see waitUntilPersisted())
+  static __thread StagingBuffer* lastCpuBuffer;
+  static __thread uint64_t lastCpuSequence;
+
+  // StagingBuffers and priority lanes of the thread for the channels other
+  // than the primary channel, indexed by Channel
+  static __thread StagingBuffer* channelBuffers[NanoLogConfig::MAX_CHANNELS];
+  static __thread PriorityLane* channelLanes[NanoLogConfig::MAX_CHANNELS];
+
+  // Channel the thread is logging to within a ChannelScope, or nullptr
+  static __thread RuntimeLogger* activeChannel;
+
+  // Direct-mapped cache of the dynamic log sites recently used by this thread
+  static __thread DynamicLogSite*
+      dynamicLogSiteCache[NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE];
+
+  // Sites of the runtime format strings this thread used after all the
+  // MAX_DYNAMIC_LOG_SITES were assigned, indexed like dynamicLogSiteCache[]
+  // and owned by the thread (see lookupDynamicLogSite())
+  static __thread DynamicLogSite*
+      overflowLogSiteCache[NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE];
+
   // Destroys the __thread StagingBuffer upon its own destruction, which
   // is synchronized with thread death
   static thread_local StagingBufferDestroyer sbc;
@@ -144,16 +711,208 @@ class RuntimeLogger {
   // background output thread.
   static RuntimeLogger nanoLogSingleton;
 
+  // RuntimeLoggers of the channels indexed by Channel; the primary channel is
+  // the nanoLogSingleton, which also holds the registry of the log sites
+  static std::atomic<RuntimeLogger*> channels[NanoLogConfig::MAX_CHANNELS];
+
+  // Serializes the creation of channels
+  static std::mutex channelMutex;
+
   RuntimeLogger();
+  RuntimeLogger(Channel channel, const char* name, const char* filename);
 
   ~RuntimeLogger();
 
+  /**
+   * Returns the RuntimeLogger of a channel.
+   *
+   * \throw std::invalid_argument
+   *      if the channel does not exist
+   */
+  static inline RuntimeLogger* getChannelLogger(Channel channel) {
+    RuntimeLogger* logger = nullptr;
+    if (channel < NanoLogConfig::MAX_CHANNELS)
+      logger = channels[channel].load(std::memory_order_acquire);
+
+    if (logger == nullptr)
+      throw std::invalid_argument("NanoLog channel does not exist");
+
+    return logger;
+  }
+
+  // Deadline of the compression steps that are not bounded in time
+  static constexpr uint64_t NO_DEADLINE = std::numeric_limits<uint64_t>::max();
+
   void compressionThreadMain();
+  bool compressionStep(CompressionState& state, uint64_t deadline,
+                       bool blocking);
+  bool driveCompression(uint64_t deadline, bool blocking);
+  void stopCompressionThread();
+  void enableEmbeddedMode_internal();
 
   void setLogFile_internal(const char* filename);
+  void setLogLevel_internal(LogLevel logLevel);
+  void sync_internal();
+  std::future<void> flushAsync_internal();
 
   void waitForAIO();
 
+  void completeSyncRound();
+  void markRecordsInFlight();
+  void markRecordsPersisted();
+
+  void snapshotModuleMaps();
+  bool measureStagingFill(uint32_t* threadFill, uint32_t* globalFill);
+  void scaleCompressionThreads();
+  void updateGovernor();
+  bool collectMetrics(bool advanceEpoch);
+  bool stageMetricSnapshot(int logId, const void* snapshot, size_t size);
+  void setEffectiveLogLevel();
+
+  void allocateCpuBuffer(CpuBuffer* cpuBuffer);
+
+  void registerStagingBuffer(StagingBuffer* sb);
+  void unregisterStagingBuffer(uint32_t slot);
+  void publishBufferRegistry(std::vector<StagingBuffer*> slots,
+                             StagingBuffer* removed);
+  BufferRegistry* enterBufferRegistry(std::atomic<uint64_t>& readerEpoch);
+  void reclaimBufferRegistries();
+  void sweepIdleBuffers(const BufferRegistry* registry);
+
+  /**
+   * Complement to enterBufferRegistry(), invoked once the calling thread no
+   * longer refers to the BufferRegistry or its StagingBuffers.
+   */
+  static inline void exitBufferRegistry(std::atomic<uint64_t>& readerEpoch) {
+    readerEpoch.store(0, std::memory_order_release);
+  }
+
+  void compressionHelperMain(CompressionHelper* helper);
+  void startCompressionHelper();
+  void handOff(CompressionHelper* helper, Log::Encoder& encoder);
+  bool collectHandoffs(Log::Encoder& encoder);
+  bool helpersIdle();
+  bool helpersCompletedPass();
+
+  void ringDoorbell();
+  void waitForWork(std::unique_lock<std::mutex>& lock, uint32_t doorbellRing,
+                   uint32_t idleWaits);
+  void waitForDoorbell(uint32_t doorbellRing);
+
+  /**
+   * Returns true if a StagingBuffer belongs to the shard of a compression
+   * thread, given the number of compression threads running.
+   */
+  static inline bool isInShard(StagingBuffer* sb, uint32_t consumerId,
+                               uint32_t numThreads) {
+    return sb->getId() % numThreads == consumerId;
+  }
+
+  static void crashSignalHandler(int signal, siginfo_t* info, void* context);
+  bool requestCrashDrain();
+  [[noreturn]] void parkForCrashDrain(Log::Encoder& encoder);
+  void drainAfterCrash();
+  void writeSynchronously(char* buffer, size_t nbytes);
+
+  /**
+   * Returns the CPU the calling thread is running on. The value is read from
+   * the thread's rseq area when available, which avoids the system call.
+   */
+  static inline uint32_t getCurrentCpu() {
+#if NANOLOG_HAS_RSEQ
+    if (__rseq_size > 0) {
+      const auto* rs = reinterpret_cast<const volatile struct rseq*>(
+          static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+      auto cpu = static_cast<int32_t>(rs->cpu_id);
+      if (cpu >= 0) return static_cast<uint32_t>(cpu);
+    }
+#endif
+    int cpu = sched_getcpu();
+    return (cpu < 0) ? 0 : static_cast<uint32_t>(cpu);
+  }
+
+  /**
+   * Points stagingBuffer to the StagingBuffer of the CPU the calling thread
+   * is running on and locks it until releaseCpuBuffer().
+   *
+   * \return
+   *      False if per-CPU staging is disabled
+   */
+  inline bool acquireCpuBuffer() {
+    CpuBuffer* cpus = cpuBuffers.load(std::memory_order_acquire);
+    if (cpus == nullptr) return false;
+
+    CpuBuffer* cpuBuffer = &cpus[getCurrentCpu() % numCpuBuffers];
+    while (cpuBuffer->locked.exchange(true, std::memory_order_acquire)) {
+      // The holder was preempted or this thread migrated between CPUs
+      std::this_thread::yield();
+      cpuBuffer = &cpus[getCurrentCpu() % numCpuBuffers];
+    }
+
+    if (cpuBuffer->buffer == nullptr) allocateCpuBuffer(cpuBuffer);
+
+    stagingBuffer = cpuBuffer->buffer;
+    heldCpuBuffer = cpuBuffer;
+    return true;
+  }
+
+  /**
+   * Complement to acquireCpuBuffer() invoked once the log record is staged.
+   */
+  static inline void releaseCpuBuffer() {
+    lastCpuBuffer = stagingBuffer;
+    lastCpuSequence = stagingBuffer->numAllocations;
+
+    stagingBuffer = nullptr;
+    heldCpuBuffer->locked.store(false, std::memory_order_release);
+    heldCpuBuffer = nullptr;
+  }
+
+  bool hasPriorityWork();
+  bool drainPriorityLanes(Log::Encoder& encoder, bool& wrapAround,
+                          SiteDictionary::View dictionary);
+  uint64_t encodeStagingBuffer(Log::Encoder& encoder, StagingBuffer* sb,
+                               char* peekPosition, uint64_t peekBytes,
+                               uint64_t quota, bool& wrapAround,
+                               SiteDictionary::View dictionary,
+                               bool* outputBufferFull);
+  bool serviceUrgentBuffers(const BufferRegistry* registry,
+                            Log::Encoder& encoder, bool& wrapAround,
+                            SiteDictionary::View dictionary);
+
+  /**
+   * Returns true if an allocation of nbytes may be placed in a priority lane.
+   * Larger allocations could stall behind a single pending message in the
+   * small lane and are placed in the StagingBuffer instead.
+   */
+  static inline bool fitsPriorityLane(size_t nbytes) {
+    return nbytes < NanoLogConfig::PRIORITY_LANE_SIZE / 2;
+  }
+
+  DynamicLogSite* lookupDynamicLogSite(
+      uint64_t hash, const char* filename, uint32_t linenum, LogLevel severity,
+      const char* format, StaticLogInfo::CompressionFn compressionFn,
+      int numArgs, const ArgumentKind* argumentKinds,
+      bool preformatted = false);
+
+  /**
+   * Computes the FNV-1a hash of a runtime format string and the static
+   * information that, together with it, identifies a dynamic log site.
+   */
+  static inline uint64_t hashDynamicLogSite(
+      const char* filename, uint32_t linenum, LogLevel severity,
+      const char* format, StaticLogInfo::CompressionFn compressionFn) {
+    const uint64_t prime = 1099511628211UL;
+    uint64_t hash = 14695981039346656037UL;
+    for (const char* c = format; *c != '\0'; ++c)
+      hash = (hash ^ static_cast<uint8_t>(*c)) * prime;
+
+    hash = (hash ^ reinterpret_cast<uintptr_t>(filename)) * prime;
+    hash = (hash ^ reinterpret_cast<uintptr_t>(compressionFn)) * prime;
+    hash = (hash ^ ((uint64_t(linenum) << 8) | severity)) * prime;
+    return hash;
+  }
+
   /**
    * Allocates thread-local structures if they weren't already allocated.
    * This is used by the generated C++ code to ensure it has space to
@@ -170,24 +929,130 @@ class RuntimeLogger {
       stagingBuffer = new StagingBuffer(bufferId);
       guard.lock();
 
-      threadBuffers.push_back(stagingBuffer);
+      registerStagingBuffer(stagingBuffer);
+    }
+  }
+
+  /**
+   * Allocates the thread-local priority lane if it wasn't already allocated.
+   * The lane shares the id of the thread's StagingBuffer, so that the log
+   * statements of both are attributed to the same thread, and the two are
+   * linked (see drainPriorityLanes()).
+   */
+  inline void ensurePriorityLaneAllocated() {
+    if (priorityLane == nullptr) {
+      // Threads staging to per-CPU buffers get an id of their own
+      uint32_t bufferId;
+      StagingBuffer* owner = nullptr;
+      if (cpuBuffers.load(std::memory_order_acquire) == nullptr) {
+        ensureStagingBufferAllocated();
+        owner = stagingBuffer;
+        bufferId = owner->getId();
+      } else {
+        std::lock_guard<std::mutex> guard(bufferMutex);
+        bufferId = nextBufferId++;
+      }
+
+      priorityLane = new PriorityLane(bufferId);
+      if (owner != nullptr) {
+        priorityLane->slot = owner->slot;
+        owner->lane.store(priorityLane, std::memory_order_release);
+      }
+
+      std::lock_guard<std::mutex> guard(bufferMutex);
+      priorityLanes.push_back(priorityLane);
+      numPriorityLanes.store(downCast<uint32_t>(priorityLanes.size()),
+                             std::memory_order_relaxed);
     }
   }
 
   // Globally the thread-local stagingBuffers
   std::vector<StagingBuffer*> threadBuffers;
 
+  // Globally the thread-local priorityLanes
+  std::vector<PriorityLane*> priorityLanes;
+
+  // Number of entries in priorityLanes, which lets the compression thread
+  // skip the bufferMutex while there are none
+  std::atomic<uint32_t> numPriorityLanes;
+
+  // Per-CPU staging buffers indexed by CPU, or nullptr while per-CPU staging
+  // is disabled. Their StagingBuffers are also listed in threadBuffers.
+  std::atomic<CpuBuffer*> cpuBuffers;
+
+  // Number of entries in cpuBuffers
+  uint32_t numCpuBuffers;
+
   // Stores the id for the next StagingBuffer to be allocated. The ids are
   // unique for this execution for each StagingBuffer allocation.
   uint32_t nextBufferId = 1;
 
-  // Protects reads and writes to threadBuffers
+  // Protects reads and writes to threadBuffers and priorityLanes, and
+  // serializes the updates to the bufferRegistry
   std::mutex bufferMutex;
 
+  // Current list of the threadBuffers by slot, which the compression threads
+  // scan without the bufferMutex
+  std::atomic<BufferRegistry*> bufferRegistry;
+
+  // Slots of the bufferRegistry whose StagingBuffers may have log messages
+  // pending
+  ActiveBufferSet activeBuffers;
+
+  // Slots of the bufferRegistry freed by deleted StagingBuffers
+  std::vector<uint32_t> freeBufferSlots;
+
+  // Advanced whenever a BufferRegistry is retired. The compression threads
+  // record the epoch in which they started to scan a BufferRegistry, and the
+  // retired ones are freed once every thread has moved past their epoch.
+  std::atomic<uint64_t> registryEpoch;
+
+  // Epoch of the BufferRegistry scanned by the background thread (or poll()),
+  // or 0 in between passes
+  std::atomic<uint64_t> scanEpoch;
+
+  // BufferRegistries waiting for the compression threads to leave their
+  // epoch; protected by the bufferMutex
+  std::vector<RetiredRegistry> retiredRegistries;
+
+  // Epoch of the last BufferRegistry freed; accessed by the background
+  // thread only
+  uint64_t reclaimedEpoch;
+
+  // Slots cleared by the last sweepIdleBuffers(); kept around to avoid
+  // allocations
+  std::vector<uint32_t> idleSlots;
+
+  // Metric: Number of times an idle StagingBuffer was removed from the
+  // activeBuffers
+  uint64_t numIdleBufferClears;
+
+  // Channel of this RuntimeLogger and its name
+  Channel channel;
+  std::string channelName;
+
   // Background thread that polls the various staging buffers, compresses
   // the staged log messages, and outputs it to a file.
   std::thread compressionThread;
 
+  // State of the compression; created by the background thread or the first
+  // poll() and replaced whenever the log file changes
+  CompressionState* compressionState;
+
+  // Indicates that the application drives the compression via poll()
+  // instead of the background thread (see enableEmbeddedMode())
+  std::atomic<bool> embedded;
+
+  // Serializes the threads driving the compression in embedded mode
+  std::mutex pollMutex;
+
+  // Set while a thread drives the compression in embedded mode; the fatal
+  // signal handler waits for it to clear
+  std::atomic<bool> pollInProgress;
+
+  // Channel whose compression the current thread drives, if any
+  static __thread RuntimeLogger* channelBeingPolled;
+
   // Indicates there's an operation in aioCb that should be waited on
   bool hasOutstandingOperation;
 
@@ -206,16 +1071,42 @@ class RuntimeLogger {
     SYNC_COMPLETED           // Operation complete/no requests
   } syncStatus;
 
-  // Protects the condition variables below
+  // Sync requests are numbered in the order they are issued. A sync round
+  // (the operation tracked by syncStatus) completes all the requests issued
+  // before it started, so that concurrent requests share a single round.
+  uint64_t syncRequestsIssued;
+
+  // Number of the last sync request covered by the round in progress
+  uint64_t syncRoundTarget;
+
+  // Number of the last sync request completed
+  uint64_t syncRequestsCompleted;
+
+  // Promises of the sync requests waiting on a round, in request order
+  std::deque<std::pair<uint64_t, std::promise<void>>> syncPromises;
+
+  // Metric: Number of sync rounds completed
+  uint64_t numSyncRounds;
+
+  // Protects the condition variables and sync state above and below
   std::mutex condMutex;
 
   // Signal for when the compression thread should wakeup
   std::condition_variable workAdded;
 
-  // Signaled when the background thread completes a sync() operation and
-  // the user thread should wake up.
+  // Signaled when log records were persisted to disk while threads are
+  // waiting on them in waitUntilPersisted()
   std::condition_variable hintSyncCompleted;
 
+  // Number of threads blocked in waitUntilPersisted()
+  uint32_t numPersistenceWaiters;
+
+  // Futex word the background thread sleeps on under the WAKEUP_DOORBELL
+  // policy; incremented upon every ring (see ringDoorbell())
+  std::atomic<uint32_t> doorbell;
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "The doorbell must be usable as a futex word");
+
   // File handle for the output file; should only be opened once at the
   // construction of the LogCompressor
   int outputFd;
@@ -235,11 +1126,103 @@ class RuntimeLogger {
   char* outputDoubleBuffer;
 
   // Minimum log level that RuntimeLogger will accept. Anything lower will
-  // be dropped.
+  // be dropped. This is the lower of the configuredLogLevel and, while the
+  // governor is engaged, the degradedLogLevel.
   LogLevel currentLogLevel;
 
+  // Protects the log levels below and the transitions of the governor
+  std::mutex logLevelMutex;
+
+  // Log level set via setLogLevel()
+  LogLevel configuredLogLevel;
+
+  // Log level enforced while the back-pressure governor is engaged, or
+  // NUM_LOG_LEVELS (the default) if the governor is disabled
+  LogLevel degradedLogLevel;
+
+  // Indicates that the back-pressure governor is engaged
+  bool governorEngaged;
+
+  // Metric: Number of times the back-pressure governor engaged
+  uint32_t numGovernorEngagements;
+
+  // Least severe log level that is staged in the priority lanes. The
+  // default of SILENT_LOG_LEVEL disables the priority lanes.
+  LogLevel priorityLaneLevel;
+
+  // Metric: Number of bytes consumed from the priority lanes
+  uint64_t priorityBytesRead;
+
+  // Indicates that the logging threads compress the arguments of their log
+  // messages before staging them (see NanoLog::setProducerCompression())
+  bool producerCompression;
+
+  // Additional compression threads, which are started as the StagingBuffers
+  // back up until there are maxCompressionThreads (including the background
+  // thread); only accessed by the background thread
+  std::vector<CompressionHelper*> compressionHelpers;
+
+  // Number of compression threads running, including the background thread
+  std::atomic<uint32_t> numCompressionThreads;
+
+  // Upper bound for numCompressionThreads (see setMaxCompressionThreads())
+  std::atomic<uint32_t> maxCompressionThreads;
+
+  // Next time (in rdtsc cycles) another compression thread may be started
+  uint64_t nextCompressionThreadStart;
+
+  // Number of StagingBuffers claimed by the additional compression threads
+  std::atomic<uint32_t> helperClaims;
+
+  // Compression threads whose output awaits collection, in handover order,
+  // and the number of them
+  std::deque<CompressionHelper*> handoffQueue;
+  std::atomic<uint32_t> numHandoffs;
+
+  // Protects the handoffQueue
+  std::mutex handoffMutex;
+
+  // Signals the additional compression threads to exit
+  std::atomic<bool> helpersShouldExit;
+
+  // Number of dictionary entries handed to the AIO, which the additional
+  // compression threads may refer to since their output is written later
+  std::atomic<uint32_t> persistedDictionaryEntries;
+
+  // Progress of handing the StagingBuffers over to the fatal signal handler
+  // (see installCrashHandler()); the background thread parks once requested
+  enum CrashDrainState : int {
+    CRASH_DRAIN_IDLE,       // No fatal signal received
+    CRASH_DRAIN_REQUESTED,  // Signal handler waits for the thread to park
+    CRASH_DRAIN_PARKED      // Thread flushed its output and holds the locks
+  };
+  std::atomic<int> crashDrainState;
+
+  // Incremented every time setLogFile() switches to a new output file
+  std::atomic<uint32_t> logFileGeneration;
+
+  // Current metric epoch (see getMetricEpoch())
+  std::atomic<uint32_t> metricEpoch;
+
+  // Indicates that collectMetrics() forces a fence onto the threads
+  // updating metrics with membarrier() (see isMetricFenceNeeded())
+  std::atomic<bool> metricMembarrier;
+
+  // Serializes the collections of the metric aggregates, i.e. by the
+  // background thread and by the destructor
+  std::mutex metricMutex;
+
+  // Indicates that some of the aggregates of the epoch before the current
+  // one have yet to be staged; set under the metricMutex
+  std::atomic<bool> metricsPending;
+
+  // StagingBuffer the aggregates collected from the threads are staged to;
+  // protected by the metricMutex
+  StagingBuffer* metricBuffer;
+
   // Marks the rdtsc() when the current compression thread first started
-  // running. A value of 0 indicates the compression thread is not running
+  // running, or when embedded mode was enabled. A value of 0 indicates the
+  // compression thread is not running
   uint64_t cycleAtThreadStart;
 
   // Marks the rdtsc() when the last I/O operation started
@@ -256,6 +1239,18 @@ class RuntimeLogger {
   // how well the background thread keeps up with the logging threads.
   uint64_t stagingBufferPeekDist[20];
 
+  // Metric: Number of times a StagingBuffer was compressed ahead of the pass
+  // under the SCAN_FILL_PRIORITY policy, how many of those had a blocked
+  // producer, and how often a StagingBuffer was left behind with log
+  // messages pending due to the SCAN_QUOTA_BYTES
+  uint64_t numUrgentServices;
+  uint64_t numBlockedServices;
+  uint64_t numQuotaCutoffs;
+
+  // StagingBuffers to compress ahead of the pass along with their priority;
+  // kept around to avoid allocations
+  std::vector<std::pair<uint64_t, StagingBuffer*>> urgentBuffers;
+
   // Metric: Amount of time spent scanning the buffers for work and
   // compressing events found.
   uint64_t cyclesScanningAndCompressing;
@@ -283,25 +1278,119 @@ class RuntimeLogger {
   // Stores the last coreId that the background thread ran in.
   int coreId;
 
-  // Used to control access to invocationSites
+  // Serializes the registration of log invocation sites; the compression
+  // threads read the invocationSites without it
   std::mutex registrationMutex;
 
   // Maps unique identifiers to log invocation sites encountered thus far
   // by the non-preprocessor version of NanoLog
-  std::vector<StaticLogInfo> invocationSites;
+  SiteDictionary invocationSites;
 
   // Indicates the index of the next invocationSite that needs to be
   // persisted to disk.
   uint32_t nextInvocationIndexToBePersisted;
 
+  // Backing storage for the StaticLogInfo::extensions of invocationSites. A
+  // deque is used so that the strings are never moved.
+  std::deque<std::string> siteExtensions;
+
+  // Serializes snapshots of the executable mappings (see enableModuleMaps())
+  std::mutex moduleMapMutex;
+
+  // Indicates that backtraces are being logged and the compression thread
+  // should persist new module maps as modules are loaded.
+  std::atomic<bool> moduleMapsEnabled;
+
+  // Number of modules ever loaded into the process as of the last module
+  // map snapshot (i.e. dl_phdr_info::dlpi_adds).
+  unsigned long long moduleMapLoadCount;
+
+  /**
+   * Static information associated with a log site created for a format
+   * string that is only known at runtime (see getDynamicLogId()).
+   */
+  struct DynamicLogSite {
+    DynamicLogSite(uint64_t hash, const char* filename, uint32_t linenum,
+                   LogLevel severity, const char* format,
+                   StaticLogInfo::CompressionFn compressionFn)
+        : hash(hash),
+          filename(filename),
+          linenum(linenum),
+          severity(severity),
+          format(format),
+          compressionFn(compressionFn),
+          paramTypes(),
+          logId(UNASSIGNED_LOGID) {}
+
+    inline bool matches(uint64_t otherHash, const char* otherFilename,
+                        uint32_t otherLinenum, LogLevel otherSeverity,
+                        const char* otherFormat,
+                        StaticLogInfo::CompressionFn otherCompressionFn) {
+      return hash == otherHash && filename == otherFilename &&
+             linenum == otherLinenum && severity == otherSeverity &&
+             compressionFn == otherCompressionFn &&
+             std::strcmp(format.c_str(), otherFormat) == 0;
+    }
+
+    // Hash of the fields below, used to index the caches
+    uint64_t hash;
+
+    // Static information identifying the dynamic log site
+    const char* filename;
+    uint32_t linenum;
+    LogLevel severity;
+
+    // Private copy of the runtime format string
+    std::string format;
+
+    // Compression function matching the types of the log arguments
+    StaticLogInfo::CompressionFn compressionFn;
+
+    // Type of the n-th format parameter as parsed from the format string
+    std::vector<ParamType> paramTypes;
+
+    // Identifier assigned by the dictionary, DYNAMIC_LOG_SITE_INVALID or,
+    // for the overflowLogSiteCache[], DYNAMIC_LOG_SITES_EXHAUSTED
+    int logId;
+
+    DISALLOW_COPY_AND_ASSIGN(DynamicLogSite);
+  };
+
+  // Protects the dynamic log site structures below
+  std::mutex dynamicLogSiteMutex;
+
+  // Dynamic log sites created thus far. A deque is used so that pointers to
+  // the sites remain valid as more sites are added.
+  std::deque<DynamicLogSite> dynamicLogSites;
+
+  // Log sites created by getPreformattedLogId(), kept apart from the
+  // dynamicLogSites so that they never exhaust them
+  std::deque<DynamicLogSite> preformattedLogSites;
+
+  // Maps the hashes of the dynamicLogSites and preformattedLogSites to the
+  // sites themselves
+  std::unordered_multimap<uint64_t, DynamicLogSite*> dynamicLogSiteIndex;
+
+  // Metric: Number of times a thread-local dynamic log site lookup missed
+  std::atomic<uint64_t> dynamicLogSiteCacheMisses;
+
+  // Metric: Number of runtime format string invocations that were formatted
+  // on the logging thread due to running out of dynamic log sites.
+  std::atomic<uint64_t> dynamicLogSiteOverflows;
+
   /**
    * Implements a circular FIFO producer/consumer byte queue that is used
    * to hold the dynamic information of a NanoLog log statement (producer)
    * as it waits for compression via the NanoLog background thread
    * (consumer). There exists a StagingBuffer for every thread that uses
-   * the NanoLog system.
+   * the NanoLog system, and a smaller PriorityLane for every thread that
+   * logs messages at or above the priorityLaneLevel.
+   *
+   * \tparam capacity
+   *      Byte size of the queue
    */
-  class StagingBuffer {
+  template <uint32_t capacity>
+  class BasicStagingBuffer {
    public:
     /**
      * Attempt to reserve contiguous space for the producer without
@@ -316,18 +1405,23 @@ class RuntimeLogger {
      *
      * \param nbytes
      *      Number of bytes to allocate
+     * \param blocking
+     *      Indicates whether to wait for the consumer instead of returning
+     *      nullptr while there's not enough space
      *
      * \return
      *      Pointer to at least nbytes of contiguous space
      */
-    inline char* reserveProducerSpace(size_t nbytes) {
+    inline char* reserveProducerSpace(size_t nbytes, bool blocking = true) {
       ++numAllocations;
 
       // Fast in-line path
       if (nbytes < minFreeSpace) return &storage[producerPos];
 
       // Slow allocation
-      return reserveSpaceInternal(nbytes);
+      char* space = reserveSpaceInternal(nbytes, blocking);
+      if (space == nullptr) --numAllocations;
+      return space;
     }
 
     /**
@@ -339,13 +1433,40 @@ class RuntimeLogger {
      */
     inline void finishReservation(size_t nbytes) {
       assert(nbytes < minFreeSpace);
-      assert(producerPos + nbytes < NanoLogConfig::STAGING_BUFFER_SIZE);
+      assert(producerPos + nbytes < capacity);
 
       Fence::sfence();  // Ensures producer finishes writes before bump
       minFreeSpace -= nbytes;
       producerPos += nbytes;
     }
 
+    /**
+     * Invoked by the producer after finishReservation() to set the bit of
+     * the StagingBuffer in the activeBuffers of its RuntimeLogger, in case
+     * the compression thread cleared it after finding the StagingBuffer
+     * idle (see RuntimeLogger::sweepIdleBuffers()).
+     */
+    inline void markActive() {
+      // Keeps the compiler from checking the bit before bumping the
+      // producerPos; the CPU is taken care of by the compression thread
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      if (!activeBuffers->test(slot)) activeBuffers->set(slot);
+    }
+
+    /**
+     * Invoked by the producer as its thread exits to let the compression
+     * thread delete the StagingBuffer once it is drained. The StagingBuffer
+     * may be deleted as soon as shouldDeallocate is set, so the bit in the
+     * activeBuffers is set without touching the StagingBuffer afterwards.
+     */
+    inline void markForDeallocation() {
+      ActiveBufferSet* buffers = activeBuffers;
+      uint32_t bufferSlot = slot;
+      shouldDeallocate = true;
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      if (!buffers->test(bufferSlot)) buffers->set(bufferSlot);
+    }
+
     char* peek(uint64_t* bytesAvailable);
 
     /**
@@ -374,13 +1495,58 @@ class RuntimeLogger {
 
     uint32_t getId() { return id; }
 
-    StagingBuffer(uint32_t bufferId) : id(bufferId) {
+    /**
+     * Claims the StagingBuffer for the calling compression thread, which
+     * keeps multiple compression threads from consuming it at once.
+     *
+     * \return
+     *      False if another compression thread holds the claim
+     */
+    bool tryClaim() {
+      return !claimed.exchange(true, std::memory_order_acquire);
+    }
+
+    // Complement to tryClaim()
+    void releaseClaim() { claimed.store(false, std::memory_order_release); }
+
+    /**
+     * Invoked by the producer after finishReservation() to check whether the
+     * compression thread went to sleep after finding the StagingBuffer empty
+     * and has to be woken up (see RuntimeLogger::waitForDoorbell()). Only the
+     * first log message after the doorbell is armed rings it.
+     *
+     * \return
+     *      True if the caller has to ring the doorbell
+     */
+    inline bool disarmDoorbell() {
+      // Keeps the compiler from checking the doorbell before bumping the
+      // producerPos; the CPU is taken care of by the compression thread
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      return doorbellArmed.load(std::memory_order_relaxed) &&
+             doorbellArmed.exchange(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the number of bytes waiting to be consumed. The value is read
+     * without synchronization and is only an estimate.
+     */
+    uint64_t getBytesPending() {
+      uint64_t cachedConsumerPos = consumerPos;
+      uint64_t cachedProducerPos = producerPos;
+
+      if (cachedProducerPos >= cachedConsumerPos)
+        return cachedProducerPos - cachedConsumerPos;
+
+      return endOfRecordedSpace - cachedConsumerPos + cachedProducerPos;
+    }
+
+    BasicStagingBuffer(uint32_t bufferId) : id(bufferId) {
       // Empty function, but causes the C++ runtime to instantiate the
       // sbc thread_local (see documentation in function).
       sbc.stagingBufferCreated();
     }
 
-    ~StagingBuffer() {}
+    ~BasicStagingBuffer() {}
 
     PRIVATE : char* reserveSpaceInternal(size_t nbytes, bool blocking = true);
 
@@ -389,11 +1555,11 @@ class RuntimeLogger {
 
     // Marks the end of valid data for the consumer. Set by the producer
     // on a roll-over
-    uint64_t endOfRecordedSpace{NanoLogConfig::STAGING_BUFFER_SIZE};
+    uint64_t endOfRecordedSpace{capacity};
 
     // Lower bound on the number of bytes the producer can allocate w/o
     // rolling over the producerPos or stalling behind the consumer
-    uint64_t minFreeSpace{NanoLogConfig::STAGING_BUFFER_SIZE};
+    uint64_t minFreeSpace{capacity};
 
 #ifdef RECORD_PRODUCER_STATS
     // Number of cycles producer was blocked while waiting for space to
@@ -410,9 +1576,24 @@ class RuntimeLogger {
     // to free up in the StagingBuffer for an allocation
     uint32_t numTimesProducerBlocked{0};
 
-    // Number of alloc()'s performed
+    // Set while the producer waits for the consumer to free up space
+    std::atomic<bool> producerBlocked{false};
+
+    // Number of alloc()'s performed. Since every alloc() holds one log
+    // record, this doubles as the sequence number of the last log record
+    // staged (see waitUntilPersisted()).
     uint64_t numAllocations{0};
 
+    // Number of log records handed to the encoder by the consumer
+    uint64_t recordsEncoded{0};
+
+    // Number of log records contained in the output handed to the AIO
+    uint64_t recordsInFlight{0};
+
+    // Number of log records persisted to the log file; written by the
+    // consumer and read by the producer
+    std::atomic<uint64_t> recordsPersisted{0};
+
     // Number of Cycles in 10ns. This is used to avoid the expensive
     // Cycles::toNanoseconds() call to calculate the bucket in the
     // cyclesProducerBlockedDist distribution.
@@ -428,17 +1609,40 @@ class RuntimeLogger {
     // compression thread.
     bool shouldDeallocate{false};
 
+    // Set while a compression thread has claimed the StagingBuffer
+    std::atomic<bool> claimed{false};
+
+    // Set by the compression thread before sleeping on the doorbell. New
+    // StagingBuffers start out armed since the compression thread does not
+    // know about them yet.
+    std::atomic<bool> doorbellArmed{true};
+
     // Uniquely identifies this StagingBuffer for this execution. It's
     // similar to ThreadId, but is only assigned to threads that NANO_LOG).
     uint32_t id;
 
+    // Bitmap of the RuntimeLogger the StagingBuffer is registered with and
+    // the slot assigned to the StagingBuffer in it. Priority lanes are not
+    // registered and record the slot of their thread's StagingBuffer.
+    ActiveBufferSet* activeBuffers{nullptr};
+    uint32_t slot{0};
+
+    // Priority lane of the thread owning the StagingBuffer, which is only
+    // drained by the compression thread holding the claim on the
+    // StagingBuffer (see RuntimeLogger::drainPriorityLanes())
+    std::atomic<PriorityLane*> lane{nullptr};
+
+    // Set by the compression threads whenever they find log messages
+    // pending; reset by sweepIdleBuffers()
+    std::atomic<bool> activeSinceSweep{false};
+
     // Backing store used to implement the circular queue
-    char storage[NanoLogConfig::STAGING_BUFFER_SIZE]{};
+    char storage[capacity]{};
 
     friend RuntimeLogger;
     friend StagingBufferDestroyer;
 
-    DISALLOW_COPY_AND_ASSIGN(StagingBuffer);
+    DISALLOW_COPY_AND_ASSIGN(BasicStagingBuffer);
   };
 
   // This class is intended to be instantiated as a C++ thread_local to
@@ -465,14 +1669,81 @@ class RuntimeLogger {
 
     virtual ~StagingBufferDestroyer() {
       if (stagingBuffer != nullptr) {
-        stagingBuffer->shouldDeallocate = true;
+        stagingBuffer->markForDeallocation();
         stagingBuffer = nullptr;
       }
+
+      if (priorityLane != nullptr) {
+        priorityLane->shouldDeallocate = true;
+        priorityLane = nullptr;
+      }
+
+      for (uint32_t i = 0; i < NanoLogConfig::MAX_CHANNELS; ++i) {
+        if (channelBuffers[i] != nullptr) {
+          channelBuffers[i]->markForDeallocation();
+          channelBuffers[i] = nullptr;
+        }
+
+        if (channelLanes[i] != nullptr) {
+          channelLanes[i]->shouldDeallocate = true;
+          channelLanes[i] = nullptr;
+        }
+      }
+
+      for (uint32_t i = 0; i < NanoLogConfig::DYNAMIC_LOG_SITE_CACHE_SIZE;
+           ++i) {
+        if (dynamicLogSiteCache[i] == overflowLogSiteCache[i])
+          dynamicLogSiteCache[i] = nullptr;
+
+        delete overflowLogSiteCache[i];
+        overflowLogSiteCache[i] = nullptr;
+      }
     }
   };
 
   DISALLOW_COPY_AND_ASSIGN(RuntimeLogger);
 };  // RuntimeLogger
+
+/**
+ * Redirects the log messages the calling thread stages during the lifetime
+ * of this object to the thread's StagingBuffer of a channel. This class is
+ * meant to be instantiated by NANO_LOG_CHANNEL().
+ */
+class RuntimeLogger::ChannelScope {
+ public:
+  explicit ChannelScope(Channel channel)
+      : channel(channel), savedBuffer(nullptr), savedLane(nullptr) {
+    if (channel == PRIMARY_CHANNEL) return;
+
+    savedBuffer = stagingBuffer;
+    savedLane = priorityLane;
+
+    activeChannel = getChannelLogger(channel);
+    stagingBuffer = channelBuffers[channel];
+    priorityLane = channelLanes[channel];
+    activeChannel->ensureStagingBufferAllocated();
+  }
+
+  ~ChannelScope() {
+    if (channel == PRIMARY_CHANNEL) return;
+
+    channelBuffers[channel] = stagingBuffer;
+    channelLanes[channel] = priorityLane;
+
+    stagingBuffer = savedBuffer;
+    priorityLane = savedLane;
+    activeChannel = nullptr;
+  }
+
+ private:
+  Channel channel;
+
+  // The thread's primary StagingBuffer and priority lane
+  StagingBuffer* savedBuffer;
+  PriorityLane* savedLane;
+
+  DISALLOW_COPY_AND_ASSIGN(ChannelScope);
+};
 };  // Namespace NanoLogInternal
 
 // MUST appear at the very end of the RuntimeLogger.h file, right before the
@@ -0,0 +1,221 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Symbolizer.h"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace NanoLogInternal {
+
+Symbolizer::Symbolizer() : mappings(), modules() {}
+
+/**
+ * Adds an executable mapping of the runtime's address space that addresses
+ * passed to symbolize() can be resolved against.
+ *
+ * \param start
+ *      Start of the mapped address range
+ * \param end
+ *      End of the mapped address range
+ * \param offset
+ *      Offset into the mapped file of the start address
+ * \param path
+ *      Path of the mapped file
+ */
+void Symbolizer::addMapping(uint64_t start, uint64_t end, uint64_t offset,
+                            const char* path) {
+  mappings.push_back({start, end, offset, path});
+}
+
+/**
+ * Removes all the mappings added thus far.
+ */
+void Symbolizer::clear() { mappings.clear(); }
+
+/**
+ * Returns a human-readable description of a return address in the form
+ * "function+0x1a (module)". Parts that cannot be resolved are replaced with
+ * the raw address.
+ *
+ * \param returnAddress
+ *      Return address captured at runtime
+ */
+std::string Symbolizer::symbolize(uint64_t returnAddress) {
+  // Return addresses point to the instruction following the call, which may
+  // belong to the next function if the call was the last instruction.
+  uint64_t address = returnAddress - 1;
+
+  auto mapping = std::find_if(mappings.rbegin(), mappings.rend(),
+                              [address](const Mapping& m) {
+                                return m.start <= address && address < m.end;
+                              });
+  char buffer[64];
+  if (mapping == mappings.rend()) {
+    snprintf(buffer, sizeof(buffer), "0x%lx", returnAddress);
+    return buffer;
+  }
+
+  const char* moduleName = strrchr(mapping->path.c_str(), '/');
+  moduleName =
+      (moduleName == nullptr) ? mapping->path.c_str() : moduleName + 1;
+
+  const Module& module = getModule(mapping->path);
+  uint64_t fileOffset = address - mapping->start + mapping->offset;
+  for (const Segment& segment : module.segments) {
+    if (fileOffset < segment.fileOffset ||
+        fileOffset >= segment.fileOffset + segment.fileSize)
+      continue;
+
+    uint64_t vaddr = fileOffset - segment.fileOffset + segment.address;
+    auto symbol = std::upper_bound(
+        module.symbols.begin(), module.symbols.end(), vaddr,
+        [](uint64_t a, const Symbol& s) { return a < s.address; });
+
+    if (symbol == module.symbols.begin()) break;
+    --symbol;
+
+    if (vaddr >= symbol->address + std::max<uint64_t>(symbol->size, 1))
+      break;
+
+    snprintf(buffer, sizeof(buffer), "+0x%lx (",
+             vaddr + 1 - symbol->address);
+    return symbol->name + buffer + moduleName + ")";
+  }
+
+  snprintf(buffer, sizeof(buffer), "0x%lx (", returnAddress);
+  return buffer + std::string(moduleName) + ")";
+}
+
+/**
+ * Returns the symbols of an ELF file, reading them upon first use. Files
+ * that cannot be read result in a Module without symbols.
+ *
+ * \param path
+ *      Path of the ELF file
+ */
+const Symbolizer::Module& Symbolizer::getModule(const std::string& path) {
+  auto it = modules.find(path);
+  if (it != modules.end()) return it->second;
+
+  Module& module = modules[path];
+  if (!loadModule(path, module)) {
+    fprintf(stderr,
+            "Warning: Could not read the symbols of \"%s\"; addresses in "
+            "the module will not be symbolized\r\n",
+            path.c_str());
+  }
+
+  return module;
+}
+
+/**
+ * Reads the loadable segments and function symbols of an ELF file.
+ *
+ * \param path
+ *      Path of the ELF file
+ * \param[out] module
+ *      Module to populate
+ *
+ * \return
+ *      true if the file was a readable 64-bit ELF file
+ */
+bool Symbolizer::loadModule(const std::string& path, Module& module) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return false;
+  }
+
+  size_t fileSize = static_cast<size_t>(st.st_size);
+  void* file = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) return false;
+
+  const char* base = static_cast<const char*>(file);
+  auto* ehdr = reinterpret_cast<const Elf64_Ehdr*>(base);
+  auto inBounds = [fileSize](uint64_t offset, uint64_t size) {
+    return offset <= fileSize && size <= fileSize - offset;
+  };
+
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      !inBounds(ehdr->e_phoff, ehdr->e_phnum * sizeof(Elf64_Phdr)) ||
+      !inBounds(ehdr->e_shoff, ehdr->e_shnum * sizeof(Elf64_Shdr))) {
+    munmap(file, fileSize);
+    return false;
+  }
+
+  auto* phdrs = reinterpret_cast<const Elf64_Phdr*>(base + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; ++i) {
+    if (phdrs[i].p_type == PT_LOAD)
+      module.segments.push_back(
+          {phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_vaddr});
+  }
+
+  // Prefer the full symbol table and fall back to the dynamic symbols for
+  // stripped binaries.
+  auto* shdrs = reinterpret_cast<const Elf64_Shdr*>(base + ehdr->e_shoff);
+  const Elf64_Shdr* symtab = nullptr;
+  for (int i = 0; i < ehdr->e_shnum; ++i) {
+    if (shdrs[i].sh_type == SHT_SYMTAB ||
+        (shdrs[i].sh_type == SHT_DYNSYM && symtab == nullptr))
+      symtab = &shdrs[i];
+  }
+
+  if (symtab != nullptr && symtab->sh_link < ehdr->e_shnum &&
+      inBounds(symtab->sh_offset, symtab->sh_size)) {
+    const Elf64_Shdr& strtab = shdrs[symtab->sh_link];
+    auto* syms = reinterpret_cast<const Elf64_Sym*>(base + symtab->sh_offset);
+    size_t numSyms = symtab->sh_size / sizeof(Elf64_Sym);
+
+    if (!inBounds(strtab.sh_offset, strtab.sh_size)) numSyms = 0;
+
+    for (size_t i = 0; i < numSyms; ++i) {
+      if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+          syms[i].st_value == 0 || syms[i].st_name >= strtab.sh_size)
+        continue;
+
+      const char* name = base + strtab.sh_offset + syms[i].st_name;
+      int status = -1;
+      char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+      module.symbols.push_back({syms[i].st_value, syms[i].st_size,
+                                (status == 0) ? demangled : name});
+      free(demangled);
+    }
+  }
+
+  std::sort(module.symbols.begin(), module.symbols.end(),
+            [](const Symbol& a, const Symbol& b) {
+              return a.address < b.address;
+            });
+
+  munmap(file, fileSize);
+  return true;
+}
+}  // namespace NanoLogInternal
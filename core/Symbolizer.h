@@ -0,0 +1,100 @@
+/* Copyright (c) 2016-2020 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Common.h"
+#include "Portability.h"
+
+namespace NanoLogInternal {
+
+/**
+ * Resolves the raw return addresses captured by NANO_LOG_BT() into function
+ * names after the fact. The runtime persists snapshots of its executable
+ * mappings in the log's dictionary, which are fed to the Symbolizer via
+ * addMapping(), and the symbols are then read from the ELF symbol tables of
+ * the mapped binaries on the machine running the decompressor.
+ */
+class Symbolizer {
+ public:
+  Symbolizer();
+
+  void addMapping(uint64_t start, uint64_t end, uint64_t offset,
+                  const char* path);
+  void clear();
+  std::string symbolize(uint64_t returnAddress);
+
+  PRIVATE :
+      /**
+       * An executable mapping of the runtime's address space.
+       */
+      struct Mapping {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    std::string path;
+  };
+
+  /**
+   * A function symbol read from an ELF symbol table.
+   */
+  struct Symbol {
+    // Virtual address and size of the function in the ELF file
+    uint64_t address;
+    uint64_t size;
+
+    // Demangled name of the function
+    std::string name;
+  };
+
+  /**
+   * A loadable segment of an ELF file.
+   */
+  struct Segment {
+    uint64_t fileOffset;
+    uint64_t fileSize;
+    uint64_t address;
+  };
+
+  /**
+   * The symbols of an ELF file and the information needed to translate
+   * file offsets into the virtual addresses the symbols are expressed in.
+   */
+  struct Module {
+    Module() : segments(), symbols() {}
+
+    std::vector<Segment> segments;
+
+    // Function symbols sorted by address
+    std::vector<Symbol> symbols;
+  };
+
+  const Module& getModule(const std::string& path);
+  static bool loadModule(const std::string& path, Module& module);
+
+  // Executable mappings in the order they were added. Later mappings take
+  // precedence when address ranges overlap.
+  std::vector<Mapping> mappings;
+
+  // Cache of the ELF files read thus far, indexed by path
+  std::unordered_map<std::string, Module> modules;
+
+  DISALLOW_COPY_AND_ASSIGN(Symbolizer);
+};
+}  // namespace NanoLogInternal
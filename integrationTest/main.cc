@@ -18,7 +18,12 @@
  * the NanoLog system.
  */
 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <thread>
+#include <vector>
 
 #ifndef PREPROCESSOR_NANOLOG
 #include "NanoLogCpp17.h"
@@ -393,8 +398,305 @@ void testAllTheTypes() {
            (long double)14.0);
 }
 
-int main() {
+// Test logging raw structs with a reflected schema.
+enum class Side : uint8_t { BUY = 1, SELL = 2 };
+
+struct Order {
+  uint64_t id;
+  double price;
+  int32_t quantity;
+  Side side;
+  char symbol[8];
+  bool ioc;
+};
+
+NANO_LOG_REFLECT(Order, id, price, quantity, side, symbol, ioc);
+
+// Structs need not be default constructible
+struct Quote {
+  Quote(int32_t bid, int32_t ask) : bid(bid), ask(ask) {}
+  int32_t bid;
+  int32_t ask;
+};
+
+NANO_LOG_REFLECT(Quote, bid, ask);
+
+void structTest() {
+  Order order = {12345678901ULL, 101.25, -300, Side::SELL, "NANO", true};
+  NANO_LOG_STRUCT(INF, order);
+
+  // A symbol filling the entire array has no NULL terminator
+  std::memcpy(order.symbol, "ABCDEFGH", sizeof(order.symbol));
+  order.side = Side::BUY;
+  NANO_LOG_STRUCT(INF, order);
+
+  Quote quote(-5, 7);
+  NANO_LOG_STRUCT(INF, quote);
+}
+
+// Test format strings that are only known at runtime.
+void runtimeFormatTest() {
+  std::string formats[] = {"Runtime format %d of %s", "Runtime double %0.2lf"};
+
+  for (int i = 0; i < 3; ++i) {
+    NANO_LOG_RUNTIME(INF, formats[0].c_str(), i, "three");
+  }
+
+  NANO_LOG_RUNTIME(WRN, formats[1].c_str(), 3.14159);
+
+  // Arguments that don't match the format cause the format itself to be logged
+  NANO_LOG_RUNTIME(ERR, formats[0].c_str(), 1, 2);
+  NANO_LOG_RUNTIME(ERR, formats[0].c_str(), 2.5, "three");
+  NANO_LOG_RUNTIME(ERR, formats[1].c_str(), -300000);
+  NANO_LOG_RUNTIME(ERR, formats[1].c_str(), 300000000000L);
+}
+
+// Test enum and errno values rendered by name from the dictionary.
+enum Color { RED, GREEN, BLUE };
+
+void enumTest() {
+  NanoLog::registerEnumTable<Color>("Color",
+                                    {{RED, "RED"}, {GREEN, "GREEN"}});
+  NanoLog::registerEnumTable<Side>("Side",
+                                   {{Side::BUY, "BUY"}, {Side::SELL, "SELL"}});
+
+  NANO_LOG(INF, "Color %d and %-6d|", GREEN, RED);
+  NANO_LOG(INF, "Unnamed color %d", BLUE);
+  NANO_LOG(INF, "Side %*d|", 5, NanoLog::enumArg(Side::SELL));
+  NANO_LOG(ERR, "Open failed: %d", NanoLog::Errno(ENOENT));
+
+  Order order = {42, 99.5, 100, Side::BUY, "ENUM", false};
+  NANO_LOG_STRUCT(INF, order);
+}
+
+// Test logging the call stack for offline symbolization.
+static void __attribute__((noinline)) backtraceLeaf(int depth) {
+  NANO_LOG_BT(ERR, "Backtrace at depth %d", depth);
+}
+
+static void __attribute__((noinline)) backtraceTest(int depth) {
+  if (depth > 0)
+    backtraceTest(depth - 1);
+  else
+    backtraceLeaf(depth);
+}
+
+// Test attaching thread-local context to log messages.
+void contextTest() {
+  NanoLog::setContext("request", "r-17");
+  NANO_LOG(INF, "Handling request");
+
+  NanoLog::setContext("request", "r-17");  // Unchanged; nothing is logged
+  NanoLog::setContext("user", "alice");
+  NANO_LOG(INF, "Authenticated");
+
+  NanoLog::clearContext("request");
+  NANO_LOG(INF, "Request done");
+
+  NanoLog::clearContext("user");
+  NANO_LOG(INF, "No context");
+}
+
+// Test timing nested scopes.
+static void spanLeaf() { NANO_SPAN("leaf"); }
+
+void spanTest() {
+  LogLevel startingLevel = NanoLog::getLogLevel();
+  NanoLog::setLogLevel(TRC);
+
+  {
+    NANO_SPAN("outer");
+    for (int i = 0; i < 3; ++i) spanLeaf();
+  }
+
+  NanoLog::setLogLevel(startingLevel);
+  NANO_SPAN("disabled");
+}
+
+// Test aggregating metrics on the logging thread.
+void metricTest() {
+  for (int i = 0; i < 1000; ++i) {
+    NANO_METRIC_COUNT("packets", 1);
+    NANO_METRIC_HIST("packet_size", 64 + (i % 3) * 512);
+  }
+
+  NANO_METRIC_COUNT("drops", -2);
+  NanoLog::flushMetrics();
+}
+
+void priorityLaneTest() {
+  NanoLog::setPriorityLaneLevel(NanoLog::WRN);
+  for (int i = 0; i < 3; ++i) {
+    NANO_LOG(INF, "Bulk message %d", i);
+    NANO_LOG(WRN, "Priority message %d", i);
+  }
+
+  NanoLog::setPriorityLaneLevel(NanoLog::SILENT_LOG_LEVEL);
+}
+
+// Test priority lanes while the StagingBuffers back up enough to start the
+// additional compression threads; the sorted output of each thread must
+// count up without gaps.
+void priorityLaneHelpersTest() {
+  NanoLog::setPriorityLaneLevel(NanoLog::WRN);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < 100000; ++i) {
+        if (i % 97 == 0)
+          NANO_LOG(WRN, "Lane thread %d message %d", t, i);
+        else
+          NANO_LOG(INF, "Lane thread %d message %d (%s)", t, i, "bulk");
+      }
+    });
+  }
+
+  for (std::thread& thread : threads) thread.join();
+  NanoLog::setPriorityLaneLevel(NanoLog::SILENT_LOG_LEVEL);
+}
+
+/**
+ * Decompresses the log messages of priorityLaneHelpersTest() from a log file
+ * and checks that every one of them was output once and in order with the
+ * other log messages of its thread and severity.
+ *
+ * \return
+ *      True if the check passed
+ */
+bool checkLaneOutput(const char* logFile) {
+  NanoLogInternal::Log::Decoder decoder;
+  if (!decoder.open(logFile)) {
+    printf("Unable to open the log file %s\r\n", logFile);
+    return false;
+  }
+
+  FILE* decoded = tmpfile();
+  decoder.decompressTo(decoded);
+  rewind(decoded);
+
+  // Next message expected of each thread among its bulk and its priority
+  // messages (every 97th message is a priority message)
+  int nextMessage[4][2] = {{1, 0}, {1, 0}, {1, 0}, {1, 0}};
+  int numMessages = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), decoded) != nullptr) {
+    const char* message = strstr(line, "Lane thread ");
+    int t, i;
+    if (message == nullptr ||
+        sscanf(message, "Lane thread %d message %d", &t, &i) != 2)
+      continue;
+
+    bool priority = (i % 97 == 0);
+    if (t < 0 || t >= 4 || i != nextMessage[t][priority]) {
+      printf("Lane thread %d message %d is out of order\r\n", t, i);
+      fclose(decoded);
+      return false;
+    }
+
+    if (priority)
+      nextMessage[t][1] = i + 97;
+    else
+      nextMessage[t][0] = (i + 1) % 97 == 0 ? i + 2 : i + 1;
+    ++numMessages;
+  }
+  fclose(decoded);
+
+  if (numMessages != 4 * 100000) {
+    printf("Found %d of the %d lane messages\r\n", numMessages, 4 * 100000);
+    return false;
+  }
+
+  return true;
+}
+
+// Test the compression settings the regular run leaves at their defaults,
+// i.e. additional compression threads, the doorbell wakeup policy and the
+// fill-priority scan policy. Since they apply to the whole process, they
+// are tested in a run of their own that checks the decoded log itself.
+int compressionModesTest() {
+  // NanoLog appends to an existing log file
+  const char* logFile = "compressionModesLog";
+  remove(logFile);
+  NanoLog::setLogFile(logFile);
+  NanoLog::setMaxCompressionThreads(2);
+  NanoLog::setWakeupPolicy(NanoLog::WAKEUP_DOORBELL);
+  NanoLog::setScanPolicy(NanoLog::SCAN_FILL_PRIORITY);
+
+  priorityLaneHelpersTest();
+  NanoLog::sync();
+
+  if (!checkLaneOutput(logFile)) return 1;
+
+  printf("Compression modes test passed\r\n");
+  return 0;
+}
+
+void durableTest() {
+  std::future<void> flushed = NanoLog::flushAsync();
+  NANO_LOG(INF, "Logged while flushing");
+  flushed.wait();
+
+  NANO_LOG_DURABLE(INF, "Durable message %d", 1);
+}
+
+void producerCompressionTest() {
+  NanoLog::setProducerCompression(true);
+  NANO_LOG(INF, "Compressed by the logging thread: %d %lu %s %0.2lf", -7,
+           1234567890123UL, "str", 3.14);
+  NANO_LOG(INF, "Precision %.*s and width %*d", 3, "truncated", 6, 42);
+  NanoLog::setProducerCompression(false);
+}
+
+void truncatedStringTest() {
+  std::string huge(NanoLogConfig::MAX_STRING_ARG_LENGTH + 100, 'x');
+  NANO_LOG(INF, "Huge string of %lu characters: %s", huge.size(),
+           huge.c_str());
+  NANO_LOG(INF, "Huge string with precision: %.5s", huge.c_str());
+}
+
+void channelTest() {
+  NanoLog::Channel audit = NanoLog::createChannel("audit", "testLog.audit");
+  NanoLog::setChannelLogLevel(audit, NanoLog::WRN);
+
+  NANO_LOG_CHANNEL(audit, WRN, "Audit record %d for %s", 1, "alice");
+  NANO_LOG_CHANNEL(audit, INF, "Dropped by the audit channel's log level");
+  NANO_LOG_CHANNEL(NanoLog::PRIMARY_CHANNEL, INF, "Logged to the primary");
+  NANO_LOG(INF, "Primary message after logging to a channel");
+
+  NanoLog::syncChannel(NanoLog::getChannel("audit"));
+}
+
+void deltaArgumentsTest() {
+  for (uint64_t seq = 1000; seq < 1005; ++seq)
+    NANO_LOG_DELTA(INF, "Order %lu at %d ticks (%s) priced %.2lf",
+                   1000000007UL * seq, 1005 - static_cast<int>(seq) * 2,
+                   "delta", 101.25 + static_cast<double>(seq % 2) / 100);
+
+  for (int tick = 0; tick < 5; ++tick) {
+    double price = 101.25 + tick / 100.0;
+    NANO_LOG_XOR(INF, 0b101, "Bid %.2lf ask %.2lf at tick %d", price,
+                 price + 0.01, tick);
+    NANO_LOG_SERIES(INF, true, 0b10, "Fill %d at %.2lf", 7 + tick, price);
+  }
+}
+
+void embeddedModeTest() {
+  NanoLog::enableEmbeddedMode();
+
+  NANO_LOG(INF, "Compressed by poll() in embedded mode");
+  while (NanoLog::poll(100000)) {
+  }
+
+  NANO_LOG(INF, "Compressed by sync() in embedded mode");
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "--compression-modes") == 0)
+    return compressionModesTest();
+
   NanoLog::setLogFile("testLog");
+  NanoLog::installCrashHandler();
   evilTestCase(NULL);
   testAllTheTypes();
 
@@ -420,6 +722,20 @@ int main() {
   st.logSomething();
 
   logLevelTest();
+  structTest();
+  runtimeFormatTest();
+  enumTest();
+  backtraceTest(2);
+  contextTest();
+  spanTest();
+  metricTest();
+  priorityLaneTest();
+  durableTest();
+  producerCompressionTest();
+  truncatedStringTest();
+  channelTest();
+  deltaArgumentsTest();
+  embeddedModeTest();
 
   NanoLog::sync();
 
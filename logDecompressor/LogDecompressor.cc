@@ -186,6 +186,7 @@ int main(int argc, char** argv) {
 
   if (sorted) {
     decoder.decompressTo(outputFd);
+    decoder.printSpanSummary(outputFd);
     // if (outputFd)
     //   fprintf(outputFd,
     //           "\r\n\r\n# Decompression Complete after printing "
@@ -198,6 +199,7 @@ int main(int argc, char** argv) {
   if (filterId < 0) {
     int64_t numLogMsgs = 0;
     while (decoder.getNextLogStatement(args, outputFd)) ++numLogMsgs;
+    decoder.printSpanSummary(outputFd);
 
     // if (outputFd)
     //   fprintf(outputFd,
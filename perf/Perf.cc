@@ -44,10 +44,13 @@
 #include <fstream>
 #include <map>
 #include <thread>
+#include <vector>
 
 #include "Cycles.h"
 #include "Fence.h"
 #include "Log.h"
+#include "NanoLogCpp17.h"
+#include "Packer.h"
 #include "PerfHelper.h"
 #include "Portability.h"
 #include "Util.h"
@@ -1220,6 +1223,385 @@ double uncompressedLogEntryIterationWithFence() {
   return Cycles::toSeconds(stop - start) / (arraySize);
 }
 
+// Number of log invocation sites registered by the dictionary benchmarks
+static const uint32_t NUM_DICTIONARY_SITES = 50000;
+
+static void compressNoArguments(int, const ParamType*, char**, char**) {}
+
+static const StaticLogInfo dictionarySite(compressNoArguments, "Perf.cc", 1,
+                                          2, "Site without arguments", 0, 0,
+                                          nullptr);
+
+/**
+ * Returns a SiteDictionary holding NUM_DICTIONARY_SITES log sites, which
+ * is built on first use and shared by the dictionary benchmarks.
+ */
+static const SiteDictionary& largeSiteDictionary() {
+  static SiteDictionary* dictionary = nullptr;
+  if (dictionary == nullptr) {
+    dictionary = new SiteDictionary();
+    for (uint32_t i = 0; i < NUM_DICTIONARY_SITES; ++i)
+      dictionary->append(dictionarySite);
+  }
+  return *dictionary;
+}
+
+double dictionaryShadowCopy() {
+  const SiteDictionary& sites = largeSiteDictionary();
+  size_t count = 100;
+  uint64_t junk = 0;
+
+  uint64_t start = Cycles::rdtsc();
+  for (size_t i = 0; i < count; ++i) {
+    std::vector<StaticLogInfo> shadow;
+    for (uint32_t j = 0; j < sites.size(); ++j) shadow.push_back(sites[j]);
+    junk += shadow.size();
+  }
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&junk);
+  return Cycles::toSeconds(stop - start) / count;
+}
+
+double dictionaryView() {
+  const SiteDictionary& sites = largeSiteDictionary();
+  size_t count = 1000000;
+  uint64_t junk = 0;
+
+  uint64_t start = Cycles::rdtsc();
+  for (size_t i = 0; i < count; ++i) {
+    SiteDictionary::View view = sites.view();
+    junk += view.size();
+  }
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&junk);
+  return Cycles::toSeconds(stop - start) / count;
+}
+
+double encodeLogMsgsLargeDictionary() {
+  const SiteDictionary& sites = largeSiteDictionary();
+  const size_t numEntries = 65536;
+  const size_t inSize = numEntries * sizeof(Log::UncompressedEntry);
+  const size_t outSize = 2 * inSize + 1024;
+  const int count = 100;
+
+  // Messages from sites spread over the whole dictionary
+  char* in = static_cast<char*>(malloc(inSize));
+  char* out = static_cast<char*>(malloc(outSize));
+  for (size_t i = 0; i < numEntries; ++i) {
+    auto* entry = reinterpret_cast<Log::UncompressedEntry*>(in) + i;
+    entry->fmtId = static_cast<uint32_t>((i * 7919) % NUM_DICTIONARY_SITES);
+    entry->entrySize = sizeof(Log::UncompressedEntry);
+    entry->timestamp = i * 10;
+  }
+
+  Log::Encoder encoder(out, outSize, true);
+  uint64_t numEvents = 0;
+
+  uint64_t start = Cycles::rdtsc();
+  for (int i = 0; i < count; ++i) {
+    encoder.encodeLogMsgs(in, inSize, 1, true, sites.view(), &numEvents);
+    encoder.swapBuffer(out, outSize);
+  }
+  uint64_t stop = Cycles::rdtsc();
+
+  free(in);
+  free(out);
+  return Cycles::toSeconds(stop - start) / (count * numEntries);
+}
+
+// Format string and arguments of the compression function benchmarks
+static constexpr char compressFormat[] =
+    "Request %d from %s took %lf ms (%lu bytes, %*d retries): %s";
+static constexpr std::array<ParamType, 7> compressParamTypes =
+    analyzeFormatString<7>(compressFormat);
+
+/**
+ * Measures the per message cost of a compression function on the arguments
+ * of compressFormat.
+ *
+ * \param compressionFn
+ *      Compression function to measure
+ */
+static double compressArguments(StaticLogInfo::CompressionFn compressionFn) {
+  const char* host = "frontend-17.example.com";
+  const char* status = "OK";
+  double latency = 1.625;
+  uint64_t bytes = 48213;
+  int width = 4, retries = 2, requestId = 1031;
+
+  uint64_t previousPrecision = -1;
+  size_t stringSizes[7] = {};
+  size_t argSize =
+      getArgSizes(compressParamTypes, previousPrecision, stringSizes,
+                  requestId, host, latency, bytes, width, retries, status);
+  char in[256];
+  char out[512];
+  char* writePos = in;
+  store_arguments(compressParamTypes, stringSizes, &writePos, requestId, host,
+                  latency, bytes, width, retries, status);
+  assert(argSize <= sizeof(in));
+
+  const int numNibbles = getNumNibblesNeeded(compressFormat);
+  const int count = 10000000;
+  uint64_t junk = 0;
+
+  uint64_t start = Cycles::rdtsc();
+  for (int i = 0; i < count; ++i) {
+    char* input = in;
+    char* output = out;
+    compressionFn(numNibbles, compressParamTypes.data(), &input, &output);
+    junk += output - out;
+  }
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&junk);
+  return Cycles::toSeconds(stop - start) / count;
+}
+
+double compressGeneric() {
+  return compressArguments(
+      &compress<int, const char*, double, uint64_t, int, int, const char*>);
+}
+
+double compressSpecialized() {
+  return compressArguments(
+      &compressSite<compressParamTypes, int, const char*, double, uint64_t,
+                    int, int, const char*>);
+}
+
+double compressVByte() {
+  return compressArguments(
+      &compressSiteVByte<compressParamTypes, int, const char*, double,
+                         uint64_t, int, int, const char*>);
+}
+
+// Number of integers encoded by the pack()/unpack() benchmarks
+static const int NUM_PACKED_INTEGERS = 1 << 20;
+
+/**
+ * Returns NUM_PACKED_INTEGERS integers of 1 to 8 bytes in random order, a
+ * quarter of which are negative.
+ */
+static const std::vector<int64_t>& mixedWidthIntegers() {
+  static std::vector<int64_t> integers;
+  if (integers.empty()) {
+    srand(0);
+    for (int i = 0; i < NUM_PACKED_INTEGERS; ++i) {
+      uint64_t bits = (static_cast<uint64_t>(rand()) << 32) ^ rand();
+      int64_t value = static_cast<int64_t>(bits >> (8 * (rand() % 8) + 1));
+      integers.push_back(rand() % 4 == 0 ? -value : value);
+    }
+  }
+  return integers;
+}
+
+double packIntegers() {
+  const std::vector<int64_t>& integers = mixedWidthIntegers();
+  std::vector<char> out(NUM_PACKED_INTEGERS * sizeof(int64_t));
+  std::vector<uint8_t> nibbles(NUM_PACKED_INTEGERS);
+
+  uint64_t start = Cycles::rdtsc();
+  char* writePos = out.data();
+  for (int i = 0; i < NUM_PACKED_INTEGERS; ++i)
+    nibbles[i] =
+        static_cast<uint8_t>(BufferUtils::pack(&writePos, integers[i]));
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(writePos);
+  return Cycles::toSeconds(stop - start) / NUM_PACKED_INTEGERS;
+}
+
+double unpackIntegers() {
+  const std::vector<int64_t>& integers = mixedWidthIntegers();
+  std::vector<char> in((NUM_PACKED_INTEGERS + 1) / 2 +
+                       (NUM_PACKED_INTEGERS + 1) * sizeof(int64_t));
+
+  // Lay out the integers as the arguments of one large log message
+  auto* nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(in.data());
+  char* writePos = in.data() + (NUM_PACKED_INTEGERS + 1) / 2;
+  for (int i = 0; i < NUM_PACKED_INTEGERS; ++i) {
+    int nibble = BufferUtils::pack(&writePos, integers[i]);
+    if (i & 0x1)
+      nibbles[i / 2].second = 0xf & nibble;
+    else
+      nibbles[i / 2].first = 0xf & nibble;
+  }
+
+  uint64_t start = Cycles::rdtsc();
+  BufferUtils::Nibbler nb(in.data(), NUM_PACKED_INTEGERS);
+  int64_t sum = 0;
+  for (int i = 0; i < NUM_PACKED_INTEGERS; ++i) sum += nb.getNext<int64_t>();
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&sum);
+  return Cycles::toSeconds(stop - start) / NUM_PACKED_INTEGERS;
+}
+
+/**
+ * Returns the values and lower bound codes that compressSiteVByte() passes
+ * to packVByte() for mixedWidthIntegers().
+ */
+static void gatherVByteIntegers(std::vector<uint64_t>* values,
+                                std::vector<uint8_t>* minCodes) {
+  for (int64_t integer : mixedWidthIntegers()) {
+    bool negated = integer < 0;
+    values->push_back(negated ? 0 - static_cast<uint64_t>(integer)
+                              : static_cast<uint64_t>(integer));
+    minCodes->push_back(BufferUtils::vbyteCode(1, negated));
+  }
+}
+
+double packVByteIntegers() {
+  std::vector<uint64_t> values;
+  std::vector<uint8_t> minCodes;
+  gatherVByteIntegers(&values, &minCodes);
+  std::vector<char> out((NUM_PACKED_INTEGERS + 1) / 2 +
+                        NUM_PACKED_INTEGERS * sizeof(int64_t) +
+                        BufferUtils::VBYTE_SLACK);
+
+  uint64_t start = Cycles::rdtsc();
+  char* writePos = BufferUtils::packVByte(values.data(), minCodes.data(),
+                                          NUM_PACKED_INTEGERS, out.data());
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(writePos);
+  return Cycles::toSeconds(stop - start) / NUM_PACKED_INTEGERS;
+}
+
+double unpackVByteIntegers() {
+  std::vector<uint64_t> values;
+  std::vector<uint8_t> minCodes;
+  gatherVByteIntegers(&values, &minCodes);
+  std::vector<char> in((NUM_PACKED_INTEGERS + 1) / 2 +
+                       NUM_PACKED_INTEGERS * sizeof(int64_t) +
+                       BufferUtils::VBYTE_SLACK);
+
+  // Lay out the integers as the arguments of one large log message
+  BufferUtils::packVByte(values.data(), minCodes.data(), NUM_PACKED_INTEGERS,
+                         in.data());
+
+  std::vector<uint64_t> unpacked(NUM_PACKED_INTEGERS);
+  uint64_t start = Cycles::rdtsc();
+  BufferUtils::Nibbler nb(in.data(), NUM_PACKED_INTEGERS, nullptr, false, 0,
+                          unpacked.data());
+  int64_t sum = 0;
+  for (int i = 0; i < NUM_PACKED_INTEGERS; ++i) sum += nb.getNext<int64_t>();
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&sum);
+  return Cycles::toSeconds(stop - start) / NUM_PACKED_INTEGERS;
+}
+
+// Number of (price, latency) pairs encoded by the packXor() benchmarks
+static const int NUM_PACKED_DOUBLES = 1 << 20;
+
+/**
+ * Returns NUM_PACKED_DOUBLES pairs of a price that moves by a few cents on a
+ * third of the ticks, followed by a latency in milliseconds with microsecond
+ * resolution, which is how prices and latencies typically show up in logs.
+ */
+static const std::vector<double>& priceAndLatencySeries() {
+  static std::vector<double> series;
+  if (series.empty()) {
+    srand(0);
+    int64_t cents = 10125;
+    for (int i = 0; i < NUM_PACKED_DOUBLES; ++i) {
+      if (rand() % 3 == 0) cents += rand() % 11 - 5;
+      series.push_back(static_cast<double>(cents) / 100);
+      series.push_back(static_cast<double>(200 + rand() % 5000) / 1000);
+    }
+  }
+  return series;
+}
+
+/**
+ * Packs the price and latency series either verbatim or as the packXor() of
+ * each value with the previous value in the same slot, and returns the time
+ * per value.
+ *
+ * \param xorWithPrevious
+ *      True to packXor() the values, false to pack() them verbatim
+ * \param[out] out
+ *      Buffer of 2 * NUM_PACKED_DOUBLES + 1 doubles to pack the values into
+ */
+static double packDoubleSeries(bool xorWithPrevious, char* out) {
+  const std::vector<double>& series = priceAndLatencySeries();
+  uint64_t previous[2] = {0, 0};
+  uint64_t junk = 0;
+
+  uint64_t start = Cycles::rdtsc();
+  char* writePos = out;
+  for (size_t i = 0; i < series.size(); ++i) {
+    if (xorWithPrevious) {
+      uint64_t bits;
+      std::memcpy(&bits, &series[i], sizeof(double));
+      junk += BufferUtils::packXor(&writePos, bits ^ previous[i & 0x1]);
+      previous[i & 0x1] = bits;
+    } else {
+      junk += BufferUtils::pack(&writePos, series[i]);
+    }
+  }
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&junk);
+  return Cycles::toSeconds(stop - start) / static_cast<double>(series.size());
+}
+
+double packDoubles() {
+  std::vector<double> out(2 * NUM_PACKED_DOUBLES + 1);
+  return packDoubleSeries(false, reinterpret_cast<char*>(out.data()));
+}
+
+double packXorDoubles() {
+  std::vector<double> out(2 * NUM_PACKED_DOUBLES + 1);
+  return packDoubleSeries(true, reinterpret_cast<char*>(out.data()));
+}
+
+double unpackXorDoubles() {
+  const std::vector<double>& series = priceAndLatencySeries();
+  std::vector<char> in(NUM_PACKED_DOUBLES * (1 + 2 * sizeof(double)) +
+                       sizeof(double));
+
+  // Lay out each pair as the arguments of a log message
+  char* writePos = in.data();
+  BufferUtils::TwoNibbles* nibbles = nullptr;
+  uint64_t previous[2] = {0, 0};
+  for (size_t i = 0; i < series.size(); ++i) {
+    if ((i & 0x1) == 0) {
+      nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(writePos);
+      writePos += sizeof(BufferUtils::TwoNibbles);
+    }
+
+    uint64_t bits;
+    std::memcpy(&bits, &series[i], sizeof(double));
+    int nibble = BufferUtils::packXor(&writePos, bits ^ previous[i & 0x1]);
+    previous[i & 0x1] = bits;
+
+    if (i & 0x1)
+      nibbles->second = 0xf & nibble;
+    else
+      nibbles->first = 0xf & nibble;
+  }
+  discard(writePos);
+
+  uint64_t start = Cycles::rdtsc();
+  const char* readPos = in.data();
+  uint64_t bases[2] = {0, 0};
+  double sum = 0;
+  for (int i = 0; i < NUM_PACKED_DOUBLES; ++i) {
+    BufferUtils::Nibbler nb(readPos, 2, bases, false, 0x3);
+    sum += nb.getNext<double>();
+    sum += nb.getNext<double>();
+    readPos = nb.getEndOfPackedArguments();
+  }
+  uint64_t stop = Cycles::rdtsc();
+
+  discard(&sum);
+  return Cycles::toSeconds(stop - start) / static_cast<double>(series.size());
+}
+
 // The following struct and table define each performance test in terms of
 // a string name and a function that implements the test.
 struct TestInfo {
@@ -1324,6 +1706,31 @@ TestInfo tests[] = {
      "Per element cost of iterating through log entries"},
     {"LogEntryIterationFence", uncompressedLogEntryIterationWithFence,
      "Per element cost of iterating through log entries with lfences"},
+    {"dictionaryShadowCopy", dictionaryShadowCopy,
+     "Copy a 50k-site dictionary into a std::vector"},
+    {"dictionaryView", dictionaryView,
+     "Take a view of a 50k-site dictionary"},
+    {"encodeLargeDictionary", encodeLogMsgsLargeDictionary,
+     "Per message cost of encoding against a 50k-site dictionary"},
+    {"compressGeneric", compressGeneric,
+     "Compress 7 arguments with compress<Ts...>"},
+    {"compressSpecialized", compressSpecialized,
+     "Compress 7 arguments with compressSite<paramTypes, Ts...>"},
+    {"compressVByte", compressVByte,
+     "Compress 7 arguments with compressSiteVByte<paramTypes, Ts...>"},
+    {"packIntegers", packIntegers,
+     "pack() an integer of 1 to 8 bytes with its nibble"},
+    {"unpackIntegers", unpackIntegers,
+     "Nibbler::getNext() an integer of 1 to 8 bytes"},
+    {"packVByteIntegers", packVByteIntegers,
+     "packVByte() an integer of 1 to 8 bytes with its code"},
+    {"unpackVByteIntegers", unpackVByteIntegers,
+     "Nibbler::getNext() an integer of 1 to 8 bytes from packVByte()"},
+    {"packDoubles", packDoubles, "pack() a price or latency verbatim"},
+    {"packXorDoubles", packXorDoubles,
+     "packXor() a price or latency with the previous one"},
+    {"unpackXorDoubles", unpackXorDoubles,
+     "Nibbler::getNext() a packXor()-ed price or latency"},
 
 };
 